@@ -0,0 +1,91 @@
+/* bench_auth.c - Authorization cost microbenchmark
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements a benchmark for the per-request access check:
+ * - Resolves a user and the directory group the way the server does
+ * - Compares direct NSS lookups with the credential cache
+ * - Reports the average cost per request in microseconds
+ */
+
+  #include "credcache.h"
+  
+  /* Benchmark defaults */
+  #define BENCH_DEFAULT_ITERATIONS 20000
+  
+  /* One authorization as the server performs it; returns 1 if allowed */
+  static int authorize_once(const char *username, const char *groupname, int cached) {
+      cred_user_t user;
+      gid_t gid;
+      int i, found, allowed = 0;
+      
+      if ((cached ? credcache_get_user(username, &user) : credcache_resolve_user(username, &user)) < 0) {
+          return 0;
+      }
+      found = cached ? credcache_get_group(groupname, &gid) : credcache_resolve_group(groupname, &gid);
+      if (user.found && found > 0) {
+          for (i = 0; i < user.ngroups; i++) {
+              if (user.groups[i] == gid) {
+                  allowed = 1;
+                  break;
+              }
+          }
+      }
+      
+      credcache_free_user(&user);
+      return allowed;
+  }
+  
+  /* Time a number of authorizations and print the per-request cost */
+  static void run_case(const char *label, const char *username, const char *groupname,
+                       int cached, int iterations) {
+      struct timespec start, end;
+      double seconds;
+      int i, allowed = 0;
+      
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      for (i = 0; i < iterations; i++) {
+          allowed += authorize_once(username, groupname, cached);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      
+      seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      printf("%-8s  %10d  %12.3f  %s\n", label, iterations, seconds * 1e6 / iterations,
+             allowed == iterations ? "allowed" : (allowed == 0 ? "denied" : "mixed"));
+  }
+  
+  /* Display usage instructions */
+  static void bench_usage(void) {
+      printf("Usage: bench_auth -u user [-g group] [-n iterations]\n");
+      printf("  Measures the cost of one access check with and without the credential cache.\n");
+  }
+  
+  /* Main function */
+  int main(int argc, char *argv[]) {
+      const char *username = NULL;
+      const char *groupname = "manufacturing";
+      int iterations = BENCH_DEFAULT_ITERATIONS;
+      int opt;
+      
+      while ((opt = getopt(argc, argv, "u:g:n:h")) != -1) {
+          switch (opt) {
+              case 'u': username = optarg; break;
+              case 'g': groupname = optarg; break;
+              case 'n': iterations = atoi(optarg); break;
+              default: bench_usage(); return EXIT_FAILURE;
+          }
+      }
+      if (!username || iterations < 1) {
+          bench_usage();
+          return EXIT_FAILURE;
+      }
+      
+      credcache_init(CREDCACHE_DEFAULT_TTL);
+      
+      printf("Authorizing %s for group %s\n", username, groupname);
+      printf("lookup    iterations  us/request    result\n");
+      run_case("direct", username, groupname, 0, iterations);
+      run_case("cached", username, groupname, 1, iterations);
+      
+      credcache_destroy();
+      return EXIT_SUCCESS;
+  }
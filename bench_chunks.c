@@ -0,0 +1,278 @@
+/* bench_chunks.c - Transfer chunk size sweep benchmark
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements a benchmark for the buffered data path:
+ * - Streams a file over loopback TCP with send_file_buffered()
+ * - Receives it into a pooled buffer and writes it to a scratch file
+ * - Reports throughput and system calls per MiB for each chunk size
+ * - Reports CRC32C throughput, the cost of the end-to-end upload checksum
+ */
+
+ #include "bufpool.h"
+ #include "crc32c.h"
+ #include <time.h>
+ 
+ /* Benchmark defaults */
+ #define BENCH_DEFAULT_MIB 256
+ #define BENCH_DEFAULT_ROUNDS 3
+ 
+ /* Sender thread arguments */
+ typedef struct {
+     int port;
+     int file_fd;
+     off_t length;
+     size_t chunk;
+     int tune;
+ } sender_args_t;
+ 
+ /* Buffers used by the receiving side */
+ static bufpool_t bench_pool;
+ 
+ /* Connect to the benchmark listener and stream the source file */
+ static void *sender_thread(void *arg) {
+     sender_args_t *args = arg;
+     struct sockaddr_in addr;
+     int sock;
+     
+     sock = socket(AF_INET, SOCK_STREAM, 0);
+     if (sock < 0) {
+         perror("socket");
+         return NULL;
+     }
+     
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_port = htons(args->port);
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+         perror("connect");
+         close(sock);
+         return NULL;
+     }
+     
+     if (args->tune) {
+         netio_tune_socket(sock, SO_SNDBUF, args->chunk);
+     }
+     
+     /* Rewind so every round sends the whole file */
+     if (lseek(args->file_fd, 0, SEEK_SET) < 0 ||
+         send_file_buffered(sock, args->file_fd, args->length, args->chunk, NULL, NULL, NULL) != args->length) {
+         perror("send_file_buffered");
+     }
+     
+     close(sock);
+     return NULL;
+ }
+ 
+ /* Transfer the source once with the given chunk size; returns seconds or -1 */
+ static double run_round(int listen_fd, int port, int src_fd, int dst_fd, off_t length,
+                         size_t chunk, int tune, unsigned long *calls) {
+     sender_args_t args = {port, src_fd, length, chunk, tune};
+     struct timespec start, end;
+     pthread_t sender;
+     ssize_t bytes_read;
+     off_t received = 0;
+     size_t capacity;
+     char *buffer;
+     int sock;
+     
+     buffer = bufpool_get(&bench_pool, chunk, &capacity);
+     if (!buffer) {
+         return -1;
+     }
+     if (ftruncate(dst_fd, 0) < 0 || lseek(dst_fd, 0, SEEK_SET) < 0) {
+         perror("reset scratch file");
+         bufpool_put(&bench_pool, buffer, capacity);
+         return -1;
+     }
+     
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     if (pthread_create(&sender, NULL, sender_thread, &args) != 0) {
+         perror("pthread_create");
+         bufpool_put(&bench_pool, buffer, capacity);
+         return -1;
+     }
+     
+     sock = accept(listen_fd, NULL, NULL);
+     if (sock < 0) {
+         perror("accept");
+     } else {
+         if (tune) {
+             netio_tune_socket(sock, SO_RCVBUF, chunk);
+         }
+         
+         /* The same loop the server runs for a plain upload */
+         while ((bytes_read = recv(sock, buffer, chunk, 0)) > 0) {
+             if (write(dst_fd, buffer, bytes_read) != bytes_read) {
+                 perror("write");
+                 break;
+             }
+             received += bytes_read;
+             *calls += 2;
+         }
+         close(sock);
+     }
+     
+     pthread_join(sender, NULL);
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     bufpool_put(&bench_pool, buffer, capacity);
+     
+     if (received != length) {
+         fprintf(stderr, "Short transfer: %lld of %lld bytes\n", (long long)received, (long long)length);
+         return -1;
+     }
+     
+     return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+ }
+ 
+ /* Checksum the source file from the page cache and print MiB/s */
+ static void run_crc(int src_fd, off_t length) {
+     struct timespec start, end;
+     uint32_t crc = 0;
+     size_t capacity;
+     double seconds;
+     char *buffer;
+     
+     buffer = bufpool_get(&bench_pool, NETIO_MAX_CHUNK, &capacity);
+     if (!buffer) {
+         return;
+     }
+     
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     if (netio_crc32c_file(src_fd, 0, length, buffer, capacity, &crc) < 0) {
+         perror("checksum source");
+     } else {
+         clock_gettime(CLOCK_MONOTONIC, &end);
+         seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+         printf("CRC32C (%s) of the file: %.1f MiB/s\n", crc32c_implementation(),
+                length / 1048576.0 / seconds);
+     }
+     
+     bufpool_put(&bench_pool, buffer, capacity);
+ }
+ 
+ /* Create an unlinked scratch file in dir */
+ static int scratch_file(const char *dir) {
+     char path[MAX_PATH_LENGTH];
+     int fd;
+     
+     snprintf(path, sizeof(path), "%s/bench_chunks.XXXXXX", dir);
+     fd = mkstemp(path);
+     if (fd < 0) {
+         perror("mkstemp");
+         return -1;
+     }
+     unlink(path);
+     
+     return fd;
+ }
+ 
+ /* Fill the source file so reads come from the page cache, not holes */
+ static int fill_source(int fd, off_t length) {
+     char block[NETIO_MAX_CHUNK];
+     off_t written = 0;
+     size_t i, n;
+     
+     for (i = 0; i < sizeof(block); i++) {
+         block[i] = (char)(i * 31 + 7);
+     }
+     while (written < length) {
+         n = (length - written > (off_t)sizeof(block)) ? sizeof(block) : (size_t)(length - written);
+         if (write(fd, block, n) != (ssize_t)n) {
+             perror("write source");
+             return -1;
+         }
+         written += n;
+     }
+     
+     return 0;
+ }
+ 
+ /* Display usage instructions */
+ static void bench_usage(void) {
+     printf("Usage: bench_chunks [-n MiB] [-r rounds] [-d dir] [-T]\n");
+     printf("  Streams a file over loopback at every chunk size from %d KiB to %d KiB.\n",
+            NETIO_MIN_CHUNK / 1024, NETIO_MAX_CHUNK / 1024);
+     printf("  -n MiB: Transfer size (default: %d)\n", BENCH_DEFAULT_MIB);
+     printf("  -r rounds: Rounds per chunk size; the best is reported (default: %d)\n", BENCH_DEFAULT_ROUNDS);
+     printf("  -d dir: Directory for the source and scratch files (default: /tmp)\n");
+     printf("  -T: Size SO_SNDBUF/SO_RCVBUF to the chunk size\n");
+ }
+ 
+ /* Main function */
+ int main(int argc, char *argv[]) {
+     const char *dir = "/tmp";
+     int mib = BENCH_DEFAULT_MIB, rounds = BENCH_DEFAULT_ROUNDS, tune = 0;
+     int opt, i, listen_fd, src_fd, dst_fd, port;
+     struct sockaddr_in addr;
+     socklen_t addr_len = sizeof(addr);
+     unsigned long calls, best_calls;
+     double seconds, best;
+     off_t length;
+     size_t chunk;
+     
+     while ((opt = getopt(argc, argv, "n:r:d:Th")) != -1) {
+         switch (opt) {
+             case 'n': mib = atoi(optarg); break;
+             case 'r': rounds = atoi(optarg); break;
+             case 'd': dir = optarg; break;
+             case 'T': tune = 1; break;
+             default: bench_usage(); return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+         }
+     }
+     if (mib < 1 || rounds < 1) {
+         bench_usage();
+         return EXIT_FAILURE;
+     }
+     length = (off_t)mib * 1024 * 1024;
+     
+     /* Source and destination files */
+     src_fd = scratch_file(dir);
+     dst_fd = scratch_file(dir);
+     if (src_fd < 0 || dst_fd < 0 || fill_source(src_fd, length) < 0) {
+         return EXIT_FAILURE;
+     }
+     
+     /* Loopback listener on an ephemeral port */
+     listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+     if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(listen_fd, 1) < 0 || getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+         perror("listen");
+         return EXIT_FAILURE;
+     }
+     port = ntohs(addr.sin_port);
+     
+     bufpool_init(&bench_pool);
+     
+     printf("Sending %d MiB over loopback, best of %d rounds%s\n", mib, rounds,
+            tune ? ", socket buffers sized to the chunk" : "");
+     printf("chunk KiB      MiB/s  calls/MiB\n");
+     for (chunk = NETIO_MIN_CHUNK; chunk <= NETIO_MAX_CHUNK; chunk <<= 1) {
+         best = -1;
+         best_calls = 0;
+         for (i = 0; i < rounds; i++) {
+             calls = 0;
+             seconds = run_round(listen_fd, port, src_fd, dst_fd, length, chunk, tune, &calls);
+             if (seconds > 0 && (best < 0 || seconds < best)) {
+                 best = seconds;
+                 best_calls = calls;
+             }
+         }
+         if (best < 0) {
+             printf("%9zu  %9s  %9s\n", chunk / 1024, "failed", "-");
+             continue;
+         }
+         printf("%9zu  %9.1f  %9.1f\n", chunk / 1024, mib / best, (double)best_calls / mib);
+     }
+     printf("Adaptive choice for a %d MiB file: %zu KiB\n", mib, netio_chunk_size(length) / 1024);
+     run_crc(src_fd, length);
+     
+     bufpool_destroy(&bench_pool);
+     close(listen_fd);
+     close(src_fd);
+     close(dst_fd);
+     return EXIT_SUCCESS;
+ }
@@ -0,0 +1,167 @@
+/* bench_concurrency.c - Concurrent upload throughput benchmark
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements a benchmark for a running server:
+ * - Spawns an increasing number of concurrent upload clients
+ * - Each client uploads its own files to the chosen directory
+ * - Reports aggregate throughput for every client count
+ */
+
+ #include "client.h"
+ #include <pthread.h>
+ #include <time.h>
+ 
+ /* Benchmark defaults */
+ #define BENCH_DEFAULT_CLIENTS 16
+ #define BENCH_DEFAULT_SIZE_KB 4096
+ #define BENCH_DEFAULT_ROUNDS 4
+ 
+ /* Parameters shared by every benchmark client */
+ typedef struct {
+     const char *username;
+     const char *target_dir;
+     const char *payload;
+     long size;
+     int rounds;
+ } bench_config_t;
+ 
+ /* Per-thread arguments and result */
+ typedef struct {
+     const bench_config_t *config;
+     int client_index;
+     int failures;
+ } bench_client_t;
+ 
+ /* Upload one file over a fresh connection; returns the server status code */
+ static int upload_once(const bench_config_t *config, const char *filename) {
+     char request[PROTO_MAX_REQUEST];
+     proto_response_t response;
+     ssize_t request_len;
+     int sock, status_code = STATUS_UNKNOWN_ERROR;
+     
+     sock = connect_to_server();
+     if (sock < 0) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* Framed request, then the body once the server is ready */
+     request_len = proto_build_request(request, PROTO_OP_PUT, 0, config->username,
+                                       config->target_dir, filename, (uint64_t)config->size);
+     if (request_len < 0 || send_all(sock, request, request_len) < 0) {
+         goto done;
+     }
+     if (proto_recv_response(sock, &response) < 0 || response.status != STATUS_READY) {
+         goto done;
+     }
+     if (send_all(sock, config->payload, config->size) < 0) {
+         goto done;
+     }
+     if (proto_recv_response(sock, &response) == 0) {
+         status_code = response.status;
+     }
+     
+ done:
+     close(sock);
+     return status_code;
+ }
+ 
+ /* Benchmark client thread */
+ static void *bench_client_main(void *arg) {
+     bench_client_t *client = (bench_client_t *)arg;
+     char filename[64];
+     int round;
+     
+     for (round = 0; round < client->config->rounds; round++) {
+         snprintf(filename, sizeof(filename), "bench_%d_%d.dat", client->client_index, round);
+         if (upload_once(client->config, filename) != STATUS_SUCCESS) {
+             client->failures++;
+         }
+     }
+     
+     return NULL;
+ }
+ 
+ /* Run one sweep step and print its throughput */
+ static int run_step(const bench_config_t *config, int clients) {
+     pthread_t *threads = calloc(clients, sizeof(pthread_t));
+     bench_client_t *args = calloc(clients, sizeof(bench_client_t));
+     struct timespec start, end;
+     double seconds, megabytes;
+     int i, failures = 0, uploads;
+     
+     if (!threads || !args) {
+         perror("calloc");
+         free(threads);
+         free(args);
+         return -1;
+     }
+     
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (i = 0; i < clients; i++) {
+         args[i].config = config;
+         args[i].client_index = i;
+         pthread_create(&threads[i], NULL, bench_client_main, &args[i]);
+     }
+     for (i = 0; i < clients; i++) {
+         pthread_join(threads[i], NULL);
+         failures += args[i].failures;
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     
+     seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+     uploads = clients * config->rounds - failures;
+     megabytes = (double)config->size * uploads / 1048576.0;
+     printf("%7d  %9.3f  %10.1f  %8d\n", clients, seconds, megabytes / seconds, failures);
+     
+     free(threads);
+     free(args);
+     return 0;
+ }
+ 
+ /* Display usage instructions */
+ static void bench_usage(void) {
+     printf("Usage: bench_concurrency -u user [-d dir] [-n max_clients] [-k size_kb] [-r rounds]\n");
+     printf("  Requires a running server; uploads bench_*.dat files as the given user.\n");
+ }
+ 
+ /* Main function */
+ int main(int argc, char *argv[]) {
+     bench_config_t config = {NULL, DEFAULT_TARGET_DIR, NULL, BENCH_DEFAULT_SIZE_KB * 1024L, BENCH_DEFAULT_ROUNDS};
+     int max_clients = BENCH_DEFAULT_CLIENTS;
+     int opt, clients;
+     char *payload;
+     
+     while ((opt = getopt(argc, argv, "u:d:n:k:r:h")) != -1) {
+         switch (opt) {
+             case 'u': config.username = optarg; break;
+             case 'd': config.target_dir = optarg; break;
+             case 'n': max_clients = atoi(optarg); break;
+             case 'k': config.size = atol(optarg) * 1024L; break;
+             case 'r': config.rounds = atoi(optarg); break;
+             default: bench_usage(); return EXIT_FAILURE;
+         }
+     }
+     if (!config.username || max_clients < 1 || config.size < 1 || config.rounds < 1) {
+         bench_usage();
+         return EXIT_FAILURE;
+     }
+     
+     /* One shared payload; its contents do not matter to the server */
+     payload = malloc(config.size);
+     if (!payload) {
+         perror("malloc");
+         return EXIT_FAILURE;
+     }
+     memset(payload, 'x', config.size);
+     config.payload = payload;
+     
+     printf("Uploading %ld KiB x %d per client to %s as %s\n",
+            config.size / 1024, config.rounds, config.target_dir, config.username);
+     printf("clients  seconds    MiB/s      failures\n");
+     for (clients = 1; clients <= max_clients; clients *= 2) {
+         run_step(&config, clients);
+     }
+     
+     free(payload);
+     return EXIT_SUCCESS;
+ }
@@ -0,0 +1,658 @@
+/* bench_load.c - Load generator and latency benchmark for a running server
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements a multi-threaded load generator:
+ * - Worker threads upload a weighted mix of file sizes to one or more directories
+ * - Each upload is timed in three phases: handshake, transfer and status
+ * - Throughput, upload and connection rates and p50/p99/p999 latencies per phase
+ * - A sweep over several concurrency levels in one run
+ * - Text output for people, JSON output for tracking regressions between releases
+ */
+
+ #include "client.h"
+ #include <pthread.h>
+ #include <time.h>
+ 
+ /* Benchmark defaults */
+ #define LOAD_DEFAULT_SIZES "64k"
+ #define LOAD_DEFAULT_CONCURRENCY "4"
+ #define LOAD_DEFAULT_UPLOADS 100
+ #define LOAD_MAX_CLASSES 16
+ #define LOAD_MAX_DIRS 4
+ #define LOAD_MAX_LEVELS 16
+ #define LOAD_FILES_PER_WORKER 8     /* Names are reused so long runs do not fill the disk */
+ 
+ /* Phases of one upload */
+ enum {
+     PHASE_HANDSHAKE,                /* Connect (or session reuse) and request until READY */
+     PHASE_TRANSFER,                 /* Body and trailer sent */
+     PHASE_STATUS,                   /* Last byte sent until the final status arrives */
+     PHASE_TOTAL,
+     PHASE_COUNT
+ };
+ 
+ static const char *phase_names[PHASE_COUNT] = {"handshake", "transfer", "status", "total"};
+ 
+ /* One entry of the file size mix */
+ typedef struct {
+     char label[16];
+     off_t size;
+     int weight;
+     uint32_t crc;                   /* CRC32C of the first size bytes of the payload */
+ } size_class_t;
+ 
+ /* Parameters shared by every worker */
+ typedef struct {
+     const char *username;
+     char *dirs[LOAD_MAX_DIRS];
+     int dir_count;
+     size_class_t classes[LOAD_MAX_CLASSES];
+     int class_count;
+     int weight_total;
+     int uploads;                    /* Per worker; 0 when the run is timed */
+     double duration;                /* Seconds, when uploads is 0 */
+     int session;                    /* Keep one connection per worker */
+     int checksum;                   /* Ask for the CRC32C trailer */
+     char *payload;
+     off_t max_size;
+ } load_config_t;
+ 
+ /* Timings of one successful upload */
+ typedef struct {
+     uint64_t ns[PHASE_COUNT];
+     int size_class;
+ } load_sample_t;
+ 
+ /* Per-thread state and results */
+ typedef struct {
+     const load_config_t *config;
+     int index;
+     struct timespec deadline;
+     load_sample_t *samples;
+     size_t count;
+     size_t capacity;
+     int failures;
+     long connections;
+     uint64_t bytes;
+ } load_worker_t;
+ 
+ /* Latency summary of one phase */
+ typedef struct {
+     size_t count;
+     double mean_us;
+     double p50_us;
+     double p99_us;
+     double p999_us;
+     double max_us;
+ } latency_t;
+ 
+ /* Results of one concurrency level */
+ typedef struct {
+     int concurrency;
+     double seconds;
+     size_t uploads;
+     int failures;
+     long connections;
+     uint64_t bytes;
+     latency_t phases[PHASE_COUNT];
+     latency_t classes[LOAD_MAX_CLASSES];    /* Total latency of each size class */
+ } load_result_t;
+ 
+ /* Nanoseconds on the monotonic clock */
+ static uint64_t now_ns(void) {
+     struct timespec ts;
+ 
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+ 
+ /* Parse a byte count with an optional k, m or g suffix */
+ static off_t parse_size(const char *text, char **end) {
+     unsigned long long value = strtoull(text, end, 10);
+ 
+     switch (**end) {
+         case 'k': case 'K': value <<= 10; (*end)++; break;
+         case 'm': case 'M': value <<= 20; (*end)++; break;
+         case 'g': case 'G': value <<= 30; (*end)++; break;
+         default: break;
+     }
+ 
+     return (off_t)value;
+ }
+ 
+ /* Parse "size[:weight],..." into the size mix */
+ static int parse_classes(load_config_t *config, const char *spec) {
+     const char *p = spec;
+     char *end;
+     size_class_t *class;
+ 
+     while (*p) {
+         if (config->class_count == LOAD_MAX_CLASSES) {
+             fprintf(stderr, "At most %d file sizes\n", LOAD_MAX_CLASSES);
+             return -1;
+         }
+         class = &config->classes[config->class_count];
+         class->size = parse_size(p, &end);
+         class->weight = 1;
+         if (end == p || class->size <= 0) {
+             fprintf(stderr, "Invalid file size in '%s'\n", spec);
+             return -1;
+         }
+         snprintf(class->label, sizeof(class->label), "%.*s", (int)(end - p), p);
+ 
+         if (*end == ':') {
+             class->weight = (int)strtol(end + 1, &end, 10);
+             if (class->weight < 1) {
+                 fprintf(stderr, "Invalid weight in '%s'\n", spec);
+                 return -1;
+             }
+         }
+         if (*end != ',' && *end != '\0') {
+             fprintf(stderr, "Invalid file size mix '%s'\n", spec);
+             return -1;
+         }
+ 
+         config->weight_total += class->weight;
+         if (class->size > config->max_size) {
+             config->max_size = class->size;
+         }
+         config->class_count++;
+         p = (*end == ',') ? end + 1 : end;
+     }
+ 
+     return config->class_count > 0 ? 0 : -1;
+ }
+ 
+ /* Split a comma-separated list in place */
+ static int split_list(char *list, char **items, int max_items) {
+     char *saveptr = NULL, *item;
+     int count = 0;
+ 
+     for (item = strtok_r(list, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+         if (count == max_items) {
+             return -1;
+         }
+         items[count++] = item;
+     }
+ 
+     return count;
+ }
+ 
+ /* Pick a size class in proportion to its weight */
+ static int pick_class(const load_config_t *config, unsigned int *seed) {
+     int ticket = rand_r(seed) % config->weight_total;
+     int i;
+ 
+     for (i = 0; i < config->class_count - 1; i++) {
+         ticket -= config->classes[i].weight;
+         if (ticket < 0) {
+             break;
+         }
+     }
+ 
+     return i;
+ }
+ 
+ /* Keep one sample, growing the array for timed runs */
+ static int record_sample(load_worker_t *worker, const load_sample_t *sample) {
+     load_sample_t *grown;
+ 
+     if (worker->count == worker->capacity) {
+         worker->capacity = worker->capacity ? worker->capacity * 2 : 256;
+         grown = realloc(worker->samples, worker->capacity * sizeof(load_sample_t));
+         if (!grown) {
+             perror("realloc");
+             return -1;
+         }
+         worker->samples = grown;
+     }
+ 
+     worker->samples[worker->count++] = *sample;
+     return 0;
+ }
+ 
+ /* Open a connection, and a session on it when uploads share one */
+ static int open_connection(load_worker_t *worker, const char *target_dir) {
+     const load_config_t *config = worker->config;
+     char request[PROTO_MAX_REQUEST];
+     proto_response_t response;
+     ssize_t request_len;
+     int sock;
+ 
+     sock = connect_to_server();
+     if (sock < 0) {
+         return -1;
+     }
+     worker->connections++;
+ 
+     if (config->session) {
+         request_len = proto_build_request(request, PROTO_OP_SESSION, PROTO_FLAG_SESSION,
+                                           config->username, target_dir, "", 0);
+         if (request_len < 0 || send_all(sock, request, request_len) < 0 ||
+             proto_recv_response(sock, &response) < 0 || response.status != STATUS_SUCCESS) {
+             close(sock);
+             return -1;
+         }
+     }
+ 
+     return sock;
+ }
+ 
+ /* Upload one file and time its phases; returns the server status code */
+ static int upload_once(load_worker_t *worker, int *sock, int size_class, const char *target_dir,
+                        const char *filename, load_sample_t *sample) {
+     const load_config_t *config = worker->config;
+     const size_class_t *class = &config->classes[size_class];
+     char request[PROTO_MAX_REQUEST];
+     proto_response_t response;
+     proto_trailer_t trailer;
+     ssize_t request_len;
+     uint16_t flags = (config->session ? PROTO_FLAG_SESSION : 0) |
+                      (config->checksum ? PROTO_FLAG_CHECKSUM : 0);
+     uint64_t start, ready, sent, done;
+ 
+     /* Handshake: connection setup when needed, then request until READY */
+     start = now_ns();
+     if (*sock < 0) {
+         *sock = open_connection(worker, target_dir);
+         if (*sock < 0) {
+             return STATUS_UNKNOWN_ERROR;
+         }
+     }
+     request_len = proto_build_request(request, PROTO_OP_PUT, flags, config->username, target_dir,
+                                       filename, (uint64_t)class->size);
+     if (request_len < 0 || send_all(*sock, request, request_len) < 0 ||
+         proto_recv_response(*sock, &response) < 0) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.status != STATUS_READY) {
+         return response.status;
+     }
+     ready = now_ns();
+ 
+     /* Transfer: the body from the shared payload, whose checksum is precomputed */
+     if (send_all(*sock, config->payload, class->size) < 0) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.flags & PROTO_FLAG_CHECKSUM) {
+         proto_build_trailer(&trailer, class->crc);
+         if (send_all(*sock, &trailer, sizeof(trailer)) < 0) {
+             return STATUS_UNKNOWN_ERROR;
+         }
+     }
+     sent = now_ns();
+ 
+     /* Status: the server's write, flush and publish as seen from the client */
+     if (proto_recv_response(*sock, &response) < 0) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     done = now_ns();
+ 
+     sample->ns[PHASE_HANDSHAKE] = ready - start;
+     sample->ns[PHASE_TRANSFER] = sent - ready;
+     sample->ns[PHASE_STATUS] = done - sent;
+     sample->ns[PHASE_TOTAL] = done - start;
+     sample->size_class = size_class;
+ 
+     return response.status;
+ }
+ 
+ /* Worker thread: upload until the count or the deadline is reached */
+ static void *load_worker_main(void *arg) {
+     load_worker_t *worker = (load_worker_t *)arg;
+     const load_config_t *config = worker->config;
+     unsigned int seed = (unsigned int)(worker->index * 2654435761u) ^ (unsigned int)now_ns();
+     char filename[64];
+     load_sample_t sample;
+     const char *target_dir;
+     struct timespec now;
+     int i, size_class, status, sock = -1;
+ 
+     for (i = 0; ; i++) {
+         if (config->uploads > 0) {
+             if (i >= config->uploads) {
+                 break;
+             }
+         } else {
+             clock_gettime(CLOCK_MONOTONIC, &now);
+             if (now.tv_sec > worker->deadline.tv_sec ||
+                 (now.tv_sec == worker->deadline.tv_sec && now.tv_nsec >= worker->deadline.tv_nsec)) {
+                 break;
+             }
+         }
+ 
+         size_class = pick_class(config, &seed);
+         target_dir = config->dirs[i % config->dir_count];
+         snprintf(filename, sizeof(filename), "load_%d_%d.dat", worker->index, i % LOAD_FILES_PER_WORKER);
+ 
+         status = upload_once(worker, &sock, size_class, target_dir, filename, &sample);
+         if (status == STATUS_SUCCESS) {
+             worker->bytes += (uint64_t)config->classes[size_class].size;
+             if (record_sample(worker, &sample) < 0) {
+                 break;
+             }
+         } else {
+             worker->failures++;
+         }
+ 
+         /* A failure may leave the stream misaligned, so start again on a new connection */
+         if (sock >= 0 && (!config->session || status != STATUS_SUCCESS)) {
+             close(sock);
+             sock = -1;
+         }
+     }
+ 
+     if (sock >= 0) {
+         close(sock);
+     }
+     return NULL;
+ }
+ 
+ /* Compare two nanosecond values for qsort */
+ static int compare_ns(const void *a, const void *b) {
+     uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+ 
+     return (x > y) - (x < y);
+ }
+ 
+ /* Nearest-rank percentile of sorted values, in microseconds */
+ static double percentile_us(const uint64_t *sorted, size_t count, double percent) {
+     size_t rank = (size_t)((percent / 100.0) * count + 0.999999);
+ 
+     if (rank < 1) {
+         rank = 1;
+     }
+     if (rank > count) {
+         rank = count;
+     }
+     return sorted[rank - 1] / 1000.0;
+ }
+ 
+ /* Summarize the values (sorted in place) */
+ static void summarize(uint64_t *values, size_t count, latency_t *latency) {
+     double sum = 0;
+     size_t i;
+ 
+     memset(latency, 0, sizeof(*latency));
+     if (count == 0) {
+         return;
+     }
+ 
+     qsort(values, count, sizeof(uint64_t), compare_ns);
+     for (i = 0; i < count; i++) {
+         sum += values[i];
+     }
+ 
+     latency->count = count;
+     latency->mean_us = sum / count / 1000.0;
+     latency->p50_us = percentile_us(values, count, 50.0);
+     latency->p99_us = percentile_us(values, count, 99.0);
+     latency->p999_us = percentile_us(values, count, 99.9);
+     latency->max_us = values[count - 1] / 1000.0;
+ }
+ 
+ /* Run every worker at one concurrency level and summarize the samples */
+ static int run_level(const load_config_t *config, int concurrency, load_result_t *result) {
+     pthread_t *threads = calloc(concurrency, sizeof(pthread_t));
+     load_worker_t *workers = calloc(concurrency, sizeof(load_worker_t));
+     struct timespec start, end, deadline;
+     uint64_t *values = NULL;
+     size_t total = 0, n, j;
+     int i, phase, class, started = 0;
+ 
+     if (!threads || !workers) {
+         perror("calloc");
+         free(threads);
+         free(workers);
+         return -1;
+     }
+     memset(result, 0, sizeof(*result));
+     result->concurrency = concurrency;
+ 
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     deadline = start;
+     deadline.tv_sec += (time_t)config->duration;
+     deadline.tv_nsec += (long)((config->duration - (time_t)config->duration) * 1e9);
+     if (deadline.tv_nsec >= 1000000000L) {
+         deadline.tv_sec++;
+         deadline.tv_nsec -= 1000000000L;
+     }
+ 
+     for (i = 0; i < concurrency; i++) {
+         workers[i].config = config;
+         workers[i].index = i;
+         workers[i].deadline = deadline;
+         if (pthread_create(&threads[i], NULL, load_worker_main, &workers[i]) != 0) {
+             perror("pthread_create");
+             break;
+         }
+         started++;
+     }
+     for (i = 0; i < started; i++) {
+         pthread_join(threads[i], NULL);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &end);
+ 
+     result->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+     for (i = 0; i < started; i++) {
+         total += workers[i].count;
+         result->failures += workers[i].failures;
+         result->connections += workers[i].connections;
+         result->bytes += workers[i].bytes;
+     }
+     result->uploads = total;
+ 
+     /* One scratch array, refilled for each phase and size class */
+     values = malloc((total ? total : 1) * sizeof(uint64_t));
+     if (!values) {
+         perror("malloc");
+     } else {
+         for (phase = 0; phase < PHASE_COUNT; phase++) {
+             n = 0;
+             for (i = 0; i < started; i++) {
+                 for (j = 0; j < workers[i].count; j++) {
+                     values[n++] = workers[i].samples[j].ns[phase];
+                 }
+             }
+             summarize(values, n, &result->phases[phase]);
+         }
+         for (class = 0; class < config->class_count; class++) {
+             n = 0;
+             for (i = 0; i < started; i++) {
+                 for (j = 0; j < workers[i].count; j++) {
+                     if (workers[i].samples[j].size_class == class) {
+                         values[n++] = workers[i].samples[j].ns[PHASE_TOTAL];
+                     }
+                 }
+             }
+             summarize(values, n, &result->classes[class]);
+         }
+     }
+ 
+     for (i = 0; i < concurrency; i++) {
+         free(workers[i].samples);
+     }
+     free(values);
+     free(threads);
+     free(workers);
+     return (started == concurrency && values) ? 0 : -1;
+ }
+ 
+ /* Print one result for people */
+ static void print_text(const load_config_t *config, const load_result_t *result) {
+     const latency_t *latency;
+     int i;
+ 
+     printf("\nconcurrency %d: %zu uploads, %d failed in %.3f s\n", result->concurrency, result->uploads,
+            result->failures, result->seconds);
+     printf("  %.1f MiB/s, %.1f uploads/s, %.1f connections/s\n",
+            result->bytes / 1048576.0 / result->seconds, result->uploads / result->seconds,
+            result->connections / result->seconds);
+     printf("  %-10s %10s %10s %10s %10s %10s\n", "phase", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+     for (i = 0; i < PHASE_COUNT; i++) {
+         latency = &result->phases[i];
+         printf("  %-10s %10.1f %10.1f %10.1f %10.1f %10.1f\n", phase_names[i], latency->mean_us,
+                latency->p50_us, latency->p99_us, latency->p999_us, latency->max_us);
+     }
+     if (config->class_count > 1) {
+         printf("  %-10s %10s %10s %10s %10s\n", "size", "uploads", "p50_us", "p99_us", "p999_us");
+         for (i = 0; i < config->class_count; i++) {
+             latency = &result->classes[i];
+             printf("  %-10s %10zu %10.1f %10.1f %10.1f\n", config->classes[i].label, latency->count,
+                    latency->p50_us, latency->p99_us, latency->p999_us);
+         }
+     }
+ }
+ 
+ /* Print one latency summary as a JSON object */
+ static void print_json_latency(const latency_t *latency) {
+     printf("{\"count\": %zu, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+            "\"max_us\": %.1f}", latency->count, latency->mean_us, latency->p50_us, latency->p99_us,
+            latency->p999_us, latency->max_us);
+ }
+ 
+ /* Print the whole run as one JSON document */
+ static void print_json(const load_config_t *config, const load_result_t *results, int count) {
+     const load_result_t *result;
+     int i, j;
+ 
+     printf("{\n  \"config\": {\"user\": \"%s\", \"dirs\": [", config->username);
+     for (i = 0; i < config->dir_count; i++) {
+         printf("%s\"%s\"", i ? ", " : "", config->dirs[i]);
+     }
+     printf("], \"sizes\": [");
+     for (i = 0; i < config->class_count; i++) {
+         printf("%s{\"size\": %lld, \"weight\": %d}", i ? ", " : "", (long long)config->classes[i].size,
+                config->classes[i].weight);
+     }
+     printf("], \"uploads_per_worker\": %d, \"duration_s\": %.1f, \"session\": %s, \"checksum\": %s},\n",
+            config->uploads, config->uploads ? 0.0 : config->duration, config->session ? "true" : "false",
+            config->checksum ? "true" : "false");
+ 
+     printf("  \"runs\": [\n");
+     for (i = 0; i < count; i++) {
+         result = &results[i];
+         printf("    {\"concurrency\": %d, \"seconds\": %.3f, \"uploads\": %zu, \"failures\": %d, "
+                "\"bytes\": %llu, \"mib_per_s\": %.2f, \"uploads_per_s\": %.2f, \"connections_per_s\": %.2f,\n",
+                result->concurrency, result->seconds, result->uploads, result->failures,
+                (unsigned long long)result->bytes, result->bytes / 1048576.0 / result->seconds,
+                result->uploads / result->seconds, result->connections / result->seconds);
+         printf("     \"latency\": {");
+         for (j = 0; j < PHASE_COUNT; j++) {
+             printf("%s\n       \"%s\": ", j ? "," : "", phase_names[j]);
+             print_json_latency(&result->phases[j]);
+         }
+         printf("},\n     \"sizes\": [");
+         for (j = 0; j < config->class_count; j++) {
+             printf("%s\n       {\"size\": %lld, \"total\": ", j ? "," : "",
+                    (long long)config->classes[j].size);
+             print_json_latency(&result->classes[j]);
+             printf("}");
+         }
+         printf("]}%s\n", i + 1 < count ? "," : "");
+     }
+     printf("  ]\n}\n");
+ }
+ 
+ /* Display usage instructions */
+ static void bench_usage(void) {
+     printf("Usage: bench_load -u user [-d dir[,dir...]] [-s size[:weight][,...]] [-c n[,n...]]\n");
+     printf("                  [-n uploads | -t seconds] [-S] [-C] [-j]\n");
+     printf("  Requires a running server; uploads load_*.dat files as the given user.\n");
+     printf("  -d dirs: Target directories, used in turn (default: %s)\n", DEFAULT_TARGET_DIR);
+     printf("  -s mix: File sizes with optional weights, e.g. 4k:70,1m:25,64m:5 (default: %s)\n",
+            LOAD_DEFAULT_SIZES);
+     printf("  -c levels: Concurrent workers; a list runs one level after another (default: %s)\n",
+            LOAD_DEFAULT_CONCURRENCY);
+     printf("  -n uploads: Uploads per worker (default: %d)\n", LOAD_DEFAULT_UPLOADS);
+     printf("  -t seconds: Run each level for this long instead of a fixed count\n");
+     printf("  -S: Keep one session per worker instead of a connection per upload\n");
+     printf("  -C: Skip the end-to-end CRC32C trailer\n");
+     printf("  -j: Print the results as JSON\n");
+ }
+ 
+ /* Main function */
+ int main(int argc, char *argv[]) {
+     load_config_t config;
+     load_result_t results[LOAD_MAX_LEVELS];
+     char *level_list[LOAD_MAX_LEVELS];
+     char dirs_arg[256] = DEFAULT_TARGET_DIR;
+     char dirs_label[256];
+     char levels_arg[128] = LOAD_DEFAULT_CONCURRENCY;
+     const char *sizes_arg = LOAD_DEFAULT_SIZES;
+     int opt, i, level_count, json = 0, failed = 0;
+     unsigned int state = 0x9e3779b9u;
+     off_t k;
+ 
+     memset(&config, 0, sizeof(config));
+     config.uploads = LOAD_DEFAULT_UPLOADS;
+     config.checksum = 1;
+ 
+     while ((opt = getopt(argc, argv, "u:d:s:c:n:t:SCjh")) != -1) {
+         switch (opt) {
+             case 'u': config.username = optarg; break;
+             case 'd': snprintf(dirs_arg, sizeof(dirs_arg), "%s", optarg); break;
+             case 's': sizes_arg = optarg; break;
+             case 'c': snprintf(levels_arg, sizeof(levels_arg), "%s", optarg); break;
+             case 'n': config.uploads = atoi(optarg); break;
+             case 't': config.duration = atof(optarg); config.uploads = 0; break;
+             case 'S': config.session = 1; break;
+             case 'C': config.checksum = 0; break;
+             case 'j': json = 1; break;
+             default: bench_usage(); return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+         }
+     }
+ 
+     /* The lists are split in place, so keep the directory list for the banner */
+     strcpy(dirs_label, dirs_arg);
+     config.dir_count = split_list(dirs_arg, config.dirs, LOAD_MAX_DIRS);
+     level_count = split_list(levels_arg, level_list, LOAD_MAX_LEVELS);
+     if (!config.username || config.dir_count < 1 || level_count < 1 ||
+         parse_classes(&config, sizes_arg) < 0 || (config.uploads < 1 && config.duration <= 0)) {
+         bench_usage();
+         return EXIT_FAILURE;
+     }
+     for (i = 0; i < level_count; i++) {
+         if (atoi(level_list[i]) < 1) {
+             bench_usage();
+             return EXIT_FAILURE;
+         }
+     }
+ 
+     /* One shared payload of incompressible bytes, checksummed once per size */
+     config.payload = malloc(config.max_size);
+     if (!config.payload) {
+         perror("malloc");
+         return EXIT_FAILURE;
+     }
+     for (k = 0; k < config.max_size; k++) {
+         state ^= state << 13;
+         state ^= state >> 17;
+         state ^= state << 5;
+         config.payload[k] = (char)state;
+     }
+     for (i = 0; i < config.class_count; i++) {
+         config.classes[i].crc = crc32c_update(0, config.payload, config.classes[i].size);
+     }
+ 
+     if (!json) {
+         printf("Uploading to %s as %s: %s, %s, %s\n", dirs_label, config.username, sizes_arg,
+                config.session ? "one session per worker" : "one connection per upload",
+                config.checksum ? "CRC32C trailer" : "no checksum");
+     }
+ 
+     for (i = 0; i < level_count; i++) {
+         if (run_level(&config, atoi(level_list[i]), &results[i]) < 0) {
+             failed = 1;
+         }
+         if (!json) {
+             print_text(&config, &results[i]);
+         }
+     }
+     if (json) {
+         print_json(&config, results, level_count);
+     }
+ 
+     free(config.payload);
+     return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+ }
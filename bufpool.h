@@ -0,0 +1,57 @@
+/* bufpool.h - Header file for the shared transfer buffer pool
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the buffer pool including:
+ * - Page-aligned buffers in power-of-two size classes
+ * - Per-class free lists shared by every connection and worker thread
+ * - Function prototypes for borrowing and returning buffers
+ */
+
+ #ifndef BUFPOOL_H
+ #define BUFPOOL_H
+ 
+ #include "server.h"
+ #include "netio.h"
+ 
+ /* Alignment of every pooled buffer (one page) */
+ #define BUFPOOL_ALIGN 4096
+ 
+ /* Size classes run in powers of two from NETIO_MIN_CHUNK to NETIO_MAX_CHUNK */
+ #define BUFPOOL_CLASSES 8
+ 
+ /* Idle buffers kept per class; extras go straight back to the allocator */
+ #define BUFPOOL_MAX_IDLE 16
+ 
+ /* Free buffers are chained through their own first bytes */
+ typedef struct bufpool_free {
+     struct bufpool_free *next;
+ } bufpool_free_t;
+ 
+ /* Pool of reusable transfer buffers */
+ typedef struct {
+     pthread_mutex_t lock;
+     bufpool_free_t *free[BUFPOOL_CLASSES];
+     int idle[BUFPOOL_CLASSES];
+     unsigned long allocated;    /* Buffers obtained from the allocator */
+     unsigned long reused;       /* Requests served from a free list */
+ } bufpool_t;
+ 
+ /* Buffers shared by every server core */
+ extern bufpool_t buffer_pool;
+ 
+ /* Function prototypes */
+ 
+ /* Initialize an empty pool */
+ void bufpool_init(bufpool_t *pool);
+ 
+ /* Borrow a buffer of at least size bytes (clamped to the largest class).
+  * The usable size is stored in capacity. Returns NULL if memory runs out. */
+ void *bufpool_get(bufpool_t *pool, size_t size, size_t *capacity);
+ 
+ /* Return a buffer obtained from bufpool_get with the capacity it reported */
+ void bufpool_put(bufpool_t *pool, void *buffer, size_t capacity);
+ 
+ /* Free every idle buffer (none may still be borrowed) */
+ void bufpool_destroy(bufpool_t *pool);
+ 
+ #endif /* BUFPOOL_H */
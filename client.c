@@ -4,40 +4,193 @@
  * This file implements the client functionality:
  * - Socket connection to server
  * - User authentication
- * - File selection and transfer
+ * - File selection and zero-copy transfer with sendfile()
+ * - Pipelined multi-file sessions over one connection
+ * - Resumable uploads sent as CRC32C-checked chunks
+ * - Optional compressed uploads, compressed in a pipeline alongside the send
+ * - Parallel uploads of one large file as ranges over several connections
+ * - Content digests announced up front, so files the server already stores are not resent
+ * - Delta uploads that send only what differs from the server's copy of a file
+ * - Downloads of whole files or byte ranges, listings, file lookups and change queries
+ * - Server address and socket settings from a configuration file and the command line
  * - Status reporting
  */
 
  #include "client.h"
 
+ #ifndef CLIENT_NO_MAIN
  /* Main function */
  int main(int argc, char *argv[]) {
      int server_socket;
-     char filepath[MAX_PATH_LENGTH] = {0};
      char target_dir[64] = {0};
-     int status_code;
+     const char *source_dir = NULL, *list_path = NULL, *config_file = NULL;
+     char error[CONFIG_LINE_LENGTH];
+     const config_t *config;
+     file_list_t files = {NULL, 0, 0};
+     int status_code, opt, i, failures, flags = 0, streams = 1, download = 0, listing = 0, ranged = 0;
+     int changes = 0;
+     unsigned long long range_offset = 0, range_length = 0, since = 0;
+     char *end;
+     
+     /* Parse command line options */
+     while ((opt = getopt(argc, argv, "bqRTCcDdgLN:O:P:r:l:F:o:h")) != -1) {
+         switch (opt) {
+             case 'b':
+                 flags |= CLIENT_FLAG_BUFFERED;
+                 break;
+             case 'q':
+                 flags |= CLIENT_FLAG_QUIET;
+                 break;
+             case 'R':
+                 flags |= CLIENT_FLAG_RESUME;
+                 break;
+             case 'T':
+                 flags |= CLIENT_FLAG_TUNE;
+                 break;
+             case 'C':
+                 flags |= CLIENT_FLAG_NO_CHECKSUM;
+                 break;
+             case 'c':
+                 flags |= CLIENT_FLAG_COMPRESS;
+                 break;
+             case 'D':
+                 flags |= CLIENT_FLAG_DEDUP;
+                 break;
+             case 'd':
+                 flags |= CLIENT_FLAG_DELTA;
+                 break;
+             case 'g':
+                 download = 1;
+                 break;
+             case 'L':
+                 listing = 1;
+                 break;
+             case 'N':
+                 errno = 0;
+                 since = strtoull(optarg, &end, 10);
+                 if (errno != 0 || *end != '\0' || optarg[0] == '-') {
+                     fprintf(stderr, "Error: -N takes a sequence number\n");
+                     return EXIT_FAILURE;
+                 }
+                 listing = 1;
+                 changes = 1;
+                 break;
+             case 'O':
+                 errno = 0;
+                 range_offset = strtoull(optarg, &end, 10);
+                 if (*end == ':') {
+                     range_length = strtoull(end + 1, &end, 10);
+                 }
+                 if (errno != 0 || *end != '\0' || optarg[0] == '-' || range_offset > INT64_MAX ||
+                     range_length > INT64_MAX) {
+                     fprintf(stderr, "Error: -O takes offset[:length] in bytes\n");
+                     return EXIT_FAILURE;
+                 }
+                 ranged = 1;
+                 break;
+             case 'P':
+                 streams = atoi(optarg);
+                 if (streams < 1 || streams > PROTO_MAX_RANGES) {
+                     fprintf(stderr, "Error: -P takes between 1 and %d connections\n", PROTO_MAX_RANGES);
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'r':
+                 source_dir = optarg;
+                 break;
+             case 'l':
+                 list_path = optarg;
+                 break;
+             case 'F':
+                 config_file = optarg;
+                 break;
+             case 'o':
+                 if (config_override(optarg) < 0) {
+                     perror("config_override");
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             default:
+                 display_usage();
+                 return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+         }
+     }
      
      /* Display usage if arguments are not provided correctly */
-     if (argc != 3) {
+     if (argc - optind < 1 || (argc - optind < 2 && !source_dir && !list_path && !listing) ||
+         (download && (source_dir || list_path)) || (download && listing)) {
          display_usage();
          return EXIT_FAILURE;
      }
+     if (ranged && (!download || argc - optind != 2)) {
+         fprintf(stderr, "Error: -O needs -g and a single file\n");
+         return EXIT_FAILURE;
+     }
+     if (listing && (argc - optind > 2 || (changes && argc - optind != 1))) {
+         fprintf(stderr, "Error: -L takes at most one file name, and -N none\n");
+         return EXIT_FAILURE;
+     }
      
-     /* Parse command line arguments */
-     strncpy(filepath, argv[1], MAX_PATH_LENGTH - 1);
-     strncpy(target_dir, argv[2], 63);
+     /* The target directory is always the last argument */
+     strncpy(target_dir, argv[argc - 1], 63);
      
-     /* Validate target directory */
-     if (strcmp(target_dir, MANUFACTURING_DIR) != 0 && strcmp(target_dir, DISTRIBUTION_DIR) != 0) {
-         fprintf(stderr, "Error: Target directory must be either 'Manufacturing' or 'Distribution'\n");
+     /* Destinations are configured on the server, which refuses names it does not know */
+     if (target_dir[0] == '\0' || target_dir[0] == '.' || strchr(target_dir, '/')) {
+         fprintf(stderr, "Error: Target directory must be a destination name such as 'Manufacturing'\n");
          display_usage();
          return EXIT_FAILURE;
      }
      
-     /* Validate file path */
-     struct stat st;
-     if (stat(filepath, &st) < 0 || !S_ISREG(st.st_mode)) {
-         fprintf(stderr, "Error: File '%s' does not exist or is not a regular file\n", filepath);
+     /* Defaults, then the file, then the command line */
+     if (config_load(config_file, error, sizeof(error)) < 0) {
+         fprintf(stderr, "Error: Invalid configuration: %s\n", error);
+         return EXIT_FAILURE;
+     }
+     config = config_current();
+     
+     /* Reads name files on the server, so there is nothing to gather */
+     if (listing || download) {
+         server_socket = connect_to_server();
+         if (server_socket == -1) {
+             fprintf(stderr, "Failed to connect to server. Exiting.\n");
+             return EXIT_FAILURE;
+         }
+         
+         if (listing) {
+             status_code = list_directory(server_socket, target_dir, argc - optind == 2 ? argv[optind] : NULL,
+                                          changes, (uint64_t)since);
+             failures = (status_code == STATUS_SUCCESS) ? 0 : 1;
+             if (failures) {
+                 display_status_message(status_code);
+             }
+         } else if (argc - optind == 2) {
+             status_code = receive_file(server_socket, argv[optind], target_dir, (off_t)range_offset,
+                                        (off_t)range_length, flags);
+             display_status_message(status_code);
+             failures = (status_code == STATUS_SUCCESS) ? 0 : 1;
+         } else {
+             failures = receive_files_session(server_socket, argv + optind, argc - optind - 1, target_dir, flags);
+             printf("%d of %d files downloaded successfully.\n", argc - optind - 1 - failures, argc - optind - 1);
+         }
+         
+         cleanup_client(server_socket);
+         return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+     }
+     
+     /* Gather the files to send */
+     for (i = optind; i < argc - 1; i++) {
+         if (file_list_add(&files, argv[i]) < 0) {
+             return EXIT_FAILURE;
+         }
+     }
+     if (source_dir && collect_directory(&files, source_dir) < 0) {
+         return EXIT_FAILURE;
+     }
+     if (list_path && collect_list_file(&files, list_path) < 0) {
+         return EXIT_FAILURE;
+     }
+     if (files.count == 0) {
+         fprintf(stderr, "Error: No regular files to send\n");
          return EXIT_FAILURE;
      }
      
@@ -48,24 +201,39 @@
          return EXIT_FAILURE;
      }
      
-     printf("Connected to server at %s:%d\n", SERVER_IP, PORT);
+     printf("Connected to server at %s:%d\n", inet_ntoa(config->server.sin_addr),
+            ntohs(config->server.sin_port));
      
-     /* Send file to server */
-     status_code = send_file(server_socket, filepath, target_dir);
-     
-     /* Display transfer status */
-     display_status_message(status_code);
+     if (files.count == 1 && !source_dir && !list_path) {
+         /* Single file: one request on one connection */
+         if (flags & CLIENT_FLAG_RESUME) {
+             status_code = send_file_resumable(&server_socket, files.paths[0], target_dir, flags);
+         } else if (streams > 1) {
+             status_code = send_file_parallel(&server_socket, files.paths[0], target_dir, flags, streams);
+         } else {
+             status_code = send_file_waiting(&server_socket, files.paths[0], target_dir, flags);
+         }
+         display_status_message(status_code);
+         failures = (status_code == STATUS_SUCCESS) ? 0 : 1;
+     } else {
+         /* Many files: one authenticated, pipelined session */
+         failures = send_files_session(server_socket, files.paths, files.count, target_dir, flags);
+         printf("%d of %d files transferred successfully.\n", files.count - failures, files.count);
+     }
      
      /* Clean up resources */
      cleanup_client(server_socket);
+     file_list_free(&files);
      
-     return (status_code == STATUS_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+     return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
  }
+ #endif /* CLIENT_NO_MAIN */
  
  /* Connect to the server */
  int connect_to_server(void) {
+     const config_t *config = config_current();
+     const char *option = NULL;
      int server_socket;
-     struct sockaddr_in server_addr;
      
      /* Create socket */
      server_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -74,20 +242,15 @@
          return -1;
      }
      
-     /* Prepare the sockaddr_in structure */
-     memset(&server_addr, 0, sizeof(server_addr));
-     server_addr.sin_family = AF_INET;
-     server_addr.sin_port = htons(PORT);
-     
-     /* Convert IP address to binary form */
-     if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
-         perror("inet_pton");
-         close(server_socket);
-         return -1;
+     /* Set before connecting, so fixed buffer sizes count towards the window scale.
+      * TCP_NODELAY is on unless configured off: every write is a whole message, and
+      * without it the small trailer after a body waits for the server's delayed ACK */
+     if (config_apply_socket(server_socket, config, &option) < 0) {
+         perror(option);
      }
      
-     /* Connect to server */
-     if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+     /* Connect to the configured server */
+     if (connect(server_socket, (const struct sockaddr *)&config->server, sizeof(config->server)) < 0) {
          perror("connect");
          close(server_socket);
          return -1;
@@ -109,16 +272,313 @@
      return pw->pw_name;
  }
  
+ /* Extract the final path component of filepath into filename */
+ static void extract_filename(const char *filepath, char *filename) {
+     const char *last_slash = strrchr(filepath, '/');
+     
+     strncpy(filename, last_slash ? last_slash + 1 : filepath, MAX_PATH_LENGTH - 1);
+     filename[MAX_PATH_LENGTH - 1] = '\0';
+ }
+ 
+ /* Protocol flags for one upload request */
+ static uint16_t request_flags(int flags) {
+     /* Resumable chunks carry their own checksums, so the trailer covers plain bodies only */
+     if (flags & CLIENT_FLAG_RESUME) {
+         return PROTO_FLAG_RESUME;
+     }
+     
+     return ((flags & CLIENT_FLAG_NO_CHECKSUM) ? 0 : PROTO_FLAG_CHECKSUM) |
+            ((flags & CLIENT_FLAG_COMPRESS) ? PROTO_FLAG_COMPRESS : 0) |
+            ((flags & CLIENT_FLAG_DELTA) ? PROTO_FLAG_DELTA : 0);
+ }
+ 
+ /* Build a PUT request, announcing the file's digest when one was computed */
+ static ssize_t build_put_request(char *request, uint16_t proto_flags, const char *username,
+                                  const char *target_dir, const char *filename, off_t filesize,
+                                  const uint8_t *digest) {
+     if (digest) {
+         return proto_build_dedup_request(request, PROTO_OP_PUT, proto_flags, username, target_dir, filename,
+                                          (uint64_t)filesize, digest);
+     }
+     return proto_build_request(request, PROTO_OP_PUT, proto_flags, username, target_dir, filename,
+                                (uint64_t)filesize);
+ }
+ 
+ /* Stream an open file's contents after the server answered READY */
+ off_t send_file_body(int server_socket, int file_fd, off_t filesize, int flags, uint16_t features) {
+     int checksum = (features & PROTO_FLAG_CHECKSUM) != 0;
+     off_t bytes_sent = -1;
+     uint32_t crc = 0;
+     proto_trailer_t trailer;
+     progress_t progress;
+     lzstream_stats_t stats;
+     netio_progress_fn report = (flags & CLIENT_FLAG_QUIET) ? NULL : progress_update;
+     
+     memset(&progress, 0, sizeof(progress));
+     progress.total = filesize;
+     clock_gettime(CLOCK_MONOTONIC, &progress.started);
+     
+     /* Let the send queue hold several chunks of a large file */
+     if (flags & CLIENT_FLAG_TUNE) {
+         netio_tune_socket(server_socket, SO_SNDBUF, netio_chunk_size(filesize));
+     }
+     
+     /* The checksum has to see every byte, and reading each buffer once to checksum
+      * and send it beats sendfile() followed by a second pass over the file */
+     if (checksum) {
+         flags |= CLIENT_FLAG_BUFFERED;
+     }
+     
+     if (features & PROTO_FLAG_COMPRESS) {
+         /* Compressed blocks, produced by a second thread while earlier ones are sent */
+         bytes_sent = lzstream_send(server_socket, file_fd, filesize, checksum ? &crc : NULL, &stats,
+                                    report, &progress);
+         if (bytes_sent >= 0 && !(flags & CLIENT_FLAG_QUIET)) {
+             if (stats.bypassed) {
+                 printf("File does not compress; sent %lld bytes uncompressed\n", (long long)stats.raw_bytes);
+             } else {
+                 printf("Compressed %lld bytes to %lld on the wire (%.1f%%)\n", (long long)stats.raw_bytes,
+                        (long long)stats.wire_bytes,
+                        stats.raw_bytes ? 100.0 * stats.wire_bytes / stats.raw_bytes : 100.0);
+             }
+         }
+     } else if (!(flags & CLIENT_FLAG_BUFFERED)) {
+         /* Zero-copy from the page cache */
+         bytes_sent = sendfile_all(server_socket, file_fd, filesize, report, &progress);
+         if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS) &&
+             lseek(file_fd, 0, SEEK_CUR) == 0) {
+             /* Nothing was sent; this file cannot be used with sendfile() */
+             flags |= CLIENT_FLAG_BUFFERED;
+         }
+     }
+     if ((flags & CLIENT_FLAG_BUFFERED) && !(features & PROTO_FLAG_COMPRESS)) {
+         /* The copy loop checksums each buffer on its way out */
+         bytes_sent = send_file_buffered(server_socket, file_fd, filesize, netio_chunk_size(filesize),
+                                         checksum ? &crc : NULL, report, &progress);
+     }
+     
+     /* The trailer lets the server reject the file before publishing it */
+     if (bytes_sent >= 0 && checksum) {
+         proto_build_trailer(&trailer, crc);
+         if (send_all(server_socket, &trailer, sizeof(trailer)) < 0) {
+             bytes_sent = -1;
+         }
+     }
+     
+     return bytes_sent;
+ }
+ 
+ /* Send a file from offset as checksummed chunks after a resumable READY */
+ off_t send_file_chunks(int server_socket, int file_fd, off_t offset, off_t filesize, int flags) {
+     char *data;
+     proto_chunk_t chunk;
+     ssize_t bytes_read;
+     size_t length;
+     progress_t progress;
+     
+     data = malloc(PROTO_CHUNK_SIZE);
+     if (!data) {
+         perror("malloc");
+         return -1;
+     }
+     
+     memset(&progress, 0, sizeof(progress));
+     progress.total = filesize;
+     clock_gettime(CLOCK_MONOTONIC, &progress.started);
+     
+     while (offset < filesize) {
+         length = (filesize - offset > PROTO_CHUNK_SIZE) ? PROTO_CHUNK_SIZE : (size_t)(filesize - offset);
+         
+         /* The checksum needs the bytes in memory, so read the chunk once and send that copy */
+         bytes_read = pread(file_fd, data, length, offset);
+         if (bytes_read != (ssize_t)length) {
+             if (bytes_read >= 0) {
+                 errno = EIO;
+             }
+             free(data);
+             return -1;
+         }
+         
+         proto_build_chunk(&chunk, (uint32_t)length, crc32c_update(0, data, length));
+         if (send_all(server_socket, &chunk, sizeof(chunk)) < 0 ||
+             send_all(server_socket, data, length) < 0) {
+             free(data);
+             return -1;
+         }
+         
+         offset += length;
+         if (!(flags & CLIENT_FLAG_QUIET)) {
+             progress_update(offset, &progress);
+         }
+     }
+     
+     free(data);
+     return offset;
+ }
+ 
+ /* Send the instructions gathered so far */
+ static int flush_delta(delta_upload_t *upload) {
+     if (upload->pending > 0 && send_all(upload->socket, upload->buffer, upload->pending) < 0) {
+         return -1;
+     }
+     upload->wire_bytes += (off_t)upload->pending;
+     upload->pending = 0;
+     
+     if (!upload->quiet) {
+         progress_update(upload->position, &upload->progress);
+     }
+     return 0;
+ }
+ 
+ /* Append one instruction from delta_encode(), sending when the buffer fills */
+ static int emit_delta(void *arg, uint32_t block, uint32_t length, const unsigned char *data) {
+     delta_upload_t *upload = (delta_upload_t *)arg;
+     size_t needed = sizeof(proto_delta_t) + ((block == PROTO_DELTA_LITERAL) ? length : 0);
+     
+     if (upload->pending + needed > upload->capacity && flush_delta(upload) < 0) {
+         return -1;
+     }
+     
+     proto_build_delta((proto_delta_t *)(upload->buffer + upload->pending), block, length);
+     upload->pending += sizeof(proto_delta_t);
+     if (block == PROTO_DELTA_LITERAL) {
+         memcpy(upload->buffer + upload->pending, data, length);
+         upload->pending += length;
+     } else {
+         upload->matched += length;
+     }
+     upload->position += length;
+     
+     return 0;
+ }
+ 
+ /* Send a file as copies of the server's blocks and literal data after a delta READY */
+ off_t send_file_delta(int server_socket, int file_fd, off_t filesize, uint64_t basis_size, int flags,
+                       uint16_t features) {
+     uint64_t count = proto_delta_block_count(basis_size);
+     proto_signature_t *sigs;
+     delta_index_t index;
+     delta_upload_t upload;
+     proto_trailer_t trailer;
+     unsigned char *data = NULL;
+     uint32_t crc = 0;
+     int result;
+     
+     /* The signatures of the server's copy follow READY; they have to be read even if
+      * this side cannot use them, or the connection is out of step */
+     if (count > PROTO_DELTA_MAX_BLOCKS) {
+         errno = EPROTO;
+         return -1;
+     }
+     sigs = malloc(count * sizeof(proto_signature_t));
+     if (!sigs) {
+         perror("malloc");
+         return -1;
+     }
+     if (recv(server_socket, sigs, count * sizeof(proto_signature_t), MSG_WAITALL) !=
+         (ssize_t)(count * sizeof(proto_signature_t))) {
+         free(sigs);
+         return -1;
+     }
+     if (delta_index_init(&index, sigs, basis_size) < 0) {
+         perror("malloc");
+         free(sigs);
+         return -1;
+     }
+     
+     /* The encoder looks back across block boundaries, so it works on the whole file mapped */
+     if (filesize > 0) {
+         data = mmap(NULL, (size_t)filesize, PROT_READ, MAP_PRIVATE, file_fd, 0);
+         if (data == MAP_FAILED) {
+             delta_index_free(&index);
+             free(sigs);
+             return -1;
+         }
+         madvise(data, (size_t)filesize, MADV_SEQUENTIAL);
+     }
+     
+     memset(&upload, 0, sizeof(upload));
+     upload.socket = server_socket;
+     upload.capacity = 2 * PROTO_CHUNK_SIZE;
+     upload.buffer = malloc(upload.capacity);
+     upload.quiet = (flags & CLIENT_FLAG_QUIET) != 0;
+     upload.progress.total = filesize;
+     clock_gettime(CLOCK_MONOTONIC, &upload.progress.started);
+     
+     /* Encode, then send what is still buffered and the checksum of the whole file, which
+      * is also how the server knows the copies it made really rebuilt it */
+     result = -1;
+     if (upload.buffer && delta_encode(&index, data, (uint64_t)filesize, emit_delta, &upload) == 0 &&
+         flush_delta(&upload) == 0) {
+         result = 0;
+         if (features & PROTO_FLAG_CHECKSUM) {
+             crc = crc32c_update(0, data, (size_t)filesize);
+             proto_build_trailer(&trailer, crc);
+             result = send_all(server_socket, &trailer, sizeof(trailer));
+         }
+     }
+     
+     if (result == 0 && !upload.quiet) {
+         printf("Matched %lld of %lld bytes against the server's copy; sent %lld bytes (%s)\n",
+                (long long)upload.matched, (long long)filesize, (long long)upload.wire_bytes,
+                delta_implementation());
+     }
+     
+     free(upload.buffer);
+     if (data) {
+         munmap(data, (size_t)filesize);
+     }
+     delta_index_free(&index);
+     free(sigs);
+     
+     return (result == 0) ? filesize : -1;
+ }
+ 
+ /* SHA-256 of an open file's first filesize bytes */
+ int digest_file(int file_fd, off_t filesize, uint8_t *digest) {
+     sha256_t ctx;
+     char *data;
+     ssize_t bytes_read;
+     off_t offset = 0;
+     
+     data = malloc(PROTO_CHUNK_SIZE);
+     if (!data) {
+         perror("malloc");
+         return -1;
+     }
+     
+     sha256_init(&ctx);
+     while (offset < filesize) {
+         bytes_read = pread(file_fd, data, (filesize - offset > PROTO_CHUNK_SIZE) ? PROTO_CHUNK_SIZE :
+                            (size_t)(filesize - offset), offset);
+         if (bytes_read <= 0) {
+             if (bytes_read == 0) {
+                 errno = EIO;
+             }
+             perror("read file");
+             free(data);
+             return -1;
+         }
+         sha256_update(&ctx, data, (size_t)bytes_read);
+         offset += bytes_read;
+     }
+     sha256_final(&ctx, digest);
+     
+     free(data);
+     return 0;
+ }
+ 
  /* Send file to server */
- int send_file(int server_socket, const char *filepath, const char *target_dir) {
+ int send_file(int server_socket, const char *filepath, const char *target_dir, int flags) {
      char *username = get_current_username();
      char filename[MAX_PATH_LENGTH] = {0};
      int file_fd;
-     ssize_t bytes_read, bytes_sent;
-     char buffer[BUFFER_SIZE] = {0};
-     long filesize;
-     int status_code = STATUS_UNKNOWN_ERROR;
-     int ready;
+     off_t filesize, bytes_sent;
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     proto_response_t response;
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     int dedup = (flags & CLIENT_FLAG_DEDUP) != 0;
      
      /* Check if username was successfully retrieved */
      if (!username) {
@@ -127,104 +587,1059 @@
      }
      
      /* Extract filename from filepath */
-     const char *last_slash = strrchr(filepath, '/');
-     if (last_slash) {
-         strncpy(filename, last_slash + 1, MAX_PATH_LENGTH - 1);
+     extract_filename(filepath, filename);
+     
+     /* Get file size */
+     filesize = get_file_size(filepath);
+     if (filesize < 0) {
+         fprintf(stderr, "Failed to get file size for '%s'\n", filepath);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* Open file for reading */
+     file_fd = open(filepath, O_RDONLY);
+     if (file_fd < 0) {
+         perror("open file");
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* The digest lets the server skip the body if it already stores this content */
+     if (dedup && digest_file(file_fd, filesize, digest) < 0) {
+         close(file_fd);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* Send the request header and fields in a single write */
+     request_len = build_put_request(request, request_flags(flags), username, target_dir, filename,
+                                     filesize, dedup ? digest : NULL);
+     if (request_len < 0) {
+         fprintf(stderr, "Username, directory or file name too long\n");
+         close(file_fd);
+         return STATUS_FILE_ERROR;
+     }
+     if (send_all(server_socket, request, request_len) < 0) {
+         perror("send request");
+         close(file_fd);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* Wait for server ready signal (or an early rejection) */
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv ready signal");
+         close(file_fd);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.status != STATUS_READY) {
+         /* Success without READY: the server published its stored copy */
+         if (dedup && response.status == STATUS_SUCCESS) {
+             printf("Already stored on the server: %s (%lld bytes not sent)\n", filename, (long long)filesize);
+         }
+         close(file_fd);
+         return response.status;
+     }
+     
+     /* A server that did not echo the resume flag expects a plain body */
+     if ((flags & CLIENT_FLAG_RESUME) &&
+         (!(response.flags & PROTO_FLAG_RESUME) || response.value > (uint64_t)filesize)) {
+         fprintf(stderr, "Server does not support resumable uploads\n");
+         close(file_fd);
+         return STATUS_PROTOCOL_ERROR;
+     }
+     
+     /* Send file data */
+     if (flags & CLIENT_FLAG_RESUME) {
+         if (response.value > 0) {
+             printf("Resuming file: %s at byte %llu of %lld\n", filename,
+                    (unsigned long long)response.value, (long long)filesize);
+         } else {
+             printf("Sending file: %s (%lld bytes)\n", filename, (long long)filesize);
+         }
+         bytes_sent = send_file_chunks(server_socket, file_fd, (off_t)response.value, filesize, flags);
+     } else if (response.flags & PROTO_FLAG_DELTA) {
+         printf("Sending changes to file: %s (%lld bytes, server has %llu)\n", filename, (long long)filesize,
+                (unsigned long long)response.value);
+         bytes_sent = send_file_delta(server_socket, file_fd, filesize, response.value, flags, response.flags);
      } else {
-         strncpy(filename, filepath, MAX_PATH_LENGTH - 1);
+         printf("Sending file: %s (%lld bytes)\n", filename, (long long)filesize);
+         bytes_sent = send_file_body(server_socket, file_fd, filesize, flags, response.flags);
      }
      
-     /* Send username to server */
-     if (send(server_socket, username, strlen(username), 0) < 0) {
-         perror("send username");
+     /* Close file */
+     close(file_fd);
+     
+     if (bytes_sent < 0) {
+         perror("send file data");
          return STATUS_UNKNOWN_ERROR;
      }
      
-     /* Send target directory to server */
-     if (send(server_socket, target_dir, strlen(target_dir), 0) < 0) {
-         perror("send target directory");
+     /* Receive status code from server */
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv status code");
          return STATUS_UNKNOWN_ERROR;
      }
      
-     /* Send filename to server */
-     if (send(server_socket, filename, strlen(filename), 0) < 0) {
-         perror("send filename");
+     return response.status;
+ }
+ 
+ /* Send one file, reconnecting to try again while the server answers BUSY: a quota's
+  * transfer cap is full, or an event-loop server has another upload writing the same file
+  * (the threaded cores wait for that one instead). Each refusal ends the connection. */
+ int send_file_waiting(int *server_socket, const char *filepath, const char *target_dir, int flags) {
+     int status_code = send_file(*server_socket, filepath, target_dir, flags);
+     
+     while (status_code == STATUS_BUSY) {
+         close(*server_socket);
+         usleep(BUSY_RETRY_MS * 1000);
+         *server_socket = connect_to_server();
+         if (*server_socket < 0) {
+             return STATUS_UNKNOWN_ERROR;
+         }
+         status_code = send_file(*server_socket, filepath, target_dir, flags);
+     }
+     
+     return status_code;
+ }
+ 
+ /* Send one file, reconnecting and resuming after interrupted attempts */
+ int send_file_resumable(int *server_socket, const char *filepath, const char *target_dir, int flags) {
+     int attempt, status_code = STATUS_UNKNOWN_ERROR;
+     
+     for (attempt = 1; attempt <= RESUME_ATTEMPTS; attempt++) {
+         /* Reconnect after a failed attempt; the server kept what it verified */
+         if (*server_socket < 0) {
+             sleep(RESUME_RETRY_DELAY);
+             *server_socket = connect_to_server();
+             if (*server_socket < 0) {
+                 continue;
+             }
+         }
+         
+         status_code = send_file_waiting(server_socket, filepath, target_dir, flags);
+         
+         /* Only interrupted or corrupted transfers are worth resuming */
+         if (status_code != STATUS_UNKNOWN_ERROR && status_code != STATUS_CHECKSUM_ERROR) {
+             break;
+         }
+         
+         fprintf(stderr, "Attempt %d of %d failed: %s\n", attempt, RESUME_ATTEMPTS,
+                 status_message(status_code));
+         close(*server_socket);
+         *server_socket = -1;
+     }
+     
+     return status_code;
+ }
+ 
+ /* Open a session so one connection can carry several requests */
+ static int open_session(int server_socket, const char *username, const char *target_dir) {
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     proto_response_t response;
+     
+     request_len = proto_build_request(request, PROTO_OP_SESSION, PROTO_FLAG_SESSION, username,
+                                       target_dir, "", 0);
+     if (request_len < 0 || send_all(server_socket, request, request_len) < 0) {
+         perror("send session request");
          return STATUS_UNKNOWN_ERROR;
      }
      
-     /* Get file size */
-     filesize = get_file_size(filepath);
-     if (filesize < 0) {
-         fprintf(stderr, "Failed to get file size for '%s'\n", filepath);
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv session response");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     return response.status;
+ }
+ 
+ /* Write the length-byte body of a download to file_fd from offset */
+ static off_t receive_body(int server_socket, int file_fd, off_t offset, off_t length, int flags) {
+     size_t buffer_size = netio_chunk_size(length);
+     off_t received = 0;
+     ssize_t bytes_read, bytes_written, done;
+     progress_t progress;
+     char *buffer;
+     
+     memset(&progress, 0, sizeof(progress));
+     progress.total = length;
+     clock_gettime(CLOCK_MONOTONIC, &progress.started);
+     
+     buffer = malloc(buffer_size);
+     if (!buffer) {
+         return -1;
+     }
+     
+     while (received < length) {
+         bytes_read = recv(server_socket, buffer,
+                           (size_t)(length - received) < buffer_size ? (size_t)(length - received) : buffer_size, 0);
+         if (bytes_read < 0 && errno == EINTR) {
+             continue;
+         }
+         if (bytes_read <= 0) {
+             if (bytes_read == 0) {
+                 errno = ECONNRESET;
+             }
+             free(buffer);
+             return -1;
+         }
+         
+         /* Each piece goes straight to its place, so a range fills in an existing copy */
+         for (done = 0; done < bytes_read; done += bytes_written) {
+             bytes_written = pwrite(file_fd, buffer + done, (size_t)(bytes_read - done), offset + received + done);
+             if (bytes_written < 0) {
+                 if (errno == EINTR) {
+                     bytes_written = 0;
+                     continue;
+                 }
+                 free(buffer);
+                 return -1;
+             }
+         }
+         received += bytes_read;
+         if (!(flags & CLIENT_FLAG_QUIET)) {
+             progress_update(received, &progress);
+         }
+     }
+     
+     free(buffer);
+     return received;
+ }
+ 
+ /* Download a file into the current directory */
+ int receive_file(int server_socket, const char *filename, const char *target_dir, off_t offset,
+                  off_t length, int flags) {
+     char *username = get_current_username();
+     char local_name[MAX_PATH_LENGTH] = {0};
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     proto_response_t response;
+     off_t received;
+     int file_fd, created = 1, whole = (offset == 0 && length == 0);
+     
+     if (!username) {
+         fprintf(stderr, "Failed to get username\n");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* The server serves names, not paths; the copy lands under the same name here */
+     extract_filename(filename, local_name);
+     
+     /* Open before asking, so a file that cannot be written is never requested;
+      * nothing is truncated until the server has agreed to send, and a file created
+      * for a refused download is removed again */
+     file_fd = open(local_name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+     if (file_fd < 0 && errno == EEXIST) {
+         created = 0;
+         file_fd = open(local_name, O_WRONLY);
+     }
+     if (file_fd < 0) {
+         perror("open file");
          return STATUS_FILE_ERROR;
      }
      
-     /* Send file size to server */
-     if (send(server_socket, &filesize, sizeof(filesize), 0) < 0) {
-         perror("send filesize");
+     request_len = proto_build_get_request(request, 0, username, target_dir, local_name, (uint64_t)offset,
+                                           (uint64_t)length);
+     if (request_len < 0) {
+         fprintf(stderr, "Username, directory or file name too long\n");
+         close(file_fd);
+         return STATUS_FILE_ERROR;
+     }
+     if (send_all(server_socket, request, request_len) < 0) {
+         perror("send request");
+         close(file_fd);
          return STATUS_UNKNOWN_ERROR;
      }
      
-     /* Wait for server ready signal */
-     if (recv(server_socket, &ready, sizeof(ready), 0) <= 0) {
+     /* READY carries the number of body bytes that follow */
+     if (proto_recv_response(server_socket, &response) < 0) {
          perror("recv ready signal");
+         close(file_fd);
          return STATUS_UNKNOWN_ERROR;
      }
+     if (response.status != STATUS_READY) {
+         close(file_fd);
+         if (created) {
+             unlink(local_name);
+         }
+         return response.status;
+     }
      
-     /* Open file for reading */
-     file_fd = open(filepath, O_RDONLY);
-     if (file_fd < 0) {
+     if (whole) {
+         printf("Receiving file: %s (%llu bytes)\n", local_name, (unsigned long long)response.value);
+     } else {
+         printf("Receiving file: %s bytes %lld to %lld\n", local_name, (long long)offset,
+                (long long)offset + (long long)response.value);
+     }
+     received = receive_body(server_socket, file_fd, offset, (off_t)response.value, flags);
+     
+     /* A whole download replaces a longer local copy entirely */
+     if (received >= 0 && whole && ftruncate(file_fd, received) < 0) {
+         perror("ftruncate");
+     }
+     close(file_fd);
+     
+     if (received < 0) {
+         perror("recv file data");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* Receive status code from server */
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv status code");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     return response.status;
+ }
+ 
+ /* Download many files over one session */
+ int receive_files_session(int server_socket, char **names, int count, const char *target_dir, int flags) {
+     char *username = get_current_username();
+     int i, status_code, failures = 0;
+     
+     if (!username) {
+         fprintf(stderr, "Failed to get username\n");
+         return count;
+     }
+     
+     /* Authenticate once for every download that follows */
+     status_code = open_session(server_socket, username, target_dir);
+     if (status_code != STATUS_SUCCESS) {
+         fprintf(stderr, "Session refused: %s\n", status_message(status_code));
+         return count;
+     }
+     
+     for (i = 0; i < count; i++) {
+         status_code = receive_file(server_socket, names[i], target_dir, 0, 0, flags);
+         if (status_code != STATUS_SUCCESS) {
+             fprintf(stderr, "%s: %s\n", names[i], status_message(status_code));
+             failures++;
+         }
+         
+         /* A connection that failed mid-body is out of step with the server */
+         if (status_code == STATUS_UNKNOWN_ERROR) {
+             return failures + count - i - 1;
+         }
+     }
+     
+     return failures;
+ }
+ 
+ /* Print the files in a directory on the server, or what changed in it */
+ int list_directory(int server_socket, const char *target_dir, const char *filename, int changes,
+                    uint64_t since) {
+     char *username = get_current_username();
+     char request[PROTO_MAX_REQUEST];
+     char name[PROTO_MAX_FILENAME + 1];
+     char modified[32], owner[32], size[24], crc[16];
+     ssize_t request_len, entry_length;
+     proto_response_t response;
+     proto_entry_t entry;
+     unsigned long long total = 0;
+     uint64_t sequence = since;
+     struct passwd *pw;
+     size_t position;
+     char *listing;
+     time_t mtime;
+     struct tm tm;
+     int files = 0;
+     
+     if (!username) {
+         fprintf(stderr, "Failed to get username\n");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* A change query carries its starting sequence where an upload carries its size */
+     request_len = proto_build_request(request, PROTO_OP_LIST, changes ? PROTO_FLAG_CHANGES : 0, username,
+                                       target_dir, filename ? filename : "", changes ? since : 0);
+     if (request_len < 0 || send_all(server_socket, request, request_len) < 0) {
+         perror("send list request");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* READY carries the length of the listing that follows */
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv ready signal");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.status != STATUS_READY) {
+         return response.status;
+     }
+     if (response.value > PROTO_MAX_LISTING) {
+         fprintf(stderr, "Listing of %llu bytes is too long\n", (unsigned long long)response.value);
+         return STATUS_PROTOCOL_ERROR;
+     }
+     
+     /* A server that did not acknowledge the query sent every file instead */
+     if (changes && !(response.flags & PROTO_FLAG_CHANGES)) {
+         fprintf(stderr, "Server does not answer change queries\n");
+         return STATUS_PROTOCOL_ERROR;
+     }
+     
+     listing = malloc(response.value ? (size_t)response.value : 1);
+     if (!listing) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.value > 0 &&
+         recv(server_socket, listing, (size_t)response.value, MSG_WAITALL) != (ssize_t)response.value) {
+         perror("recv listing");
+         free(listing);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* One line per file */
+     for (position = 0; position < response.value; position += (size_t)entry_length) {
+         entry_length = proto_parse_entry(listing + position, (size_t)response.value - position, &entry, name);
+         if (entry_length < 0) {
+             fprintf(stderr, "Malformed listing entry at byte %zu\n", position);
+             free(listing);
+             return STATUS_PROTOCOL_ERROR;
+         }
+         mtime = (time_t)entry.mtime;
+         localtime_r(&mtime, &tm);
+         strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm);
+         pw = getpwuid(entry.owner);
+         if (pw) {
+             snprintf(owner, sizeof(owner), "%s", pw->pw_name);
+         } else {
+             snprintf(owner, sizeof(owner), "%u", entry.owner);
+         }
+         if (entry.flags & PROTO_ENTRY_REMOVED) {
+             snprintf(size, sizeof(size), "removed");
+         } else {
+             snprintf(size, sizeof(size), "%llu", (unsigned long long)entry.size);
+             total += entry.size;
+             files++;
+         }
+         if (entry.flags & PROTO_ENTRY_CRC_UNKNOWN) {
+             snprintf(crc, sizeof(crc), "-");
+         } else {
+             snprintf(crc, sizeof(crc), "%08x", entry.crc32c);
+         }
+         printf("%8llu %12s  %s  %-12s %8s  %s\n", (unsigned long long)entry.sequence, size, modified, owner,
+                crc, name);
+         if (entry.sequence > sequence) {
+             sequence = entry.sequence;
+         }
+     }
+     free(listing);
+     
+     /* A full body of changes may have been cut short; the rest follows the last sequence */
+     if (changes) {
+         printf("%d files, %llu bytes changed in %s up to sequence %llu\n", files, total, target_dir,
+                (unsigned long long)sequence);
+         if (response.value + sizeof(proto_entry_t) + PROTO_MAX_FILENAME > PROTO_MAX_LISTING) {
+             printf("More changes follow; ask again with -N %llu\n", (unsigned long long)sequence);
+         }
+     } else {
+         printf("%d files, %llu bytes in %s\n", files, total, target_dir);
+     }
+     
+     /* Receive status code from server */
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv status code");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     return response.status;
+ }
+ 
+ /* Send one range over a session: request, READY, body, then its status */
+ static int send_range(int server_socket, int file_fd, parallel_upload_t *upload, uint32_t index) {
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     proto_response_t response;
+     off_t offset = (off_t)index * upload->range_size;
+     off_t length = upload->filesize - offset;
+     uint16_t proto_flags = PROTO_FLAG_SESSION;
+     
+     if (length > upload->range_size) {
+         length = upload->range_size;
+     }
+     
+     /* Ranges are checksummed like plain bodies but never compressed or resumed */
+     if (!(upload->flags & CLIENT_FLAG_NO_CHECKSUM)) {
+         proto_flags |= PROTO_FLAG_CHECKSUM;
+     }
+     request_len = proto_build_range_request(request, PROTO_OP_RANGE, proto_flags, upload->username,
+                                             upload->target_dir, upload->filename, (uint64_t)length,
+                                             upload->token, index);
+     if (request_len < 0 || send_all(server_socket, request, request_len) < 0) {
+         perror("send range request");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv ready signal");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.status != STATUS_READY) {
+         return response.status;
+     }
+     
+     /* Both send paths start at the descriptor's current offset */
+     if (lseek(file_fd, offset, SEEK_SET) != offset ||
+         send_file_body(server_socket, file_fd, length, upload->flags | CLIENT_FLAG_QUIET,
+                        response.flags & PROTO_FLAG_CHECKSUM) < 0) {
+         perror("send range data");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv status code");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (response.status == STATUS_SUCCESS) {
+         pthread_mutex_lock(&upload->lock);
+         upload->bytes_sent += length;
+         if (!(upload->flags & CLIENT_FLAG_QUIET)) {
+             progress_update(upload->bytes_sent, &upload->progress);
+         }
+         pthread_mutex_unlock(&upload->lock);
+     }
+     
+     return response.status;
+ }
+ 
+ /* Stream thread: its own connection and file descriptor, taking ranges until none are left */
+ static void *send_ranges(void *arg) {
+     parallel_upload_t *upload = (parallel_upload_t *)arg;
+     int server_socket, file_fd = -1, status;
+     uint32_t index;
+     
+     server_socket = connect_to_server();
+     if (server_socket < 0) {
+         status = STATUS_UNKNOWN_ERROR;
+     } else if ((file_fd = open(upload->filepath, O_RDONLY)) < 0) {
          perror("open file");
+         status = STATUS_FILE_ERROR;
+     } else {
+         status = open_session(server_socket, upload->username, upload->target_dir);
+     }
+     
+     while (status == STATUS_SUCCESS) {
+         /* Stop handing out ranges once any stream has failed */
+         pthread_mutex_lock(&upload->lock);
+         index = upload->next_range;
+         if (upload->status == STATUS_SUCCESS && index < upload->range_count) {
+             upload->next_range++;
+         } else {
+             index = upload->range_count;
+         }
+         pthread_mutex_unlock(&upload->lock);
+         
+         if (index >= upload->range_count) {
+             break;
+         }
+         status = send_range(server_socket, file_fd, upload, index);
+         
+         /* Over a quota's transfer cap: the session is still aligned, so wait for a slot */
+         while (status == STATUS_BUSY) {
+             usleep(BUSY_RETRY_MS * 1000);
+             status = send_range(server_socket, file_fd, upload, index);
+         }
+     }
+     
+     if (status != STATUS_SUCCESS) {
+         pthread_mutex_lock(&upload->lock);
+         if (upload->status == STATUS_SUCCESS) {
+             upload->status = status;
+         }
+         pthread_mutex_unlock(&upload->lock);
+     }
+     
+     if (file_fd >= 0) {
+         close(file_fd);
+     }
+     if (server_socket >= 0) {
+         close(server_socket);
+     }
+     return NULL;
+ }
+ 
+ /* Send one large file as ranges over streams connections, then commit it */
+ int send_file_parallel(int *server_socket, const char *filepath, const char *target_dir, int flags,
+                        int streams) {
+     char *username = get_current_username();
+     char filename[MAX_PATH_LENGTH] = {0};
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     proto_response_t response;
+     parallel_upload_t upload;
+     pthread_t threads[PROTO_MAX_RANGES];
+     off_t filesize, bytes_sent;
+     int file_fd, commit_socket, started = 0, i;
+     
+     if (!username) {
+         fprintf(stderr, "Failed to get username\n");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     filesize = get_file_size(filepath);
+     if (filesize < 0) {
+         fprintf(stderr, "Failed to get file size for '%s'\n", filepath);
          return STATUS_FILE_ERROR;
      }
      
-     /* Send file data */
-     printf("Sending file: %s (%ld bytes)\n", filename, filesize);
+     /* Extra connections only pay off once each carries several megabytes */
+     if (filesize < PARALLEL_MIN_SIZE) {
+         return send_file_waiting(server_socket, filepath, target_dir, flags);
+     }
+     extract_filename(filepath, filename);
      
-     while ((bytes_read = read(file_fd, buffer, BUFFER_SIZE)) > 0) {
-         bytes_sent = send(server_socket, buffer, bytes_read, 0);
-         if (bytes_sent < 0) {
+     /* Open and commit are one-shot requests, so no idle connection holds a pool worker
+      * while the ranges wait for one */
+     request_len = proto_build_request(request, PROTO_OP_PUT, PROTO_FLAG_PARALLEL | (request_flags(flags) & ~PROTO_FLAG_DELTA),
+                                       username, target_dir, filename, (uint64_t)filesize);
+     if (request_len < 0) {
+         fprintf(stderr, "Username, directory or file name too long\n");
+         return STATUS_FILE_ERROR;
+     }
+     if (send_all(*server_socket, request, request_len) < 0) {
+         perror("send request");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     if (proto_recv_response(*server_socket, &response) < 0) {
+         perror("recv parallel upload token");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* A server without parallel uploads treats this as an ordinary upload */
+     if (response.status == STATUS_READY) {
+         printf("Server does not support parallel uploads; sending over one connection\n");
+         file_fd = open(filepath, O_RDONLY);
+         if (file_fd < 0) {
+             perror("open file");
+             return STATUS_FILE_ERROR;
+         }
+         bytes_sent = send_file_body(*server_socket, file_fd, filesize, flags, response.flags);
+         close(file_fd);
+         if (bytes_sent < 0 || proto_recv_response(*server_socket, &response) < 0) {
              perror("send file data");
-             close(file_fd);
              return STATUS_UNKNOWN_ERROR;
          }
-         
-         printf("Sent %zd bytes\n", bytes_sent);
+         return response.status;
+     }
+     if (response.status != STATUS_SUCCESS) {
+         return response.status;
      }
      
-     /* Close file */
-     close(file_fd);
+     memset(&upload, 0, sizeof(upload));
+     upload.filepath = filepath;
+     upload.username = username;
+     upload.target_dir = target_dir;
+     upload.filename = filename;
+     upload.filesize = filesize;
+     upload.range_size = (off_t)proto_range_size((uint64_t)filesize);
+     upload.range_count = proto_range_count((uint64_t)filesize);
+     upload.token = response.value;
+     upload.flags = flags;
+     upload.status = STATUS_SUCCESS;
+     upload.progress.total = filesize;
+     clock_gettime(CLOCK_MONOTONIC, &upload.progress.started);
+     pthread_mutex_init(&upload.lock, NULL);
      
-     /* Receive status code from server */
-     if (recv(server_socket, &status_code, sizeof(status_code), 0) <= 0) {
-         perror("recv status code");
+     if ((uint32_t)streams > upload.range_count) {
+         streams = (int)upload.range_count;
+     }
+     printf("Sending file: %s (%lld bytes) as %u ranges over %d connections\n", filename,
+            (long long)filesize, upload.range_count, streams);
+     
+     /* Threads that fail to start only mean fewer streams */
+     for (i = 0; i < streams; i++) {
+         if (pthread_create(&threads[started], NULL, send_ranges, &upload) != 0) {
+             perror("pthread_create");
+             continue;
+         }
+         started++;
+     }
+     for (i = 0; i < started; i++) {
+         pthread_join(threads[i], NULL);
+     }
+     pthread_mutex_destroy(&upload.lock);
+     
+     if (started == 0) {
          return STATUS_UNKNOWN_ERROR;
      }
      
-     return status_code;
+     /* The server discards an upload that is never committed */
+     if (upload.status != STATUS_SUCCESS) {
+         return upload.status;
+     }
+     
+     /* Every range is stored: publish the file, once no other upload is writing it */
+     request_len = proto_build_range_request(request, PROTO_OP_COMMIT, 0, username, target_dir, filename,
+                                             (uint64_t)filesize, upload.token, 0);
+     do {
+         commit_socket = connect_to_server();
+         if (commit_socket < 0) {
+             return STATUS_UNKNOWN_ERROR;
+         }
+         if (request_len < 0 || send_all(commit_socket, request, request_len) < 0) {
+             perror("send commit request");
+             close(commit_socket);
+             return STATUS_UNKNOWN_ERROR;
+         }
+         if (proto_recv_response(commit_socket, &response) < 0) {
+             perror("recv status code");
+             close(commit_socket);
+             return STATUS_UNKNOWN_ERROR;
+         }
+         close(commit_socket);
+         if (response.status == STATUS_BUSY) {
+             usleep(BUSY_RETRY_MS * 1000);
+         }
+     } while (response.status == STATUS_BUSY);
+     
+     return response.status;
  }
  
- /* Display transfer status message */
- void display_status_message(int status_code) {
+ /* Open the next sendable file at or after index and send its request header.
+  * Returns 0 when a header was sent, 1 when no files remain, -1 on a socket error. */
+ static int announce_next_file(int server_socket, char **paths, int count, int index,
+                               const char *username, const char *target_dir, int flags,
+                               pending_file_t *file, int *failures) {
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     struct stat st;
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     int dedup = (flags & CLIENT_FLAG_DEDUP) != 0;
+     
+     for (; index < count; index++) {
+         file->index = index;
+         extract_filename(paths[index], file->filename);
+         
+         /* Open before announcing so the size we promise is the size we send */
+         file->fd = open(paths[index], O_RDONLY);
+         if (file->fd < 0 || fstat(file->fd, &st) < 0) {
+             printf("[%d/%d] %s: cannot open: %s\n", index + 1, count, paths[index], strerror(errno));
+             if (file->fd >= 0) {
+                 close(file->fd);
+             }
+             (*failures)++;
+             continue;
+         }
+         file->size = st.st_size;
+         
+         if (dedup && digest_file(file->fd, file->size, digest) < 0) {
+             printf("[%d/%d] %s: cannot read\n", index + 1, count, paths[index]);
+             close(file->fd);
+             (*failures)++;
+             continue;
+         }
+         
+         request_len = build_put_request(request, PROTO_FLAG_SESSION | request_flags(flags), username,
+                                         target_dir, file->filename, file->size, dedup ? digest : NULL);
+         if (request_len < 0) {
+             printf("[%d/%d] %s: file name too long\n", index + 1, count, paths[index]);
+             close(file->fd);
+             (*failures)++;
+             continue;
+         }
+         
+         if (send_all(server_socket, request, request_len) < 0) {
+             perror("send request");
+             close(file->fd);
+             return -1;
+         }
+         return 0;
+     }
+     
+     file->index = count;
+     file->fd = -1;
+     return 1;
+ }
+ 
+ /* Send many files over one session; returns the number that failed */
+ int send_files_session(int server_socket, char **paths, int count, const char *target_dir, int flags) {
+     char *username = get_current_username();
+     char request[PROTO_MAX_REQUEST];
+     ssize_t request_len;
+     proto_response_t response;
+     pending_file_t current, next;
+     int failures = 0, result, status_code, cloned;
+     off_t bytes_sent;
+     
+     if (!username) {
+         fprintf(stderr, "Failed to get username\n");
+         return count;
+     }
+     
+     /* Open the session: access is verified once for every file that follows */
+     request_len = proto_build_request(request, PROTO_OP_SESSION, PROTO_FLAG_SESSION, username,
+                                       target_dir, "", 0);
+     if (request_len < 0 || send_all(server_socket, request, request_len) < 0) {
+         perror("send session request");
+         return count;
+     }
+     
+     /* Pipeline the first file header behind the session request */
+     result = announce_next_file(server_socket, paths, count, 0, username, target_dir, flags,
+                                 &current, &failures);
+     if (result < 0) {
+         return count;
+     }
+     
+     if (proto_recv_response(server_socket, &response) < 0) {
+         perror("recv session response");
+         return count;
+     }
+     if (response.status != STATUS_SUCCESS) {
+         display_status_message(response.status);
+         if (current.fd >= 0) {
+             close(current.fd);
+         }
+         return count;
+     }
+     
+     printf("Session opened for %d files\n", count);
+     
+     while (current.index < count) {
+         /* READY, or an early per-file rejection */
+         if (proto_recv_response(server_socket, &response) < 0) {
+             perror("recv ready signal");
+             close(current.fd);
+             return failures + (count - current.index);
+         }
+         
+         bytes_sent = 0;
+         if (response.status == STATUS_READY && (flags & CLIENT_FLAG_RESUME)) {
+             /* Continue from whatever an earlier run left staged */
+             if (!(response.flags & PROTO_FLAG_RESUME) || response.value > (uint64_t)current.size) {
+                 fprintf(stderr, "Server does not support resumable uploads\n");
+                 close(current.fd);
+                 return failures + (count - current.index);
+             }
+             bytes_sent = send_file_chunks(server_socket, current.fd, (off_t)response.value,
+                                           current.size, flags | CLIENT_FLAG_QUIET);
+         } else if (response.status == STATUS_READY && (response.flags & PROTO_FLAG_DELTA)) {
+             bytes_sent = send_file_delta(server_socket, current.fd, current.size, response.value,
+                                          flags | CLIENT_FLAG_QUIET, response.flags);
+         } else if (response.status == STATUS_READY) {
+             bytes_sent = send_file_body(server_socket, current.fd, current.size, flags | CLIENT_FLAG_QUIET,
+                                         response.flags);
+         }
+         close(current.fd);
+         if (bytes_sent < 0) {
+             perror("send file data");
+             return failures + (count - current.index);
+         }
+         
+         /* BUSY in place of READY leaves the session aligned: announce the same file again
+          * once the upload writing it has had time to finish */
+         if (response.status == STATUS_BUSY) {
+             usleep(BUSY_RETRY_MS * 1000);
+             result = announce_next_file(server_socket, paths, count, current.index, username, target_dir,
+                                         flags, &current, &failures);
+             if (result < 0) {
+                 return failures + (count - current.index);
+             }
+             continue;
+         }
+         
+         /* Send the next header before waiting for this file's status */
+         result = announce_next_file(server_socket, paths, count, current.index + 1,
+                                     username, target_dir, flags, &next, &failures);
+         if (result < 0) {
+             return failures + (count - current.index);
+         }
+         
+         /* Success in place of READY: the server published its stored copy */
+         status_code = response.status;
+         cloned = (status_code == STATUS_SUCCESS);
+         if (status_code == STATUS_READY) {
+             if (proto_recv_response(server_socket, &response) < 0) {
+                 perror("recv status code");
+                 if (next.fd >= 0) {
+                     close(next.fd);
+                 }
+                 return failures + (count - current.index);
+             }
+             status_code = response.status;
+         }
+         
+         printf("[%d/%d] %s (%lld bytes): %s%s\n", current.index + 1, count, current.filename,
+                (long long)current.size, status_message(status_code),
+                cloned ? " (already stored, not sent)" : "");
+         if (status_code != STATUS_SUCCESS) {
+             failures++;
+         }
+         
+         current = next;
+     }
+     
+     return failures;
+ }
+ 
+ /* Milliseconds between two monotonic timestamps */
+ static long elapsed_ms(const struct timespec *start, const struct timespec *end) {
+     return (end->tv_sec - start->tv_sec) * 1000L + (end->tv_nsec - start->tv_nsec) / 1000000L;
+ }
+ 
+ /* Redraw the progress bar at most every PROGRESS_INTERVAL_MS */
+ void progress_update(off_t bytes_sent, void *arg) {
+     progress_t *progress = (progress_t *)arg;
+     struct timespec now;
+     char bar[PROGRESS_BAR_WIDTH + 1];
+     int filled, finished;
+     long ms;
+     double rate;
+     
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     finished = (bytes_sent >= progress->total);
+     
+     /* Skip redraws that come too soon after the last one, except the final one */
+     if (!finished && progress->last_update.tv_sec != 0 &&
+         elapsed_ms(&progress->last_update, &now) < PROGRESS_INTERVAL_MS) {
+         return;
+     }
+     progress->last_update = now;
+     
+     filled = progress->total > 0 ? (int)((double)bytes_sent * PROGRESS_BAR_WIDTH / progress->total) : PROGRESS_BAR_WIDTH;
+     memset(bar, '#', filled);
+     memset(bar + filled, ' ', PROGRESS_BAR_WIDTH - filled);
+     bar[PROGRESS_BAR_WIDTH] = '\0';
+     
+     ms = elapsed_ms(&progress->started, &now);
+     rate = ms > 0 ? (double)bytes_sent / 1048576.0 / (ms / 1000.0) : 0.0;
+     
+     printf("\r[%s] %3d%% %lld/%lld bytes %.1f MiB/s", bar,
+            progress->total > 0 ? (int)(bytes_sent * 100 / progress->total) : 100,
+            (long long)bytes_sent, (long long)progress->total, rate);
+     if (finished) {
+         printf("\n");
+     }
+     fflush(stdout);
+ }
+ 
+ /* Describe a transfer status code */
+ const char *status_message(int status_code) {
      switch (status_code) {
          case STATUS_SUCCESS:
-             printf("File transfer successful.\n");
-             break;
+             return "File transfer successful.";
          case STATUS_PERMISSION_DENIED:
-             printf("Permission denied. You do not have access to the target directory.\n");
-             break;
+             return "Permission denied. You do not have access to the target directory.";
          case STATUS_FILE_ERROR:
-             printf("File transfer failed due to a file-related error.\n");
-             break;
+             return "File transfer failed due to a file-related error.";
+         case STATUS_PROTOCOL_ERROR:
+             return "File transfer failed: the server rejected the request as malformed.";
+         case STATUS_CHECKSUM_ERROR:
+             return "File transfer failed: data was corrupted in transit.";
+         case STATUS_BUSY:
+             return "File transfer refused: too many uploads in progress, or the file is being written by another.";
          case STATUS_UNKNOWN_ERROR:
          default:
-             printf("File transfer failed due to an unknown error.\n");
-             break;
+             return "File transfer failed due to an unknown error.";
+     }
+ }
+ 
+ /* Display transfer status message */
+ void display_status_message(int status_code) {
+     printf("%s\n", status_message(status_code));
+ }
+ 
+ /* Append a path to the file list if it names a regular file */
+ int file_list_add(file_list_t *list, const char *path) {
+     struct stat st;
+     char **grown;
+     
+     /* Validate file path */
+     if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+         fprintf(stderr, "Error: File '%s' does not exist or is not a regular file\n", path);
+         return -1;
+     }
+     
+     if (list->count == list->capacity) {
+         list->capacity = list->capacity ? list->capacity * 2 : 16;
+         grown = realloc(list->paths, list->capacity * sizeof(char *));
+         if (!grown) {
+             perror("realloc");
+             return -1;
+         }
+         list->paths = grown;
+     }
+     
+     list->paths[list->count] = strdup(path);
+     if (!list->paths[list->count]) {
+         perror("strdup");
+         return -1;
+     }
+     list->count++;
+     
+     return 0;
+ }
+ 
+ /* Add every regular file directly inside a directory */
+ int collect_directory(file_list_t *list, const char *dirpath) {
+     char path[MAX_PATH_LENGTH * 2];
+     struct dirent *entry;
+     struct stat st;
+     DIR *dir;
+     
+     dir = opendir(dirpath);
+     if (!dir) {
+         perror("opendir");
+         return -1;
+     }
+     
+     while ((entry = readdir(dir)) != NULL) {
+         snprintf(path, sizeof(path), "%s/%s", dirpath, entry->d_name);
+         
+         /* Sub-directories are skipped: destination names cannot contain '/' */
+         if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+             continue;
+         }
+         if (file_list_add(list, path) < 0) {
+             closedir(dir);
+             return -1;
+         }
+     }
+     
+     closedir(dir);
+     return 0;
+ }
+ 
+ /* Add the paths listed one per line in a file */
+ int collect_list_file(file_list_t *list, const char *list_path) {
+     char line[MAX_PATH_LENGTH * 2];
+     size_t length;
+     FILE *fp;
+     
+     fp = fopen(list_path, "r");
+     if (!fp) {
+         perror("fopen");
+         return -1;
+     }
+     
+     while (fgets(line, sizeof(line), fp)) {
+         length = strcspn(line, "\r\n");
+         line[length] = '\0';
+         if (length == 0) {
+             continue;
+         }
+         if (file_list_add(list, line) < 0) {
+             fclose(fp);
+             return -1;
+         }
+     }
+     
+     fclose(fp);
+     return 0;
+ }
+ 
+ /* Release the file list */
+ void file_list_free(file_list_t *list) {
+     int i;
+     
+     for (i = 0; i < list->count; i++) {
+         free(list->paths[i]);
      }
+     free(list->paths);
+     list->paths = NULL;
+     list->count = list->capacity = 0;
  }
  
  /* Get file size */
- long get_file_size(const char *filepath) {
+ off_t get_file_size(const char *filepath) {
      struct stat st;
      
      if (stat(filepath, &st) < 0) {
@@ -237,10 +1652,44 @@
  
  /* Display usage instructions */
  void display_usage(void) {
-     printf("Usage: client <filepath> <target_directory>\n");
-     printf("  filepath: Path to the file you want to transfer\n");
-     printf("  target_directory: Either 'Manufacturing' or 'Distribution'\n");
+     printf("Usage: client [-b] [-q] [-R] [-T] [-C] [-c] [-D] [-d] [-P streams] [-r dir] [-l listfile]\n");
+     printf("              [-F file] [-o key=value]... [filepath...] <target_directory>\n");
+     printf("       client -g [-q] [-O offset[:length]] [-F file] [-o key=value]... filename... <target_directory>\n");
+     printf("       client -L [-F file] [-o key=value]... [filename] <target_directory>\n");
+     printf("       client -N sequence [-F file] [-o key=value]... <target_directory>\n");
+     printf("  -b: Copy through a user-space buffer instead of sendfile() (implied unless -C)\n");
+     printf("  -q: Do not display a progress bar\n");
+     printf("  -R: Resumable upload: continue an interrupted transfer, checksumming each chunk\n");
+     printf("  -T: Size the socket send buffer to the transfer chunk size (disables autotuning)\n");
+     printf("  -C: Skip the end-to-end CRC32C check of each file's contents\n");
+     printf("  -c: Compress file contents on the fly (skipped for files that do not compress, and with -R)\n");
+     printf("  -D: Send each file's SHA-256 first; the server skips bodies it already stores (not with -P)\n");
+     printf("  -d: Send only the parts of each file that differ from the server's copy (not with -R or -P)\n");
+     printf("  -P streams: Send a single large file as ranges over this many connections (not with -R)\n");
+     printf("  -r dir: Send every regular file in dir\n");
+     printf("  -l listfile: Send the files listed one per line in listfile\n");
+     printf("  -g: Download the named files from target_directory into the current directory\n");
+     printf("  -O offset[:length]: Download only length bytes (default: the rest) from offset of a\n");
+     printf("     single file, written in place in the local copy, e.g. to finish an interrupted one\n");
+     printf("  -L: List the files in target_directory, or describe only filename\n");
+     printf("  -N sequence: List what changed in target_directory after this sequence number,\n");
+     printf("     oldest first; the last sequence printed is the one to ask from next time\n");
+     printf("  -F file: Read settings from this file, one key = value per line ('#' comments)\n");
+     printf("  -o key=value: Override a setting of the file; repeat for each. Keys:\n");
+     printf("     server=address[:port]    Server to connect to (default: %s:%d)\n", CONFIG_DEFAULT_SERVER, PORT);
+     printf("     chunk_size=bytes         Largest transfer buffer, 4k to 512k (default: 512k)\n");
+     printf("     tcp_nodelay=on|off       Send each message at once (default: on)\n");
+     printf("     tcp_cork=on|off          Send only full segments (default: off)\n");
+     printf("     sndbuf=, rcvbuf=bytes    Fixed socket buffers; 0 autotunes (default: 0)\n");
+     printf("     keepalive=off|idle[,interval[,count]]  TCP keepalive in seconds (default: off)\n");
+     printf("  filepath: Path to a file you want to transfer\n");
+     printf("  target_directory: A destination the server is configured with, by default\n");
+     printf("                    'Manufacturing' or 'Distribution'\n");
+     printf("\nMore than one file is sent over a single authenticated session.\n");
      printf("\nExample: ./client /path/to/myfile.txt Manufacturing\n");
+     printf("         ./client -r reports/ Manufacturing\n");
+     printf("         ./client -g myfile.txt Manufacturing\n");
+     printf("         ./client -N 1200 Manufacturing\n");
  }
  
  /* Clean up resources */
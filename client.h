@@ -15,27 +15,109 @@
  #include <unistd.h>
  #include <sys/socket.h>
  #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <arpa/inet.h>
  #include <sys/stat.h>
  #include <fcntl.h>
  #include <pwd.h>
  #include <errno.h>
+ #include <stdint.h>
+ #include <endian.h>
+ #include <time.h>
+ #include <dirent.h>
+ #include <pthread.h>
+ #include <sys/mman.h>
+ #include "netio.h"
+ #include "protocol.h"
+ #include "crc32c.h"
+ #include "lzstream.h"
+ #include "sha256.h"
+ #include "delta.h"
+ #include "config.h"
  
- /* Client configuration constants */
- #define SERVER_IP "127.0.0.1"
- #define PORT 8080
- #define BUFFER_SIZE 1024
+ /* Client configuration constants; the server address and socket settings are in config.h */
  #define MAX_PATH_LENGTH 256
  
- /* Available transfer destinations */
- #define MANUFACTURING_DIR "Manufacturing"
- #define DISTRIBUTION_DIR "Distribution"
+ /* Destination the benchmarks upload to unless told otherwise, one the server has by default */
+ #define DEFAULT_TARGET_DIR "Manufacturing"
  
- /* Status codes from server responses */
- #define STATUS_SUCCESS 0
- #define STATUS_PERMISSION_DENIED 1
- #define STATUS_FILE_ERROR 2
- #define STATUS_UNKNOWN_ERROR 3
+ /* Transfer option flags */
+ #define CLIENT_FLAG_BUFFERED 0x01   /* Copy through a user-space buffer instead of sendfile() */
+ #define CLIENT_FLAG_QUIET    0x02   /* Suppress the progress bar */
+ #define CLIENT_FLAG_RESUME   0x04   /* Resumable, checksummed chunked uploads */
+ #define CLIENT_FLAG_TUNE     0x08   /* Size SO_SNDBUF to the transfer chunk size */
+ #define CLIENT_FLAG_NO_CHECKSUM 0x10 /* Do not ask for an end-to-end body checksum */
+ #define CLIENT_FLAG_COMPRESS 0x20   /* Ask to send plain bodies as compressed blocks */
+ #define CLIENT_FLAG_DEDUP    0x40   /* Announce each file's SHA-256 so stored content is not resent */
+ #define CLIENT_FLAG_DELTA    0x80   /* Send only what differs from the file already on the server */
+ 
+ /* Parallel uploads: files smaller than two ranges go over one connection */
+ #define PARALLEL_MIN_SIZE (2 * PROTO_MIN_RANGE)
+ 
+ /* Retry policy for resumable single-file uploads */
+ #define RESUME_ATTEMPTS 5
+ #define RESUME_RETRY_DELAY 1        /* Seconds between attempts */
+ 
+ /* A request refused as BUSY (a full transfer quota, or another upload writing the same
+  * file) is made again after this long */
+ #define BUSY_RETRY_MS 100
+ 
+ /* Progress bar settings */
+ #define PROGRESS_INTERVAL_MS 200
+ #define PROGRESS_BAR_WIDTH 40
+ 
+ /* Rate-limited progress reporting state for one transfer */
+ typedef struct {
+     off_t total;
+     struct timespec started;
+     struct timespec last_update;
+ } progress_t;
+ 
+ /* Growable list of files to send */
+ typedef struct {
+     char **paths;
+     int count;
+     int capacity;
+ } file_list_t;
+ 
+ /* A file whose request header has been sent in a session */
+ typedef struct {
+     int index;
+     int fd;
+     off_t size;
+     char filename[MAX_PATH_LENGTH];
+ } pending_file_t;
+ 
+ /* One file sent as ranges over several connections */
+ typedef struct {
+     const char *filepath;
+     const char *username;
+     const char *target_dir;
+     const char *filename;
+     off_t filesize;
+     off_t range_size;
+     uint32_t range_count;
+     uint64_t token;             /* Names the upload in every range request */
+     int flags;
+     pthread_mutex_t lock;       /* Guards the fields below */
+     uint32_t next_range;
+     off_t bytes_sent;
+     int status;                 /* First failure, or STATUS_SUCCESS */
+     progress_t progress;
+ } parallel_upload_t;
+ 
+ /* Instructions of a delta upload, gathered into large sends */
+ typedef struct {
+     int socket;
+     char *buffer;
+     size_t capacity;
+     size_t pending;             /* Bytes in buffer not yet sent */
+     off_t position;             /* File bytes described so far */
+     off_t matched;              /* Of which copied from the server's file */
+     off_t wire_bytes;
+     int quiet;
+     progress_t progress;
+ } delta_upload_t;
  
  /* Function prototypes */
  
@@ -46,13 +128,73 @@
  char *get_current_username(void);
  
  /* Send file to server */
- int send_file(int server_socket, const char *filepath, const char *target_dir);
+ int send_file(int server_socket, const char *filepath, const char *target_dir, int flags);
+ 
+ /* Stream an open file's contents after the server answered READY, in the form the
+  * features it echoed ask for: compressed blocks and/or a trailing CRC32C */
+ off_t send_file_body(int server_socket, int file_fd, off_t filesize, int flags, uint16_t features);
+ 
+ /* Send a file from offset as checksummed chunks after a resumable READY */
+ off_t send_file_chunks(int server_socket, int file_fd, off_t offset, off_t filesize, int flags);
+ 
+ /* Send a file as copies of the server's blocks and literal data after a delta READY
+  * announced a basis_size-byte file; its signatures follow on the socket */
+ off_t send_file_delta(int server_socket, int file_fd, off_t filesize, uint64_t basis_size, int flags,
+                       uint16_t features);
+ 
+ /* SHA-256 of an open file's first filesize bytes. Returns 0 or -1. */
+ int digest_file(int file_fd, off_t filesize, uint8_t *digest);
+ 
+ /* Send one file, reconnecting to try again while the server answers BUSY */
+ int send_file_waiting(int *server_socket, const char *filepath, const char *target_dir, int flags);
+ 
+ /* Send one file, reconnecting and resuming after interrupted attempts */
+ int send_file_resumable(int *server_socket, const char *filepath, const char *target_dir, int flags);
+ 
+ /* Send one large file as ranges over streams connections, then commit it */
+ int send_file_parallel(int *server_socket, const char *filepath, const char *target_dir, int flags,
+                        int streams);
+ 
+ /* Send many files over one session; returns the number that failed */
+ int send_files_session(int server_socket, char **paths, int count, const char *target_dir, int flags);
+ 
+ /* Download a file from target_dir into the current directory: all of it, or length bytes
+  * (0 for the rest) from offset, written in place without truncating the local copy */
+ int receive_file(int server_socket, const char *filename, const char *target_dir, off_t offset,
+                  off_t length, int flags);
+ 
+ /* Download many files over one session; returns the number that failed */
+ int receive_files_session(int server_socket, char **names, int count, const char *target_dir, int flags);
+ 
+ /* Print the files in target_dir from its manifest with their sequence numbers, sizes,
+  * modification times, owners and checksums: all of them, only filename if not NULL, or
+  * with changes set only those changed after sequence since, removals included */
+ int list_directory(int server_socket, const char *target_dir, const char *filename, int changes,
+                    uint64_t since);
+ 
+ /* Redraw the progress bar at most every PROGRESS_INTERVAL_MS */
+ void progress_update(off_t bytes_sent, void *arg);
+ 
+ /* Describe a transfer status code */
+ const char *status_message(int status_code);
  
  /* Display transfer status message */
  void display_status_message(int status_code);
  
+ /* Append a path to the file list if it names a regular file */
+ int file_list_add(file_list_t *list, const char *path);
+ 
+ /* Add every regular file directly inside a directory */
+ int collect_directory(file_list_t *list, const char *dirpath);
+ 
+ /* Add the paths listed one per line in a file */
+ int collect_list_file(file_list_t *list, const char *list_path);
+ 
+ /* Release the file list */
+ void file_list_free(file_list_t *list);
+ 
  /* Get file size */
- long get_file_size(const char *filepath);
+ off_t get_file_size(const char *filepath);
  
  /* Display usage instructions */
  void display_usage(void);
@@ -0,0 +1,692 @@
+/* config.c - Implementation of runtime configuration
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the configuration shared by the server and client:
+ * - Parsing of "key = value" settings from a file and from the command line
+ * - Validation with messages naming the file, line and setting at fault
+ * - Immutable snapshots published with one atomic store, so readers never lock and
+ *   a reload never pulls a directory out from under a transfer in progress
+ * - Stable metrics slots for directory names across reloads
+ * - Socket options applied to listeners and connections
+ */
+
+ #include "config.h"
+ #include "netio.h"
+ #include <arpa/inet.h>
+ #include <ctype.h>
+ #include <limits.h>
+ #include <netinet/tcp.h>
+ #include <pthread.h>
+ 
+ /* Destinations before any "dir" setting: the pair that used to be built in */
+ static const config_dir_t default_dirs[] = {
+     {"Manufacturing", "./Manufacturing", "manufacturing"},
+     {"Distribution", "./Distribution", "distribution"}
+ };
+ 
+ /* Each load publishes a new snapshot; older ones are kept until exit because a thread
+  * may still hold a directory from one of them, and a reload only costs a few kilobytes */
+ typedef struct config_snapshot {
+     config_t config;
+     struct config_snapshot *previous;
+ } config_snapshot_t;
+ 
+ static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+ static config_snapshot_t *current;
+ static char *file_path;
+ static char **overrides;
+ static int override_count;
+ 
+ /* Directory names in the order they were first configured; only ever appended to */
+ static char slot_names[CONFIG_MAX_DIRS][PROTO_MAX_TARGET_DIR + 1];
+ static int slot_count;
+ 
+ /* What config_current() returns before anything was loaded */
+ static pthread_once_t defaults_once = PTHREAD_ONCE_INIT;
+ static config_t builtin;
+ 
+ /* Copy [start, end) into out without surrounding whitespace. Returns 0, or -1 if it does not fit. */
+ static int copy_trimmed(char *out, size_t size, const char *start, const char *end) {
+     while (start < end && isspace((unsigned char)*start)) {
+         start++;
+     }
+     while (end > start && isspace((unsigned char)end[-1])) {
+         end--;
+     }
+     
+     if ((size_t)(end - start) >= size) {
+         return -1;
+     }
+     memcpy(out, start, (size_t)(end - start));
+     out[end - start] = '\0';
+     return 0;
+ }
+ 
+ /* Parse a whole decimal number within [min, max]. Returns 0 or -1. */
+ static int parse_number(const char *text, long min, long max, long *number) {
+     char *end;
+     long value;
+     
+     errno = 0;
+     value = strtol(text, &end, 10);
+     if (end == text || *end != '\0' || errno != 0 || value < min || value > max) {
+         return -1;
+     }
+     
+     *number = value;
+     return 0;
+ }
+ 
+ /* Parse a byte count with an optional binary suffix, at most max. Returns 0 or -1. */
+ static int parse_size(const char *text, unsigned long long max, unsigned long long *size) {
+     unsigned long long value, scale = 1;
+     char *end;
+     
+     errno = 0;
+     value = strtoull(text, &end, 10);
+     if (end == text || errno != 0 || text[0] == '-') {
+         return -1;
+     }
+     
+     switch (*end) {
+         case 'g':
+         case 'G':
+             scale *= 1024;
+             /* fall through */
+         case 'm':
+         case 'M':
+             scale *= 1024;
+             /* fall through */
+         case 'k':
+         case 'K':
+             scale *= 1024;
+             end++;
+             break;
+         default:
+             break;
+     }
+     if (*end != '\0' || value > max / scale) {
+         return -1;
+     }
+     
+     *size = value * scale;
+     return 0;
+ }
+ 
+ /* Parse on/off. Returns 1, 0, or -1 if it is neither. */
+ static int parse_switch(const char *text) {
+     if (strcmp(text, "on") == 0 || strcmp(text, "yes") == 0 || strcmp(text, "true") == 0 ||
+         strcmp(text, "1") == 0) {
+         return 1;
+     }
+     if (strcmp(text, "off") == 0 || strcmp(text, "no") == 0 || strcmp(text, "false") == 0 ||
+         strcmp(text, "0") == 0) {
+         return 0;
+     }
+     return -1;
+ }
+ 
+ /* Parse "[address][:port]" into addr, keeping whichever part is left out */
+ static int parse_endpoint(const char *text, struct sockaddr_in *addr, char *error, size_t error_size) {
+     const char *colon = strrchr(text, ':');
+     char host[INET_ADDRSTRLEN];
+     long port;
+     
+     if (copy_trimmed(host, sizeof(host), text, colon ? colon : text + strlen(text)) < 0) {
+         snprintf(error, error_size, "not an IPv4 address: %s", text);
+         return -1;
+     }
+     
+     if (colon) {
+         if (parse_number(colon + 1, 1, 65535, &port) < 0) {
+             snprintf(error, error_size, "port must be between 1 and 65535: %s", colon + 1);
+             return -1;
+         }
+         addr->sin_port = htons((uint16_t)port);
+     }
+     
+     /* "*" listens on every interface */
+     if (strcmp(host, "*") == 0) {
+         addr->sin_addr.s_addr = htonl(INADDR_ANY);
+     } else if (host[0] != '\0' && inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+         snprintf(error, error_size, "not an IPv4 address: %s", host);
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /* Parse "off" or "idle[,interval[,count]]" seconds */
+ static int parse_keepalive(const char *text, config_t *config) {
+     long idle, interval = 0, count = 0;
+     char *end;
+     
+     if (parse_switch(text) == 0) {
+         config->keepalive_idle = 0;
+         return 0;
+     }
+     
+     errno = 0;
+     idle = strtol(text, &end, 10);
+     if (end == text || errno != 0 || idle < 1 || idle > 32767) {
+         return -1;
+     }
+     if (*end == ',') {
+         text = end + 1;
+         interval = strtol(text, &end, 10);
+         if (end == text || interval < 1 || interval > 32767) {
+             return -1;
+         }
+     }
+     if (*end == ',') {
+         text = end + 1;
+         count = strtol(text, &end, 10);
+         if (end == text || count < 1 || count > 127) {
+             return -1;
+         }
+     }
+     if (*end != '\0') {
+         return -1;
+     }
+     
+     config->keepalive_idle = (int)idle;
+     config->keepalive_interval = (int)interval;
+     config->keepalive_count = (int)count;
+     return 0;
+ }
+ 
+ /* Add a destination from "name path group" */
+ static int parse_dir(char *text, config_t *config, char *error, size_t error_size) {
+     char *name, *path, *group, *extra, *saved;
+     config_dir_t *dir;
+     int i;
+     
+     name = strtok_r(text, " \t", &saved);
+     path = name ? strtok_r(NULL, " \t", &saved) : NULL;
+     group = path ? strtok_r(NULL, " \t", &saved) : NULL;
+     extra = group ? strtok_r(NULL, " \t", &saved) : NULL;
+     if (!group || extra) {
+         snprintf(error, error_size, "dir takes a name, a path and a group");
+         return -1;
+     }
+     
+     /* Clients send the name as one path component, so it can never climb out */
+     if (strlen(name) > PROTO_MAX_TARGET_DIR || strchr(name, '/') || name[0] == '.') {
+         snprintf(error, error_size, "invalid directory name: %s", name);
+         return -1;
+     }
+     if (strlen(path) >= CONFIG_PATH_LENGTH) {
+         snprintf(error, error_size, "directory path longer than %d bytes: %s", CONFIG_PATH_LENGTH - 1, path);
+         return -1;
+     }
+     if (strlen(group) >= CONFIG_GROUP_LENGTH) {
+         snprintf(error, error_size, "group name too long: %s", group);
+         return -1;
+     }
+     
+     /* The first "dir" replaces the defaults rather than adding to them */
+     if (!config->dirs_replaced) {
+         config->dir_count = 0;
+         config->dirs_replaced = 1;
+     }
+     for (i = 0; i < config->dir_count; i++) {
+         if (strcmp(config->dirs[i].name, name) == 0) {
+             snprintf(error, error_size, "directory %s listed twice", name);
+             return -1;
+         }
+     }
+     if (config->dir_count == CONFIG_MAX_DIRS) {
+         snprintf(error, error_size, "more than %d directories", CONFIG_MAX_DIRS);
+         return -1;
+     }
+     
+     dir = &config->dirs[config->dir_count++];
+     memset(dir, 0, sizeof(*dir));
+     strcpy(dir->name, name);
+     strcpy(dir->path, path);
+     strcpy(dir->group, group);
+     return 0;
+ }
+ 
+ /* Fill config with the built-in defaults */
+ void config_defaults(config_t *config) {
+     memset(config, 0, sizeof(*config));
+     
+     config->listen.sin_family = AF_INET;
+     config->listen.sin_addr.s_addr = htonl(INADDR_ANY);
+     config->listen.sin_port = htons(PORT);
+     config->server.sin_family = AF_INET;
+     inet_pton(AF_INET, CONFIG_DEFAULT_SERVER, &config->server.sin_addr);
+     config->server.sin_port = htons(PORT);
+     config->backlog = CONFIG_DEFAULT_BACKLOG;
+     config->workers = 0;
+     config->max_clients = CONFIG_DEFAULT_MAX_CLIENTS;
+     config->uring_slots = CONFIG_DEFAULT_URING_SLOTS;
+     config->uring_buffers = CONFIG_DEFAULT_URING_BUFFERS;
+     config->chunk_size = NETIO_MAX_CHUNK;
+     config->tcp_nodelay = 1;
+     config->cache_size = CONFIG_DEFAULT_CACHE_SIZE;
+     config->cache_max_file = CONFIG_DEFAULT_CACHE_MAX_FILE;
+     
+     memcpy(config->dirs, default_dirs, sizeof(default_dirs));
+     config->dir_count = (int)(sizeof(default_dirs) / sizeof(default_dirs[0]));
+ }
+ 
+ /* Apply one "key = value" setting */
+ int config_set(config_t *config, const char *setting, char *error, size_t error_size) {
+     const char *equals = strchr(setting, '=');
+     char key[32], value[CONFIG_LINE_LENGTH];
+     unsigned long long size;
+     long number, minimum;
+     int on;
+     
+     if (!equals || copy_trimmed(key, sizeof(key), setting, equals) < 0 ||
+         copy_trimmed(value, sizeof(value), equals + 1, equals + strlen(equals)) < 0) {
+         snprintf(error, error_size, "expected key = value: %s", setting);
+         return -1;
+     }
+     if (value[0] == '\0') {
+         snprintf(error, error_size, "%s needs a value", key);
+         return -1;
+     }
+     
+     /* Addresses */
+     if (strcmp(key, "listen") == 0) {
+         return parse_endpoint(value, &config->listen, error, error_size);
+     }
+     if (strcmp(key, "server") == 0) {
+         return parse_endpoint(value, &config->server, error, error_size);
+     }
+     
+     /* Counts */
+     if (strcmp(key, "backlog") == 0 || strcmp(key, "workers") == 0 || strcmp(key, "max_clients") == 0) {
+         minimum = (strcmp(key, "workers") == 0) ? 0 : 1;
+         if (parse_number(value, minimum, 65535, &number) < 0) {
+             snprintf(error, error_size, "%s must be a number from %ld to 65535: %s", key, minimum, value);
+             return -1;
+         }
+         if (key[0] == 'b') {
+             config->backlog = (int)number;
+         } else if (key[0] == 'w') {
+             config->workers = (int)number;
+         } else {
+             config->max_clients = (int)number;
+         }
+         return 0;
+     }
+     if (strcmp(key, "uring_slots") == 0) {
+         if (parse_number(value, 1, 65535, &number) < 0) {
+             snprintf(error, error_size, "uring_slots must be a number from 1 to 65535: %s", value);
+             return -1;
+         }
+         config->uring_slots = (int)number;
+         return 0;
+     }
+     if (strcmp(key, "uring_buffers") == 0) {
+         if (parse_number(value, 1, CONFIG_MAX_URING_BUFFERS, &number) < 0) {
+             snprintf(error, error_size, "uring_buffers must be a number from 1 to %d: %s",
+                      CONFIG_MAX_URING_BUFFERS, value);
+             return -1;
+         }
+         config->uring_buffers = (int)number;
+         return 0;
+     }
+     
+     /* Buffer sizes */
+     if (strcmp(key, "chunk_size") == 0) {
+         if (parse_size(value, NETIO_MAX_CHUNK, &size) < 0 || size < NETIO_MIN_CHUNK) {
+             snprintf(error, error_size, "chunk_size must be between %dk and %dk: %s",
+                      NETIO_MIN_CHUNK / 1024, NETIO_MAX_CHUNK / 1024, value);
+             return -1;
+         }
+         config->chunk_size = (size_t)size;
+         return 0;
+     }
+     if (strcmp(key, "sndbuf") == 0 || strcmp(key, "rcvbuf") == 0) {
+         if (parse_size(value, INT_MAX / 2, &size) < 0) {
+             snprintf(error, error_size, "%s must be a byte count: %s", key, value);
+             return -1;
+         }
+         if (key[0] == 's') {
+             config->sndbuf = (int)size;
+         } else {
+             config->rcvbuf = (int)size;
+         }
+         return 0;
+     }
+     if (strcmp(key, "cache_size") == 0 || strcmp(key, "cache_max_file") == 0) {
+         if (parse_size(value, SIZE_MAX / 2, &size) < 0) {
+             snprintf(error, error_size, "%s must be a byte count: %s", key, value);
+             return -1;
+         }
+         if (strcmp(key, "cache_size") == 0) {
+             config->cache_size = (size_t)size;
+         } else {
+             config->cache_max_file = (size_t)size;
+         }
+         return 0;
+     }
+     
+     /* Socket options */
+     if (strcmp(key, "tcp_nodelay") == 0 || strcmp(key, "tcp_cork") == 0) {
+         on = parse_switch(value);
+         if (on < 0) {
+             snprintf(error, error_size, "%s must be on or off: %s", key, value);
+             return -1;
+         }
+         if (strcmp(key, "tcp_nodelay") == 0) {
+             config->tcp_nodelay = on;
+         } else {
+             config->tcp_cork = on;
+         }
+         return 0;
+     }
+     if (strcmp(key, "keepalive") == 0) {
+         if (parse_keepalive(value, config) < 0) {
+             snprintf(error, error_size, "keepalive must be off or idle[,interval[,count]] seconds: %s", value);
+             return -1;
+         }
+         return 0;
+     }
+     
+     /* Destinations */
+     if (strcmp(key, "dir") == 0) {
+         return parse_dir(value, config, error, error_size);
+     }
+     
+     snprintf(error, error_size, "unknown setting: %s", key);
+     return -1;
+ }
+ 
+ /* Apply every setting in a file */
+ int config_read_file(config_t *config, const char *path, char *error, size_t error_size) {
+     char line[CONFIG_LINE_LENGTH], message[CONFIG_LINE_LENGTH];
+     char *start, *comment;
+     FILE *file;
+     size_t length;
+     int number = 0;
+     
+     file = fopen(path, "r");
+     if (!file) {
+         snprintf(error, error_size, "%s: %s", path, strerror(errno));
+         return -1;
+     }
+     
+     while (fgets(line, sizeof(line), file)) {
+         number++;
+         length = strlen(line);
+         if (length == sizeof(line) - 1 && line[length - 1] != '\n' && !feof(file)) {
+             snprintf(error, error_size, "%s:%d: line longer than %d bytes", path, number, CONFIG_LINE_LENGTH - 2);
+             fclose(file);
+             return -1;
+         }
+     
+         /* Skip comments and blank lines */
+         comment = strchr(line, '#');
+         if (comment) {
+             *comment = '\0';
+         }
+         start = line;
+         while (isspace((unsigned char)*start)) {
+             start++;
+         }
+         if (*start == '\0') {
+             continue;
+         }
+     
+         if (config_set(config, start, message, sizeof(message)) < 0) {
+             snprintf(error, error_size, "%s:%d: %s", path, number, message);
+             fclose(file);
+             return -1;
+         }
+     }
+     
+     if (ferror(file)) {
+         snprintf(error, error_size, "%s: %s", path, strerror(errno));
+         fclose(file);
+         return -1;
+     }
+     fclose(file);
+     return 0;
+ }
+ 
+ /* Remember a command-line setting, applied over the file on every load */
+ int config_override(const char *setting) {
+     char **grown = realloc(overrides, (size_t)(override_count + 1) * sizeof(char *));
+     
+     if (!grown) {
+         return -1;
+     }
+     overrides = grown;
+     overrides[override_count] = strdup(setting);
+     if (!overrides[override_count]) {
+         return -1;
+     }
+     override_count++;
+     return 0;
+ }
+ 
+ /* Give every directory name of config a slot, unless it has one from an earlier load */
+ static int assign_slots(const config_t *config, char *error, size_t error_size) {
+     int i, fresh = 0;
+     
+     /* Check for room first so a failed load leaves the table as it was */
+     for (i = 0; i < config->dir_count; i++) {
+         if (config_dir_slot(config->dirs[i].name) < 0) {
+             fresh++;
+         }
+     }
+     if (slot_count + fresh > CONFIG_MAX_DIRS) {
+         snprintf(error, error_size, "more than %d directory names configured since startup", CONFIG_MAX_DIRS);
+         return -1;
+     }
+     
+     /* The metrics thread reads the count without a lock, so each name is written first */
+     for (i = 0; i < config->dir_count; i++) {
+         if (config_dir_slot(config->dirs[i].name) < 0) {
+             strcpy(slot_names[slot_count], config->dirs[i].name);
+             __atomic_store_n(&slot_count, slot_count + 1, __ATOMIC_RELEASE);
+         }
+     }
+     
+     return 0;
+ }
+ 
+ /* The defaults, for programs that never load a configuration */
+ static void init_builtin(void) {
+     config_defaults(&builtin);
+ }
+ 
+ /* Build a configuration from the defaults, the file and the overrides and make it current.
+  * Called with load_lock held. */
+ static int publish(char *error, size_t error_size) {
+     config_snapshot_t *snapshot;
+     char message[CONFIG_LINE_LENGTH];
+     int i;
+     
+     snapshot = malloc(sizeof(config_snapshot_t));
+     if (!snapshot) {
+         snprintf(error, error_size, "%s", strerror(errno));
+         return -1;
+     }
+     
+     /* Later sources win: defaults, then the file, then the command line */
+     config_defaults(&snapshot->config);
+     if (file_path && config_read_file(&snapshot->config, file_path, error, error_size) < 0) {
+         free(snapshot);
+         return -1;
+     }
+     for (i = 0; i < override_count; i++) {
+         if (config_set(&snapshot->config, overrides[i], message, sizeof(message)) < 0) {
+             snprintf(error, error_size, "%s: %s", overrides[i], message);
+             free(snapshot);
+             return -1;
+         }
+     }
+     if (assign_slots(&snapshot->config, error, error_size) < 0) {
+         free(snapshot);
+         return -1;
+     }
+     
+     /* Readers load the pointer without a lock; everything they can reach is written by now */
+     snapshot->previous = current;
+     __atomic_store_n(&current, snapshot, __ATOMIC_RELEASE);
+     
+     /* Transfers size their buffers when they start, so the new cap applies to the next ones */
+     netio_set_max_chunk(snapshot->config.chunk_size);
+     return 0;
+ }
+ 
+ /* Build the configuration from the defaults, a file and the overrides */
+ int config_load(const char *path, char *error, size_t error_size) {
+     int result;
+     
+     pthread_mutex_lock(&load_lock);
+     if (path && !file_path) {
+         file_path = strdup(path);
+         if (!file_path) {
+             pthread_mutex_unlock(&load_lock);
+             snprintf(error, error_size, "%s", strerror(errno));
+             return -1;
+         }
+     }
+     result = publish(error, error_size);
+     pthread_mutex_unlock(&load_lock);
+     
+     return result;
+ }
+ 
+ /* Build the configuration again from the same file and overrides */
+ int config_reload(char *error, size_t error_size) {
+     int result;
+     
+     pthread_mutex_lock(&load_lock);
+     result = publish(error, error_size);
+     pthread_mutex_unlock(&load_lock);
+     
+     return result;
+ }
+ 
+ /* File config_load() read, or NULL */
+ const char *config_path(void) {
+     return file_path;
+ }
+ 
+ /* The current configuration */
+ const config_t *config_current(void) {
+     config_snapshot_t *snapshot = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+     
+     if (snapshot) {
+         return &snapshot->config;
+     }
+     pthread_once(&defaults_once, init_builtin);
+     return &builtin;
+ }
+ 
+ /* Directory requested as name (bare or "./" form) or by its path */
+ const config_dir_t *config_find_dir(const config_t *config, const char *name) {
+     const char *bare = (strncmp(name, "./", 2) == 0) ? name + 2 : name;
+     int i;
+     
+     for (i = 0; i < config->dir_count; i++) {
+         if (strcmp(config->dirs[i].name, bare) == 0 || strcmp(config->dirs[i].path, name) == 0) {
+             return &config->dirs[i];
+         }
+     }
+     
+     return NULL;
+ }
+ 
+ /* Metrics slot of a directory name, or -1 if it was never configured */
+ int config_dir_slot(const char *name) {
+     int i, count = __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+     
+     for (i = 0; i < count; i++) {
+         if (strcmp(slot_names[i], name) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ /* Directory names assigned a metrics slot so far */
+ int config_dir_slots(void) {
+     return __atomic_load_n(&slot_count, __ATOMIC_ACQUIRE);
+ }
+ 
+ /* Name in one metrics slot */
+ const char *config_dir_label(int slot) {
+     return slot_names[slot];
+ }
+ 
+ /* Set one integer socket option, naming it on failure */
+ static int set_option(int socket_fd, int level, int name, int value, const char *label, const char **option) {
+     if (setsockopt(socket_fd, level, name, &value, sizeof(value)) < 0) {
+         *option = label;
+         return -1;
+     }
+     return 0;
+ }
+ 
+ /* Apply the socket options of config to a socket */
+ int config_apply_socket(int socket_fd, const config_t *config, const char **option) {
+     /* Both switches are always written, so a reload can turn them off again */
+     if (set_option(socket_fd, IPPROTO_TCP, TCP_NODELAY, config->tcp_nodelay, "TCP_NODELAY", option) < 0 ||
+         set_option(socket_fd, IPPROTO_TCP, TCP_CORK, config->tcp_cork, "TCP_CORK", option) < 0) {
+         return -1;
+     }
+     
+     /* A fixed size turns autotuning off for good, so 0 does not touch the buffer */
+     if (config->sndbuf > 0 &&
+         set_option(socket_fd, SOL_SOCKET, SO_SNDBUF, config->sndbuf, "SO_SNDBUF", option) < 0) {
+         return -1;
+     }
+     if (config->rcvbuf > 0 &&
+         set_option(socket_fd, SOL_SOCKET, SO_RCVBUF, config->rcvbuf, "SO_RCVBUF", option) < 0) {
+         return -1;
+     }
+     
+     /* Keepalive probes notice peers that vanished without closing the connection */
+     if (set_option(socket_fd, SOL_SOCKET, SO_KEEPALIVE, config->keepalive_idle > 0, "SO_KEEPALIVE", option) < 0) {
+         return -1;
+     }
+     if (config->keepalive_idle > 0) {
+         if (set_option(socket_fd, IPPROTO_TCP, TCP_KEEPIDLE, config->keepalive_idle, "TCP_KEEPIDLE", option) < 0) {
+             return -1;
+         }
+         if (config->keepalive_interval > 0 &&
+             set_option(socket_fd, IPPROTO_TCP, TCP_KEEPINTVL, config->keepalive_interval, "TCP_KEEPINTVL",
+                        option) < 0) {
+             return -1;
+         }
+         if (config->keepalive_count > 0 &&
+             set_option(socket_fd, IPPROTO_TCP, TCP_KEEPCNT, config->keepalive_count, "TCP_KEEPCNT", option) < 0) {
+             return -1;
+         }
+     }
+     
+     return 0;
+ }
+ 
+ /* Free every configuration loaded so far */
+ void config_destroy(void) {
+     config_snapshot_t *snapshot, *previous;
+     int i;
+     
+     pthread_mutex_lock(&load_lock);
+     snapshot = __atomic_exchange_n(&current, NULL, __ATOMIC_ACQ_REL);
+     while (snapshot) {
+         previous = snapshot->previous;
+         free(snapshot);
+         snapshot = previous;
+     }
+     for (i = 0; i < override_count; i++) {
+         free(overrides[i]);
+     }
+     free(overrides);
+     overrides = NULL;
+     override_count = 0;
+     free(file_path);
+     file_path = NULL;
+     pthread_mutex_unlock(&load_lock);
+ }
@@ -0,0 +1,133 @@
+/* config.h - Header file for runtime configuration
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations shared by the server and client for:
+ * - Listener, worker, buffer and socket settings that were compile-time constants,
+ *   with the same defaults
+ * - A "key = value" configuration file and command-line overrides in the same syntax
+ * - The destination directories and the group whose members may upload to each
+ * - The current configuration, replaced as a whole when the server reloads it
+ */
+
+ #ifndef CONFIG_H
+ #define CONFIG_H
+ 
+ #include <stddef.h>
+ #include <netinet/in.h>
+ #include <sys/socket.h>
+ #include "protocol.h"
+ 
+ /* Destination directories one configuration may list, and directory names the server
+  * can label metrics with over its lifetime */
+ #define CONFIG_MAX_DIRS 16
+ 
+ /* Longest directory path and group name */
+ #define CONFIG_PATH_LENGTH 192
+ #define CONFIG_GROUP_LENGTH 64
+ 
+ /* Longest line of a configuration file */
+ #define CONFIG_LINE_LENGTH 512
+ 
+ /* Defaults, as the constants they replace had them */
+ #define CONFIG_DEFAULT_SERVER "127.0.0.1"
+ #define CONFIG_DEFAULT_BACKLOG SOMAXCONN
+ #define CONFIG_DEFAULT_MAX_CLIENTS 10
+ 
+ /* io_uring core defaults: connection slots per ring, and 64 KiB body buffers they share */
+ #define CONFIG_DEFAULT_URING_SLOTS 256
+ #define CONFIG_DEFAULT_URING_BUFFERS 64
+ #define CONFIG_MAX_URING_BUFFERS 32768
+ 
+ /* Download cache defaults: mapped bytes kept for hot files, and the largest file cached */
+ #define CONFIG_DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+ #define CONFIG_DEFAULT_CACHE_MAX_FILE (8 * 1024 * 1024)
+ 
+ /* One destination: the name clients ask for, where its uploads land and who may send them */
+ typedef struct {
+     char name[PROTO_MAX_TARGET_DIR + 1];    /* e.g. "Manufacturing" */
+     char path[CONFIG_PATH_LENGTH];          /* e.g. "./Manufacturing" */
+     char group[CONFIG_GROUP_LENGTH];        /* e.g. "manufacturing" */
+ } config_dir_t;
+ 
+ /* Every runtime setting. Settings marked (restart) are only read at startup. */
+ typedef struct {
+     struct sockaddr_in listen;      /* Server: address and port to bind (restart) */
+     struct sockaddr_in server;      /* Client: address and port to connect to */
+     int backlog;                    /* Server: pending connections per listener (restart) */
+     int workers;                    /* Server: pool threads, 0 for one per core (restart) */
+     int max_clients;                /* Server: connections the threaded core admits */
+     int uring_slots;                /* Server: connections each io_uring ring serves (restart) */
+     int uring_buffers;              /* Server: body buffers each io_uring ring shares (restart) */
+     size_t chunk_size;              /* Largest user-space transfer chunk */
+     int tcp_nodelay;                /* Send small messages at once */
+     int tcp_cork;                   /* Hold partial segments until full or 200 ms pass */
+     int sndbuf;                     /* SO_SNDBUF in bytes; 0 leaves it to autotuning */
+     int rcvbuf;                     /* SO_RCVBUF in bytes; 0 leaves it to autotuning */
+     int keepalive_idle;             /* Seconds idle before probing; 0 disables keepalive */
+     int keepalive_interval;         /* Seconds between probes; 0 keeps the kernel default */
+     int keepalive_count;            /* Unanswered probes before dropping; 0 keeps the default */
+     size_t cache_size;              /* Server: bytes of hot files kept mapped for downloads; 0 disables */
+     size_t cache_max_file;          /* Server: largest file the download cache keeps */
+     config_dir_t dirs[CONFIG_MAX_DIRS];
+     int dir_count;
+     int dirs_replaced;              /* A "dir" setting has replaced the default directories */
+ } config_t;
+ 
+ /* Function prototypes */
+ 
+ /* Fill config with the built-in defaults */
+ void config_defaults(config_t *config);
+ 
+ /* Apply one "key = value" setting:
+  *   listen = [address][:port]          server = address[:port]
+  *   backlog = n    workers = n    max_clients = n    chunk_size = bytes
+  *   uring_slots = n    uring_buffers = n
+  *   tcp_nodelay = on|off    tcp_cork = on|off    sndbuf = bytes    rcvbuf = bytes
+  *   keepalive = off|idle[,interval[,count]]
+  *   cache_size = bytes    cache_max_file = bytes
+  *   dir = name path group   (repeatable; the first replaces the default directories)
+  * Byte counts take k, m or g suffixes. Returns 0, or -1 with a message in error. */
+ int config_set(config_t *config, const char *setting, char *error, size_t error_size);
+ 
+ /* Apply every setting in a file, ignoring blank lines and '#' comments.
+  * Returns 0, or -1 with "file:line: message" in error. */
+ int config_read_file(config_t *config, const char *path, char *error, size_t error_size);
+ 
+ /* Remember a command-line setting, applied over the file on every load. Returns 0 or -1. */
+ int config_override(const char *setting);
+ 
+ /* Build the configuration from the defaults, the file at path (if not NULL) and the
+  * overrides, and make it current. Returns 0, or -1 with a message in error. */
+ int config_load(const char *path, char *error, size_t error_size);
+ 
+ /* Build the configuration again from the same file and overrides. The previous one stays
+  * current if this fails. Returns 0, or -1 with a message in error. */
+ int config_reload(char *error, size_t error_size);
+ 
+ /* File config_load() read, or NULL */
+ const char *config_path(void);
+ 
+ /* The current configuration (the defaults until one is loaded). It is never modified or
+  * freed while the program runs, so pointers into it stay valid across reloads. */
+ const config_t *config_current(void);
+ 
+ /* Directory requested as name (bare or "./" form) or by its path, or NULL if none */
+ const config_dir_t *config_find_dir(const config_t *config, const char *name);
+ 
+ /* Metrics slot of a directory name, or -1 if no load configured it. A name keeps its
+  * slot when a reload drops it, so transfers still running there are counted. */
+ int config_dir_slot(const char *name);
+ 
+ /* Directory names assigned a metrics slot so far, and the name in one slot */
+ int config_dir_slots(void);
+ const char *config_dir_label(int slot);
+ 
+ /* Apply the socket options of config to a socket (a listener passes them on to the
+  * connections it accepts). Returns 0, or -1 with errno set and *option naming the
+  * option that failed. */
+ int config_apply_socket(int socket_fd, const config_t *config, const char **option);
+ 
+ /* Free every configuration loaded so far */
+ void config_destroy(void);
+ 
+ #endif /* CONFIG_H */
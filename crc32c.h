@@ -0,0 +1,27 @@
+/* crc32c.h - Header file for the CRC32C (Castagnoli) checksum
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations shared by the server and client for:
+ * - Incremental CRC32C over buffers of any length
+ * - Combining the checksums of adjacent pieces
+ * - Reporting which implementation (hardware or table) is in use
+ */
+
+ #ifndef CRC32C_H
+ #define CRC32C_H
+ 
+ #include <stdint.h>
+ #include <stddef.h>
+ 
+ /* Function prototypes */
+ 
+ /* Extend a running checksum (start from 0) with length bytes of data */
+ uint32_t crc32c_update(uint32_t crc, const void *data, size_t length);
+ 
+ /* Checksum of A followed by B, given the checksums of each and the length of B */
+ uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t length_b);
+ 
+ /* Name of the implementation in use ("sse4.2" or "software") */
+ const char *crc32c_implementation(void);
+ 
+ #endif /* CRC32C_H */
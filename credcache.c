@@ -0,0 +1,341 @@
+/* credcache.c - Implementation of the passwd/group credential cache
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the credential cache:
+ * - Lookups with getpwnam_r, getgrouplist and getgrnam_r only
+ * - Hash tables guarded by a reader/writer lock so hits run in parallel
+ * - Records that expire after a TTL or when the generation changes
+ */
+
+ #include "credcache.h"
+ #include <stdint.h>
+ 
+ /* Cached user record */
+ typedef struct user_entry {
+     char name[CREDCACHE_NAME_MAX];
+     cred_user_t user;
+     time_t expires;
+     unsigned int generation;
+     struct user_entry *next;
+ } user_entry_t;
+ 
+ /* Cached group record */
+ typedef struct group_entry {
+     char name[CREDCACHE_NAME_MAX];
+     int found;
+     gid_t gid;
+     time_t expires;
+     unsigned int generation;
+     struct group_entry *next;
+ } group_entry_t;
+ 
+ /* Cache state */
+ static pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+ static user_entry_t *user_table[CREDCACHE_BUCKETS];
+ static group_entry_t *group_table[CREDCACHE_BUCKETS];
+ static int cache_ttl = CREDCACHE_DEFAULT_TTL;
+ static unsigned int cache_generation = 0;
+ 
+ /* FNV-1a hash of a name */
+ static unsigned int hash_name(const char *name) {
+     uint32_t hash = 2166136261u;
+     
+     while (*name) {
+         hash ^= (unsigned char)*name++;
+         hash *= 16777619u;
+     }
+     
+     return hash % CREDCACHE_BUCKETS;
+ }
+ 
+ /* Current monotonic time in seconds */
+ static time_t now_seconds(void) {
+     struct timespec ts;
+     
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return ts.tv_sec;
+ }
+ 
+ /* Size of the scratch buffer the _r functions need */
+ static size_t nss_buffer_size(int name) {
+     long size = sysconf(name);
+     
+     return (size > 0) ? (size_t)size : 16384;
+ }
+ 
+ /* Copy a user record so callers never hold pointers into the cache */
+ static int copy_user(const cred_user_t *source, cred_user_t *dest) {
+     *dest = *source;
+     dest->groups = NULL;
+     
+     if (source->ngroups > 0) {
+         dest->groups = malloc(source->ngroups * sizeof(gid_t));
+         if (!dest->groups) {
+             return -1;
+         }
+         memcpy(dest->groups, source->groups, source->ngroups * sizeof(gid_t));
+     }
+     
+     return 0;
+ }
+ 
+ /* Initialize the cache; a ttl of 0 disables caching */
+ void credcache_init(int ttl_seconds) {
+     cache_ttl = ttl_seconds;
+ }
+ 
+ /* Resolve a user directly with the reentrant NSS calls, bypassing the cache */
+ int credcache_resolve_user(const char *username, cred_user_t *user) {
+     struct passwd pwd, *result = NULL;
+     size_t buffer_size = nss_buffer_size(_SC_GETPW_R_SIZE_MAX);
+     char *buffer;
+     gid_t *groups;
+     int ngroups = 16, rc;
+     
+     memset(user, 0, sizeof(*user));
+     
+     /* Grow the scratch buffer until the record fits */
+     while (1) {
+         buffer = malloc(buffer_size);
+         if (!buffer) {
+             return -1;
+         }
+         rc = getpwnam_r(username, &pwd, buffer, buffer_size, &result);
+         if (rc != ERANGE) {
+             break;
+         }
+         free(buffer);
+         buffer_size *= 2;
+     }
+     
+     if (rc != 0) {
+         free(buffer);
+         errno = rc;
+         return -1;
+     }
+     if (!result) {
+         /* No such user */
+         free(buffer);
+         return 0;
+     }
+     
+     user->found = 1;
+     user->uid = pwd.pw_uid;
+     user->gid = pwd.pw_gid;
+     free(buffer);
+     
+     /* Fetch the group list, retrying with the size getgrouplist reports */
+     while (1) {
+         groups = malloc(ngroups * sizeof(gid_t));
+         if (!groups) {
+             return -1;
+         }
+         if (getgrouplist(username, user->gid, groups, &ngroups) >= 0) {
+             break;
+         }
+         free(groups);
+     }
+     
+     user->ngroups = ngroups;
+     user->groups = groups;
+     return 0;
+ }
+ 
+ /* Resolve a group directly with the reentrant NSS calls, bypassing the cache */
+ int credcache_resolve_group(const char *groupname, gid_t *gid) {
+     struct group grp, *result = NULL;
+     size_t buffer_size = nss_buffer_size(_SC_GETGR_R_SIZE_MAX);
+     char *buffer;
+     int rc;
+     
+     while (1) {
+         buffer = malloc(buffer_size);
+         if (!buffer) {
+             return -1;
+         }
+         rc = getgrnam_r(groupname, &grp, buffer, buffer_size, &result);
+         if (rc != ERANGE) {
+             break;
+         }
+         free(buffer);
+         buffer_size *= 2;
+     }
+     
+     if (rc != 0) {
+         free(buffer);
+         errno = rc;
+         return -1;
+     }
+     
+     if (result) {
+         *gid = grp.gr_gid;
+     }
+     free(buffer);
+     
+     return result ? 1 : 0;
+ }
+ 
+ /* Look up a user, filling a private copy of the record */
+ int credcache_get_user(const char *username, cred_user_t *user) {
+     unsigned int bucket = hash_name(username);
+     unsigned int generation = __atomic_load_n(&cache_generation, __ATOMIC_RELAXED);
+     user_entry_t *entry, **link;
+     cred_user_t fresh;
+     time_t now;
+     int rc;
+     
+     if (cache_ttl <= 0 || strlen(username) >= CREDCACHE_NAME_MAX) {
+         return credcache_resolve_user(username, user);
+     }
+     
+     now = now_seconds();
+     
+     /* Fast path: shared lock, valid entry */
+     pthread_rwlock_rdlock(&cache_lock);
+     for (entry = user_table[bucket]; entry; entry = entry->next) {
+         if (strcmp(entry->name, username) == 0) {
+             if (entry->expires > now && entry->generation == generation) {
+                 rc = copy_user(&entry->user, user);
+                 pthread_rwlock_unlock(&cache_lock);
+                 return rc;
+             }
+             break;
+         }
+     }
+     pthread_rwlock_unlock(&cache_lock);
+     
+     /* Miss or stale: resolve outside any lock, then publish */
+     if (credcache_resolve_user(username, &fresh) < 0) {
+         return -1;
+     }
+     
+     pthread_rwlock_wrlock(&cache_lock);
+     for (link = &user_table[bucket]; *link; link = &(*link)->next) {
+         if (strcmp((*link)->name, username) == 0) {
+             break;
+         }
+     }
+     entry = *link;
+     if (!entry) {
+         entry = calloc(1, sizeof(user_entry_t));
+         if (entry) {
+             strcpy(entry->name, username);
+             *link = entry;
+         }
+     } else {
+         free(entry->user.groups);
+     }
+     if (entry) {
+         entry->user = fresh;
+         entry->expires = now + cache_ttl;
+         entry->generation = generation;
+         rc = copy_user(&entry->user, user);
+     } else {
+         /* Could not cache it; hand over the fresh record instead */
+         *user = fresh;
+         rc = 0;
+     }
+     pthread_rwlock_unlock(&cache_lock);
+     
+     return rc;
+ }
+ 
+ /* Look up a group's gid */
+ int credcache_get_group(const char *groupname, gid_t *gid) {
+     unsigned int bucket = hash_name(groupname);
+     unsigned int generation = __atomic_load_n(&cache_generation, __ATOMIC_RELAXED);
+     group_entry_t *entry, **link;
+     gid_t fresh_gid = 0;
+     time_t now;
+     int found;
+     
+     if (cache_ttl <= 0 || strlen(groupname) >= CREDCACHE_NAME_MAX) {
+         return credcache_resolve_group(groupname, gid);
+     }
+     
+     now = now_seconds();
+     
+     pthread_rwlock_rdlock(&cache_lock);
+     for (entry = group_table[bucket]; entry; entry = entry->next) {
+         if (strcmp(entry->name, groupname) == 0) {
+             if (entry->expires > now && entry->generation == generation) {
+                 found = entry->found;
+                 *gid = entry->gid;
+                 pthread_rwlock_unlock(&cache_lock);
+                 return found;
+             }
+             break;
+         }
+     }
+     pthread_rwlock_unlock(&cache_lock);
+     
+     found = credcache_resolve_group(groupname, &fresh_gid);
+     if (found < 0) {
+         return -1;
+     }
+     
+     pthread_rwlock_wrlock(&cache_lock);
+     for (link = &group_table[bucket]; *link; link = &(*link)->next) {
+         if (strcmp((*link)->name, groupname) == 0) {
+             break;
+         }
+     }
+     entry = *link;
+     if (!entry) {
+         entry = calloc(1, sizeof(group_entry_t));
+         if (entry) {
+             strcpy(entry->name, groupname);
+             *link = entry;
+         }
+     }
+     if (entry) {
+         entry->found = found;
+         entry->gid = fresh_gid;
+         entry->expires = now + cache_ttl;
+         entry->generation = generation;
+     }
+     pthread_rwlock_unlock(&cache_lock);
+     
+     *gid = fresh_gid;
+     return found;
+ }
+ 
+ /* Release a record filled by credcache_get_user or credcache_resolve_user */
+ void credcache_free_user(cred_user_t *user) {
+     free(user->groups);
+     user->groups = NULL;
+     user->ngroups = 0;
+ }
+ 
+ /* Mark every cached record stale; async-signal-safe */
+ void credcache_invalidate(void) {
+     __atomic_add_fetch(&cache_generation, 1, __ATOMIC_RELAXED);
+ }
+ 
+ /* Current generation, bumped by every invalidation */
+ unsigned int credcache_generation(void) {
+     return __atomic_load_n(&cache_generation, __ATOMIC_RELAXED);
+ }
+ 
+ /* Free all cached records */
+ void credcache_destroy(void) {
+     user_entry_t *user, *next_user;
+     group_entry_t *group, *next_group;
+     int i;
+     
+     pthread_rwlock_wrlock(&cache_lock);
+     for (i = 0; i < CREDCACHE_BUCKETS; i++) {
+         for (user = user_table[i]; user; user = next_user) {
+             next_user = user->next;
+             free(user->user.groups);
+             free(user);
+         }
+         user_table[i] = NULL;
+         for (group = group_table[i]; group; group = next_group) {
+             next_group = group->next;
+             free(group);
+         }
+         group_table[i] = NULL;
+     }
+     pthread_rwlock_unlock(&cache_lock);
+ }
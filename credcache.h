@@ -0,0 +1,73 @@
+/* credcache.h - Header file for the passwd/group credential cache
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the credential cache including:
+ * - Cached user records (uid, primary gid, supplementary groups)
+ * - Cached group name to gid mappings
+ * - TTL expiry and generation-based invalidation (used on SIGHUP)
+ * - Function prototypes for cached and uncached lookups
+ */
+
+ #ifndef CREDCACHE_H
+ #define CREDCACHE_H
+ 
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <pwd.h>
+ #include <grp.h>
+ #include <time.h>
+ #include <sys/types.h>
+ 
+ /* Default lifetime of a cached record in seconds */
+ #define CREDCACHE_DEFAULT_TTL 60
+ 
+ /* Number of hash buckets per table */
+ #define CREDCACHE_BUCKETS 128
+ 
+ /* Longest user or group name cached */
+ #define CREDCACHE_NAME_MAX 64
+ 
+ /* Resolved identity of a user */
+ typedef struct {
+     int found;              /* Zero if the user does not exist */
+     uid_t uid;
+     gid_t gid;
+     int ngroups;
+     gid_t *groups;          /* Primary and supplementary groups */
+ } cred_user_t;
+ 
+ /* Function prototypes */
+ 
+ /* Initialize the cache; a ttl of 0 disables caching */
+ void credcache_init(int ttl_seconds);
+ 
+ /* Look up a user, filling a private copy of the record (release with credcache_free_user).
+  * Returns 0, or -1 on a lookup error. A missing user is reported through found. */
+ int credcache_get_user(const char *username, cred_user_t *user);
+ 
+ /* Look up a group's gid. Returns 1 if found, 0 if missing, -1 on error. */
+ int credcache_get_group(const char *groupname, gid_t *gid);
+ 
+ /* Release a record filled by credcache_get_user or credcache_resolve_user */
+ void credcache_free_user(cred_user_t *user);
+ 
+ /* Resolve a user directly with the reentrant NSS calls, bypassing the cache */
+ int credcache_resolve_user(const char *username, cred_user_t *user);
+ 
+ /* Resolve a group directly with the reentrant NSS calls, bypassing the cache */
+ int credcache_resolve_group(const char *groupname, gid_t *gid);
+ 
+ /* Mark every cached record stale; async-signal-safe */
+ void credcache_invalidate(void);
+ 
+ /* Current generation; anything decided from records of an earlier one is stale */
+ unsigned int credcache_generation(void);
+ 
+ /* Free all cached records */
+ void credcache_destroy(void);
+ 
+ #endif /* CREDCACHE_H */
@@ -0,0 +1,342 @@
+/* dedup.c - Implementation of the content-addressed upload store
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements deduplicated uploads:
+ * - A store per target directory, so content never crosses between groups of users
+ * - Reflink clones of stored content, with an in-kernel copy where reflinks are unsupported
+ * - Fresh inodes for every upload, so ownership is applied exactly as for received files
+ * - Digests computed by the server over what it staged; the client's claim is only a lookup key
+ * - Store inserts for the event loops copied and flushed by one background thread
+ * - Each object's CRC32C kept in an extended attribute, for the manifest entries of its clones
+ */
+
+ #include "dedup.h"
+ #include "bufpool.h"
+ #include "netio.h"
+ #include "metrics.h"
+ #include <sys/ioctl.h>
+ #include <sys/xattr.h>
+ #include <linux/fs.h>
+ 
+ int dedup_enabled = 0;
+ 
+ /* Background writer queue, oldest first */
+ static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+ static dedup_job_t *queue_head;
+ static dedup_job_t *queue_tail;
+ static int queue_length;
+ 
+ /* Forward declarations for internal helpers */
+ static void *store_main(void *arg);
+ 
+ /* Build "<dir>/.store/<hex digest>" for a request's directory and digest */
+ static int store_object_path(const proto_request_t *request, char *store_path) {
+     const char *target_dir = resolve_target_dir(request->target_dir);
+     char hex[SHA256_HEX_LENGTH];
+     int length;
+     
+     if (!target_dir) {
+         return -1;
+     }
+     
+     sha256_hex(request->digest, hex);
+     length = snprintf(store_path, MAX_PATH_LENGTH, "%s/%s/%s", target_dir, DEDUP_STORE_NAME, hex);
+     return (length < 0 || length >= MAX_PATH_LENGTH) ? -1 : 0;
+ }
+ 
+ /* Give dst_fd the first length bytes of src_fd */
+ static int clone_contents(int dst_fd, int src_fd, off_t length) {
+     loff_t in_offset = 0, out_offset = 0;
+     ssize_t copied;
+     
+     /* Share the extents where the filesystem can (btrfs, XFS); the copy is a new inode either way */
+     if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+         return 0;
+     }
+     if (errno != EOPNOTSUPP && errno != EXDEV && errno != EINVAL && errno != ENOTTY) {
+         log_errno("FICLONE");
+         return -1;
+     }
+     
+     /* Otherwise copy inside the kernel, which still never touches the network */
+     while (in_offset < length) {
+         copied = copy_file_range(src_fd, &in_offset, dst_fd, &out_offset, (size_t)(length - in_offset), 0);
+         if (copied <= 0) {
+             if (copied == 0) {
+                 errno = EIO;
+             }
+             log_errno("copy_file_range");
+             return -1;
+         }
+     }
+     
+     return 0;
+ }
+ 
+ /* SHA-256 of the first length bytes of a staging file */
+ static int digest_staged_file(int file_fd, off_t length, uint8_t *digest) {
+     sha256_t ctx;
+     size_t capacity;
+     off_t offset = 0;
+     ssize_t bytes_read;
+     char *buffer;
+     
+     buffer = bufpool_get(&buffer_pool, netio_chunk_size(length), &capacity);
+     if (!buffer) {
+         return -1;
+     }
+     
+     /* The data was just written, so this reads the page cache rather than the disk */
+     sha256_init(&ctx);
+     while (offset < length) {
+         bytes_read = pread(file_fd, buffer, (length - offset > (off_t)capacity) ? capacity :
+                            (size_t)(length - offset), offset);
+         if (bytes_read <= 0) {
+             if (bytes_read == 0) {
+                 errno = EIO;
+             }
+             log_errno("digest staged file");
+             bufpool_put(&buffer_pool, buffer, capacity);
+             return -1;
+         }
+         sha256_update(&ctx, buffer, (size_t)bytes_read);
+         offset += bytes_read;
+     }
+     sha256_final(&ctx, digest);
+     
+     bufpool_put(&buffer_pool, buffer, capacity);
+     return 0;
+ }
+ 
+ /* Create the store under each configured directory that lacks one */
+ int dedup_prepare(const config_t *config) {
+     char store_dir[MAX_PATH_LENGTH];
+     int i;
+     
+     /* Only the server reads the store; users see their own copies */
+     for (i = 0; i < config->dir_count; i++) {
+         snprintf(store_dir, sizeof(store_dir), "%s/%s", config->dirs[i].path, DEDUP_STORE_NAME);
+         if (mkdir(store_dir, 0700) < 0 && errno != EEXIST) {
+             log_errno("mkdir content store");
+             return -1;
+         }
+     }
+     
+     return 0;
+ }
+ 
+ /* Create the store under each target directory and start the background writer */
+ int dedup_init(void) {
+     pthread_t writer;
+     
+     if (dedup_prepare(config_current()) < 0) {
+         return -1;
+     }
+     
+     if (pthread_create(&writer, NULL, store_main, NULL) != 0) {
+         log_errno("pthread_create content store writer");
+         return -1;
+     }
+     pthread_detach(writer);
+     
+     dedup_enabled = 1;
+     log_info("Uploads announced with a digest are deduplicated (%s SHA-256)", sha256_implementation());
+     return 0;
+ }
+ 
+ /* Whether a request is a single-stream upload the store should handle */
+ int dedup_requested(const proto_request_t *request) {
+     return dedup_enabled && request->opcode == PROTO_OP_PUT && (request->flags & PROTO_FLAG_DEDUP) &&
+            !(request->flags & PROTO_FLAG_PARALLEL);
+ }
+ 
+ /* Stage a copy of stored content for target_path */
+ int dedup_clone(const proto_request_t *request, const char *target_path, char *staging_path,
+                 uint32_t *crc, int *summed) {
+     char store_path[MAX_PATH_LENGTH];
+     uint32_t stored_crc;
+     struct stat st;
+     int store_fd, file_fd;
+     off_t unused;
+     
+     if (store_object_path(request, store_path) < 0) {
+         return -1;
+     }
+     
+     store_fd = open(store_path, O_RDONLY);
+     if (store_fd < 0) {
+         if (errno != ENOENT) {
+             log_errno("open stored content");
+         }
+         return -1;
+     }
+     
+     /* A size that disagrees with the digest means the entry cannot be this upload */
+     if (fstat(store_fd, &st) < 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != request->size) {
+         close(store_fd);
+         return -1;
+     }
+     
+     /* Into a staging file like any other upload, published once its owner is set */
+     file_fd = open_staging_file(target_path, 0, st.st_size, staging_path, &unused);
+     if (file_fd < 0) {
+         close(store_fd);
+         return -1;
+     }
+     if (clone_contents(file_fd, store_fd, st.st_size) < 0) {
+         close(file_fd);
+         close(store_fd);
+         if (staging_path[0]) {
+             unlink(staging_path);
+         }
+         return -1;
+     }
+     
+     /* Objects stored where extended attributes are unsupported leave the clone's checksum unknown */
+     *summed = (fgetxattr(store_fd, DEDUP_CRC_XATTR, &stored_crc, sizeof(stored_crc)) == sizeof(stored_crc));
+     if (*summed) {
+         *crc = stored_crc;
+     }
+     close(store_fd);
+     
+     metrics_record_dedup(request);
+     log_debug("Cloned %s from the content store", request->filename);
+     return file_fd;
+ }
+ 
+ /* Add verified content to the store with its CRC32C, computed here when crc is NULL;
+  * failing only costs a later upload its shortcut */
+ static void add_to_store(int file_fd, const proto_request_t *request, const uint32_t *crc) {
+     char store_path[MAX_PATH_LENGTH], store_staging[STAGING_PATH_LENGTH];
+     off_t filesize = (off_t)request->size;
+     uint32_t computed;
+     off_t unused;
+     int store_fd;
+     
+     /* Already stored, perhaps by a concurrent upload of the same content */
+     if (store_object_path(request, store_path) < 0 || access(store_path, F_OK) == 0) {
+         return;
+     }
+     
+     /* Staged and flushed before it gets its name: a torn entry would corrupt every clone of it */
+     store_fd = open_staging_file(store_path, 0, filesize, store_staging, &unused);
+     if (store_fd < 0) {
+         return;
+     }
+     
+     /* Clones take their manifest checksum from here; without one they record it as unknown */
+     if (!crc && checksum_staged_body(file_fd, 0, filesize, &computed) == 0) {
+         crc = &computed;
+     }
+     if (crc && fsetxattr(store_fd, DEDUP_CRC_XATTR, crc, sizeof(*crc), 0) < 0 && errno != ENOTSUP) {
+         log_errno("fsetxattr content store");
+     }
+     if (clone_contents(store_fd, file_fd, filesize) < 0 || fdatasync(store_fd) < 0 ||
+         commit_staging_file(store_fd, store_staging, store_path) < 0) {
+         log_warn("Could not add %s to the content store", request->filename);
+         if (store_staging[0]) {
+             unlink(store_staging);
+         }
+     }
+     close(store_fd);
+ }
+ 
+ /* Compare the SHA-256 of a body with the request's digest */
+ int dedup_verify(const proto_request_t *request, const uint8_t *digest) {
+     /* Later uploads are built from the stored copy, so it must be exactly what was announced */
+     if (memcmp(digest, request->digest, SHA256_DIGEST_SIZE) != 0) {
+         log_warn("Content of %s does not match the digest it was announced with", request->filename);
+         return STATUS_CHECKSUM_ERROR;
+     }
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Check a complete staging file against the request's digest, then add it to the store */
+ int dedup_store(int file_fd, const proto_request_t *request, const uint32_t *crc) {
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     int status;
+     
+     if (digest_staged_file(file_fd, (off_t)request->size, digest) < 0) {
+         return STATUS_FILE_ERROR;
+     }
+     status = dedup_verify(request, digest);
+     if (status == STATUS_SUCCESS) {
+         add_to_store(file_fd, request, crc);
+     }
+     
+     return status;
+ }
+ 
+ /* Add each queued body to the store, digesting those the loops could not */
+ static void *store_main(void *arg) {
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     dedup_job_t *job;
+     
+     (void)arg;
+     while (1) {
+         pthread_mutex_lock(&queue_lock);
+         while (!queue_head) {
+             pthread_cond_wait(&queue_ready, &queue_lock);
+         }
+         job = queue_head;
+         queue_head = job->next;
+         if (!queue_head) {
+             queue_tail = NULL;
+         }
+         queue_length--;
+         pthread_mutex_unlock(&queue_lock);
+         
+         if (job->verified ||
+             (digest_staged_file(job->file_fd, (off_t)job->request.size, digest) == 0 &&
+              dedup_verify(&job->request, digest) == STATUS_SUCCESS)) {
+             add_to_store(job->file_fd, &job->request, job->summed ? &job->crc : NULL);
+         }
+         close(job->file_fd);
+         free(job);
+     }
+     
+     return NULL;
+ }
+ 
+ /* Add a complete staging file to the store on the background writer */
+ void dedup_store_later(int file_fd, const proto_request_t *request, int verified, const uint32_t *crc) {
+     dedup_job_t *job;
+     
+     /* The staging file is published or closed long before the writer gets to it, but its
+      * inode stays as it is: uploads to the same name stage a new one */
+     job = malloc(sizeof(dedup_job_t));
+     if (!job) {
+         return;
+     }
+     job->file_fd = dup(file_fd);
+     if (job->file_fd < 0) {
+         log_errno("dup");
+         free(job);
+         return;
+     }
+     job->request = *request;
+     job->verified = verified;
+     job->summed = (crc != NULL);
+     job->crc = crc ? *crc : 0;
+     job->next = NULL;
+     
+     pthread_mutex_lock(&queue_lock);
+     if (queue_length >= DEDUP_QUEUE_LIMIT) {
+         pthread_mutex_unlock(&queue_lock);
+         log_debug("Content store writer is behind; %s is not stored", request->filename);
+         close(job->file_fd);
+         free(job);
+         return;
+     }
+     if (queue_tail) {
+         queue_tail->next = job;
+     } else {
+         queue_head = job;
+     }
+     queue_tail = job;
+     queue_length++;
+     pthread_cond_signal(&queue_ready);
+     pthread_mutex_unlock(&queue_lock);
+ }
@@ -0,0 +1,75 @@
+/* dedup.h - Header file for the content-addressed upload store
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for deduplicated uploads including:
+ * - The store layout: one file per SHA-256 digest under each target directory, carrying
+ *   the CRC32C of its content so a clone's manifest entry needs no read-back
+ * - Staging a copy of stored content instead of receiving the body again
+ * - Checking a received body against its announced digest and adding it to the store
+ * - A background writer that adds bodies received by the event loops to the store
+ */
+
+ #ifndef DEDUP_H
+ #define DEDUP_H
+ 
+ #include "server.h"
+ #include "sha256.h"
+ 
+ /* Stored content lives in "<dir>/.store/<hex digest>", readable by the server only */
+ #define DEDUP_STORE_NAME ".store"
+ 
+ /* Extended attribute of a stored object holding its CRC32C, in host byte order */
+ #define DEDUP_CRC_XATTR "user.sscm.crc32c"
+ 
+ /* Bodies waiting for the background writer; past this, uploads are not stored */
+ #define DEDUP_QUEUE_LIMIT 64
+ 
+ /* A body the background writer will add to the store */
+ typedef struct dedup_job {
+     int file_fd;                /* Its own descriptor for the staging file's inode */
+     proto_request_t request;
+     int verified;               /* The digest was already checked as the body arrived */
+     int summed;                 /* crc was kept as the body arrived */
+     uint32_t crc;
+     struct dedup_job *next;
+ } dedup_job_t;
+ 
+ /* Non-zero once dedup_init() prepared the store */
+ extern int dedup_enabled;
+ 
+ /* Function prototypes */
+ 
+ /* Create the store under each target directory and start the background writer.
+  * Returns 0 or -1. */
+ int dedup_init(void);
+ 
+ /* Create the store under each directory of config that lacks one, as after a reload
+  * added directories. Returns 0 or -1. */
+ int dedup_prepare(const config_t *config);
+ 
+ /* Whether a request is a single-stream upload the store should handle */
+ int dedup_requested(const proto_request_t *request);
+ 
+ /* Stage a copy of stored content matching the request's digest and size for target_path,
+  * sharing its blocks where the filesystem can. Returns the staging descriptor (with
+  * staging_path set as by open_staging_file()), or -1 if the store cannot supply it.
+  * On success *summed says whether *crc was set to the content's CRC32C. */
+ int dedup_clone(const proto_request_t *request, const char *target_path, char *staging_path,
+                 uint32_t *crc, int *summed);
+ 
+ /* Check a complete staging file against the request's digest, then add it to the store
+  * with crc, its CRC32C, or one computed from the file if that is NULL.
+  * Returns STATUS_SUCCESS, STATUS_CHECKSUM_ERROR or STATUS_FILE_ERROR; failing to store
+  * the content only costs a later upload its shortcut. */
+ int dedup_store(int file_fd, const proto_request_t *request, const uint32_t *crc);
+ 
+ /* Compare the SHA-256 of a body, kept as it was received, with the request's digest.
+  * Returns STATUS_SUCCESS or STATUS_CHECKSUM_ERROR. */
+ int dedup_verify(const proto_request_t *request, const uint8_t *digest);
+ 
+ /* Add a complete staging file to the store on the background writer, so an event loop never
+  * copies, flushes or reads it. Unless verified, the writer digests the file first and keeps
+  * content that does not match out of the store; without crc it checksums the file too. */
+ void dedup_store_later(int file_fd, const proto_request_t *request, int verified, const uint32_t *crc);
+ 
+ #endif /* DEDUP_H */
@@ -0,0 +1,461 @@
+/* delta.c - Implementation of delta encoding against an existing file
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the rsync-style block matching of delta uploads:
+ * - rsync's weak checksum, summed 32 bytes per step with AVX2 where the CPU has it
+ * - The window slid eight positions per step with AVX2, by prefix sums over the bytes
+ *   leaving and entering it, so every offset gets a checksum without a serial roll
+ * - SHA-256, truncated, to confirm weak matches
+ * - An open-addressing table over the signatures, mostly empty so misses cost one probe
+ * - Runs of consecutive matched blocks merged into single copy instructions
+ */
+
+ #include "delta.h"
+ #include "sha256.h"
+ #include <errno.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <endian.h>
+ #include <pthread.h>
+ 
+ #if defined(__x86_64__)
+ #include <immintrin.h>
+ #define DELTA_HAVE_AVX2 1
+ #endif
+ 
+ /* Window positions one vector roll checks */
+ #define DELTA_MAX_LANES 8
+ 
+ /* Longest copy instruction; longer runs of matched blocks are split */
+ #define DELTA_MAX_COPY (1024u * 1024 * 1024)
+ 
+ /* Pack the two sums into the checksum carried in signatures */
+ #define DELTA_WEAK(a, b) (((a) & 0xffff) | ((b) << 16))
+ 
+ /* Fibonacci hashing spreads weak checksums, whose low bits are a plain byte sum */
+ #define DELTA_SLOT(index, weak) (((weak) * 0x9E3779B1u) >> (index)->shift)
+ 
+ /* Sum length bytes: a is the byte sum, b weights each byte by its distance from the end */
+ typedef void (*delta_sum_fn)(const unsigned char *p, size_t length, uint32_t *a, uint32_t *b);
+ 
+ /* Slide a length-byte window starting at p forward by one position per lane, writing the
+  * checksum of each new position and leaving a and b at the last */
+ typedef void (*delta_roll_fn)(const unsigned char *p, uint32_t length, uint32_t *a, uint32_t *b,
+                               uint32_t *weak);
+ 
+ /* Encoder state: a run of matched blocks not yet emitted, then literal bytes */
+ typedef struct {
+     const delta_index_t *index;
+     const unsigned char *data;
+     delta_emit_fn emit;
+     void *arg;
+     uint32_t run_block;
+     uint64_t run_length;
+     uint64_t literal;           /* First byte not yet covered by an instruction */
+ } delta_encoder_t;
+ 
+ static delta_sum_fn delta_sum;
+ static delta_roll_fn delta_roll;
+ static uint32_t delta_lanes;
+ static const char *delta_impl_name;
+ static pthread_once_t delta_once = PTHREAD_ONCE_INIT;
+ 
+ /* Portable sums, one byte at a time */
+ static void delta_sum_scalar(const unsigned char *p, size_t length, uint32_t *a, uint32_t *b) {
+     uint32_t s1 = *a, s2 = *b;
+     size_t i;
+     
+     for (i = 0; i < length; i++) {
+         s1 += p[i];
+         s2 += s1;
+     }
+     
+     *a = s1;
+     *b = s2;
+ }
+ 
+ /* Portable roll by one position: the first byte leaves, the byte after the window enters */
+ static void delta_roll_scalar(const unsigned char *p, uint32_t length, uint32_t *a, uint32_t *b,
+                               uint32_t *weak) {
+     *a += (uint32_t)p[length] - p[0];
+     *b += *a - length * (uint32_t)p[0];
+     weak[0] = DELTA_WEAK(*a, *b);
+ }
+ 
+ #ifdef DELTA_HAVE_AVX2
+ /* Add up the eight 32-bit lanes of a vector */
+ __attribute__((target("avx2")))
+ static uint32_t hsum_epi32(__m256i v) {
+     __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+     
+     sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+     sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+     return (uint32_t)_mm_cvtsi128_si32(sum);
+ }
+ 
+ /* Inclusive prefix sum across eight 32-bit lanes */
+ __attribute__((target("avx2")))
+ static __m256i prefix_epi32(__m256i v) {
+     __m256i carry;
+     
+     /* Within each 128-bit half, then the low half's total carried into the high half */
+     v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+     v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+     carry = _mm256_permute2x128_si256(_mm256_shuffle_epi32(v, 0xFF), v, 0x08);
+     return _mm256_add_epi32(v, carry);
+ }
+ 
+ /* Vector sums: per 32-byte step, byte sums with psadbw and weighted sums with pmaddubsw.
+  * The weights run 32..1 within a step; every later step adds 32 times the bytes before it. */
+ __attribute__((target("avx2")))
+ static void delta_sum_avx2(const unsigned char *p, size_t length, uint32_t *a, uint32_t *b) {
+     const __m256i weights = _mm256_set_epi8(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                                             17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32);
+     const __m256i ones = _mm256_set1_epi16(1);
+     const __m256i zero = _mm256_setzero_si256();
+     __m256i s1 = zero, s2 = zero, before = zero, bytes;
+     size_t steps = length / 32, i;
+     uint32_t sum1, sum2;
+     
+     for (i = 0; i < steps; i++) {
+         bytes = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+         before = _mm256_add_epi32(before, s1);
+         s1 = _mm256_add_epi32(s1, _mm256_sad_epu8(bytes, zero));
+         s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes, weights), ones));
+     }
+     
+     /* Earlier input shifts every weight here up by the number of bytes summed now */
+     sum1 = hsum_epi32(s1);
+     sum2 = hsum_epi32(s2) + 32 * hsum_epi32(before);
+     *b += *a * (uint32_t)(32 * steps) + sum2;
+     *a += sum1;
+     
+     delta_sum_scalar(p + 32 * steps, length - 32 * steps, a, b);
+ }
+ 
+ /* Vector roll by eight positions. With d the entering minus the leaving byte, the byte
+  * sum after step j is a + d[0..j]; the weighted sum gains that minus length times the
+  * leaving byte at each step, so both are prefix sums over the lanes. */
+ __attribute__((target("avx2")))
+ static void delta_roll_avx2(const unsigned char *p, uint32_t length, uint32_t *a, uint32_t *b,
+                             uint32_t *weak) {
+     __m256i out = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+     __m256i in = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(p + length)));
+     __m256i sums_a, sums_b;
+     
+     sums_a = _mm256_add_epi32(_mm256_set1_epi32((int)*a), prefix_epi32(_mm256_sub_epi32(in, out)));
+     sums_b = _mm256_sub_epi32(sums_a, _mm256_mullo_epi32(out, _mm256_set1_epi32((int)length)));
+     sums_b = _mm256_add_epi32(_mm256_set1_epi32((int)*b), prefix_epi32(sums_b));
+     
+     _mm256_storeu_si256((__m256i *)weak,
+                         _mm256_or_si256(_mm256_and_si256(sums_a, _mm256_set1_epi32(0xffff)),
+                                         _mm256_slli_epi32(sums_b, 16)));
+     *a = (uint32_t)_mm256_extract_epi32(sums_a, 7);
+     *b = (uint32_t)_mm256_extract_epi32(sums_b, 7);
+ }
+ #endif
+ 
+ /* Pick the fastest implementation */
+ static void delta_select(void) {
+     delta_sum = delta_sum_scalar;
+     delta_roll = delta_roll_scalar;
+     delta_lanes = 1;
+     delta_impl_name = "scalar";
+ #ifdef DELTA_HAVE_AVX2
+     if (__builtin_cpu_supports("avx2")) {
+         delta_sum = delta_sum_avx2;
+         delta_roll = delta_roll_avx2;
+         delta_lanes = DELTA_MAX_LANES;
+         delta_impl_name = "avx2";
+     }
+ #endif
+ }
+ 
+ /* Truncated SHA-256 of a block */
+ static void delta_strong(const void *data, size_t length, uint8_t *strong) {
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     sha256_t ctx;
+     
+     sha256_init(&ctx);
+     sha256_update(&ctx, data, length);
+     sha256_final(&ctx, digest);
+     memcpy(strong, digest, PROTO_DELTA_STRONG_SIZE);
+ }
+ 
+ /* Weak checksum of length bytes */
+ uint32_t delta_weak(const void *data, size_t length) {
+     uint32_t a = 0, b = 0;
+     
+     pthread_once(&delta_once, delta_select);
+     
+     delta_sum((const unsigned char *)data, length, &a, &b);
+     return DELTA_WEAK(a, b);
+ }
+ 
+ /* Signature of one block, in network byte order */
+ void delta_sign_block(const void *data, size_t length, proto_signature_t *sig) {
+     sig->weak = htobe32(delta_weak(data, length));
+     delta_strong(data, length, sig->strong);
+ }
+ 
+ /* Sign the blocks that one read of as many whole blocks as scratch holds covers */
+ int delta_sign_step(int fd, uint64_t size, uint64_t *offset, proto_signature_t *sigs, char *scratch,
+                     size_t capacity) {
+     uint32_t block_size = proto_delta_block_size(size);
+     size_t span = capacity / block_size * block_size, length, i;
+     ssize_t bytes_read;
+     
+     if (span == 0) {
+         errno = EINVAL;
+         return -1;
+     }
+     
+     sigs += *offset / block_size;
+     length = (size - *offset > span) ? span : (size_t)(size - *offset);
+     bytes_read = pread(fd, scratch, length, (off_t)*offset);
+     if (bytes_read != (ssize_t)length) {
+         if (bytes_read >= 0) {
+             errno = EIO;
+         }
+         return -1;
+     }
+     for (i = 0; i < length; i += block_size) {
+         delta_sign_block(scratch + i, (length - i > block_size) ? block_size : length - i, sigs++);
+     }
+     *offset += length;
+     
+     return 0;
+ }
+ 
+ /* Sign every block of a file */
+ int delta_sign_file(int fd, uint64_t size, proto_signature_t *sigs, char *scratch, size_t capacity) {
+     uint64_t offset = 0;
+     
+     while (offset < size) {
+         if (delta_sign_step(fd, size, &offset, sigs, scratch, capacity) < 0) {
+             return -1;
+         }
+     }
+     
+     return 0;
+ }
+ 
+ /* Index the signatures of an existing file */
+ int delta_index_init(delta_index_t *index, const proto_signature_t *sigs, uint64_t basis_size) {
+     uint32_t bits = 4, i, slot, weak;
+     
+     pthread_once(&delta_once, delta_select);
+     
+     index->sigs = sigs;
+     index->basis_size = basis_size;
+     index->block_size = proto_delta_block_size(basis_size);
+     index->count = (uint32_t)proto_delta_block_count(basis_size);
+     index->tail = (uint32_t)(basis_size % index->block_size);
+     
+     /* At most a quarter full, so a checksum that matches nothing usually lands on an empty slot */
+     while ((1u << bits) < 4 * (uint64_t)index->count) {
+         bits++;
+     }
+     index->shift = 32 - bits;
+     index->slots = calloc((size_t)1 << bits, sizeof(delta_slot_t));
+     if (!index->slots) {
+         return -1;
+     }
+     
+     /* A short last block can only match at the very end of the new file */
+     for (i = 0; i < index->count - (index->tail ? 1 : 0); i++) {
+         weak = be32toh(sigs[i].weak);
+         slot = DELTA_SLOT(index, weak);
+         while (index->slots[slot].block) {
+             slot = (slot + 1) & ((1u << bits) - 1);
+         }
+         index->slots[slot].weak = weak;
+         index->slots[slot].block = i + 1;
+     }
+     
+     return 0;
+ }
+ 
+ /* Release an index */
+ void delta_index_free(delta_index_t *index) {
+     free(index->slots);
+     index->slots = NULL;
+ }
+ 
+ /* Block whose signature matches the full-length window at p, or -1. Among equal blocks
+  * the one after the previous match is preferred, keeping copy runs unbroken. */
+ static int64_t find_block(const delta_index_t *index, uint32_t weak, const unsigned char *p, uint32_t hint) {
+     uint32_t mask = (uint32_t)((1ull << (32 - index->shift)) - 1);
+     uint32_t slot = DELTA_SLOT(index, weak), block;
+     uint8_t strong[PROTO_DELTA_STRONG_SIZE];
+     int have_strong = 0;
+     int64_t found = -1;
+     
+     for (; index->slots[slot].block; slot = (slot + 1) & mask) {
+         if (index->slots[slot].weak != weak) {
+             continue;
+         }
+     
+         /* The strong hash is only worth computing once the weak one agrees */
+         block = index->slots[slot].block - 1;
+         if (!have_strong) {
+             delta_strong(p, index->block_size, strong);
+             have_strong = 1;
+         }
+         if (memcmp(strong, index->sigs[block].strong, PROTO_DELTA_STRONG_SIZE) == 0) {
+             if (block == hint) {
+                 return block;
+             }
+             if (found < 0) {
+                 found = block;
+             }
+         }
+     }
+     
+     return found;
+ }
+ 
+ /* Emit the pending run of matched blocks as one copy */
+ static int flush_run(delta_encoder_t *enc) {
+     int result = 0;
+     
+     if (enc->run_length > 0) {
+         result = enc->emit(enc->arg, enc->run_block, (uint32_t)enc->run_length, NULL);
+         enc->run_length = 0;
+     }
+     return result;
+ }
+ 
+ /* Emit the literal bytes before end, in pieces a chunk buffer holds */
+ static int flush_literal(delta_encoder_t *enc, uint64_t end) {
+     uint32_t length;
+     
+     if (enc->literal < end && flush_run(enc) < 0) {
+         return -1;
+     }
+     while (enc->literal < end) {
+         length = (end - enc->literal > PROTO_CHUNK_SIZE) ? PROTO_CHUNK_SIZE : (uint32_t)(end - enc->literal);
+         if (enc->emit(enc->arg, PROTO_DELTA_LITERAL, length, enc->data + enc->literal) < 0) {
+             return -1;
+         }
+         enc->literal += length;
+     }
+     return 0;
+ }
+ 
+ /* Cover length bytes at offset with a copy of block, extending the pending run if it is next */
+ static int add_copy(delta_encoder_t *enc, uint32_t block, uint32_t length, uint64_t offset) {
+     uint32_t block_size = enc->index->block_size;
+     
+     if (flush_literal(enc, offset) < 0) {
+         return -1;
+     }
+     if (enc->run_length > 0 && (enc->run_length % block_size != 0 ||
+                                 block != enc->run_block + enc->run_length / block_size ||
+                                 enc->run_length + length > DELTA_MAX_COPY)) {
+         if (flush_run(enc) < 0) {
+             return -1;
+         }
+     }
+     if (enc->run_length == 0) {
+         enc->run_block = block;
+     }
+     enc->run_length += length;
+     enc->literal = offset + length;
+     return 0;
+ }
+ 
+ /* Encode a file against an indexed existing file */
+ int delta_encode(const delta_index_t *index, const unsigned char *data, uint64_t size,
+                  delta_emit_fn emit, void *arg) {
+     delta_encoder_t enc = { index, data, emit, arg, 0, 0, 0 };
+     uint32_t length = index->block_size, a = 0, b = 0, lanes, j, hint = 0;
+     uint32_t weak[DELTA_MAX_LANES];
+     uint64_t pos = 0, tail_pos;
+     int64_t match;
+     int fresh = 1;
+     
+     pthread_once(&delta_once, delta_select);
+     
+     while (pos + length <= size) {
+         /* After a match the next window shares no bytes with the last: sum it afresh */
+         if (fresh) {
+             a = b = 0;
+             delta_sum(data + pos, length, &a, &b);
+             fresh = 0;
+             match = find_block(index, DELTA_WEAK(a, b), data + pos, hint);
+             if (match >= 0) {
+                 if (add_copy(&enc, (uint32_t)match, length, pos) < 0) {
+                     return -1;
+                 }
+                 pos += length;
+                 hint = (uint32_t)match + 1;
+                 fresh = 1;
+                 continue;
+             }
+         }
+     
+         /* Otherwise slide one position at a time, several per step where there is room */
+         if (pos + length + delta_lanes <= size) {
+             delta_roll(data + pos, length, &a, &b, weak);
+             lanes = delta_lanes;
+         } else if (pos + length < size) {
+             delta_roll_scalar(data + pos, length, &a, &b, weak);
+             lanes = 1;
+         } else {
+             break;
+         }
+     
+         match = -1;
+         for (j = 0; j < lanes; j++) {
+             if (index->slots[DELTA_SLOT(index, weak[j])].block &&
+                 (match = find_block(index, weak[j], data + pos + 1 + j, hint)) >= 0) {
+                 break;
+             }
+         }
+         if (match >= 0) {
+             pos += 1 + j;
+             if (add_copy(&enc, (uint32_t)match, length, pos) < 0) {
+                 return -1;
+             }
+             pos += length;
+             hint = (uint32_t)match + 1;
+             fresh = 1;
+             continue;
+         }
+         pos += lanes;
+     
+         /* Stream long stretches of new data rather than holding them until the next match */
+         if (pos - enc.literal >= PROTO_CHUNK_SIZE && flush_literal(&enc, enc.literal + PROTO_CHUNK_SIZE) < 0) {
+             return -1;
+         }
+     }
+     
+     /* A short last block of the existing file may still end the new one */
+     if (index->tail && size >= index->tail) {
+         tail_pos = size - index->tail;
+         if (tail_pos >= enc.literal &&
+             delta_weak(data + tail_pos, index->tail) == be32toh(index->sigs[index->count - 1].weak)) {
+             uint8_t strong[PROTO_DELTA_STRONG_SIZE];
+     
+             delta_strong(data + tail_pos, index->tail, strong);
+             if (memcmp(strong, index->sigs[index->count - 1].strong, PROTO_DELTA_STRONG_SIZE) == 0 &&
+                 add_copy(&enc, index->count - 1, index->tail, tail_pos) < 0) {
+                 return -1;
+             }
+         }
+     }
+     
+     if (flush_literal(&enc, size) < 0 || flush_run(&enc) < 0) {
+         return -1;
+     }
+     return 0;
+ }
+ 
+ /* Name of the implementation in use ("avx2" or "scalar") */
+ const char *delta_implementation(void) {
+     pthread_once(&delta_once, delta_select);
+     
+     return delta_impl_name;
+ }
@@ -0,0 +1,72 @@
+/* delta.h - Header file for delta encoding against an existing file
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations shared by the server and client for:
+ * - The rolling weak checksum and truncated SHA-256 that sign each block
+ * - Signing every block of the existing file of a delta upload, at once or a buffer at a time
+ * - Indexing received signatures and encoding a new file as copies and literals
+ * - Reporting which implementation (vector or scalar) is in use
+ */
+
+ #ifndef DELTA_H
+ #define DELTA_H
+ 
+ #include <stdint.h>
+ #include <stddef.h>
+ #include "protocol.h"
+ 
+ /* Receives the instructions of an encoded file in order: a copy of length bytes from the
+  * start of block, or length literal bytes at data (block is PROTO_DELTA_LITERAL).
+  * Returns 0, or -1 to stop the encoding. */
+ typedef int (*delta_emit_fn)(void *arg, uint32_t block, uint32_t length, const unsigned char *data);
+ 
+ /* One slot of the signature lookup table */
+ typedef struct {
+     uint32_t weak;
+     uint32_t block;             /* Block number plus one; 0 marks an empty slot */
+ } delta_slot_t;
+ 
+ /* Signatures of an existing file, indexed by weak checksum */
+ typedef struct {
+     const proto_signature_t *sigs;  /* As received: weak checksums in network order */
+     uint64_t basis_size;
+     uint32_t block_size;
+     uint32_t count;
+     uint32_t tail;              /* Length of a short last block, which is matched separately */
+     delta_slot_t *slots;
+     uint32_t shift;             /* Table has 1 << (32 - shift) slots */
+ } delta_index_t;
+ 
+ /* Function prototypes */
+ 
+ /* Weak checksum of length bytes (rsync's: byte sum low, position-weighted sum high) */
+ uint32_t delta_weak(const void *data, size_t length);
+ 
+ /* Signature of one block, in network byte order */
+ void delta_sign_block(const void *data, size_t length, proto_signature_t *sig);
+ 
+ /* Sign every block of the size-byte file open on fd into sigs (proto_delta_block_count()
+  * entries), reading through scratch (at least PROTO_DELTA_MAX_BLOCK bytes). Returns 0 or -1. */
+ int delta_sign_file(int fd, uint64_t size, proto_signature_t *sigs, char *scratch, size_t capacity);
+ 
+ /* Sign the blocks of the size-byte file open on fd that one read through scratch covers,
+  * starting at the block boundary *offset, into their places in sigs, and advance *offset
+  * past them; signing is done once *offset reaches size. Returns 0 or -1. */
+ int delta_sign_step(int fd, uint64_t size, uint64_t *offset, proto_signature_t *sigs, char *scratch,
+                     size_t capacity);
+ 
+ /* Index the signatures of a basis_size-byte file. Returns 0, or -1 if out of memory. */
+ int delta_index_init(delta_index_t *index, const proto_signature_t *sigs, uint64_t basis_size);
+ 
+ /* Release an index */
+ void delta_index_free(delta_index_t *index);
+ 
+ /* Encode size bytes of data as copies of indexed blocks and literals, passing each
+  * instruction to emit. Returns 0, or -1 if emit failed. */
+ int delta_encode(const delta_index_t *index, const unsigned char *data, uint64_t size,
+                  delta_emit_fn emit, void *arg);
+ 
+ /* Name of the implementation in use ("avx2" or "scalar") */
+ const char *delta_implementation(void);
+ 
+ #endif /* DELTA_H */
@@ -0,0 +1,177 @@
+/* download.c - Implementation of downloads and directory listings
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the read side of the server:
+ * - Downloads authorized exactly like uploads to the same directory
+ * - Byte ranges, so an interrupted download can continue where it stopped
+ * - Listings from the directory's manifest rather than a scan of the directory
+ * - Hidden files (staging files, the content store) and symlinks are never served
+ * - Hot files sent from shared mappings, others straight from the page cache with sendfile()
+ */
+
+ #include "download.h"
+ #include "netio.h"
+ #include "manifest.h"
+ 
+ /* Check access to the directory a listing names and resolve it */
+ static int authorize_listing(const proto_request_t *request, session_t *session,
+                              const char **full_target_dir) {
+     access_decision_t decision;
+     
+     *full_target_dir = resolve_target_dir(request->target_dir);
+     if (!*full_target_dir) {
+         log_warn("Invalid target directory: %s", request->target_dir);
+         return STATUS_PERMISSION_DENIED;
+     }
+     
+     /* A session already verified this user for this directory */
+     if (session && session_covers(session, request->username, *full_target_dir)) {
+         return STATUS_SUCCESS;
+     }
+     if (!authorize_user(request->username, *full_target_dir, &decision)) {
+         log_warn("User %s does not have permission to access %s", request->username, request->target_dir);
+         return STATUS_PERMISSION_DENIED;
+     }
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Check a download request and open its file */
+ int open_download(const proto_request_t *request, session_t *session, download_t *download) {
+     char target_path[MAX_PATH_LENGTH];
+     access_decision_t decision;
+     int status;
+     
+     /* Same directory, name and access checks as an upload */
+     status = prepare_file_transfer(request, session, target_path, &decision);
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     /* Staging files and the content store are not part of the directory's contents */
+     if (request->filename[0] == '.') {
+         log_warn("Refusing to serve hidden file %s", target_path);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* A symlink could lead out of the directory; a FIFO would block the open */
+     download->file_fd = open(target_path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+     if (download->file_fd < 0) {
+         log_warn("Cannot open %s: %s", target_path, strerror(errno));
+         return STATUS_FILE_ERROR;
+     }
+     if (fstat(download->file_fd, &download->st) < 0 || !S_ISREG(download->st.st_mode)) {
+         log_warn("Not a regular file: %s", target_path);
+         close(download->file_fd);
+         download->file_fd = -1;
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* A range starting at the end is empty; one starting past it is an error */
+     if (request->offset > (uint64_t)download->st.st_size) {
+         log_warn("Range of %s starts at %llu, past its %lld bytes", target_path,
+                  (unsigned long long)request->offset, (long long)download->st.st_size);
+         close(download->file_fd);
+         download->file_fd = -1;
+         return STATUS_FILE_ERROR;
+     }
+     download->offset = (off_t)request->offset;
+     download->length = download->st.st_size - download->offset;
+     if (request->length > 0 && request->length < (uint64_t)download->length) {
+         download->length = (off_t)request->length;
+     }
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Check a listing request and build its body */
+ int build_listing(const proto_request_t *request, session_t *session, char **listing, size_t *length,
+                   uint16_t *flags) {
+     const char *full_target_dir;
+     int status;
+     
+     status = authorize_listing(request, session, &full_target_dir);
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     /* Acknowledge a change query, so the client knows it is not a full listing */
+     *flags = request->flags & PROTO_FLAG_CHANGES;
+     return manifest_query(full_target_dir, request, listing, length);
+ }
+ 
+ /* Send the extent of an opened download */
+ static int send_download(int client_socket, const download_t *download) {
+     filecache_entry_t *entry;
+     off_t sent;
+     int result;
+     
+     if (download->length == 0) {
+         return 0;
+     }
+     
+     /* A hot file goes out of the shared mapping */
+     entry = filecache_get(download->file_fd, &download->st);
+     if (entry) {
+         result = send_all(client_socket, entry->data + download->offset, (size_t)download->length);
+         filecache_put(entry);
+         return result;
+     }
+     
+     /* Anything else straight from the page cache, or through a buffer where sendfile() is unsupported */
+     if (lseek(download->file_fd, download->offset, SEEK_SET) < 0) {
+         return -1;
+     }
+     sent = sendfile_all(client_socket, download->file_fd, download->length, NULL, NULL);
+     if (sent < 0 && (errno == EINVAL || errno == ENOSYS) &&
+         lseek(download->file_fd, 0, SEEK_CUR) == download->offset) {
+         sent = send_file_buffered(client_socket, download->file_fd, download->length,
+                                   netio_chunk_size(download->length), NULL, NULL, NULL);
+     }
+     return (sent == download->length) ? 0 : -1;
+ }
+ 
+ /* Answer a download or listing on a blocking socket */
+ int process_download(int client_socket, const proto_request_t *request, session_t *session, uint64_t *sent) {
+     download_t download;
+     uint16_t flags = 0;
+     char *listing;
+     size_t length;
+     int status, result;
+     
+     *sent = 0;
+     
+     /* Listings are built whole, so their length is known before READY */
+     if (request->opcode == PROTO_OP_LIST) {
+         status = build_listing(request, session, &listing, &length, &flags);
+         if (status != STATUS_SUCCESS) {
+             return status;
+         }
+         result = proto_send_response(client_socket, STATUS_READY, flags, length);
+         if (result == 0) {
+             result = send_all(client_socket, listing, length);
+         }
+         free(listing);
+     } else {
+         status = open_download(request, session, &download);
+         if (status != STATUS_SUCCESS) {
+             return status;
+         }
+         length = (size_t)download.length;
+         result = proto_send_response(client_socket, STATUS_READY, 0, length);
+         if (result == 0) {
+             result = send_download(client_socket, &download);
+         }
+         close(download.file_fd);
+     }
+     
+     /* The client counts body bytes, so a short body leaves the stream unusable */
+     if (result < 0) {
+         log_errno("send download");
+         session->stream_broken = 1;
+         return STATUS_FILE_ERROR;
+     }
+     
+     *sent = length;
+     return STATUS_SUCCESS;
+ }
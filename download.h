@@ -0,0 +1,42 @@
+/* download.h - Header file for downloads and directory listings
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the read side of the server including:
+ * - Opening the file a download names, after the same access check as an upload
+ * - Clamping the requested byte range to the file
+ * - Answering directory listings, lookups and change queries from the manifest
+ * - Serving both on a blocking socket
+ */
+
+ #ifndef DOWNLOAD_H
+ #define DOWNLOAD_H
+ 
+ #include "server.h"
+ #include "filecache.h"
+ 
+ /* A download that passed its checks: the open file and the extent of it to send */
+ typedef struct {
+     int file_fd;
+     struct stat st;
+     off_t offset;
+     off_t length;
+ } download_t;
+ 
+ /* Function prototypes */
+ 
+ /* Check a download request and open its file. Returns a status code; on success the
+  * caller closes download->file_fd. */
+ int open_download(const proto_request_t *request, session_t *session, download_t *download);
+ 
+ /* Check a listing request and build its body from the directory's manifest: one
+  * proto_entry_t and name for every file, the named file or the changes asked for. Returns
+  * a status code; on success the caller frees *listing and echoes *flags in READY. */
+ int build_listing(const proto_request_t *request, session_t *session, char **listing, size_t *length,
+                   uint16_t *flags);
+ 
+ /* Answer a download or listing on a blocking socket with READY and the body, from the
+  * file cache or with sendfile(). Returns a status code for the caller to send, with
+  * *sent set to the body bytes; a body cut short marks the session's stream broken. */
+ int process_download(int client_socket, const proto_request_t *request, session_t *session, uint64_t *sent);
+ 
+ #endif /* DOWNLOAD_H */
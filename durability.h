@@ -0,0 +1,73 @@
+/* durability.h - Header file for upload durability policies
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for flushing uploads to stable storage:
+ * - The selectable durability modes (none, fdatasync, group commit)
+ * - Group commit, where one syncfs() covers every upload on the same filesystem waiting on it
+ * - Batches spanning several filesystems, synced once per filesystem
+ * - Function prototypes used before and after an upload is published
+ */
+
+ #ifndef DURABILITY_H
+ #define DURABILITY_H
+ 
+ #include "server.h"
+ 
+ /* How uploads are flushed before the client is told they succeeded */
+ typedef enum {
+     DURABILITY_NONE,        /* Leave write-back to the kernel */
+     DURABILITY_FDATASYNC,   /* fdatasync() each file and fsync() its directory; threaded and pool
+                              * modes only, the event loops fall back to group commit */
+     DURABILITY_GROUP        /* Batch concurrent uploads behind shared syncfs() calls */
+ } durability_mode_t;
+ 
+ /* Filesystems one batch of uploads may span: one per configured directory */
+ #define DURABILITY_MAX_FILESYSTEMS CONFIG_MAX_DIRS
+ 
+ /* Group commit state of one filesystem, shared by all transfer threads */
+ typedef struct group_commit {
+     dev_t dev;
+     pthread_mutex_t lock;
+     pthread_cond_t done;
+     unsigned long requested;    /* Tickets handed out to waiting uploads */
+     unsigned long completed;    /* Highest ticket covered by a finished sync */
+     int syncing;                /* A leader is inside syncfs() */
+     struct group_commit *next;
+ } group_commit_t;
+ 
+ /* Filesystems an event loop has synced during one pass over its batch, and the results */
+ typedef struct {
+     dev_t dev[DURABILITY_MAX_FILESYSTEMS];
+     int result[DURABILITY_MAX_FILESYSTEMS];
+     int count;
+ } durability_batch_t;
+ 
+ /* Selected durability mode */
+ extern durability_mode_t durability_mode;
+ 
+ /* Function prototypes */
+ 
+ /* Parse a mode name. Returns 0, or -1 if the name is unknown. */
+ int durability_parse(const char *name, durability_mode_t *mode);
+ 
+ /* Name of a mode for log messages */
+ const char *durability_name(durability_mode_t mode);
+ 
+ /* Flush a staged file's data before it is published. Returns 0 or -1. */
+ int durability_sync_file(int file_fd);
+ 
+ /* Flush the directory entry of a published file. Returns 0 or -1. */
+ int durability_sync_dir(const char *target_path);
+ 
+ /* Wait until a syncfs() of fd's filesystem that started after this call has completed.
+  * Returns 0 or -1. */
+ int durability_group_commit(int fd);
+ 
+ /* Start a pass over a batch of uploads */
+ void durability_batch_init(durability_batch_t *batch);
+ 
+ /* Group commit fd's filesystem unless this pass already did; returns that sync's result,
+  * 0 or -1 */
+ int durability_batch_sync(durability_batch_t *batch, int fd);
+ 
+ #endif /* DURABILITY_H */
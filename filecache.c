@@ -0,0 +1,209 @@
+/* filecache.c - Implementation of the download file cache
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the mappings downloads are sent from:
+ * - One shared mapping per hot file, so repeated downloads cost no reads and no extra copies
+ * - Revalidation on every lookup, so a replaced or modified file is never served stale
+ * - Eviction from the cold end whenever the configured size is exceeded, deferred for
+ *   mappings still being sent from
+ * - Only the blocking cores send from these mappings; the event loops send from the descriptor,
+ *   so neither a page fault nor a file truncated under the mapping can stall or kill a loop
+ */
+
+ #include "filecache.h"
+ #include <sys/mman.h>
+ 
+ static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+ static filecache_entry_t *buckets[FILECACHE_BUCKETS];
+ static filecache_entry_t *lru_head;     /* Most recently used */
+ static filecache_entry_t *lru_tail;
+ static uint64_t cached_bytes;
+ static uint64_t hits_total;
+ static uint64_t misses_total;
+ 
+ /* Hash bucket of an inode */
+ static filecache_entry_t **bucket_of(dev_t dev, ino_t ino) {
+     return &buckets[((uint64_t)ino * 0x9E3779B97F4A7C15ULL ^ (uint64_t)dev) % FILECACHE_BUCKETS];
+ }
+ 
+ /* Map a whole file read-only */
+ static filecache_entry_t *map_file(int file_fd, const struct stat *st) {
+     filecache_entry_t *entry;
+     
+     entry = calloc(1, sizeof(*entry));
+     if (!entry) {
+         return NULL;
+     }
+     
+     entry->data = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+     if (entry->data == MAP_FAILED) {
+         log_errno("mmap");
+         free(entry);
+         return NULL;
+     }
+     
+     /* Downloads read front to back, so read ahead aggressively */
+     madvise(entry->data, (size_t)st->st_size, MADV_SEQUENTIAL);
+     
+     entry->dev = st->st_dev;
+     entry->ino = st->st_ino;
+     entry->size = st->st_size;
+     entry->mtime = st->st_mtim;
+     entry->refs = 1;
+     return entry;
+ }
+ 
+ /* Unmap an entry nobody is sending from */
+ static void unmap_entry(filecache_entry_t *entry) {
+     munmap(entry->data, (size_t)entry->size);
+     free(entry);
+ }
+ 
+ /* Take an entry out of the lists; it is unmapped now if idle, or by its last borrower */
+ static void evict(filecache_entry_t *entry) {
+     filecache_entry_t **link = bucket_of(entry->dev, entry->ino);
+     
+     while (*link != entry) {
+         link = &(*link)->next_hash;
+     }
+     *link = entry->next_hash;
+     
+     if (entry->lru_prev) {
+         entry->lru_prev->lru_next = entry->lru_next;
+     } else {
+         lru_head = entry->lru_next;
+     }
+     if (entry->lru_next) {
+         entry->lru_next->lru_prev = entry->lru_prev;
+     } else {
+         lru_tail = entry->lru_prev;
+     }
+     
+     cached_bytes -= (uint64_t)entry->size;
+     entry->cached = 0;
+     if (entry->refs == 0) {
+         unmap_entry(entry);
+     }
+ }
+ 
+ /* Make entry the most recently used */
+ static void touch(filecache_entry_t *entry) {
+     if (entry == lru_head) {
+         return;
+     }
+     
+     /* Unlink (it is not the head, so it has a predecessor) */
+     entry->lru_prev->lru_next = entry->lru_next;
+     if (entry->lru_next) {
+         entry->lru_next->lru_prev = entry->lru_prev;
+     } else {
+         lru_tail = entry->lru_prev;
+     }
+     
+     entry->lru_prev = NULL;
+     entry->lru_next = lru_head;
+     lru_head->lru_prev = entry;
+     lru_head = entry;
+ }
+ 
+ /* Find, revalidate or add the entry for a file */
+ static filecache_entry_t *lookup(int file_fd, const struct stat *st) {
+     const config_t *config = config_current();
+     filecache_entry_t **bucket, *entry;
+     
+     if (st->st_size <= 0) {
+         return NULL;
+     }
+     
+     pthread_mutex_lock(&cache_lock);
+     
+     /* A file modified in place, or a new file reusing the inode, drops the old mapping */
+     bucket = bucket_of(st->st_dev, st->st_ino);
+     for (entry = *bucket; entry; entry = entry->next_hash) {
+         if (entry->dev == st->st_dev && entry->ino == st->st_ino) {
+             break;
+         }
+     }
+     if (entry && (entry->size != st->st_size || entry->mtime.tv_sec != st->st_mtim.tv_sec ||
+                   entry->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+         evict(entry);
+         entry = NULL;
+     }
+     if (entry) {
+         hits_total++;
+         entry->refs++;
+         touch(entry);
+         pthread_mutex_unlock(&cache_lock);
+         return entry;
+     }
+     misses_total++;
+     
+     /* Too large for the cache: the caller sends it from the descriptor */
+     if ((uint64_t)st->st_size > config->cache_max_file || (uint64_t)st->st_size > config->cache_size) {
+         pthread_mutex_unlock(&cache_lock);
+         return NULL;
+     }
+     
+     /* Make room from the cold end; the bound may also have shrunk since the last miss */
+     while (lru_tail && cached_bytes + (uint64_t)st->st_size > config->cache_size) {
+         evict(lru_tail);
+     }
+     
+     entry = map_file(file_fd, st);
+     if (entry) {
+         entry->cached = 1;
+         entry->next_hash = *bucket;
+         *bucket = entry;
+         entry->lru_next = lru_head;
+         if (lru_head) {
+             lru_head->lru_prev = entry;
+         } else {
+             lru_tail = entry;
+         }
+         lru_head = entry;
+         cached_bytes += (uint64_t)entry->size;
+     }
+     
+     pthread_mutex_unlock(&cache_lock);
+     return entry;
+ }
+ 
+ /* Borrow the cached mapping of a file, caching it if it fits */
+ filecache_entry_t *filecache_get(int file_fd, const struct stat *st) {
+     return lookup(file_fd, st);
+ }
+ 
+ /* Return a borrowed mapping */
+ void filecache_put(filecache_entry_t *entry) {
+     int idle;
+     
+     if (!entry) {
+         return;
+     }
+     
+     pthread_mutex_lock(&cache_lock);
+     idle = (--entry->refs == 0 && !entry->cached);
+     pthread_mutex_unlock(&cache_lock);
+     
+     if (idle) {
+         unmap_entry(entry);
+     }
+ }
+ 
+ /* Cache effectiveness so far */
+ void filecache_counts(uint64_t *hits, uint64_t *misses, uint64_t *bytes) {
+     pthread_mutex_lock(&cache_lock);
+     *hits = hits_total;
+     *misses = misses_total;
+     *bytes = cached_bytes;
+     pthread_mutex_unlock(&cache_lock);
+ }
+ 
+ /* Unmap every cached file */
+ void filecache_destroy(void) {
+     pthread_mutex_lock(&cache_lock);
+     while (lru_tail) {
+         evict(lru_tail);
+     }
+     pthread_mutex_unlock(&cache_lock);
+ }
@@ -0,0 +1,51 @@
+/* filecache.h - Header file for the download file cache
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for serving downloads from memory including:
+ * - Read-only mappings of hot files, shared by every blocking connection sending them
+ * - Entries keyed by device and inode and revalidated against size and modification time
+ * - A least-recently-used bound on the mapped bytes, taken from the current configuration
+ * - Function prototypes for borrowing and returning mappings
+ */
+
+ #ifndef FILECACHE_H
+ #define FILECACHE_H
+ 
+ #include "server.h"
+ #include <time.h>
+ 
+ /* Hash buckets for looking entries up by inode */
+ #define FILECACHE_BUCKETS 256
+ 
+ /* One mapped file. Published files are replaced by renaming a new inode over them, never
+  * rewritten in place, so a mapping stays valid for as long as it is borrowed. */
+ typedef struct filecache_entry {
+     dev_t dev;
+     ino_t ino;
+     off_t size;
+     struct timespec mtime;
+     char *data;                         /* The whole file */
+     int refs;                           /* Borrowers still sending from data */
+     int cached;                         /* Listed in the cache; 0 once evicted */
+     struct filecache_entry *next_hash;
+     struct filecache_entry *lru_prev;   /* Towards the most recently used */
+     struct filecache_entry *lru_next;
+ } filecache_entry_t;
+ 
+ /* Function prototypes */
+ 
+ /* Borrow the cached mapping of the non-empty file open on file_fd, whose status is st,
+  * mapping and caching it first if it fits the configured bounds. Returns NULL if it
+  * does not fit or cannot be mapped. */
+ filecache_entry_t *filecache_get(int file_fd, const struct stat *st);
+ 
+ /* Return a borrowed mapping; one no longer cached is unmapped by its last borrower */
+ void filecache_put(filecache_entry_t *entry);
+ 
+ /* Lookups answered from the cache, lookups that were not, and bytes mapped by the cache */
+ void filecache_counts(uint64_t *hits, uint64_t *misses, uint64_t *bytes);
+ 
+ /* Unmap every cached file; call once nothing is borrowed */
+ void filecache_destroy(void);
+ 
+ #endif /* FILECACHE_H */
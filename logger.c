@@ -0,0 +1,498 @@
+/* logger.c - Implementation of the asynchronous server log
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the logger:
+ * - A ring per thread, attached on first use and recycled when the thread exits
+ * - Lock-free queueing that drops records when a ring is full instead of waiting
+ * - A background thread that formats records as key=value lines and writes them out
+ * - Size-based rotation, reopening on request and runtime level changes
+ */
+
+ #include "logger.h"
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <stdarg.h>
+ #include <errno.h>
+ #include <pthread.h>
+ #include <time.h>
+ 
+ /* Level names, in enum order */
+ static const char *level_names[] = {"debug", "info", "warn", "error"};
+ 
+ /* Current threshold; records below it are discarded before they are formatted */
+ int log_level = LOG_LEVEL_INFO;
+ 
+ /* Registry of rings; the lock is only taken when a thread attaches or exits */
+ static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+ static log_ring_t *all_rings;
+ static log_ring_t *free_rings;
+ static pthread_key_t ring_key;
+ static __thread log_ring_t *local_ring;
+ 
+ /* Log thread state */
+ static pthread_t log_thread;
+ static int running;
+ static int stopping;
+ static int reopen_requested;
+ static FILE *log_file;
+ static char log_path[4096];
+ static uint64_t rotate_limit;
+ static uint64_t file_bytes;
+ 
+ /* Idle time between passes over the rings */
+ #define LOGGER_IDLE_NS 10000000L
+ 
+ /* Hand an exiting thread's ring to the next thread that needs one; queued records still drain */
+ static void release_ring(void *arg) {
+     log_ring_t *ring = (log_ring_t *)arg;
+ 
+     pthread_mutex_lock(&registry_lock);
+     ring->next_free = free_rings;
+     free_rings = ring;
+     pthread_mutex_unlock(&registry_lock);
+ }
+ 
+ /* This thread's ring, attached on first use; NULL only if allocation failed */
+ static log_ring_t *get_ring(void) {
+     log_ring_t *ring = local_ring;
+ 
+     if (ring) {
+         return ring;
+     }
+ 
+     pthread_mutex_lock(&registry_lock);
+     if (free_rings) {
+         ring = free_rings;
+         free_rings = ring->next_free;
+     } else {
+         ring = calloc(1, sizeof(log_ring_t));
+         if (ring) {
+             ring->next = all_rings;
+             __atomic_store_n(&all_rings, ring, __ATOMIC_RELEASE);
+         }
+     }
+     pthread_mutex_unlock(&registry_lock);
+ 
+     if (ring) {
+         pthread_setspecific(ring_key, ring);
+         local_ring = ring;
+     }
+     return ring;
+ }
+ 
+ /* Claim the next free record of this thread's ring, or NULL (counted as dropped) if it is full */
+ static log_record_t *begin_record(log_level_t level, log_record_kind_t kind) {
+     log_ring_t *ring = get_ring();
+     log_record_t *record;
+     struct timespec ts;
+     uint64_t head;
+ 
+     if (!ring) {
+         return NULL;
+     }
+ 
+     head = ring->head;
+     if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOGGER_RING_RECORDS) {
+         __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+         return NULL;
+     }
+ 
+     record = &ring->records[head % LOGGER_RING_RECORDS];
+     clock_gettime(CLOCK_REALTIME, &ts);
+     record->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+     record->level = (uint8_t)level;
+     record->kind = (uint8_t)kind;
+     return record;
+ }
+ 
+ /* Publish the record claimed by begin_record() to the log thread */
+ static void commit_record(void) {
+     log_ring_t *ring = local_ring;
+ 
+     __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+ }
+ 
+ /* Write a value in double quotes, escaping what would break the line apart */
+ static void write_quoted(FILE *out, const char *value) {
+     fputc('"', out);
+     for (; *value; value++) {
+         if (*value == '"' || *value == '\\') {
+             fputc('\\', out);
+             fputc(*value, out);
+         } else if (*value == '\n') {
+             fputs("\\n", out);
+         } else {
+             fputc(*value, out);
+         }
+     }
+     fputc('"', out);
+ }
+ 
+ /* Format one record as a key=value line */
+ static void write_record(FILE *out, const log_record_t *record) {
+     static const char *op_names[] = {"open", "put", "session", "range", "commit", "get", "list"};
+     char timestamp[32];
+     struct tm tm;
+     time_t seconds = (time_t)(record->timestamp_ns / 1000000000ULL);
+ 
+     gmtime_r(&seconds, &tm);
+     strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+     fprintf(out, "ts=%s.%06lluZ level=%s", timestamp,
+             (unsigned long long)(record->timestamp_ns % 1000000000ULL / 1000), level_names[record->level]);
+ 
+     if (record->kind == LOG_RECORD_TRANSFER) {
+         fprintf(out, " event=transfer client=%d op=%s user=", record->client_id,
+                 record->opcode <= PROTO_OP_LIST ? op_names[record->opcode] : "?");
+         write_quoted(out, record->username);
+         fputs(" dir=", out);
+         write_quoted(out, record->target_dir);
+         fputs(" file=", out);
+         write_quoted(out, record->filename);
+         fprintf(out, " bytes=%llu duration_us=%llu status=%d\n", (unsigned long long)record->bytes,
+                 (unsigned long long)(record->duration_ns / 1000), record->status);
+     } else {
+         fputs(" msg=", out);
+         write_quoted(out, record->message);
+         fputc('\n', out);
+     }
+ }
+ 
+ /* Open (or reopen) the log file for appending */
+ static int open_log_file(void) {
+     FILE *file;
+     long size;
+ 
+     file = fopen(log_path, "a");
+     if (!file) {
+         fprintf(stderr, "Cannot open log file %s: %s\n", log_path, strerror(errno));
+         return -1;
+     }
+ 
+     /* Appending to an existing file counts towards its rotation */
+     fseek(file, 0, SEEK_END);
+     size = ftell(file);
+     file_bytes = (size > 0) ? (uint64_t)size : 0;
+     if (log_file && log_file != stdout) {
+         fclose(log_file);
+     }
+     log_file = file;
+     return 0;
+ }
+ 
+ /* Shift path.1 .. path.N up by one, move the current file to path.1 and start a new one */
+ static void rotate_log_file(void) {
+     char from[sizeof(log_path) + 16], to[sizeof(log_path) + 16];
+     int i;
+ 
+     fclose(log_file);
+     log_file = NULL;
+ 
+     for (i = LOGGER_KEEP_FILES - 1; i >= 1; i--) {
+         snprintf(from, sizeof(from), "%s.%d", log_path, i);
+         snprintf(to, sizeof(to), "%s.%d", log_path, i + 1);
+         rename(from, to);
+     }
+     snprintf(to, sizeof(to), "%s.1", log_path);
+     rename(log_path, to);
+ 
+     /* With nowhere to write, fall back to standard output rather than lose everything */
+     if (open_log_file() < 0) {
+         log_file = stdout;
+     }
+ }
+ 
+ /* Write a line the log thread produces itself, outside any ring */
+ static void write_notice(log_level_t level, const char *message) {
+     log_record_t record;
+     struct timespec ts;
+ 
+     memset(&record, 0, sizeof(record));
+     clock_gettime(CLOCK_REALTIME, &ts);
+     record.timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+     record.level = (uint8_t)level;
+     record.kind = LOG_RECORD_MESSAGE;
+     snprintf(record.message, sizeof(record.message), "%s", message);
+     write_record(log_file, &record);
+ }
+ 
+ /* Write out everything queued in every ring, oldest first across threads.
+  * Returns the number of records written. */
+ static int drain_rings(void) {
+     log_ring_t *rings = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE);
+     log_ring_t *ring, *oldest;
+     const log_record_t *record;
+     long position;
+     int written = 0;
+ 
+     /* Only records queued before this pass take part, so a busy thread cannot stall it */
+     for (ring = rings; ring; ring = ring->next) {
+         ring->drain_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+     }
+ 
+     /* Merge the rings by timestamp; each one is already in order */
+     while (1) {
+         oldest = NULL;
+         for (ring = rings; ring; ring = ring->next) {
+             if (ring->tail != ring->drain_head &&
+                 (!oldest || ring->records[ring->tail % LOGGER_RING_RECORDS].timestamp_ns <
+                             oldest->records[oldest->tail % LOGGER_RING_RECORDS].timestamp_ns)) {
+                 oldest = ring;
+             }
+         }
+         if (!oldest) {
+             break;
+         }
+ 
+         record = &oldest->records[oldest->tail % LOGGER_RING_RECORDS];
+         write_record(log_file, record);
+         written++;
+ 
+         /* A slot is only handed back once its contents were written */
+         __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+     }
+ 
+     if (written > 0) {
+         fflush(log_file);
+         if (log_file != stdout) {
+             position = ftell(log_file);
+             file_bytes = (position > 0) ? (uint64_t)position : file_bytes;
+         }
+     }
+     return written;
+ }
+ 
+ /* Log thread: drain the rings, then rotate, reopen and report as needed */
+ static void *log_main(void *arg) {
+     struct timespec idle = {0, LOGGER_IDLE_NS};
+     uint64_t dropped, reported_dropped = 0;
+     int level, reported_level = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+     char notice[LOGGER_MESSAGE_LENGTH];
+ 
+     (void)arg;
+ 
+     while (1) {
+         /* Signal handlers can only change the level; announce it from here,
+          * ahead of the records that follow the change */
+         level = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+         if (level != reported_level) {
+             snprintf(notice, sizeof(notice), "Log level changed to %s", level_names[level]);
+             write_notice(LOG_LEVEL_WARN, notice);
+             reported_level = level;
+         }
+ 
+         if (drain_rings() == 0) {
+             if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                 break;
+             }
+             nanosleep(&idle, NULL);
+         }
+ 
+         /* Drops are reported in totals, once the rings have room again */
+         dropped = logger_dropped();
+         if (dropped != reported_dropped) {
+             snprintf(notice, sizeof(notice), "Dropped %llu log records because a thread's queue was full",
+                      (unsigned long long)(dropped - reported_dropped));
+             write_notice(LOG_LEVEL_WARN, notice);
+             reported_dropped = dropped;
+         }
+ 
+         if (log_path[0]) {
+             if (__atomic_exchange_n(&reopen_requested, 0, __ATOMIC_ACQ_REL)) {
+                 open_log_file();
+             } else if (rotate_limit > 0 && file_bytes >= rotate_limit && log_file != stdout) {
+                 rotate_log_file();
+             }
+         }
+         fflush(log_file);
+     }
+ 
+     return NULL;
+ }
+ 
+ /* Start the log thread writing to path, or to standard output if path is NULL */
+ int logger_start(const char *path, uint64_t rotate_bytes, log_level_t level) {
+     __atomic_store_n(&log_level, (int)level, __ATOMIC_RELAXED);
+     pthread_key_create(&ring_key, release_ring);
+ 
+     if (path) {
+         if (strlen(path) >= sizeof(log_path)) {
+             fprintf(stderr, "Log file path too long: %s\n", path);
+             return -1;
+         }
+         strcpy(log_path, path);
+         rotate_limit = rotate_bytes;
+         if (open_log_file() < 0) {
+             log_path[0] = '\0';
+             return -1;
+         }
+     } else {
+         log_file = stdout;
+     }
+ 
+     if (pthread_create(&log_thread, NULL, log_main, NULL) != 0) {
+         perror("pthread_create logger");
+         return -1;
+     }
+     __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+ 
+     return 0;
+ }
+ 
+ /* Write out every queued record and stop the log thread */
+ void logger_stop(void) {
+     if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+         return;
+     }
+ 
+     __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+     pthread_join(log_thread, NULL);
+     __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+ 
+     if (log_file && log_file != stdout) {
+         fclose(log_file);
+     }
+     log_file = NULL;
+ }
+ 
+ /* Parse a level name */
+ int logger_parse_level(const char *name) {
+     int level;
+ 
+     for (level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR; level++) {
+         if (strcmp(name, level_names[level]) == 0) {
+             return level;
+         }
+     }
+     return -1;
+ }
+ 
+ /* Make logging one step more or less verbose */
+ void logger_adjust_level(int delta) {
+     int level = __atomic_load_n(&log_level, __ATOMIC_RELAXED) + delta;
+ 
+     if (level >= LOG_LEVEL_DEBUG && level <= LOG_LEVEL_ERROR) {
+         __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+     }
+ }
+ 
+ /* Reopen the log file before the next write */
+ void logger_reopen(void) {
+     __atomic_store_n(&reopen_requested, 1, __ATOMIC_RELEASE);
+ }
+ 
+ /* Records dropped so far because a ring was full */
+ uint64_t logger_dropped(void) {
+     log_ring_t *ring;
+     uint64_t total = 0;
+ 
+     for (ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+         total += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+     }
+     return total;
+ }
+ 
+ /* Format a message into a record; before the log thread starts, write it straight out */
+ static void log_vmessage(log_level_t level, const char *format, va_list args) {
+     log_record_t *record, direct;
+     size_t length;
+     int queued = __atomic_load_n(&running, __ATOMIC_ACQUIRE);
+ 
+     if (queued) {
+         record = begin_record(level, LOG_RECORD_MESSAGE);
+         if (!record) {
+             return;
+         }
+     } else {
+         struct timespec ts;
+ 
+         record = &direct;
+         clock_gettime(CLOCK_REALTIME, &ts);
+         record->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+         record->level = (uint8_t)level;
+         record->kind = LOG_RECORD_MESSAGE;
+     }
+ 
+     vsnprintf(record->message, sizeof(record->message), format, args);
+ 
+     /* Lines are terminated by the writer */
+     length = strlen(record->message);
+     if (length > 0 && record->message[length - 1] == '\n') {
+         record->message[length - 1] = '\0';
+     }
+ 
+     if (queued) {
+         commit_record();
+     } else {
+         write_record(level >= LOG_LEVEL_WARN ? stderr : stdout, record);
+     }
+ }
+ 
+ /* Queue a formatted message */
+ void log_message(log_level_t level, const char *format, ...) {
+     va_list args;
+ 
+     if ((int)level < __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+         return;
+     }
+ 
+     va_start(args, format);
+     log_vmessage(level, format, args);
+     va_end(args);
+ }
+ 
+ /* Queue "what: <description of errno>" as an error */
+ void log_errno(const char *what) {
+     char buffer[128];
+     int saved_errno = errno;
+ 
+     if (LOG_LEVEL_ERROR < __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+         return;
+     }
+ 
+     log_message(LOG_LEVEL_ERROR, "%s: %s", what, strerror_r(saved_errno, buffer, sizeof(buffer)));
+     errno = saved_errno;
+ }
+ 
+ /* Queue a structured record for a finished upload, range or commit */
+ void log_transfer(int client_id, const proto_request_t *request, uint64_t bytes, uint64_t start_ns,
+                   int status) {
+     log_level_t level = (status == STATUS_SUCCESS) ? LOG_LEVEL_INFO : LOG_LEVEL_WARN;
+     log_record_t *record;
+     struct timespec ts;
+     uint64_t now;
+ 
+     if ((request->opcode != PROTO_OP_PUT && request->opcode != PROTO_OP_RANGE &&
+          request->opcode != PROTO_OP_COMMIT && request->opcode != PROTO_OP_GET &&
+          request->opcode != PROTO_OP_LIST) || request->username_len == 0) {
+         return;
+     }
+     if ((int)level < __atomic_load_n(&log_level, __ATOMIC_RELAXED) ||
+         !__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+         return;
+     }
+ 
+     record = begin_record(level, LOG_RECORD_TRANSFER);
+     if (!record) {
+         return;
+     }
+ 
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+     record->client_id = client_id;
+     record->status = status;
+ 
+     /* Opening a parallel upload moves no data; its reply carries the token instead */
+     if (request->opcode == PROTO_OP_PUT && (request->flags & PROTO_FLAG_PARALLEL)) {
+         record->opcode = 0;
+         record->bytes = 0;
+     } else {
+         record->opcode = request->opcode;
+         record->bytes = bytes;
+     }
+     record->duration_ns = (start_ns && now > start_ns) ? now - start_ns : 0;
+     memcpy(record->username, request->username, sizeof(record->username));
+     memcpy(record->target_dir, request->target_dir, sizeof(record->target_dir));
+     memcpy(record->filename, request->filename, sizeof(record->filename));
+     commit_record();
+ }
@@ -0,0 +1,109 @@
+/* logger.h - Header file for the asynchronous server log
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the logger including:
+ * - Log levels, adjustable while the server runs
+ * - Fixed-size records queued in per-thread rings that never block the caller
+ * - Structured transfer records (client, user, directory, file, bytes, duration, status)
+ * - Function prototypes for starting, logging, rotating and stopping
+ */
+
+ #ifndef LOGGER_H
+ #define LOGGER_H
+ 
+ #include "protocol.h"
+ #include <stdint.h>
+ 
+ /* Records a thread can queue before further ones are dropped */
+ #define LOGGER_RING_RECORDS 512
+ 
+ /* Longest formatted message kept in a record */
+ #define LOGGER_MESSAGE_LENGTH 256
+ 
+ /* Rotate the log file past this size unless told otherwise, keeping this many old files */
+ #define LOGGER_DEFAULT_ROTATE_MB 64
+ #define LOGGER_KEEP_FILES 4
+ 
+ /* Severity, from the most to the least verbose */
+ typedef enum {
+     LOG_LEVEL_DEBUG,
+     LOG_LEVEL_INFO,
+     LOG_LEVEL_WARN,
+     LOG_LEVEL_ERROR
+ } log_level_t;
+ 
+ /* Kinds of record */
+ typedef enum {
+     LOG_RECORD_MESSAGE,         /* Free text */
+     LOG_RECORD_TRANSFER         /* One finished request, field by field */
+ } log_record_kind_t;
+ 
+ /* One queued log record */
+ typedef struct {
+     uint64_t timestamp_ns;      /* Wall-clock time the record was made */
+     uint8_t level;
+     uint8_t kind;
+     uint8_t opcode;             /* Transfer records only, from here on; 0 opens a parallel upload */
+     int client_id;
+     int status;
+     uint64_t bytes;
+     uint64_t duration_ns;
+     char username[PROTO_MAX_USERNAME + 1];
+     char target_dir[PROTO_MAX_TARGET_DIR + 1];
+     char filename[PROTO_MAX_FILENAME + 1];
+     char message[LOGGER_MESSAGE_LENGTH];
+ } log_record_t;
+ 
+ /* Single-producer ring owned by one thread at a time and drained by the log thread */
+ typedef struct log_ring {
+     log_record_t records[LOGGER_RING_RECORDS];
+     uint64_t head;              /* Next slot to fill; written by the owning thread */
+     uint64_t tail;              /* Next slot to drain; written by the log thread */
+     uint64_t drain_head;        /* Head seen at the start of the current drain pass */
+     uint64_t dropped;           /* Records discarded because the ring was full */
+     struct log_ring *next;      /* Every ring ever created, for the log thread */
+     struct log_ring *next_free; /* Rings of exited threads, for reuse */
+ } log_ring_t;
+ 
+ /* Current threshold; records below it are discarded before they are formatted */
+ extern int log_level;
+ 
+ /* Function prototypes */
+ 
+ /* Start the log thread writing to path, or to standard output if path is NULL.
+  * Files are rotated once they exceed rotate_bytes (0 disables rotation). Returns 0 or -1. */
+ int logger_start(const char *path, uint64_t rotate_bytes, log_level_t level);
+ 
+ /* Write out every queued record and stop the log thread */
+ void logger_stop(void);
+ 
+ /* Parse a level name ("debug", "info", "warn", "error"). Returns the level or -1. */
+ int logger_parse_level(const char *name);
+ 
+ /* Make logging one step more (-1) or less (+1) verbose; safe in a signal handler */
+ void logger_adjust_level(int delta);
+ 
+ /* Reopen the log file before the next write, for external rotation; safe in a signal handler */
+ void logger_reopen(void);
+ 
+ /* Records dropped so far because a ring was full */
+ uint64_t logger_dropped(void);
+ 
+ /* Queue a formatted message */
+ void log_message(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+ 
+ /* Queue "what: <description of errno>" as an error, like perror() */
+ void log_errno(const char *what);
+ 
+ /* Queue a structured record for a finished upload, range or commit that began at
+  * start_ns (monotonic, as from metrics_now(); 0 if unknown); other requests are ignored */
+ void log_transfer(int client_id, const proto_request_t *request, uint64_t bytes, uint64_t start_ns,
+                   int status);
+ 
+ /* Shorthands for each level */
+ #define log_debug(...) log_message(LOG_LEVEL_DEBUG, __VA_ARGS__)
+ #define log_info(...) log_message(LOG_LEVEL_INFO, __VA_ARGS__)
+ #define log_warn(...) log_message(LOG_LEVEL_WARN, __VA_ARGS__)
+ #define log_error(...) log_message(LOG_LEVEL_ERROR, __VA_ARGS__)
+ 
+ #endif /* LOGGER_H */
@@ -0,0 +1,29 @@
+/* lzblock.h - Header file for the LZ4-style block codec
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations shared by the server and client for:
+ * - Compressing one block with a greedy hash-chain-free LZ77 matcher
+ * - Bounds-checked decompression of untrusted blocks
+ */
+
+ #ifndef LZBLOCK_H
+ #define LZBLOCK_H
+ 
+ #include <stddef.h>
+ #include <sys/types.h>
+ 
+ /* Shortest match worth encoding and furthest back a match may point */
+ #define LZ_MIN_MATCH 4
+ #define LZ_MAX_OFFSET 65535
+ 
+ /* Function prototypes */
+ 
+ /* Compress length bytes of source into at most capacity bytes of dest.
+  * Returns the compressed size, or 0 if the result would not fit. */
+ size_t lz_compress(const void *source, size_t length, void *dest, size_t capacity);
+ 
+ /* Decompress a block into at most capacity bytes of dest.
+  * Returns the decompressed size, or -1 if the block is malformed. */
+ ssize_t lz_decompress(const void *source, size_t length, void *dest, size_t capacity);
+ 
+ #endif /* LZBLOCK_H */
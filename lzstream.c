@@ -0,0 +1,185 @@
+/* lzstream.c - Implementation of the compressed upload pipeline
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements compressed uploads for the client:
+ * - A compressor thread that reads, checksums and compresses each block
+ *   while the previous ones are still being sent
+ * - Slots handed over through a mutex and condition variable, so the
+ *   compressor blocks only when it is LZSTREAM_DEPTH blocks ahead
+ * - Falling back to stored blocks when the first block does not compress
+ */
+
+ #include "lzstream.h"
+ #include "lzblock.h"
+ #include "crc32c.h"
+ #include <errno.h>
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ 
+ /* Compressor thread: fill slots in order until the file is done or the sender gives up */
+ static void *compress_blocks(void *arg) {
+     lzstream_t *stream = (lzstream_t *)arg;
+     lzstream_slot_t *slot;
+     unsigned int tail = 0;
+     off_t offset = 0;
+     ssize_t bytes_read;
+     size_t length, packed;
+     int error = 0;
+     
+     while (offset < stream->length) {
+         /* Wait for the sender to free a slot */
+         pthread_mutex_lock(&stream->lock);
+         while (stream->filled == LZSTREAM_DEPTH && !stream->cancelled) {
+             pthread_cond_wait(&stream->changed, &stream->lock);
+         }
+         if (stream->cancelled) {
+             pthread_mutex_unlock(&stream->lock);
+             break;
+         }
+         pthread_mutex_unlock(&stream->lock);
+         
+         slot = &stream->slots[tail];
+         length = (stream->length - offset > PROTO_BLOCK_SIZE) ? PROTO_BLOCK_SIZE
+                                                                : (size_t)(stream->length - offset);
+         bytes_read = pread(stream->file_fd, slot->raw, length, offset);
+         if (bytes_read != (ssize_t)length) {
+             /* A file that shrank under us cannot fill the size already announced */
+             error = (bytes_read < 0) ? errno : EIO;
+             break;
+         }
+         
+         /* The trailer covers the file contents, so checksum before compressing */
+         if (stream->crc) {
+             *stream->crc = crc32c_update(*stream->crc, slot->raw, length);
+         }
+         
+         /* Compression must save enough to be worth it, otherwise the block is stored */
+         packed = 0;
+         if (!stream->bypass) {
+             packed = lz_compress(slot->raw, length, slot->packed, length - length / LZSTREAM_MIN_SAVING - 1);
+             if (offset == 0 && packed == 0) {
+                 /* Already-compressed data: stop spending cycles on it */
+                 stream->bypass = 1;
+             }
+         }
+         
+         proto_build_block(&slot->header, (uint32_t)length, (uint32_t)packed);
+         slot->payload = packed ? slot->packed : slot->raw;
+         slot->payload_length = packed ? packed : length;
+         slot->length = length;
+         offset += length;
+         tail = (tail + 1) % LZSTREAM_DEPTH;
+         
+         /* Hand the slot to the sender */
+         pthread_mutex_lock(&stream->lock);
+         stream->filled++;
+         pthread_cond_signal(&stream->changed);
+         pthread_mutex_unlock(&stream->lock);
+     }
+     
+     pthread_mutex_lock(&stream->lock);
+     stream->error = error;
+     stream->finished = 1;
+     pthread_cond_signal(&stream->changed);
+     pthread_mutex_unlock(&stream->lock);
+     
+     return NULL;
+ }
+ 
+ /* Send a file as compressed blocks */
+ off_t lzstream_send(int socket_fd, int file_fd, off_t length, uint32_t *crc, lzstream_stats_t *stats,
+                     netio_progress_fn progress, void *arg) {
+     lzstream_t stream;
+     lzstream_slot_t *slot;
+     pthread_t compressor;
+     char *buffers;
+     off_t sent = 0, wire = 0;
+     int i, result = 0;
+     
+     /* Each slot holds a raw block and room for its compressed form */
+     buffers = malloc((size_t)LZSTREAM_DEPTH * 2 * PROTO_BLOCK_SIZE);
+     if (!buffers) {
+         perror("malloc");
+         return -1;
+     }
+     
+     memset(&stream, 0, sizeof(stream));
+     for (i = 0; i < LZSTREAM_DEPTH; i++) {
+         stream.slots[i].raw = buffers + (size_t)i * 2 * PROTO_BLOCK_SIZE;
+         stream.slots[i].packed = stream.slots[i].raw + PROTO_BLOCK_SIZE;
+     }
+     stream.file_fd = file_fd;
+     stream.length = length;
+     stream.crc = crc;
+     pthread_mutex_init(&stream.lock, NULL);
+     pthread_cond_init(&stream.changed, NULL);
+     
+     /* Compression overlaps with the sends below instead of alternating with them */
+     result = pthread_create(&compressor, NULL, compress_blocks, &stream);
+     if (result != 0) {
+         errno = result;
+         perror("pthread_create");
+         pthread_cond_destroy(&stream.changed);
+         pthread_mutex_destroy(&stream.lock);
+         free(buffers);
+         return -1;
+     }
+     
+     while (1) {
+         /* Wait for the next compressed block, or the end of the file */
+         pthread_mutex_lock(&stream.lock);
+         while (stream.filled == 0 && !stream.finished) {
+             pthread_cond_wait(&stream.changed, &stream.lock);
+         }
+         if (stream.filled == 0) {
+             pthread_mutex_unlock(&stream.lock);
+             break;
+         }
+         pthread_mutex_unlock(&stream.lock);
+         
+         /* The slot stays ours until it is released below */
+         slot = &stream.slots[stream.head];
+         if (send_all(socket_fd, &slot->header, sizeof(slot->header)) < 0 ||
+             send_all(socket_fd, slot->payload, slot->payload_length) < 0) {
+             result = -1;
+             break;
+         }
+         sent += (off_t)slot->length;
+         wire += (off_t)(sizeof(slot->header) + slot->payload_length);
+         if (progress) {
+             progress(sent, arg);
+         }
+         
+         pthread_mutex_lock(&stream.lock);
+         stream.head = (stream.head + 1) % LZSTREAM_DEPTH;
+         stream.filled--;
+         pthread_cond_signal(&stream.changed);
+         pthread_mutex_unlock(&stream.lock);
+     }
+     
+     /* Stop the compressor if the socket failed first */
+     pthread_mutex_lock(&stream.lock);
+     stream.cancelled = 1;
+     pthread_cond_signal(&stream.changed);
+     pthread_mutex_unlock(&stream.lock);
+     pthread_join(compressor, NULL);
+     
+     if (result == 0 && stream.error) {
+         errno = stream.error;
+         result = -1;
+     }
+     
+     if (stats) {
+         stats->raw_bytes = sent;
+         stats->wire_bytes = wire;
+         stats->bypassed = stream.bypass;
+     }
+     
+     pthread_cond_destroy(&stream.changed);
+     pthread_mutex_destroy(&stream.lock);
+     free(buffers);
+     
+     return (result == 0) ? sent : -1;
+ }
@@ -0,0 +1,65 @@
+/* lzstream.h - Header file for the compressed upload pipeline
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for sending a file as compressed blocks:
+ * - A compressor thread that reads, checksums and compresses ahead of the sender
+ * - A bounded ring of block slots handed from that thread to the socket
+ * - Function prototypes for streaming a body and reporting its savings
+ */
+
+ #ifndef LZSTREAM_H
+ #define LZSTREAM_H
+ 
+ #include "netio.h"
+ #include "protocol.h"
+ #include <pthread.h>
+ 
+ /* Blocks the compressor may run ahead of the socket */
+ #define LZSTREAM_DEPTH 4
+ 
+ /* A block is sent compressed only if it shrinks by at least 1/LZSTREAM_MIN_SAVING;
+  * a first block that does not is taken to mean the file is already compressed */
+ #define LZSTREAM_MIN_SAVING 16
+ 
+ /* One block travelling from the compressor thread to the sender */
+ typedef struct {
+     proto_block_t header;       /* Network order, ready to send */
+     const char *payload;        /* raw or packed, whichever is sent */
+     size_t payload_length;
+     size_t length;              /* Uncompressed bytes in the block */
+     char *raw;
+     char *packed;
+ } lzstream_slot_t;
+ 
+ /* Pipeline state shared by the compressor thread and the sender */
+ typedef struct {
+     pthread_mutex_t lock;
+     pthread_cond_t changed;
+     lzstream_slot_t slots[LZSTREAM_DEPTH];
+     unsigned int head;          /* Next slot the sender takes */
+     unsigned int filled;        /* Slots compressed and waiting to be sent */
+     int finished;               /* Compressor has produced its last block */
+     int cancelled;              /* Sender stopped; the compressor must exit */
+     int error;                  /* errno of a failed read, or 0 */
+     int file_fd;
+     off_t length;
+     uint32_t *crc;              /* CRC32C of the uncompressed body, or NULL */
+     int bypass;                 /* First block did not compress: store the rest */
+ } lzstream_t;
+ 
+ /* What one compressed body cost on the wire */
+ typedef struct {
+     off_t raw_bytes;
+     off_t wire_bytes;           /* Block prefixes included */
+     int bypassed;
+ } lzstream_stats_t;
+ 
+ /* Function prototypes */
+ 
+ /* Send length bytes of a file from offset 0 as compressed blocks, folding the
+  * uncompressed bytes into *crc when crc is not NULL. Returns the uncompressed
+  * bytes sent, or -1 with errno set. stats may be NULL. */
+ off_t lzstream_send(int socket_fd, int file_fd, off_t length, uint32_t *crc, lzstream_stats_t *stats,
+                     netio_progress_fn progress, void *arg);
+ 
+ #endif /* LZSTREAM_H */
@@ -0,0 +1,102 @@
+/* manifest.h - Header file for the directory manifests
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the index of each target directory including:
+ * - One entry per visible file: name, size, owner, modification time and CRC32C, or a mark
+ *   that the checksum is not known yet
+ * - A sequence number per directory, advanced by every change, for "changed since" queries
+ * - The append-only log under each directory the index is rebuilt from at startup
+ * - Function prototypes for recording published uploads and answering listings
+ */
+
+ #ifndef MANIFEST_H
+ #define MANIFEST_H
+ 
+ #include "server.h"
+ 
+ /* The log is "<dir>/.manifest", rewritten through "<dir>/.manifest.tmp"; uploads may not
+  * use either name */
+ #define MANIFEST_LOG_NAME ".manifest"
+ #define MANIFEST_TEMP_SUFFIX ".tmp"
+ 
+ /* Identifies each record of a log */
+ #define MANIFEST_MAGIC 0x5353434Du  /* "SSCM" */
+ 
+ /* Record flags; a log written before there were any holds 0 or 1, which mean the same */
+ #define MANIFEST_REMOVED 0x0001
+ #define MANIFEST_CRC_UNKNOWN 0x0002     /* Published without a checksum; filled in at the next startup */
+ 
+ /* Stale records and changes tolerated beyond twice the live ones before compaction */
+ #define MANIFEST_COMPACT_SLACK 1024
+ 
+ /* One file a directory holds, or held until its removal was noticed */
+ typedef struct {
+     uint64_t sequence;          /* Change that last touched it */
+     uint64_t size;
+     int64_t mtime;
+     uint32_t owner;
+     uint32_t crc32c;            /* 0 while crc_unknown */
+     int crc_unknown;
+     int removed;                /* Kept so a list of changes can report it */
+     int seen;                   /* Found again while reconciling with the directory */
+     char name[];
+ } manifest_entry_t;
+ 
+ /* One change in sequence order; stale once its entry has changed again */
+ typedef struct {
+     uint64_t sequence;
+     manifest_entry_t *entry;
+ } manifest_change_t;
+ 
+ /* Record of one change in a log, in host byte order; name_len bytes of the name follow */
+ typedef struct __attribute__((packed)) {
+     uint32_t magic;
+     uint16_t flags;             /* MANIFEST_* */
+     uint16_t name_len;
+     uint64_t sequence;
+     uint64_t size;
+     int64_t mtime;
+     uint32_t owner;
+     uint32_t crc32c;
+ } manifest_record_t;
+ 
+ /* The index of one target directory. Entries sorted by name answer listings and lookups,
+  * changes sorted by sequence answer "changed since"; both by binary search. */
+ typedef struct manifest_dir {
+     char path[CONFIG_PATH_LENGTH];
+     pthread_rwlock_t lock;
+     manifest_entry_t **entries;
+     size_t count;
+     size_t capacity;
+     manifest_change_t *changes;
+     size_t change_count;
+     size_t change_capacity;
+     uint64_t sequence;          /* Last change recorded */
+     int log_fd;                 /* Appended to, or -1 if the log cannot be written */
+     size_t log_records;
+     struct manifest_dir *next;
+ } manifest_dir_t;
+ 
+ /* Function prototypes */
+ 
+ /* Load, reconcile and compact the index of each directory of config that has none yet,
+  * as at startup or after a reload added directories. Returns 0 or -1. */
+ int manifest_prepare(const config_t *config);
+ 
+ /* Whether filename is reserved for the log of a directory */
+ int manifest_reserved_name(const char *filename);
+ 
+ /* Record the file just published at target_path and still open on file_fd. crc is the
+  * CRC32C its upload kept as the body arrived, or NULL to record the checksum as unknown;
+  * the file is never read back here. */
+ void manifest_record(const char *target_path, int file_fd, const uint32_t *crc);
+ 
+ /* Build the body of a listing of the directory at path: every file in name order, the
+  * file the request names, or with PROTO_FLAG_CHANGES the changes after the sequence in
+  * its size field. Returns a status code; on success the caller frees *listing. */
+ int manifest_query(const char *path, const proto_request_t *request, char **listing, size_t *length);
+ 
+ /* Free every index and close the logs */
+ void manifest_destroy(void);
+ 
+ #endif /* MANIFEST_H */
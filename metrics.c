@@ -0,0 +1,506 @@
+/* metrics.c - Implementation of server metrics
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the metrics registry:
+ * - A shard per thread, attached on first use and recycled when the thread exits
+ * - Single-writer relaxed atomic updates, so recording never takes a lock
+ * - Scrapes that merge every shard into totals, histograms and quantiles
+ * - A Unix control socket answering raw or HTTP GET requests with Prometheus text
+ */
+
+ #include "metrics.h"
+ #include "netio.h"
+ #include "quota.h"
+ #include "filecache.h"
+ #include <poll.h>
+ #include <stddef.h>
+ #include <sys/un.h>
+ #include <time.h>
+ 
+ /* Phase labels, in enum order; directories are labelled by their configured names */
+ static const char *phase_names[METRICS_PHASE_COUNT] = {
+     "accept", "auth", "lock_wait", "receive", "chown", "publish"
+ };
+ 
+ /* Quantiles reported alongside each histogram */
+ static const double quantiles[] = {0.5, 0.99, 0.999};
+ 
+ /* Registry of shards; the lock is only taken when a thread attaches or exits */
+ static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+ static metrics_shard_t *all_shards;
+ static metrics_shard_t *free_shards;
+ static pthread_key_t shard_key;
+ static __thread metrics_shard_t *local_shard;
+ static uint64_t started_ns;
+ 
+ /* Control socket and the previous scrape, which only the metrics thread touches */
+ static char socket_path[108];
+ static uint64_t last_scrape_ns;
+ static uint64_t last_bytes[METRICS_DIRS];
+ 
+ /* Hand an exiting thread's shard to the next thread that needs one; its counts stay in the totals */
+ static void release_shard(void *arg) {
+     metrics_shard_t *shard = (metrics_shard_t *)arg;
+ 
+     pthread_mutex_lock(&registry_lock);
+     shard->next_free = free_shards;
+     free_shards = shard;
+     pthread_mutex_unlock(&registry_lock);
+ }
+ 
+ /* This thread's shard, attached on first use; NULL only if allocation failed */
+ static metrics_shard_t *get_shard(void) {
+     metrics_shard_t *shard = local_shard;
+ 
+     if (shard) {
+         return shard;
+     }
+ 
+     pthread_mutex_lock(&registry_lock);
+     if (free_shards) {
+         shard = free_shards;
+         free_shards = shard->next_free;
+     } else {
+         shard = calloc(1, sizeof(metrics_shard_t));
+         if (shard) {
+             shard->next = all_shards;
+             all_shards = shard;
+         }
+     }
+     pthread_mutex_unlock(&registry_lock);
+ 
+     if (shard) {
+         pthread_setspecific(shard_key, shard);
+         local_shard = shard;
+     }
+     return shard;
+ }
+ 
+ /* Add to a cell only this thread writes; scrapes may read it concurrently */
+ static inline void shard_add(uint64_t *cell, uint64_t value) {
+     __atomic_store_n(cell, __atomic_load_n(cell, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+ }
+ 
+ /* Bucket holding a duration: exact below 16 ns, then 16 buckets per power of two */
+ static int bucket_index(uint64_t ns) {
+     int shift;
+ 
+     if (ns < METRICS_SUB_BUCKETS) {
+         return (int)ns;
+     }
+ 
+     shift = 63 - __builtin_clzll(ns);
+     if (shift > METRICS_MAX_SHIFT) {
+         return METRICS_BUCKETS - 1;
+     }
+     return (shift - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS +
+            (int)((ns >> (shift - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1));
+ }
+ 
+ /* Largest duration that falls into a bucket */
+ static uint64_t bucket_upper(int index) {
+     int shift;
+ 
+     if (index < METRICS_SUB_BUCKETS) {
+         return (uint64_t)index;
+     }
+ 
+     shift = index / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+     return (((uint64_t)(METRICS_SUB_BUCKETS + index % METRICS_SUB_BUCKETS) + 1) <<
+             (shift - METRICS_SUB_BITS)) - 1;
+ }
+ 
+ /* Prepare the registry; call once before any thread records */
+ void metrics_init(void) {
+     pthread_key_create(&shard_key, release_shard);
+     started_ns = metrics_now();
+     last_scrape_ns = started_ns;
+ }
+ 
+ /* Current monotonic time in nanoseconds, for timing a phase */
+ uint64_t metrics_now(void) {
+     struct timespec ts;
+ 
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+ }
+ 
+ /* Record a phase that started at start_ns and ends now */
+ void metrics_observe(metrics_phase_t phase, uint64_t start_ns) {
+     metrics_shard_t *shard = get_shard();
+     metrics_histogram_t *histogram;
+     uint64_t now = metrics_now();
+     uint64_t ns = (now > start_ns) ? now - start_ns : 0;
+ 
+     if (!shard) {
+         return;
+     }
+ 
+     histogram = &shard->phases[phase];
+     shard_add(&histogram->buckets[bucket_index(ns)], 1);
+     shard_add(&histogram->count, 1);
+     shard_add(&histogram->sum_ns, ns);
+ }
+ 
+ /* Add to an event counter */
+ void metrics_count(metrics_counter_t counter) {
+     metrics_shard_t *shard = get_shard();
+ 
+     if (shard) {
+         shard_add(&shard->counters[counter], 1);
+     }
+ }
+ 
+ /* Index of a request's directory in the per-directory counters, or -1 if it names none */
+ static int metrics_dir(const proto_request_t *request) {
+     const config_dir_t *dir = config_find_dir(config_current(), request->target_dir);
+     const char *name = request->target_dir;
+ 
+     /* By name, which keeps its slot and counters across reloads, even ones that drop it */
+     if (dir) {
+         name = dir->name;
+     } else if (strncmp(name, "./", 2) == 0) {
+         name += 2;
+     }
+     return config_dir_slot(name);
+ }
+ 
+ /* Account for a finished request */
+ void metrics_record_request(const proto_request_t *request, uint64_t bytes, int status) {
+     metrics_shard_t *shard;
+     int dir = metrics_dir(request), upload, body;
+ 
+     if (dir < 0) {
+         return;
+     }
+ 
+     /* Reads are counted apart from uploads */
+     if (request->opcode == PROTO_OP_GET || request->opcode == PROTO_OP_LIST) {
+         shard = get_shard();
+         if (!shard) {
+             return;
+         }
+         shard_add(&shard->downloads[dir][status == STATUS_SUCCESS ? 0 : 1], 1);
+         if (status == STATUS_SUCCESS) {
+             shard_add(&shard->sent_bytes[dir], bytes);
+         }
+         return;
+     }
+ 
+     /* Opening a parallel upload moves no data; its ranges carry the bytes and its
+      * commit counts as the upload */
+     upload = (request->opcode == PROTO_OP_PUT && !(request->flags & PROTO_FLAG_PARALLEL)) ||
+              request->opcode == PROTO_OP_COMMIT;
+     body = (request->opcode == PROTO_OP_PUT && !(request->flags & PROTO_FLAG_PARALLEL)) ||
+            request->opcode == PROTO_OP_RANGE;
+     if (!upload && !body) {
+         return;
+     }
+ 
+     shard = get_shard();
+     if (!shard) {
+         return;
+     }
+     if (upload) {
+         shard_add(&shard->uploads[dir][status == STATUS_SUCCESS ? 0 : 1], 1);
+     }
+     if (body && status == STATUS_SUCCESS) {
+         shard_add(&shard->bytes[dir], bytes);
+     }
+ }
+ 
+ /* Account for an upload whose body was cloned from the content store */
+ void metrics_record_dedup(const proto_request_t *request) {
+     metrics_shard_t *shard;
+     int dir = metrics_dir(request);
+ 
+     if (dir < 0) {
+         return;
+     }
+ 
+     shard = get_shard();
+     if (!shard) {
+         return;
+     }
+     shard_add(&shard->dedup_hits[dir], 1);
+     shard_add(&shard->dedup_bytes[dir], request->size);
+ }
+ 
+ /* Sum one histogram over every shard */
+ static void merge_histogram(metrics_phase_t phase, metrics_histogram_t *total) {
+     metrics_shard_t *shard;
+     int i;
+ 
+     memset(total, 0, sizeof(*total));
+     for (shard = __atomic_load_n(&all_shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+         for (i = 0; i < METRICS_BUCKETS; i++) {
+             total->buckets[i] += __atomic_load_n(&shard->phases[phase].buckets[i], __ATOMIC_RELAXED);
+         }
+         total->count += __atomic_load_n(&shard->phases[phase].count, __ATOMIC_RELAXED);
+         total->sum_ns += __atomic_load_n(&shard->phases[phase].sum_ns, __ATOMIC_RELAXED);
+     }
+ }
+ 
+ /* Sum a per-shard cell over every shard, given its offset inside the shard */
+ static uint64_t merge_cell(size_t offset) {
+     metrics_shard_t *shard;
+     uint64_t total = 0;
+ 
+     for (shard = __atomic_load_n(&all_shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+         total += __atomic_load_n((uint64_t *)((char *)shard + offset), __ATOMIC_RELAXED);
+     }
+     return total;
+ }
+ 
+ /* Smallest bucket bound covering quantile q of a merged histogram, in seconds */
+ static double histogram_quantile(const metrics_histogram_t *histogram, double q) {
+     uint64_t rank, seen = 0;
+     int i;
+ 
+     if (histogram->count == 0) {
+         return 0.0;
+     }
+ 
+     rank = (uint64_t)(q * histogram->count + 0.999999);
+     if (rank < 1) {
+         rank = 1;
+     }
+     for (i = 0; i < METRICS_BUCKETS; i++) {
+         seen += histogram->buckets[i];
+         if (seen >= rank) {
+             break;
+         }
+     }
+     return bucket_upper(i < METRICS_BUCKETS ? i : METRICS_BUCKETS - 1) / 1e9;
+ }
+ 
+ /* Write every metric in the Prometheus text exposition format */
+ void metrics_render(FILE *out) {
+     metrics_histogram_t histogram;
+     uint64_t accepted, closed, bytes, now = metrics_now(), cumulative;
+     uint64_t rejected, throttled, cache_hits, cache_misses, cache_bytes;
+     double interval = (now - last_scrape_ns) / 1e9;
+     int phase, dir, dirs = config_dir_slots(), shift, i;
+     size_t q;
+ 
+     accepted = merge_cell(offsetof(metrics_shard_t, counters[METRICS_CONNECTIONS_ACCEPTED]));
+     closed = merge_cell(offsetof(metrics_shard_t, counters[METRICS_CONNECTIONS_CLOSED]));
+ 
+     fprintf(out, "# HELP transfer_uptime_seconds Seconds since the server started.\n");
+     fprintf(out, "# TYPE transfer_uptime_seconds gauge\n");
+     fprintf(out, "transfer_uptime_seconds %.3f\n", (now - started_ns) / 1e9);
+ 
+     fprintf(out, "# HELP transfer_connections_accepted_total Client connections accepted.\n");
+     fprintf(out, "# TYPE transfer_connections_accepted_total counter\n");
+     fprintf(out, "transfer_connections_accepted_total %llu\n", (unsigned long long)accepted);
+     fprintf(out, "# HELP transfer_connections_open Client connections currently open.\n");
+     fprintf(out, "# TYPE transfer_connections_open gauge\n");
+     fprintf(out, "transfer_connections_open %llu\n",
+             (unsigned long long)(accepted > closed ? accepted - closed : 0));
+ 
+     fprintf(out, "# HELP transfer_log_dropped_records_total Log records dropped because a queue was full.\n");
+     fprintf(out, "# TYPE transfer_log_dropped_records_total counter\n");
+     fprintf(out, "transfer_log_dropped_records_total %llu\n", (unsigned long long)logger_dropped());
+ 
+     quota_counts(&rejected, &throttled);
+     fprintf(out, "# HELP transfer_quota_rejected_total Transfers refused because a concurrency cap was reached.\n");
+     fprintf(out, "# TYPE transfer_quota_rejected_total counter\n");
+     fprintf(out, "transfer_quota_rejected_total %llu\n", (unsigned long long)rejected);
+     fprintf(out, "# HELP transfer_quota_throttled_total Reads deferred because a rate limit had no tokens.\n");
+     fprintf(out, "# TYPE transfer_quota_throttled_total counter\n");
+     fprintf(out, "transfer_quota_throttled_total %llu\n", (unsigned long long)throttled);
+     
+     fprintf(out, "# HELP transfer_uploads_total Uploads finished, by directory and result.\n");
+     fprintf(out, "# TYPE transfer_uploads_total counter\n");
+     for (dir = 0; dir < dirs; dir++) {
+         fprintf(out, "transfer_uploads_total{dir=\"%s\",result=\"ok\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, uploads[dir][0])));
+         fprintf(out, "transfer_uploads_total{dir=\"%s\",result=\"failed\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, uploads[dir][1])));
+     }
+ 
+     /* The rate covers the time since the previous scrape */
+     fprintf(out, "# HELP transfer_received_bytes_total Body bytes received, by directory.\n");
+     fprintf(out, "# TYPE transfer_received_bytes_total counter\n");
+     fprintf(out, "# HELP transfer_received_bytes_per_second Receive rate since the previous scrape.\n");
+     fprintf(out, "# TYPE transfer_received_bytes_per_second gauge\n");
+     for (dir = 0; dir < dirs; dir++) {
+         bytes = merge_cell(offsetof(metrics_shard_t, bytes[dir]));
+         fprintf(out, "transfer_received_bytes_total{dir=\"%s\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)bytes);
+         fprintf(out, "transfer_received_bytes_per_second{dir=\"%s\"} %.1f\n", config_dir_label(dir),
+                 interval > 0 ? (bytes - last_bytes[dir]) / interval : 0.0);
+         last_bytes[dir] = bytes;
+     }
+     last_scrape_ns = now;
+ 
+     fprintf(out, "# HELP transfer_dedup_hits_total Uploads cloned from the content store instead of received.\n");
+     fprintf(out, "# TYPE transfer_dedup_hits_total counter\n");
+     fprintf(out, "# HELP transfer_dedup_saved_bytes_total Body bytes those uploads did not have to send.\n");
+     fprintf(out, "# TYPE transfer_dedup_saved_bytes_total counter\n");
+     for (dir = 0; dir < dirs; dir++) {
+         fprintf(out, "transfer_dedup_hits_total{dir=\"%s\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, dedup_hits[dir])));
+         fprintf(out, "transfer_dedup_saved_bytes_total{dir=\"%s\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, dedup_bytes[dir])));
+     }
+ 
+     fprintf(out, "# HELP transfer_downloads_total Downloads and listings finished, by directory and result.\n");
+     fprintf(out, "# TYPE transfer_downloads_total counter\n");
+     fprintf(out, "# HELP transfer_sent_bytes_total Body bytes of downloads and listings sent, by directory.\n");
+     fprintf(out, "# TYPE transfer_sent_bytes_total counter\n");
+     for (dir = 0; dir < dirs; dir++) {
+         fprintf(out, "transfer_downloads_total{dir=\"%s\",result=\"ok\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, downloads[dir][0])));
+         fprintf(out, "transfer_downloads_total{dir=\"%s\",result=\"failed\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, downloads[dir][1])));
+         fprintf(out, "transfer_sent_bytes_total{dir=\"%s\"} %llu\n", config_dir_label(dir),
+                 (unsigned long long)merge_cell(offsetof(metrics_shard_t, sent_bytes[dir])));
+     }
+ 
+     filecache_counts(&cache_hits, &cache_misses, &cache_bytes);
+     fprintf(out, "# HELP transfer_file_cache_hits_total Downloads sent from an already mapped file.\n");
+     fprintf(out, "# TYPE transfer_file_cache_hits_total counter\n");
+     fprintf(out, "transfer_file_cache_hits_total %llu\n", (unsigned long long)cache_hits);
+     fprintf(out, "# HELP transfer_file_cache_misses_total Downloads whose file had to be mapped or sent with sendfile.\n");
+     fprintf(out, "# TYPE transfer_file_cache_misses_total counter\n");
+     fprintf(out, "transfer_file_cache_misses_total %llu\n", (unsigned long long)cache_misses);
+     fprintf(out, "# HELP transfer_file_cache_bytes Bytes of hot files the download cache keeps mapped.\n");
+     fprintf(out, "# TYPE transfer_file_cache_bytes gauge\n");
+     fprintf(out, "transfer_file_cache_bytes %llu\n", (unsigned long long)cache_bytes);
+ 
+     /* Buckets at powers of two from about 1 us to 69 s line up with histogram octaves */
+     fprintf(out, "# HELP transfer_phase_duration_seconds Time spent in each phase of serving a client.\n");
+     fprintf(out, "# TYPE transfer_phase_duration_seconds histogram\n");
+     for (phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+         merge_histogram((metrics_phase_t)phase, &histogram);
+         cumulative = 0;
+         i = 0;
+         for (shift = 10; shift <= 36; shift++) {
+             while (i < METRICS_BUCKETS && bucket_upper(i) < (1ULL << shift)) {
+                 cumulative += histogram.buckets[i++];
+             }
+             fprintf(out, "transfer_phase_duration_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %llu\n",
+                     phase_names[phase], (double)(1ULL << shift) / 1e9, (unsigned long long)cumulative);
+         }
+         fprintf(out, "transfer_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n",
+                 phase_names[phase], (unsigned long long)histogram.count);
+         fprintf(out, "transfer_phase_duration_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[phase],
+                 histogram.sum_ns / 1e9);
+         fprintf(out, "transfer_phase_duration_seconds_count{phase=\"%s\"} %llu\n", phase_names[phase],
+                 (unsigned long long)histogram.count);
+     }
+ 
+     /* Quantiles from the full-resolution histograms, which the coarse buckets above cannot give */
+     fprintf(out, "# HELP transfer_phase_duration_quantile_seconds Phase latency quantiles since start.\n");
+     fprintf(out, "# TYPE transfer_phase_duration_quantile_seconds gauge\n");
+     for (phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+         merge_histogram((metrics_phase_t)phase, &histogram);
+         for (q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+             fprintf(out, "transfer_phase_duration_quantile_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                     phase_names[phase], quantiles[q], histogram_quantile(&histogram, quantiles[q]));
+         }
+     }
+ }
+ 
+ /* Answer one scrape: HTTP for a GET request, the bare text otherwise */
+ static void answer_scrape(int client_fd) {
+     char request[512], *body = NULL;
+     size_t body_len = 0;
+     struct pollfd pfd = {client_fd, POLLIN, 0};
+     ssize_t received = 0;
+     int http;
+     FILE *out;
+ 
+     /* Tools like "nc -U" send nothing, so only wait briefly for a request line */
+     if (poll(&pfd, 1, 100) > 0) {
+         received = recv(client_fd, request, sizeof(request) - 1, 0);
+     }
+     http = (received >= 4 && strncmp(request, "GET ", 4) == 0);
+ 
+     out = open_memstream(&body, &body_len);
+     if (!out) {
+         perror("open_memstream");
+         return;
+     }
+     metrics_render(out);
+     fclose(out);
+ 
+     if (http) {
+         dprintf(client_fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+     }
+     if (send_all(client_fd, body, body_len) < 0) {
+         perror("send metrics");
+     }
+     free(body);
+ }
+ 
+ /* Metrics thread: serve scrapes one at a time, off every server core's hot path */
+ static void *metrics_main(void *arg) {
+     int listen_fd = (int)(intptr_t)arg;
+     int client_fd;
+ 
+     while (1) {
+         client_fd = accept(listen_fd, NULL, NULL);
+         if (client_fd < 0) {
+             if (errno != EINTR) {
+                 perror("accept metrics");
+             }
+             continue;
+         }
+         answer_scrape(client_fd);
+         close(client_fd);
+     }
+ 
+     return NULL;
+ }
+ 
+ /* Serve metrics on a Unix socket at path from a background thread */
+ int metrics_serve(const char *path) {
+     struct sockaddr_un addr;
+     pthread_t thread;
+     int listen_fd;
+ 
+     if (strlen(path) >= sizeof(addr.sun_path)) {
+         fprintf(stderr, "Metrics socket path too long: %s\n", path);
+         return -1;
+     }
+ 
+     listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if (listen_fd < 0) {
+         perror("socket metrics");
+         return -1;
+     }
+ 
+     /* A socket left behind by an earlier run would make bind() fail */
+     memset(&addr, 0, sizeof(addr));
+     addr.sun_family = AF_UNIX;
+     strcpy(addr.sun_path, path);
+     unlink(path);
+     if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+         perror("bind metrics socket");
+         close(listen_fd);
+         return -1;
+     }
+     strcpy(socket_path, path);
+ 
+     if (pthread_create(&thread, NULL, metrics_main, (void *)(intptr_t)listen_fd) != 0) {
+         perror("pthread_create metrics");
+         close(listen_fd);
+         unlink(path);
+         socket_path[0] = '\0';
+         return -1;
+     }
+     pthread_detach(thread);
+ 
+     printf("Serving metrics on %s\n", path);
+     return 0;
+ }
+ 
+ /* Remove the control socket */
+ void metrics_shutdown(void) {
+     if (socket_path[0]) {
+         unlink(socket_path);
+     }
+ }
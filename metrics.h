@@ -0,0 +1,98 @@
+/* metrics.h - Header file for server metrics
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the metrics registry including:
+ * - Per-thread shards of counters and latency histograms, written without locks
+ * - Log-linear (HDR-style) histograms of the time spent in each server phase
+ * - Connection, upload and byte counters, the last two per target directory
+ * - Uploads served from the content store and the bytes they did not have to send
+ * - Downloads and listings per target directory, the bytes sent, and download cache hits
+ * - Function prototypes for recording and for the Prometheus-text control socket
+ */
+
+ #ifndef METRICS_H
+ #define METRICS_H
+ 
+ #include "server.h"
+ 
+ /* Histogram layout: 16 linear sub-buckets per power of two keeps every value
+  * within 6.25%; durations are in nanoseconds and clamp at about an hour */
+ #define METRICS_SUB_BITS 4
+ #define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+ #define METRICS_MAX_SHIFT 41
+ #define METRICS_BUCKETS ((METRICS_MAX_SHIFT - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+ 
+ /* Target directories tracked separately, by the metrics slot of their configured name */
+ #define METRICS_DIRS CONFIG_MAX_DIRS
+ 
+ /* Timed phases of serving a connection */
+ typedef enum {
+     METRICS_PHASE_ACCEPT,       /* Accepted until a thread or loop starts serving it */
+     METRICS_PHASE_AUTH,         /* User and group membership check */
+     METRICS_PHASE_LOCK_WAIT,    /* Waiting for the destination path lock */
+     METRICS_PHASE_RECEIVE,      /* READY sent until the body and trailer arrived */
+     METRICS_PHASE_CHOWN,        /* Setting the owner of the staged file */
+     METRICS_PHASE_PUBLISH,      /* Flush and rename into place */
+     METRICS_PHASE_COUNT
+ } metrics_phase_t;
+ 
+ /* Plain event counters */
+ typedef enum {
+     METRICS_CONNECTIONS_ACCEPTED,
+     METRICS_CONNECTIONS_CLOSED,
+     METRICS_COUNTER_COUNT
+ } metrics_counter_t;
+ 
+ /* Latency distribution of one phase */
+ typedef struct {
+     uint64_t buckets[METRICS_BUCKETS];
+     uint64_t count;
+     uint64_t sum_ns;
+ } metrics_histogram_t;
+ 
+ /* Everything one thread records; only that thread writes it */
+ typedef struct metrics_shard {
+     uint64_t counters[METRICS_COUNTER_COUNT];
+     uint64_t uploads[METRICS_DIRS][2];      /* Succeeded, failed */
+     uint64_t bytes[METRICS_DIRS];
+     uint64_t dedup_hits[METRICS_DIRS];      /* Uploads cloned from the content store */
+     uint64_t dedup_bytes[METRICS_DIRS];     /* Body bytes those uploads did not send */
+     uint64_t downloads[METRICS_DIRS][2];    /* Downloads and listings succeeded, failed */
+     uint64_t sent_bytes[METRICS_DIRS];      /* Body bytes of downloads and listings */
+     metrics_histogram_t phases[METRICS_PHASE_COUNT];
+     struct metrics_shard *next;             /* Every shard ever created, for scrapes */
+     struct metrics_shard *next_free;        /* Shards of exited threads, for reuse */
+ } metrics_shard_t;
+ 
+ /* Function prototypes */
+ 
+ /* Prepare the registry; call once before any thread records */
+ void metrics_init(void);
+ 
+ /* Current monotonic time in nanoseconds, for timing a phase */
+ uint64_t metrics_now(void);
+ 
+ /* Record a phase that started at start_ns and ends now */
+ void metrics_observe(metrics_phase_t phase, uint64_t start_ns);
+ 
+ /* Add to an event counter */
+ void metrics_count(metrics_counter_t counter);
+ 
+ /* Account for a finished request: uploads per directory for single-stream
+  * uploads and parallel commits, received bytes for bodies and ranges, and
+  * downloads and sent bytes for downloads and listings */
+ void metrics_record_request(const proto_request_t *request, uint64_t bytes, int status);
+ 
+ /* Account for an upload whose body was cloned from the content store */
+ void metrics_record_dedup(const proto_request_t *request);
+ 
+ /* Write every metric in the Prometheus text exposition format */
+ void metrics_render(FILE *out);
+ 
+ /* Serve metrics on a Unix socket at path from a background thread. Returns 0 or -1. */
+ int metrics_serve(const char *path);
+ 
+ /* Remove the control socket */
+ void metrics_shutdown(void);
+ 
+ #endif /* METRICS_H */
@@ -0,0 +1,82 @@
+/* netio.h - Header file for zero-copy socket I/O helpers
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations shared by the server and client for:
+ * - Moving socket data into files through a pipe with splice()
+ * - Sending whole files from the page cache with sendfile()
+ * - Checksumming file contents that never passed through user space
+ * - Choosing transfer chunk sizes and matching socket buffers to them
+ * - Function prototypes for the data path helpers
+ */
+
+ #ifndef NETIO_H
+ #define NETIO_H
+ 
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <errno.h>
+ #include <fcntl.h>
+ #include <stdint.h>
+ #include <sys/types.h>
+ 
+ /* Requested capacity of each thread's splice pipe */
+ #define NETIO_PIPE_SIZE (1024 * 1024)
+ 
+ /* Bytes handed to one sendfile() call, bounding the progress update interval */
+ #define NETIO_SENDFILE_CHUNK (8 * 1024 * 1024)
+ 
+ /* Smallest and largest user-space transfer chunk */
+ #define NETIO_MIN_CHUNK (4 * 1024)
+ #define NETIO_MAX_CHUNK (512 * 1024)
+ 
+ /* Chunks per transfer the size choice aims for, so small files fit in one buffer */
+ #define NETIO_CHUNKS_PER_FILE 16
+ 
+ /* Socket buffers are sized to hold this many chunks in flight */
+ #define NETIO_SOCKBUF_CHUNKS 4
+ 
+ /* Called after each chunk with the running total of bytes sent */
+ typedef void (*netio_progress_fn)(off_t bytes_sent, void *arg);
+ 
+ /* Function prototypes */
+ 
+ /* Move up to max_bytes from a socket into a file without a user-space copy.
+  * Returns bytes moved, 0 when the peer closed, or -1 with errno set.
+  * errno EINVAL/ENOSYS before any data moved means splice is unsupported. */
+ ssize_t splice_socket_to_file(int socket_fd, int file_fd, size_t max_bytes, unsigned int flags);
+ 
+ /* Release the calling thread's splice pipe */
+ void netio_release_pipe(void);
+ 
+ /* Send a whole buffer, retrying partial sends and EINTR. Returns 0 or -1. */
+ int send_all(int socket_fd, const void *data, size_t length);
+ 
+ /* Send length bytes of a file starting at its current offset with sendfile().
+  * Returns bytes sent, or -1 with errno set. errno EINVAL/ENOSYS with nothing
+  * sent means sendfile is unsupported for this descriptor pair. */
+ off_t sendfile_all(int socket_fd, int file_fd, off_t length, netio_progress_fn progress, void *arg);
+ 
+ /* Send length bytes of a file through a user-space buffer of buffer_size bytes,
+  * extending *crc with the CRC32C of the bytes sent when crc is not NULL */
+ off_t send_file_buffered(int socket_fd, int file_fd, off_t length, size_t buffer_size,
+                          uint32_t *crc, netio_progress_fn progress, void *arg);
+ 
+ /* Extend *crc with the CRC32C of length bytes of a file from offset, reading
+  * through buffer. Returns 0, or -1 with errno set (EIO if the file is short). */
+ int netio_crc32c_file(int file_fd, off_t offset, off_t length, void *buffer, size_t buffer_size,
+                       uint32_t *crc);
+ 
+ /* Pick a power-of-two chunk size for a transfer of filesize bytes */
+ size_t netio_chunk_size(off_t filesize);
+ 
+ /* Cap the chunk size netio_chunk_size() picks at chunk_size, rounded down to a power
+  * of two between NETIO_MIN_CHUNK and NETIO_MAX_CHUNK */
+ void netio_set_max_chunk(size_t chunk_size);
+ 
+ /* Grow SO_RCVBUF or SO_SNDBUF (optname) to hold NETIO_SOCKBUF_CHUNKS chunks.
+  * Never shrinks a buffer. Returns the resulting kernel size, or -1 on error. */
+ int netio_tune_socket(int socket_fd, int optname, size_t chunk_size);
+ 
+ #endif /* NETIO_H */
@@ -0,0 +1,59 @@
+/* pathlock.h - Header file for per-destination-file locking
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the path lock table including:
+ * - Reference-counted lock entries keyed on the destination path
+ * - A fixed array of hash buckets, each with its own small mutex
+ * - Function prototypes for acquiring and releasing a path, blocking or not
+ */
+
+ #ifndef PATHLOCK_H
+ #define PATHLOCK_H
+ 
+ #include "server.h"
+ 
+ /* Number of hash buckets in the lock table */
+ #define PATHLOCK_BUCKETS 256
+ 
+ /* Lock for one destination path, alive while anyone holds or waits on it */
+ typedef struct pathlock_entry {
+     char path[MAX_PATH_LENGTH];
+     int refcount;
+     pthread_mutex_t mutex;
+     struct pathlock_entry *next;
+ } pathlock_entry_t;
+ 
+ /* Hash bucket guarding a chain of entries */
+ typedef struct {
+     pthread_mutex_t lock;
+     pathlock_entry_t *head;
+ } pathlock_bucket_t;
+ 
+ /* Table of path locks */
+ typedef struct {
+     pathlock_bucket_t buckets[PATHLOCK_BUCKETS];
+ } pathlock_table_t;
+ 
+ /* Locks for destination files, shared by every server core: the threaded and pool cores
+  * wait for a path, the event loops never block and answer STATUS_BUSY instead */
+ extern pathlock_table_t path_locks;
+ 
+ /* Function prototypes */
+ 
+ /* Initialize an empty lock table */
+ void pathlock_init(pathlock_table_t *table);
+ 
+ /* Block until the caller exclusively owns path; returns the handle to release */
+ pathlock_entry_t *pathlock_acquire(pathlock_table_t *table, const char *path);
+ 
+ /* Own path if no other writer does; returns the handle to release, or NULL with errno
+  * set to EBUSY if the path is held (or ENOMEM) */
+ pathlock_entry_t *pathlock_try_acquire(pathlock_table_t *table, const char *path);
+ 
+ /* Release a path obtained from pathlock_acquire or pathlock_try_acquire */
+ void pathlock_release(pathlock_table_t *table, pathlock_entry_t *entry);
+ 
+ /* Destroy the table (no paths may be held) */
+ void pathlock_destroy(pathlock_table_t *table);
+ 
+ #endif /* PATHLOCK_H */
@@ -0,0 +1,412 @@
+/* protocol.c - Wire protocol shared by the server and client
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements message handling for both programs:
+ * - Building a request header and its fields into one buffer
+ * - Validating headers and fields before any of them are trusted
+ * - The range layout both sides derive for parallel uploads
+ * - The content digest carried by deduplicated uploads
+ * - The block layout and instruction framing of delta uploads
+ * - Download ranges and the entries of directory listings
+ * - Sending and receiving fixed-size responses
+ */
+
+ #include "protocol.h"
+ #include "netio.h"
+ #include <endian.h>
+ #include <sys/socket.h>
+ 
+ /* Serialize a request header and its fields into one buffer */
+ ssize_t proto_build_request(void *buffer, uint8_t opcode, uint16_t flags, const char *username,
+                             const char *target_dir, const char *filename, uint64_t size) {
+     proto_header_t *header = (proto_header_t *)buffer;
+     size_t username_len = strlen(username);
+     size_t target_dir_len = strlen(target_dir);
+     size_t filename_len = strlen(filename);
+     char *p;
+     
+     if (username_len > PROTO_MAX_USERNAME || target_dir_len > PROTO_MAX_TARGET_DIR ||
+         filename_len > PROTO_MAX_FILENAME) {
+         return -1;
+     }
+     
+     header->magic = htobe32(PROTO_MAGIC);
+     header->version = PROTO_VERSION;
+     header->opcode = opcode;
+     header->flags = htobe16(flags);
+     header->username_len = htobe16((uint16_t)username_len);
+     header->target_dir_len = htobe16((uint16_t)target_dir_len);
+     header->filename_len = htobe16((uint16_t)filename_len);
+     header->reserved = 0;
+     header->size = htobe64(size);
+     
+     /* Fields follow the header back to back */
+     p = (char *)buffer + sizeof(proto_header_t);
+     memcpy(p, username, username_len);
+     p += username_len;
+     memcpy(p, target_dir, target_dir_len);
+     p += target_dir_len;
+     memcpy(p, filename, filename_len);
+     p += filename_len;
+     
+     return p - (char *)buffer;
+ }
+ 
+ /* Serialize a range or commit request, descriptor included */
+ ssize_t proto_build_range_request(void *buffer, uint8_t opcode, uint16_t flags, const char *username,
+                                   const char *target_dir, const char *filename, uint64_t size,
+                                   uint64_t token, uint32_t index) {
+     proto_range_t range;
+     ssize_t length;
+     
+     length = proto_build_request(buffer, opcode, flags, username, target_dir, filename, size);
+     if (length < 0) {
+         return -1;
+     }
+     
+     range.token = htobe64(token);
+     range.index = htobe32(index);
+     range.reserved = 0;
+     memcpy((char *)buffer + length, &range, sizeof(range));
+     
+     return length + (ssize_t)sizeof(range);
+ }
+ 
+ /* Serialize a deduplicated upload request, digest included */
+ ssize_t proto_build_dedup_request(void *buffer, uint8_t opcode, uint16_t flags, const char *username,
+                                   const char *target_dir, const char *filename, uint64_t size,
+                                   const uint8_t *digest) {
+     ssize_t length;
+     
+     length = proto_build_request(buffer, opcode, flags | PROTO_FLAG_DEDUP, username, target_dir,
+                                  filename, size);
+     if (length < 0) {
+         return -1;
+     }
+     
+     memcpy((char *)buffer + length, digest, PROTO_DIGEST_SIZE);
+     
+     return length + PROTO_DIGEST_SIZE;
+ }
+ 
+ /* Serialize a download request, byte range included */
+ ssize_t proto_build_get_request(void *buffer, uint16_t flags, const char *username, const char *target_dir,
+                                 const char *filename, uint64_t offset, uint64_t length) {
+     proto_extent_t extent;
+     ssize_t header_length;
+     
+     header_length = proto_build_request(buffer, PROTO_OP_GET, flags, username, target_dir, filename, 0);
+     if (header_length < 0) {
+         return -1;
+     }
+     
+     extent.offset = htobe64(offset);
+     extent.length = htobe64(length);
+     memcpy((char *)buffer + header_length, &extent, sizeof(extent));
+     
+     return header_length + (ssize_t)sizeof(extent);
+ }
+ 
+ /* Decode and validate a received header */
+ ssize_t proto_parse_header(const proto_header_t *header, proto_request_t *request) {
+     ssize_t field_bytes;
+     
+     memset(request, 0, sizeof(*request));
+     
+     if (be32toh(header->magic) != PROTO_MAGIC || header->version != PROTO_VERSION) {
+         return -1;
+     }
+     
+     request->version = header->version;
+     request->opcode = header->opcode;
+     request->flags = be16toh(header->flags);
+     request->username_len = be16toh(header->username_len);
+     request->target_dir_len = be16toh(header->target_dir_len);
+     request->filename_len = be16toh(header->filename_len);
+     request->size = be64toh(header->size);
+     
+     if (request->username_len == 0 || request->username_len > PROTO_MAX_USERNAME ||
+         request->target_dir_len == 0 || request->target_dir_len > PROTO_MAX_TARGET_DIR ||
+         request->filename_len > PROTO_MAX_FILENAME) {
+         return -1;
+     }
+     
+     field_bytes = (ssize_t)request->username_len + request->target_dir_len + request->filename_len;
+     
+     /* Range and commit requests name their parallel upload after the fields */
+     if (request->opcode == PROTO_OP_RANGE || request->opcode == PROTO_OP_COMMIT) {
+         field_bytes += sizeof(proto_range_t);
+     }
+     
+     /* Deduplicated uploads announce the digest of their content */
+     if (request->opcode == PROTO_OP_PUT && (request->flags & PROTO_FLAG_DEDUP)) {
+         field_bytes += PROTO_DIGEST_SIZE;
+     }
+     
+     /* Downloads name the byte range they want */
+     if (request->opcode == PROTO_OP_GET) {
+         field_bytes += sizeof(proto_extent_t);
+     }
+     
+     return field_bytes;
+ }
+ 
+ /* Copy the received field bytes into request */
+ int proto_parse_fields(const char *fields, proto_request_t *request) {
+     proto_extent_t extent;
+     proto_range_t range;
+     
+     memcpy(request->username, fields, request->username_len);
+     fields += request->username_len;
+     memcpy(request->target_dir, fields, request->target_dir_len);
+     fields += request->target_dir_len;
+     memcpy(request->filename, fields, request->filename_len);
+     fields += request->filename_len;
+     
+     if (request->opcode == PROTO_OP_RANGE || request->opcode == PROTO_OP_COMMIT) {
+         memcpy(&range, fields, sizeof(range));
+         request->token = be64toh(range.token);
+         request->range_index = be32toh(range.index);
+     }
+     if (request->opcode == PROTO_OP_PUT && (request->flags & PROTO_FLAG_DEDUP)) {
+         memcpy(request->digest, fields, PROTO_DIGEST_SIZE);
+     }
+     if (request->opcode == PROTO_OP_GET) {
+         memcpy(&extent, fields, sizeof(extent));
+         request->offset = be64toh(extent.offset);
+         request->length = be64toh(extent.length);
+     }
+     
+     /* Embedded NULs would silently shorten a field */
+     if (strlen(request->username) != request->username_len ||
+         strlen(request->target_dir) != request->target_dir_len ||
+         strlen(request->filename) != request->filename_len) {
+         return -1;
+     }
+     
+     /* A file name must stay inside the target directory */
+     if (request->filename_len > 0 &&
+         (strchr(request->filename, '/') || strcmp(request->filename, ".") == 0 ||
+          strcmp(request->filename, "..") == 0)) {
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /* Fill a response in network byte order */
+ void proto_build_response(proto_response_t *response, uint8_t status, uint16_t flags, uint64_t value) {
+     response->magic = htobe32(PROTO_MAGIC);
+     response->version = PROTO_VERSION;
+     response->status = status;
+     response->flags = htobe16(flags);
+     response->value = htobe64(value);
+ }
+ 
+ /* Fill a chunk prefix in network byte order */
+ void proto_build_chunk(proto_chunk_t *chunk, uint32_t length, uint32_t crc) {
+     chunk->length = htobe32(length);
+     chunk->crc32c = htobe32(crc);
+ }
+ 
+ /* Decode a chunk prefix in place */
+ int proto_parse_chunk(proto_chunk_t *chunk, uint64_t remaining) {
+     chunk->length = be32toh(chunk->length);
+     chunk->crc32c = be32toh(chunk->crc32c);
+     
+     if (chunk->length == 0 || chunk->length > PROTO_CHUNK_SIZE || chunk->length > remaining) {
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /* Fill a block prefix in network byte order */
+ void proto_build_block(proto_block_t *block, uint32_t length, uint32_t packed_length) {
+     block->length = htobe32(length);
+     block->packed_length = htobe32(packed_length);
+ }
+ 
+ /* Decode a block prefix in place */
+ int proto_parse_block(proto_block_t *block, uint64_t remaining) {
+     block->length = be32toh(block->length);
+     block->packed_length = be32toh(block->packed_length);
+     
+     if (block->length == 0 || block->length > PROTO_BLOCK_SIZE || block->length > remaining) {
+         return -1;
+     }
+     
+     /* A block that does not shrink is sent stored instead */
+     return (block->packed_length < block->length) ? 0 : -1;
+ }
+ 
+ /* Size of each range of a parallel upload */
+ uint64_t proto_range_size(uint64_t filesize) {
+     uint64_t size = (filesize + PROTO_MAX_RANGES - 1) / PROTO_MAX_RANGES;
+     
+     /* Whole megabytes, and never so small that per-range round trips dominate */
+     size = (size + PROTO_RANGE_ALIGN - 1) / PROTO_RANGE_ALIGN * PROTO_RANGE_ALIGN;
+     return (size < PROTO_MIN_RANGE) ? PROTO_MIN_RANGE : size;
+ }
+ 
+ /* Number of ranges a parallel upload is split into */
+ uint32_t proto_range_count(uint64_t filesize) {
+     uint64_t size = proto_range_size(filesize);
+     
+     return (uint32_t)((filesize + size - 1) / size);
+ }
+ 
+ /* Size of each block the existing file of a delta upload is signed in */
+ uint32_t proto_delta_block_size(uint64_t basis_size) {
+     uint64_t size = PROTO_DELTA_MIN_BLOCK;
+     
+     /* About the square root of the file balances signature bytes against the literal
+      * bytes each edit costs */
+     while (size < PROTO_DELTA_MAX_BLOCK && size * size < basis_size) {
+         size += PROTO_DELTA_ALIGN;
+     }
+     return (uint32_t)size;
+ }
+ 
+ /* Number of blocks an existing file is signed in */
+ uint64_t proto_delta_block_count(uint64_t basis_size) {
+     uint64_t size = proto_delta_block_size(basis_size);
+     
+     return (basis_size + size - 1) / size;
+ }
+ 
+ /* Fill a delta instruction in network byte order */
+ void proto_build_delta(proto_delta_t *op, uint32_t block, uint32_t length) {
+     op->block = htobe32(block);
+     op->length = htobe32(length);
+ }
+ 
+ /* Decode a delta instruction in place */
+ int proto_parse_delta(proto_delta_t *op, uint64_t remaining, uint64_t basis_size) {
+     op->block = be32toh(op->block);
+     op->length = be32toh(op->length);
+     
+     if (op->length == 0 || op->length > remaining) {
+         return -1;
+     }
+     if (op->block == PROTO_DELTA_LITERAL) {
+         return (op->length <= PROTO_CHUNK_SIZE) ? 0 : -1;
+     }
+     
+     /* Copies may span consecutive blocks but never leave the existing file */
+     return ((uint64_t)op->block * proto_delta_block_size(basis_size) + op->length <= basis_size) ? 0 : -1;
+ }
+ 
+ /* Fill a body trailer in network byte order */
+ void proto_build_trailer(proto_trailer_t *trailer, uint32_t crc) {
+     trailer->magic = htobe32(PROTO_TRAILER_MAGIC);
+     trailer->crc32c = htobe32(crc);
+ }
+ 
+ /* Decode a body trailer in place */
+ int proto_parse_trailer(proto_trailer_t *trailer) {
+     trailer->magic = be32toh(trailer->magic);
+     trailer->crc32c = be32toh(trailer->crc32c);
+     
+     return (trailer->magic == PROTO_TRAILER_MAGIC) ? 0 : -1;
+ }
+ 
+ /* Append a listing entry */
+ ssize_t proto_build_entry(void *buffer, size_t space, const proto_entry_t *entry, const char *name) {
+     size_t name_len = strlen(name);
+     proto_entry_t wire;
+     
+     if (name_len > PROTO_MAX_FILENAME || sizeof(wire) + name_len > space) {
+         return -1;
+     }
+     
+     wire.sequence = htobe64(entry->sequence);
+     wire.size = htobe64(entry->size);
+     wire.mtime = (int64_t)htobe64((uint64_t)entry->mtime);
+     wire.owner = htobe32(entry->owner);
+     wire.crc32c = htobe32(entry->crc32c);
+     wire.flags = htobe16(entry->flags);
+     wire.name_len = htobe16((uint16_t)name_len);
+     memcpy(buffer, &wire, sizeof(wire));
+     memcpy((char *)buffer + sizeof(wire), name, name_len);
+     
+     return (ssize_t)(sizeof(wire) + name_len);
+ }
+ 
+ /* Decode one listing entry */
+ ssize_t proto_parse_entry(const void *buffer, size_t available, proto_entry_t *entry, char *name) {
+     if (available < sizeof(*entry)) {
+         return -1;
+     }
+     
+     memcpy(entry, buffer, sizeof(*entry));
+     entry->sequence = be64toh(entry->sequence);
+     entry->size = be64toh(entry->size);
+     entry->mtime = (int64_t)be64toh((uint64_t)entry->mtime);
+     entry->owner = be32toh(entry->owner);
+     entry->crc32c = be32toh(entry->crc32c);
+     entry->flags = be16toh(entry->flags);
+     entry->name_len = be16toh(entry->name_len);
+     if (entry->name_len == 0 || entry->name_len > PROTO_MAX_FILENAME ||
+         sizeof(*entry) + entry->name_len > available) {
+         return -1;
+     }
+     
+     /* The name is written to a local file, so it gets the same checks as an upload's */
+     memcpy(name, (const char *)buffer + sizeof(*entry), entry->name_len);
+     name[entry->name_len] = '\0';
+     if (strlen(name) != entry->name_len || strchr(name, '/') || strcmp(name, ".") == 0 ||
+         strcmp(name, "..") == 0) {
+         return -1;
+     }
+     
+     return (ssize_t)(sizeof(*entry) + entry->name_len);
+ }
+ 
+ /* Receive a whole request (header and fields) from a blocking socket */
+ int proto_recv_request(int socket_fd, proto_request_t *request) {
+     char fields[PROTO_MAX_FIELDS];
+     proto_header_t header;
+     ssize_t field_bytes;
+     
+     if (recv(socket_fd, &header, sizeof(header), MSG_WAITALL) != sizeof(header)) {
+         return -1;
+     }
+     
+     field_bytes = proto_parse_header(&header, request);
+     if (field_bytes < 0) {
+         return -2;
+     }
+     
+     if (field_bytes > 0 && recv(socket_fd, fields, field_bytes, MSG_WAITALL) != field_bytes) {
+         return -1;
+     }
+     
+     return proto_parse_fields(fields, request) == 0 ? 0 : -2;
+ }
+ 
+ /* Send a response on a blocking socket */
+ int proto_send_response(int socket_fd, uint8_t status, uint16_t flags, uint64_t value) {
+     proto_response_t response;
+     
+     proto_build_response(&response, status, flags, value);
+     return send_all(socket_fd, &response, sizeof(response));
+ }
+ 
+ /* Receive a response on a blocking socket, converting to host order */
+ int proto_recv_response(int socket_fd, proto_response_t *response) {
+     if (recv(socket_fd, response, sizeof(*response), MSG_WAITALL) != sizeof(*response)) {
+         return -1;
+     }
+     
+     if (be32toh(response->magic) != PROTO_MAGIC || response->version != PROTO_VERSION) {
+         errno = EPROTO;
+         return -1;
+     }
+     
+     response->magic = PROTO_MAGIC;
+     response->flags = be16toh(response->flags);
+     response->value = be64toh(response->value);
+     
+     return 0;
+ }
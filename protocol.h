@@ -0,0 +1,312 @@
+/* protocol.h - Wire protocol shared by the server and client
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains the definitions both programs must agree on:
+ * - The versioned, length-prefixed request header
+ * - The fixed-size response sent for readiness and final status
+ * - Status codes and feature flags
+ * - The checksummed chunk framing used by resumable uploads
+ * - The whole-body checksum trailer sent after plain uploads
+ * - The block framing used by compressed uploads
+ * - The range descriptor and layout of parallel multi-stream uploads
+ * - The content digest that lets the server skip bodies it already stores
+ * - Block signatures and copy/literal instructions of delta uploads
+ * - The byte range of a download and the entries of a directory listing
+ * - Function prototypes for building and parsing messages
+ */
+
+ #ifndef PROTOCOL_H
+ #define PROTOCOL_H
+ 
+ #include <stdint.h>
+ #include <stddef.h>
+ #include <sys/types.h>
+ 
+ /* Server port unless the listen or server setting names another */
+ #define PORT 8080
+ 
+ /* Header identification */
+ #define PROTO_MAGIC 0x53534341u     /* "SSCA" */
+ #define PROTO_TRAILER_MAGIC 0x53534354u /* "SSCT" */
+ #define PROTO_VERSION 1
+ 
+ /* Request operations */
+ #define PROTO_OP_PUT 1              /* Upload one file */
+ #define PROTO_OP_SESSION 2          /* Authenticate once and keep the connection open */
+ #define PROTO_OP_RANGE 3            /* Upload one range of a parallel upload */
+ #define PROTO_OP_COMMIT 4           /* Publish a parallel upload once every range arrived */
+ #define PROTO_OP_GET 5              /* Download one file, or one byte range of it */
+ #define PROTO_OP_LIST 6             /* List the files of a directory, or describe the one named */
+ 
+ /* Field length limits (bytes, excluding the terminator) */
+ #define PROTO_MAX_USERNAME 63
+ #define PROTO_MAX_TARGET_DIR 63
+ #define PROTO_MAX_FILENAME 255
+ 
+ /* Size of the SHA-256 content digest ending the fields of a deduplicated upload */
+ #define PROTO_DIGEST_SIZE 32
+ 
+ /* Largest field bytes after a header (range, commit and download requests end with a
+  * descriptor, deduplicated uploads with a digest) */
+ #define PROTO_MAX_FIELDS (PROTO_MAX_USERNAME + PROTO_MAX_TARGET_DIR + PROTO_MAX_FILENAME + \
+                           sizeof(proto_range_t) + PROTO_DIGEST_SIZE)
+ 
+ /* Largest header plus fields a client may send */
+ #define PROTO_MAX_REQUEST (sizeof(proto_header_t) + PROTO_MAX_FIELDS)
+ 
+ /* Feature flags, negotiated by the server echoing the ones it accepts */
+ #define PROTO_FLAG_SESSION 0x0001   /* Connection carries a sequence of requests */
+ #define PROTO_FLAG_RESUME 0x0002    /* Body resumes at the offset in READY, sent as chunks */
+ #define PROTO_FLAG_CHECKSUM 0x0004  /* Plain body is followed by a CRC32C trailer */
+ #define PROTO_FLAG_COMPRESS 0x0008  /* Plain body is sent as LZ-compressed blocks */
+ #define PROTO_FLAG_PARALLEL 0x0010  /* Open a parallel upload; its ranges follow as PROTO_OP_RANGE */
+ #define PROTO_FLAG_DEDUP 0x0020     /* Fields end with the body's SHA-256; the server may answer with
+                                      * the final status instead of READY when it already stores it */
+ #define PROTO_FLAG_DELTA 0x0040     /* Body is sent as instructions against the existing file, whose
+                                      * size is in READY and whose block signatures follow it */
+ #define PROTO_FLAG_CHANGES 0x0080   /* Listing holds only the entries changed after the sequence
+                                      * number in the size field, oldest first, removals included */
+ #define PROTO_FLAGS_SUPPORTED (PROTO_FLAG_SESSION | PROTO_FLAG_RESUME | PROTO_FLAG_CHECKSUM | \
+                                PROTO_FLAG_COMPRESS | PROTO_FLAG_PARALLEL | PROTO_FLAG_DEDUP | \
+                                PROTO_FLAG_DELTA | PROTO_FLAG_CHANGES)
+ 
+ /* Largest chunk payload in a resumable body */
+ #define PROTO_CHUNK_SIZE (256 * 1024)
+ 
+ /* Largest uncompressed block in a compressed body */
+ #define PROTO_BLOCK_SIZE (128 * 1024)
+ 
+ /* Delta uploads split the existing file into blocks of about the square root of its size,
+  * between PROTO_DELTA_MIN_BLOCK and PROTO_DELTA_MAX_BLOCK bytes in multiples of
+  * PROTO_DELTA_ALIGN; files needing more than PROTO_DELTA_MAX_BLOCKS are sent whole */
+ #define PROTO_DELTA_MIN_BLOCK 2048
+ #define PROTO_DELTA_MAX_BLOCK (128 * 1024)
+ #define PROTO_DELTA_ALIGN 1024
+ #define PROTO_DELTA_MAX_BLOCKS (1024 * 1024)
+ 
+ /* Truncated SHA-256 confirming a weak checksum match */
+ #define PROTO_DELTA_STRONG_SIZE 16
+ 
+ /* Instruction block number of literal data, which follows the instruction */
+ #define PROTO_DELTA_LITERAL 0xFFFFFFFFu
+ 
+ /* Parallel uploads are split into at most PROTO_MAX_RANGES ranges of at least
+  * PROTO_MIN_RANGE bytes, in multiples of PROTO_RANGE_ALIGN */
+ #define PROTO_MAX_RANGES 64
+ #define PROTO_MIN_RANGE (4 * 1024 * 1024)
+ #define PROTO_RANGE_ALIGN (1024 * 1024)
+ 
+ /* Largest listing body; the server refuses to list a directory with more entries, and
+  * cuts a list of changes short there (the client asks again from its last sequence) */
+ #define PROTO_MAX_LISTING (16 * 1024 * 1024)
+ 
+ /* Status codes carried in responses */
+ #define STATUS_SUCCESS 0
+ #define STATUS_PERMISSION_DENIED 1
+ #define STATUS_FILE_ERROR 2
+ #define STATUS_UNKNOWN_ERROR 3
+ #define STATUS_PROTOCOL_ERROR 4
+ #define STATUS_CHECKSUM_ERROR 5     /* Body or chunk arrived corrupted; resume from the value */
+ #define STATUS_BUSY 6               /* A transfer quota is full, or another upload is writing
+                                      * the same file; try again later */
+ #define STATUS_READY 16             /* Request accepted, send the body (or, for a download or
+                                      * listing, the value bytes of body follow) */
+ 
+ /* Request header; all integers in network byte order, fields follow unterminated */
+ typedef struct __attribute__((packed)) {
+     uint32_t magic;
+     uint8_t version;
+     uint8_t opcode;
+     uint16_t flags;
+     uint16_t username_len;
+     uint16_t target_dir_len;
+     uint16_t filename_len;
+     uint16_t reserved;
+     uint64_t size;
+ } proto_header_t;
+ 
+ /* Response sent by the server; integers in network byte order */
+ typedef struct __attribute__((packed)) {
+     uint32_t magic;
+     uint8_t version;
+     uint8_t status;
+     uint16_t flags;
+     uint64_t value;
+ } proto_response_t;
+ 
+ /* Prefix of each chunk in a resumable body; payload follows */
+ typedef struct __attribute__((packed)) {
+     uint32_t length;
+     uint32_t crc32c;            /* CRC32C of the payload */
+ } proto_chunk_t;
+ 
+ /* Prefix of each block in a compressed body; packed_length bytes follow, or length
+  * bytes stored as-is when packed_length is 0 */
+ typedef struct __attribute__((packed)) {
+     uint32_t length;            /* Bytes the block expands to */
+     uint32_t packed_length;     /* Compressed payload size, always below length */
+ } proto_block_t;
+ 
+ /* Bytes on the wire after a decoded block prefix */
+ #define PROTO_BLOCK_PAYLOAD(block) ((block)->packed_length ? (block)->packed_length : (block)->length)
+ 
+ /* Ends the fields of range and commit requests */
+ typedef struct __attribute__((packed)) {
+     uint64_t token;             /* Returned when the parallel upload was opened */
+     uint32_t index;             /* Range being sent (0 for a commit) */
+     uint32_t reserved;
+ } proto_range_t;
+ 
+ /* Ends the fields of a download request */
+ typedef struct __attribute__((packed)) {
+     uint64_t offset;            /* First byte to send */
+     uint64_t length;            /* Bytes to send, or 0 for the rest of the file */
+ } proto_extent_t;
+ 
+ /* One file in the body of a listing; name_len bytes of its name follow, unterminated */
+ typedef struct __attribute__((packed)) {
+     uint64_t sequence;          /* Position of the file's last change in its directory's history */
+     uint64_t size;
+     int64_t mtime;              /* Last modification, in seconds since the epoch */
+     uint32_t owner;             /* Owning user ID */
+     uint32_t crc32c;            /* CRC32C of the contents */
+     uint16_t flags;             /* PROTO_ENTRY_* */
+     uint16_t name_len;
+ } proto_entry_t;
+ 
+ /* Entry flags: the file was removed (only in a list of changes), or its crc32c is not
+  * known yet because it was published without one */
+ #define PROTO_ENTRY_REMOVED 0x0001
+ #define PROTO_ENTRY_CRC_UNKNOWN 0x0002
+ 
+ /* Sent after a plain body when the server echoed PROTO_FLAG_CHECKSUM */
+ typedef struct __attribute__((packed)) {
+     uint32_t magic;             /* PROTO_TRAILER_MAGIC, catching a body of the wrong length */
+     uint32_t crc32c;            /* CRC32C of the whole body */
+ } proto_trailer_t;
+ 
+ /* Signature of one block of the existing file, sent by the server after a delta READY */
+ typedef struct __attribute__((packed)) {
+     uint32_t weak;              /* Rolling checksum: byte sum low, position-weighted sum high */
+     uint8_t strong[PROTO_DELTA_STRONG_SIZE];
+ } proto_signature_t;
+ 
+ /* One instruction of a delta body: copy length bytes of the existing file from the
+  * start of block, or insert the length literal bytes that follow (PROTO_DELTA_LITERAL) */
+ typedef struct __attribute__((packed)) {
+     uint32_t block;
+     uint32_t length;
+ } proto_delta_t;
+ 
+ /* A decoded request in host byte order with terminated strings */
+ typedef struct {
+     uint8_t version;
+     uint8_t opcode;
+     uint16_t flags;
+     uint16_t username_len;
+     uint16_t target_dir_len;
+     uint16_t filename_len;
+     uint64_t size;
+     char username[PROTO_MAX_USERNAME + 1];
+     char target_dir[PROTO_MAX_TARGET_DIR + 1];
+     char filename[PROTO_MAX_FILENAME + 1];
+     uint64_t token;             /* Range and commit requests only */
+     uint32_t range_index;
+     uint8_t digest[PROTO_DIGEST_SIZE]; /* Uploads with PROTO_FLAG_DEDUP only: SHA-256 of the body */
+     uint64_t offset;            /* Download requests only */
+     uint64_t length;
+ } proto_request_t;
+ 
+ /* Function prototypes */
+ 
+ /* Serialize a request header and its fields into buffer (at least PROTO_MAX_REQUEST
+  * bytes) so it can be sent with one write. Returns the length, or -1 if a field is too long. */
+ ssize_t proto_build_request(void *buffer, uint8_t opcode, uint16_t flags, const char *username,
+                             const char *target_dir, const char *filename, uint64_t size);
+ 
+ /* As proto_build_request(), followed by the descriptor of a range or commit request */
+ ssize_t proto_build_range_request(void *buffer, uint8_t opcode, uint16_t flags, const char *username,
+                                   const char *target_dir, const char *filename, uint64_t size,
+                                   uint64_t token, uint32_t index);
+ 
+ /* As proto_build_request(), followed by the SHA-256 of the body of a PROTO_FLAG_DEDUP upload */
+ ssize_t proto_build_dedup_request(void *buffer, uint8_t opcode, uint16_t flags, const char *username,
+                                   const char *target_dir, const char *filename, uint64_t size,
+                                   const uint8_t *digest);
+ 
+ /* As proto_build_request(), followed by the byte range of a download (length 0 for the
+  * rest of the file) */
+ ssize_t proto_build_get_request(void *buffer, uint16_t flags, const char *username, const char *target_dir,
+                                 const char *filename, uint64_t offset, uint64_t length);
+ 
+ /* Decode and validate a received header. Returns the number of field bytes that
+  * follow, or -1 if the header is malformed. */
+ ssize_t proto_parse_header(const proto_header_t *header, proto_request_t *request);
+ 
+ /* Copy the received field bytes into request. Returns 0, or -1 if a field is invalid. */
+ int proto_parse_fields(const char *fields, proto_request_t *request);
+ 
+ /* Fill a response in network byte order */
+ void proto_build_response(proto_response_t *response, uint8_t status, uint16_t flags, uint64_t value);
+ 
+ /* Fill a chunk prefix in network byte order */
+ void proto_build_chunk(proto_chunk_t *chunk, uint32_t length, uint32_t crc);
+ 
+ /* Decode a chunk prefix in place. Returns 0, or -1 if the length is zero,
+  * above PROTO_CHUNK_SIZE or beyond the remaining body bytes. */
+ int proto_parse_chunk(proto_chunk_t *chunk, uint64_t remaining);
+ 
+ /* Fill a block prefix in network byte order (packed_length 0 for a stored block) */
+ void proto_build_block(proto_block_t *block, uint32_t length, uint32_t packed_length);
+ 
+ /* Decode a block prefix in place. Returns 0, or -1 if the length is zero, above
+  * PROTO_BLOCK_SIZE or beyond the remaining body bytes, or the payload does not shrink. */
+ int proto_parse_block(proto_block_t *block, uint64_t remaining);
+ 
+ /* Size of each range of a parallel upload of filesize bytes (the last may be shorter) */
+ uint64_t proto_range_size(uint64_t filesize);
+ 
+ /* Number of ranges a parallel upload of filesize bytes is split into */
+ uint32_t proto_range_count(uint64_t filesize);
+ 
+ /* Size of each block the existing file of a delta upload is signed in (the last may be shorter) */
+ uint32_t proto_delta_block_size(uint64_t basis_size);
+ 
+ /* Number of blocks, and so signatures, of an existing file of basis_size bytes */
+ uint64_t proto_delta_block_count(uint64_t basis_size);
+ 
+ /* Fill a delta instruction in network byte order */
+ void proto_build_delta(proto_delta_t *op, uint32_t block, uint32_t length);
+ 
+ /* Decode a delta instruction in place. Returns 0, or -1 if the length is zero or beyond
+  * the remaining body bytes, a literal is above PROTO_CHUNK_SIZE, or a copy reaches past
+  * the end of the existing file. */
+ int proto_parse_delta(proto_delta_t *op, uint64_t remaining, uint64_t basis_size);
+ 
+ /* Append a listing entry for name at buffer, which has space bytes left, from entry in host
+  * byte order (its name_len is ignored). Returns the bytes written, or -1 if they do not
+  * fit or the name is too long. */
+ ssize_t proto_build_entry(void *buffer, size_t space, const proto_entry_t *entry, const char *name);
+ 
+ /* Decode the listing entry at buffer, which has available bytes left, copying its
+  * terminated name into name (at least PROTO_MAX_FILENAME + 1 bytes). Returns the bytes
+  * it occupies, or -1 if it is truncated or its name is invalid. */
+ ssize_t proto_parse_entry(const void *buffer, size_t available, proto_entry_t *entry, char *name);
+ 
+ /* Fill a body trailer in network byte order */
+ void proto_build_trailer(proto_trailer_t *trailer, uint32_t crc);
+ 
+ /* Decode a body trailer in place. Returns 0, or -1 if the magic is wrong. */
+ int proto_parse_trailer(proto_trailer_t *trailer);
+ 
+ /* Receive a whole request (header and fields) from a blocking socket.
+  * Returns 0, -1 on connection error, or -2 if the request is malformed. */
+ int proto_recv_request(int socket_fd, proto_request_t *request);
+ 
+ /* Send a response on a blocking socket. Returns 0 or -1. */
+ int proto_send_response(int socket_fd, uint8_t status, uint16_t flags, uint64_t value);
+ 
+ /* Receive a response on a blocking socket, converting to host order. Returns 0 or -1. */
+ int proto_recv_response(int socket_fd, proto_response_t *response);
+ 
+ #endif /* PROTOCOL_H */
@@ -0,0 +1,106 @@
+/* quota.h - Header file for per-user and per-directory transfer quotas
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the quota scheduler including:
+ * - Concurrency caps and token-bucket rate limits keyed by user and target directory
+ * - Admission tickets held by each upload or range while it is being served
+ * - Deficit round robin sharing of each bucket's tokens between its active transfers
+ * - Function prototypes for configuring, admitting, granting and releasing
+ */
+
+ #ifndef QUOTA_H
+ #define QUOTA_H
+ 
+ #include "server.h"
+ 
+ /* Most a transfer is granted from one bucket per round */
+ #define QUOTA_QUANTUM (64 * 1024)
+ 
+ /* Tokens an idle bucket saves up, as milliseconds at its rate */
+ #define QUOTA_BURST_MS 100
+ 
+ /* Bounds on how long a throttled transfer waits before asking again */
+ #define QUOTA_MIN_WAIT_NS 1000000ULL
+ #define QUOTA_MAX_WAIT_NS 100000000ULL
+ 
+ /* Number of hash buckets for per-user accounting */
+ #define QUOTA_USER_SLOTS 64
+ 
+ /* Scopes every transfer is charged to, in lock order */
+ #define QUOTA_SCOPE_USER 0
+ #define QUOTA_SCOPE_DIR 1
+ #define QUOTA_SCOPES 2
+ 
+ /* Limits for one user or directory; zero means unlimited */
+ typedef struct {
+     uint64_t rate;              /* Body bytes per second */
+     unsigned int transfers;     /* Uploads and ranges admitted at once */
+ } quota_limit_t;
+ 
+ /* One transfer's place in a bucket's round-robin ring */
+ typedef struct quota_flow {
+     struct quota_bucket *bucket;    /* NULL if the scope has no limits */
+     uint64_t deficit;               /* Bytes granted to the transfer but not yet taken */
+     uint64_t demand;                /* Size of its latest request, capping its top-ups */
+     struct quota_flow *next;
+     struct quota_flow *prev;
+ } quota_flow_t;
+ 
+ /* Accounting for one user or directory */
+ typedef struct quota_bucket {
+     char name[PROTO_MAX_USERNAME + 1];
+     quota_limit_t limit;
+     int configured;             /* Limit given explicitly rather than the per-user default */
+     unsigned int active;        /* Admitted transfers, each with a flow in the ring */
+     double tokens;              /* Bytes earned but not yet handed to a flow */
+     uint64_t refilled_ns;       /* When tokens were last earned */
+     quota_flow_t *cursor;       /* Next flow to be topped up; NULL when none is active */
+     struct quota_bucket *next;
+ } quota_bucket_t;
+ 
+ /* Admission of one transfer, held until its status is sent */
+ typedef struct quota_ticket {
+     quota_flow_t flows[QUOTA_SCOPES];
+     int rate_limited;           /* Some scope has a rate, so reads must ask for grants */
+ } quota_ticket_t;
+ 
+ /* Function prototypes */
+ 
+ /* Add a limit from "scope=rate[,transfers]". The scope is "user" (the default for every user),
+  * "user:<name>" or a target directory; the rate is bytes per second with an optional k, m
+  * or g suffix. Returns 0, or -1 if the specification is malformed. */
+ int quota_configure(const char *spec);
+ 
+ /* Log the limits in force */
+ void quota_log_limits(void);
+ 
+ /* Charge a transfer to its user and resolved target directory (which may be NULL).
+  * Returns STATUS_SUCCESS with a ticket, NULL if nothing limits it, or STATUS_BUSY
+  * if either scope already has its maximum number of transfers. */
+ int quota_admit(const char *username, const char *target_dir, quota_ticket_t **ticket);
+ 
+ /* Bytes of up to wanted that a transfer may read now; 0 means wait quota_delay_ns() */
+ size_t quota_grant(quota_ticket_t *ticket, size_t wanted);
+ 
+ /* Give back the part of a grant that a short read did not use */
+ void quota_return(quota_ticket_t *ticket, size_t unused);
+ 
+ /* How long a transfer refused a grant should wait before asking again */
+ uint64_t quota_delay_ns(quota_ticket_t *ticket);
+ 
+ /* Block until some of wanted is granted; returns the amount (threaded and pool modes) */
+ size_t quota_wait(quota_ticket_t *ticket, size_t wanted);
+ 
+ /* Block until all of bytes has been granted */
+ void quota_take(quota_ticket_t *ticket, size_t bytes);
+ 
+ /* End a transfer's admission; NULL is ignored */
+ void quota_release(quota_ticket_t *ticket);
+ 
+ /* Transfers refused admission and grants refused so far */
+ void quota_counts(uint64_t *rejected, uint64_t *throttled);
+ 
+ /* Free every bucket */
+ void quota_destroy(void);
+ 
+ #endif /* QUOTA_H */
@@ -0,0 +1,81 @@
+/* rangetable.h - Header file for parallel multi-stream uploads
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the range table including:
+ * - Open parallel uploads, keyed by a random token handed to the client
+ * - The staging file, access decision and range bookkeeping each one shares
+ *   between every connection sending it
+ * - Function prototypes for opening, claiming, completing, taking and returning uploads,
+ *   and for the whole file's checksum built from those of its ranges
+ */
+
+ #ifndef RANGETABLE_H
+ #define RANGETABLE_H
+ 
+ #include "server.h"
+ #include <time.h>
+ 
+ /* Seconds an unfinished parallel upload may go unused before it is discarded */
+ #define RANGETABLE_IDLE_TIMEOUT 600
+ 
+ /* A parallel upload between its open and its commit */
+ typedef struct range_upload {
+     uint64_t token;
+     char username[PROTO_MAX_USERNAME + 1];
+     char filename[PROTO_MAX_FILENAME + 1];
+     char target_path[MAX_PATH_LENGTH];
+     char staging_path[STAGING_PATH_LENGTH];  /* Empty for an unnamed O_TMPFILE */
+     access_decision_t access;   /* Decided once, when the upload was opened */
+     int file_fd;
+     off_t filesize;
+     uint32_t range_count;
+     uint64_t stored;            /* One bit per range written in full */
+     uint64_t summed;            /* One bit per stored range whose CRC32C is in range_crc */
+     uint32_t range_crc[PROTO_MAX_RANGES];
+     time_t last_used;
+     struct range_upload *next;
+ } range_upload_t;
+ 
+ /* Table of open parallel uploads */
+ typedef struct {
+     pthread_mutex_t lock;
+     range_upload_t *head;
+ } rangetable_t;
+ 
+ /* Parallel uploads shared by every server core */
+ extern rangetable_t range_uploads;
+ 
+ /* Function prototypes */
+ 
+ /* Initialize an empty table */
+ void rangetable_init(rangetable_t *table);
+ 
+ /* Give a filled-in upload a fresh token and add it, discarding abandoned ones. Returns 0 or -1. */
+ int rangetable_open(rangetable_t *table, range_upload_t *upload);
+ 
+ /* Check a range request against its upload and open a descriptor of its own,
+  * positioned at the start of the range. Returns a status code. */
+ int rangetable_claim(rangetable_t *table, const proto_request_t *request, int *file_fd, off_t *offset);
+ 
+ /* Record that a claimed range was written and verified; crc is the CRC32C kept as it
+  * arrived, or NULL if it was spliced without one */
+ void rangetable_complete(rangetable_t *table, const proto_request_t *request, const uint32_t *crc);
+ 
+ /* Remove an upload whose ranges have all arrived so the caller can publish it.
+  * Returns a status code; incomplete uploads stay in the table. */
+ int rangetable_take(rangetable_t *table, const proto_request_t *request, range_upload_t **upload);
+ 
+ /* Put back a taken upload that could not be published yet, so its commit can be retried */
+ void rangetable_return(rangetable_t *table, range_upload_t *upload);
+ 
+ /* CRC32C of a taken upload's whole file, combined from those of its ranges.
+  * Returns 0, or -1 if any range arrived without one. */
+ int rangetable_checksum(const range_upload_t *upload, uint32_t *crc);
+ 
+ /* Close and free an upload taken from the table */
+ void rangetable_free_upload(range_upload_t *upload);
+ 
+ /* Discard every upload still open */
+ void rangetable_destroy(rangetable_t *table);
+ 
+ #endif /* RANGETABLE_H */
@@ -0,0 +1,1292 @@
+/* reactor.c - Implementation of the epoll event-driven server core
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the reactor server mode:
+ * - Non-blocking accept of new connections
+ * - Edge-triggered readiness handling for every client socket
+ * - A per-connection state machine over the framed request header
+ * - Budgeted reads so one large upload cannot starve the others
+ * - Block-by-block decompression of compressed uploads
+ * - Delta bases signed and copies applied a buffer per pass, so no delta stalls the loop
+ * - Ranges and commits of parallel uploads
+ * - Group commit of the uploads completed in one loop pass
+ * - Quota admission, with rate-limited connections parked until tokens are due
+ * - Uploads cloned from the content store, and received ones checked against their digest
+ * - Downloads sent with sendfile() from the file, never a mapping a truncation could fault in,
+ *   and listings, with input paused until they are out
+ */
+
+ #include "reactor.h"
+ #include "netio.h"
+ #include "bufpool.h"
+ #include "durability.h"
+ #include "rangetable.h"
+ #include "metrics.h"
+ #include "quota.h"
+ #include "dedup.h"
+ #include "delta.h"
+ #include "download.h"
+ #include "manifest.h"
+ #include <sys/epoll.h>
+ #include <sys/sendfile.h>
+ 
+ /* Forward declarations for internal helpers */
+ static void service_input(reactor_t *reactor, connection_t *conn);
+ static void release_connection(reactor_t *reactor, connection_t *conn);
+ static void finish_send(reactor_t *reactor, connection_t *conn);
+ 
+ /* Put a file descriptor into non-blocking mode */
+ static int set_nonblocking(int fd) {
+     int flags = fcntl(fd, F_GETFL, 0);
+     
+     if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+         log_errno("fcntl O_NONBLOCK");
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /* Queue a connection for another read pass after its budget ran out */
+ static void schedule_ready(reactor_t *reactor, connection_t *conn) {
+     if (conn->on_ready_list) {
+         return;
+     }
+     
+     conn->on_ready_list = 1;
+     conn->next_ready = NULL;
+     if (reactor->ready_tail) {
+         reactor->ready_tail->next_ready = conn;
+     } else {
+         reactor->ready_head = conn;
+     }
+     reactor->ready_tail = conn;
+ }
+ 
+ /* Park a connection whose quota has no tokens; reads as EAGAIN until it is woken */
+ static ssize_t throttle_connection(reactor_t *reactor, connection_t *conn) {
+     if (!conn->throttled) {
+         conn->throttled = 1;
+         conn->throttle_until = metrics_now() + quota_delay_ns(conn->session.ticket);
+         conn->next_throttled = reactor->throttled_head;
+         reactor->throttled_head = conn;
+     }
+     
+     errno = EAGAIN;
+     return -1;
+ }
+ 
+ /* Give the other connections a pass before this one's next step of signing or copying;
+  * reads as EAGAIN. Commits and closed connections are already requeued by their own paths. */
+ static ssize_t yield_connection(reactor_t *reactor, connection_t *conn) {
+     if (conn->state != CONN_CLOSED && conn->state != CONN_COMMIT) {
+         schedule_ready(reactor, conn);
+     }
+     
+     errno = EAGAIN;
+     return -1;
+ }
+ 
+ /* Milliseconds until the first parked connection is due, or -1 if none is parked */
+ static int throttle_timeout(reactor_t *reactor) {
+     uint64_t now = metrics_now(), first = UINT64_MAX;
+     connection_t *conn;
+     
+     if (!reactor->throttled_head) {
+         return -1;
+     }
+     for (conn = reactor->throttled_head; conn; conn = conn->next_throttled) {
+         if (conn->throttle_until < first) {
+             first = conn->throttle_until;
+         }
+     }
+     
+     return first <= now ? 0 : (int)((first - now + 999999) / 1000000);
+ }
+ 
+ /* Queue the parked connections that are due (or closed) for a read pass */
+ static void wake_throttled(reactor_t *reactor) {
+     connection_t **link = &reactor->throttled_head, *conn;
+     uint64_t now = metrics_now();
+     
+     while (*link) {
+         conn = *link;
+         if (conn->state == CONN_CLOSED || conn->throttle_until <= now) {
+             *link = conn->next_throttled;
+             conn->throttled = 0;
+             schedule_ready(reactor, conn);
+             continue;
+         }
+         link = &conn->next_throttled;
+     }
+ }
+ 
+ /* Free the attachment, or close the file a download body comes from */
+ static void release_attachment(connection_t *conn) {
+     if (conn->send_fd >= 0) {
+         close(conn->send_fd);
+         conn->send_fd = -1;
+     }
+     free(conn->attachment);
+     conn->attachment = NULL;
+ }
+ 
+ /* Whether a body is still to follow the response at attachment_at */
+ static int has_attachment(const connection_t *conn) {
+     return conn->attachment || conn->send_fd >= 0;
+ }
+ 
+ /* Send as much pending output as the socket accepts */
+ static void flush_output(reactor_t *reactor, connection_t *conn) {
+     ssize_t bytes_sent;
+     int attached;
+     
+     while (conn->out_sent < conn->out_len || has_attachment(conn)) {
+         /* Signatures of a delta upload, or a download body, go out right behind the READY
+          * that announced them */
+         attached = has_attachment(conn) && conn->out_sent == conn->attachment_at;
+         if (attached && conn->send_fd >= 0) {
+             /* A file truncated meanwhile ends the body early rather than faulting a mapping */
+             bytes_sent = sendfile(conn->fd, conn->send_fd, &conn->send_offset,
+                                   conn->attachment_len - conn->attachment_sent);
+             if (bytes_sent == 0) {
+                 log_error("Client %d: %s shrank while it was being sent", conn->client_id,
+                           conn->request.filename);
+                 release_connection(reactor, conn);
+                 return;
+             }
+         } else if (attached) {
+             bytes_sent = send(conn->fd, conn->attachment + conn->attachment_sent,
+                               conn->attachment_len - conn->attachment_sent, MSG_NOSIGNAL);
+         } else {
+             bytes_sent = send(conn->fd, conn->out_buf + conn->out_sent,
+                               (has_attachment(conn) ? conn->attachment_at : conn->out_len) - conn->out_sent,
+                               MSG_NOSIGNAL);
+         }
+         if (bytes_sent < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                 /* EPOLLOUT edge will resume the flush */
+                 return;
+             }
+             log_errno("send");
+             release_connection(reactor, conn);
+             return;
+         }
+         if (!attached) {
+             conn->out_sent += bytes_sent;
+             continue;
+         }
+         conn->attachment_sent += bytes_sent;
+         if (conn->attachment_sent == conn->attachment_len) {
+             release_attachment(conn);
+         }
+     }
+     
+     conn->out_len = conn->out_sent = 0;
+     
+     /* A download's body is out: its status follows and reading resumes */
+     if (conn->state == CONN_SEND) {
+         finish_send(reactor, conn);
+         return;
+     }
+     
+     if (conn->close_after_flush) {
+         release_connection(reactor, conn);
+     }
+ }
+ 
+ /* Append a protocol response (ready or final status) to the output buffer */
+ static void queue_reply(reactor_t *reactor, connection_t *conn, uint8_t status, uint16_t flags,
+                         uint64_t value) {
+     /* A client that pipelines without reading its responses is dropped */
+     if (conn->out_len + sizeof(proto_response_t) > sizeof(conn->out_buf)) {
+         log_warn("Client %d is not reading responses", conn->client_id);
+         release_connection(reactor, conn);
+         return;
+     }
+     
+     proto_build_response((proto_response_t *)(conn->out_buf + conn->out_len), status, flags, value);
+     conn->out_len += sizeof(proto_response_t);
+     flush_output(reactor, conn);
+ }
+ 
+ /* Count a finished request in the metrics and queue its log record */
+ static void record_request(connection_t *conn, int status_code) {
+     metrics_record_request(&conn->request, (uint64_t)conn->total_received, status_code);
+     log_transfer(conn->client_id, &conn->request, (uint64_t)conn->total_received, conn->request_started,
+                  status_code);
+     conn->request_started = 0;
+     quota_release(conn->session.ticket);
+     conn->session.ticket = NULL;
+ }
+ 
+ /* Close the files of the current transfer and let other uploads have its destination */
+ static void end_transfer(connection_t *conn) {
+     if (conn->file_fd >= 0) {
+         close(conn->file_fd);
+         conn->file_fd = -1;
+     }
+     if (conn->basis_fd >= 0) {
+         close(conn->basis_fd);
+         conn->basis_fd = -1;
+     }
+     free(conn->signatures);
+     conn->signatures = NULL;
+     if (conn->path_lock) {
+         pathlock_release(&path_locks, conn->path_lock);
+         conn->path_lock = NULL;
+     }
+ }
+ 
+ /* Send the final status code and close once it has been delivered */
+ static void finish_with_status(reactor_t *reactor, connection_t *conn, int status_code) {
+     end_transfer(conn);
+     record_request(conn, status_code);
+     conn->state = CONN_STATUS;
+     conn->close_after_flush = 1;
+     queue_reply(reactor, conn, status_code, 0, (uint64_t)conn->total_received);
+ }
+ 
+ /* Send a per-file status; sessions then wait for the next request, others close */
+ static void finish_request(reactor_t *reactor, connection_t *conn, int status_code) {
+     if (!conn->session.persistent) {
+         finish_with_status(reactor, conn, status_code);
+         return;
+     }
+     
+     end_transfer(conn);
+     if (status_code == STATUS_SUCCESS) {
+         conn->session.files++;
+     }
+     record_request(conn, status_code);
+     
+     conn->state = CONN_HEADER;
+     conn->in_received = 0;
+     queue_reply(reactor, conn, status_code, 0, (uint64_t)conn->total_received);
+     conn->total_received = 0;
+ }
+ 
+ /* Queue READY and the body of a download or listing; the status follows once it is out */
+ static void begin_send(reactor_t *reactor, connection_t *conn) {
+     download_t download;
+     uint16_t flags = 0;
+     char *listing;
+     size_t length;
+     int status;
+     
+     if (conn->request.opcode == PROTO_OP_LIST) {
+         status = build_listing(&conn->request, &conn->session, &listing, &length, &flags);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+         conn->attachment = listing;
+     } else {
+         status = open_download(&conn->request, &conn->session, &download);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+         
+         /* Sent from the descriptor as the socket drains; a truncated file then ends the
+          * body short instead of raising SIGBUS in the loop */
+         length = (size_t)download.length;
+         conn->send_fd = download.file_fd;
+         conn->send_offset = download.offset;
+     }
+     if (length == 0) {
+         release_attachment(conn);
+     }
+     
+     conn->attachment_len = length;
+     conn->attachment_sent = 0;
+     conn->attachment_at = conn->out_len + sizeof(proto_response_t);
+     conn->state = CONN_SEND;
+     
+     /* Once the body is out, flush_output() sends the status */
+     queue_reply(reactor, conn, STATUS_READY, flags, length);
+ }
+ 
+ /* A download's body is out: send its status and replay input that arrived meanwhile */
+ static void finish_send(reactor_t *reactor, connection_t *conn) {
+     conn->total_received = (off_t)conn->attachment_len;
+     finish_request(reactor, conn, STATUS_SUCCESS);
+     if (conn->state != CONN_CLOSED) {
+         schedule_ready(reactor, conn);
+     }
+ }
+ 
+ /* Set ownership and flush a complete upload, then publish it */
+ static void complete_transfer(reactor_t *reactor, connection_t *conn) {
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     uint64_t publish_start;
+     int status = STATUS_SUCCESS;
+     
+     /* Commits adopt a body that other connections received */
+     if (conn->body_started) {
+         metrics_observe(METRICS_PHASE_RECEIVE, conn->body_started);
+         conn->body_started = 0;
+     }
+     
+     /* A range is only part of a file; its upload is published by the commit request */
+     if (conn->range) {
+         rangetable_complete(&range_uploads, &conn->request, conn->summed ? &conn->crc : NULL);
+         finish_request(reactor, conn, STATUS_SUCCESS);
+         return;
+     }
+     
+     /* A body announced with a digest must match it before it is published; the store copy
+      * is made and flushed off the loop. A resumed body was partly received by an earlier
+      * connection, so the writer checks that one before storing it. */
+     if (conn->dedup) {
+         if (conn->hashing) {
+             sha256_final(&conn->sha, digest);
+             status = dedup_verify(&conn->request, digest);
+         }
+         if (status != STATUS_SUCCESS) {
+             conn->total_received = 0;
+             if (conn->staging_path[0]) {
+                 unlink(conn->staging_path);
+             }
+             finish_request(reactor, conn, status);
+             return;
+         }
+         dedup_store_later(conn->file_fd, &conn->request, conn->hashing, conn->summed ? &conn->crc : NULL);
+     }
+     
+     /* Set ownership before publishing so the file never appears with the wrong owner */
+     if (apply_file_ownership(conn->file_fd, &conn->access) != 0) {
+         log_error("Failed to set file ownership for %s", conn->target_path);
+         finish_request(reactor, conn, STATUS_FILE_ERROR);
+         return;
+     }
+     
+     /* Group commit: publish together with the other uploads finished in this pass */
+     if (durability_mode == DURABILITY_GROUP) {
+         conn->state = CONN_COMMIT;
+         conn->next_commit = reactor->commit_head;
+         reactor->commit_head = conn;
+         return;
+     }
+     
+     /* Only durability none gets here (fdatasync mode is run as group commit in the loops),
+      * so nothing below waits for the device */
+     publish_start = metrics_now();
+     if (durability_sync_file(conn->file_fd) != 0 ||
+         commit_staging_file(conn->file_fd, conn->staging_path, conn->target_path) != 0) {
+         status = STATUS_FILE_ERROR;
+     } else {
+         /* The checksum kept as the body arrived; an upload without one is recorded as unknown */
+         manifest_record(conn->target_path, conn->file_fd, conn->summed ? &conn->crc : NULL);
+     }
+     close(conn->file_fd);
+     conn->file_fd = -1;
+     
+     /* Make the new name durable before acknowledging it */
+     if (status == STATUS_SUCCESS && durability_sync_dir(conn->target_path) != 0) {
+         status = STATUS_FILE_ERROR;
+     }
+     
+     if (status == STATUS_SUCCESS) {
+         metrics_observe(METRICS_PHASE_PUBLISH, publish_start);
+         log_debug("File transfer completed: %s -> %s", conn->request.filename, conn->target_path);
+     }
+     finish_request(reactor, conn, status);
+ }
+ 
+ /* The last body byte arrived: wait for the checksum trailer, or publish straight away */
+ static void body_complete(reactor_t *reactor, connection_t *conn) {
+     if (conn->checksum) {
+         conn->state = CONN_TRAILER;
+         conn->in_received = 0;
+         return;
+     }
+     
+     complete_transfer(reactor, conn);
+ }
+ 
+ /* Compare a received trailer with the body checksum, then publish or discard the upload */
+ static void check_trailer(reactor_t *reactor, connection_t *conn) {
+     int status;
+     
+     status = verify_body_trailer(&conn->trailer, conn->crc, conn->request.filename);
+     if (status == STATUS_SUCCESS) {
+         complete_transfer(reactor, conn);
+         return;
+     }
+     
+     /* Nothing is kept; a mismatch leaves the stream aligned for the next request */
+     conn->total_received = 0;
+     if (status == STATUS_CHECKSUM_ERROR) {
+         if (conn->staging_path[0]) {
+             unlink(conn->staging_path);
+         }
+         finish_request(reactor, conn, status);
+     } else {
+         finish_with_status(reactor, conn, status);
+     }
+ }
+ 
+ /* Flush every upload waiting for group commit with two syncfs() calls per filesystem, then publish them */
+ static void flush_commits(reactor_t *reactor) {
+     connection_t *conn, *next, *batch = NULL;
+     durability_batch_t synced;
+     int published, count = 0;
+     uint64_t flush_start;
+     
+     /* Connections dropped while waiting are only reclaimed here */
+     for (conn = reactor->commit_head; conn; conn = next) {
+         next = conn->next_commit;
+         if (conn->state == CONN_CLOSED) {
+             if (!conn->throttled) {
+                 free(conn);
+             }
+             continue;
+         }
+         conn->next_commit = batch;
+         batch = conn;
+     }
+     reactor->commit_head = NULL;
+     if (!batch) {
+         return;
+     }
+     
+     /* One sync for the data of each filesystem the batch writes to */
+     flush_start = metrics_now();
+     durability_batch_init(&synced);
+     
+     /* Rename everything, then one sync per filesystem for all of the new names */
+     for (conn = batch; conn; conn = conn->next_commit) {
+         if (durability_batch_sync(&synced, conn->file_fd) == 0 &&
+             commit_staging_file(conn->file_fd, conn->staging_path, conn->target_path) == 0) {
+             manifest_record(conn->target_path, conn->file_fd, conn->summed ? &conn->crc : NULL);
+             conn->state = CONN_BODY;
+             count++;
+         }
+     }
+     durability_batch_init(&synced);
+     
+     /* Report each result and resume reading pipelined requests */
+     for (conn = batch; conn; conn = next) {
+         next = conn->next_commit;
+         conn->next_commit = NULL;
+         published = conn->state == CONN_BODY && durability_batch_sync(&synced, conn->file_fd) == 0;
+         close(conn->file_fd);
+         conn->file_fd = -1;
+         
+         if (published) {
+             metrics_observe(METRICS_PHASE_PUBLISH, flush_start);
+             log_debug("File transfer completed: %s -> %s", conn->request.filename, conn->target_path);
+             finish_request(reactor, conn, STATUS_SUCCESS);
+         } else {
+             finish_request(reactor, conn, STATUS_FILE_ERROR);
+         }
+         if (conn->state != CONN_CLOSED) {
+             schedule_ready(reactor, conn);
+         }
+     }
+     
+     log_info("Group commit published %d uploads", count);
+ }
+ 
+ /* Queue READY, with the delta signatures if there are any, and start receiving the body */
+ static void send_ready(reactor_t *reactor, connection_t *conn) {
+     proto_signature_t *signatures = conn->signatures;
+     size_t capacity;
+     
+     conn->signatures = NULL;
+     if ((conn->resume || conn->compress || conn->delta) && !conn->chunk_buf) {
+         conn->chunk_buf = bufpool_get(&buffer_pool, PROTO_CHUNK_SIZE, &capacity);
+         if (!conn->chunk_buf) {
+             free(signatures);
+             finish_request(reactor, conn, STATUS_UNKNOWN_ERROR);
+             return;
+         }
+     }
+     
+     if (conn->resume && conn->total_received > 0) {
+         log_debug("Resuming %s at byte %lld", conn->request.filename, (long long)conn->total_received);
+     }
+     
+     /* Acknowledge ready to receive file, telling a resuming client where to start
+      * and a delta one the size of the existing file, whose signatures follow */
+     if (conn->delta) {
+         conn->state = CONN_DELTA;
+     } else {
+         conn->state = conn->resume ? CONN_CHUNK : (conn->compress ? CONN_BLOCK : CONN_BODY);
+     }
+     conn->in_received = 0;
+     conn->checksum = !conn->resume && (conn->request.flags & PROTO_FLAG_CHECKSUM) != 0;
+     
+     /* A checksummed or digested body goes through the buffer: reading spliced bytes back
+      * from the file would stall the loop for the whole body */
+     conn->use_splice = zero_copy_receive && !conn->resume && !conn->compress && !conn->delta &&
+                        !conn->checksum && !conn->hashing;
+     
+     /* The manifest's checksum is kept as the body arrives, unless part of it is already
+      * staged or it bypasses user space */
+     conn->summed = conn->total_received == 0 && !conn->use_splice;
+     conn->crc = 0;
+     conn->chunk_size = netio_chunk_size(conn->filesize);
+     if (tune_socket_buffers) {
+         netio_tune_socket(conn->fd, SO_RCVBUF, conn->chunk_size);
+     }
+     conn->body_started = metrics_now();
+     if (signatures) {
+         conn->attachment = (char *)signatures;
+         conn->attachment_len = proto_delta_block_count(conn->basis_size) * sizeof(proto_signature_t);
+         conn->attachment_sent = 0;
+         conn->attachment_at = conn->out_len + sizeof(proto_response_t);
+     }
+     queue_reply(reactor, conn, STATUS_READY,
+                 (conn->resume ? PROTO_FLAG_RESUME : 0) | (conn->checksum ? PROTO_FLAG_CHECKSUM : 0) |
+                 (conn->compress ? PROTO_FLAG_COMPRESS : 0) | (conn->delta ? PROTO_FLAG_DELTA : 0),
+                 conn->delta ? conn->basis_size : (uint64_t)conn->total_received);
+     
+     if ((conn->state == CONN_BODY || conn->state == CONN_CHUNK || conn->state == CONN_BLOCK ||
+          conn->state == CONN_DELTA) && conn->total_received >= conn->filesize) {
+         body_complete(reactor, conn);
+     }
+ }
+ 
+ /* Act on a complete request: open a session or start receiving a file */
+ static void begin_body(reactor_t *reactor, connection_t *conn) {
+     range_upload_t *upload;
+     uint64_t token;
+     int status;
+     
+     /* Session setup verifies access once for every file that follows */
+     if (conn->request.opcode == PROTO_OP_SESSION) {
+         status = begin_session(&conn->session, &conn->request);
+         log_info("Client %d opened a session as %s for %s: status %d", conn->client_id,
+                  conn->request.username, conn->request.target_dir, status);
+         if (status != STATUS_SUCCESS) {
+             finish_with_status(reactor, conn, status);
+             return;
+         }
+         conn->state = CONN_HEADER;
+         conn->in_received = 0;
+         queue_reply(reactor, conn, STATUS_SUCCESS, PROTO_FLAG_SESSION, 0);
+         return;
+     }
+     
+     log_debug("Client %d: user %s, directory %s, file %s (%llu bytes)", conn->client_id,
+               conn->request.username, conn->request.target_dir, conn->request.filename,
+               (unsigned long long)conn->request.size);
+     
+     /* Downloads and listings answer with READY and their body instead of receiving one */
+     if (conn->request.opcode == PROTO_OP_GET || conn->request.opcode == PROTO_OP_LIST) {
+         conn->request_started = metrics_now();
+         conn->total_received = 0;
+         begin_send(reactor, conn);
+         return;
+     }
+     
+     if (conn->request.opcode != PROTO_OP_PUT && conn->request.opcode != PROTO_OP_RANGE &&
+         conn->request.opcode != PROTO_OP_COMMIT) {
+         finish_with_status(reactor, conn, STATUS_PROTOCOL_ERROR);
+         return;
+     }
+     conn->range = 0;
+     conn->range_offset = 0;
+     conn->body_started = 0;
+     conn->dedup = 0;
+     conn->hashing = 0;
+     conn->delta = 0;
+     conn->checksum = 0;
+     conn->summed = 0;
+     conn->request_started = metrics_now();
+     
+     /* Opening a parallel upload answers with its token instead of READY */
+     if (conn->request.opcode == PROTO_OP_PUT && (conn->request.flags & PROTO_FLAG_PARALLEL)) {
+         status = open_parallel_upload(&conn->request, &conn->session, &token);
+         conn->total_received = (status == STATUS_SUCCESS) ? (off_t)token : 0;
+         finish_request(reactor, conn, status);
+         return;
+     }
+     
+     /* All ranges arrived: adopt the staging file and publish it like any other upload */
+     if (conn->request.opcode == PROTO_OP_COMMIT) {
+         status = rangetable_take(&range_uploads, &conn->request, &upload);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+     
+         /* Publishing replaces target_path, so it waits for any upload writing it; the loop
+          * cannot wait, so the upload goes back in the table for the client's retry */
+         conn->path_lock = pathlock_try_acquire(&path_locks, upload->target_path);
+         if (!conn->path_lock) {
+             status = (errno == EBUSY) ? STATUS_BUSY : STATUS_UNKNOWN_ERROR;
+             log_info("Client %d: %s is being written by another upload", conn->client_id, upload->target_path);
+             rangetable_return(&range_uploads, upload);
+             finish_request(reactor, conn, status);
+             return;
+         }
+         conn->file_fd = upload->file_fd;
+         upload->file_fd = -1;
+         strcpy(conn->target_path, upload->target_path);
+         strcpy(conn->staging_path, upload->staging_path);
+         conn->access = upload->access;
+         conn->filesize = upload->filesize;
+         conn->total_received = upload->filesize;
+         conn->summed = (rangetable_checksum(upload, &conn->crc) == 0);
+         rangetable_free_upload(upload);
+         complete_transfer(reactor, conn);
+         return;
+     }
+     
+     /* Failures before READY leave the stream aligned, so a session can continue */
+     if (conn->request.opcode == PROTO_OP_RANGE) {
+         status = rangetable_claim(&range_uploads, &conn->request, &conn->file_fd, &conn->range_offset);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+         status = quota_admit(conn->request.username, resolve_target_dir(conn->request.target_dir),
+                              &conn->session.ticket);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+         conn->range = 1;
+         conn->filesize = (off_t)conn->request.size;
+         conn->staging_path[0] = '\0';
+         conn->resume = 0;
+         conn->compress = 0;
+     } else {
+         status = prepare_file_transfer(&conn->request, &conn->session, conn->target_path, &conn->access);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+         
+         conn->filesize = (off_t)conn->request.size;
+         if (conn->filesize < 0) {
+             log_warn("Invalid file size: %lld", (long long)conn->filesize);
+             finish_request(reactor, conn, STATUS_FILE_ERROR);
+             return;
+         }
+         
+         log_debug("Expected file size: %lld bytes", (long long)conn->filesize);
+         
+         /* Charged to the user's and directory's quotas until its status is recorded */
+         status = quota_admit(conn->request.username, resolve_target_dir(conn->request.target_dir),
+                              &conn->session.ticket);
+         if (status != STATUS_SUCCESS) {
+             finish_request(reactor, conn, status);
+             return;
+         }
+         
+         /* One writer per destination, or two resumers would interleave chunks in the same
+          * staging file; the loop cannot wait for the other, so the client tries again later */
+         conn->path_lock = pathlock_try_acquire(&path_locks, conn->target_path);
+         if (!conn->path_lock) {
+             log_info("Client %d: %s is being written by another upload", conn->client_id, conn->target_path);
+             finish_request(reactor, conn, errno == EBUSY ? STATUS_BUSY : STATUS_UNKNOWN_ERROR);
+             return;
+         }
+         
+         /* Content the store already holds is cloned rather than received: no READY, no body */
+         if (dedup_requested(&conn->request)) {
+             conn->file_fd = dedup_clone(&conn->request, conn->target_path, conn->staging_path, &conn->crc,
+                                         &conn->summed);
+             if (conn->file_fd >= 0) {
+                 conn->total_received = 0;
+                 complete_transfer(reactor, conn);
+                 return;
+             }
+             conn->dedup = 1;
+         }
+         
+         /* Write into a staging file; the destination only changes once it is complete */
+         conn->resume = (conn->request.flags & PROTO_FLAG_RESUME) != 0;
+         conn->compress = !conn->resume && (conn->request.flags & PROTO_FLAG_COMPRESS) != 0;
+         conn->file_fd = open_staging_file(conn->target_path, conn->resume, conn->filesize,
+                                           conn->staging_path, &conn->total_received);
+         if (conn->file_fd < 0) {
+             finish_request(reactor, conn, STATUS_FILE_ERROR);
+             return;
+         }
+         
+         /* The store digest is kept as the body arrives, unless part of it is already staged */
+         conn->hashing = conn->dedup && conn->total_received == 0;
+         if (conn->hashing) {
+             sha256_init(&conn->sha);
+         }
+         
+         /* A delta upload is rebuilt from the existing file, if there is one. Signing it can
+          * take a while, so it is done a buffer per pass and READY follows. */
+         if (!conn->resume && (conn->request.flags & PROTO_FLAG_DELTA)) {
+             conn->signatures = open_delta_basis(conn->target_path, &conn->basis_fd, &conn->basis_size);
+             if (conn->signatures) {
+                 conn->sign_offset = 0;
+                 conn->state = CONN_SIGN;
+                 return;
+             }
+         }
+     }
+     send_ready(reactor, conn);
+ }
+ 
+ /* Consume one chunk of input for the current state; returns bytes read or recv result */
+ static ssize_t read_step(reactor_t *reactor, connection_t *conn) {
+     ssize_t bytes_read, bytes_written, field_bytes;
+     quota_ticket_t *ticket = conn->session.ticket;
+     size_t wanted;
+     int status;
+     
+     switch (conn->state) {
+         case CONN_HEADER:
+             bytes_read = recv(conn->fd, (char *)&conn->header + conn->in_received,
+                               sizeof(conn->header) - conn->in_received, 0);
+             if (bytes_read > 0) {
+                 conn->in_received += bytes_read;
+                 if (conn->in_received == sizeof(conn->header)) {
+                     field_bytes = proto_parse_header(&conn->header, &conn->request);
+                     if (field_bytes < 0) {
+                         log_warn("Client %d sent a malformed request", conn->client_id);
+                         finish_with_status(reactor, conn, STATUS_PROTOCOL_ERROR);
+                     } else {
+                         conn->field_bytes = field_bytes;
+                         conn->in_received = 0;
+                         conn->state = CONN_FIELDS;
+                     }
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_FIELDS:
+             bytes_read = recv(conn->fd, conn->fields + conn->in_received,
+                               conn->field_bytes - conn->in_received, 0);
+             if (bytes_read > 0) {
+                 conn->in_received += bytes_read;
+                 if (conn->in_received == conn->field_bytes) {
+                     if (proto_parse_fields(conn->fields, &conn->request) < 0) {
+                         log_warn("Client %d sent a malformed request", conn->client_id);
+                         finish_with_status(reactor, conn, STATUS_PROTOCOL_ERROR);
+                     } else {
+                         begin_body(reactor, conn);
+                     }
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_CHUNK:
+             bytes_read = recv(conn->fd, (char *)&conn->chunk + conn->in_received,
+                               sizeof(conn->chunk) - conn->in_received, 0);
+             if (bytes_read > 0) {
+                 conn->in_received += bytes_read;
+                 if (conn->in_received == sizeof(conn->chunk)) {
+                     if (proto_parse_chunk(&conn->chunk, conn->filesize - conn->total_received) < 0) {
+                         log_warn("Client %d sent an invalid chunk length %u",
+                                  conn->client_id, conn->chunk.length);
+                         finish_with_status(reactor, conn, STATUS_PROTOCOL_ERROR);
+                     } else {
+                         conn->in_received = 0;
+                         conn->state = CONN_BODY;
+                     }
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_BLOCK:
+             bytes_read = recv(conn->fd, (char *)&conn->block + conn->in_received,
+                               sizeof(conn->block) - conn->in_received, 0);
+             if (bytes_read > 0) {
+                 conn->in_received += bytes_read;
+                 if (conn->in_received == sizeof(conn->block)) {
+                     if (proto_parse_block(&conn->block, conn->filesize - conn->total_received) < 0) {
+                         log_warn("Client %d sent an invalid block length %u (%u packed)",
+                                  conn->client_id, conn->block.length, conn->block.packed_length);
+                         finish_with_status(reactor, conn, STATUS_PROTOCOL_ERROR);
+                     } else {
+                         conn->in_received = 0;
+                         conn->state = CONN_BODY;
+                     }
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_DELTA:
+             bytes_read = recv(conn->fd, (char *)&conn->op + conn->in_received,
+                               sizeof(conn->op) - conn->in_received, 0);
+             if (bytes_read > 0) {
+                 conn->in_received += bytes_read;
+                 if (conn->in_received == sizeof(conn->op)) {
+                     conn->in_received = 0;
+                     if (proto_parse_delta(&conn->op, (uint64_t)(conn->filesize - conn->total_received),
+                                           conn->basis_size) < 0) {
+                         log_warn("Client %d sent an invalid delta instruction: block %u, %u bytes",
+                                  conn->client_id, conn->op.block, conn->op.length);
+                         finish_with_status(reactor, conn, STATUS_PROTOCOL_ERROR);
+                     } else if (conn->op.block == PROTO_DELTA_LITERAL) {
+                         conn->state = CONN_BODY;
+                     } else {
+                         /* Copies come from the server's own file, a buffer per pass */
+                         conn->state = CONN_COPY;
+                     }
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_SIGN:
+             /* One buffer of the basis per pass, however large the file */
+             if (delta_sign_step(conn->basis_fd, conn->basis_size, &conn->sign_offset, conn->signatures,
+                                 reactor->buffer, reactor->buffer_size) < 0) {
+                 /* Without signatures the body is simply sent whole */
+                 log_errno("sign delta basis");
+                 free(conn->signatures);
+                 conn->signatures = NULL;
+                 close(conn->basis_fd);
+                 conn->basis_fd = -1;
+                 send_ready(reactor, conn);
+             } else if (conn->sign_offset >= conn->basis_size) {
+                 log_debug("Signed %s: %llu blocks of %u bytes", conn->target_path,
+                           (unsigned long long)proto_delta_block_count(conn->basis_size),
+                           proto_delta_block_size(conn->basis_size));
+                 conn->delta = 1;
+                 conn->compress = 0;
+                 send_ready(reactor, conn);
+             }
+             return yield_connection(reactor, conn);
+             
+         case CONN_COPY:
+             /* A copy may span the whole basis, so it too is applied a buffer per pass */
+             status = store_delta_step(conn->file_fd, conn->basis_fd, conn->basis_size, &conn->op,
+                                       reactor->buffer, reactor->buffer_size, &conn->total_received,
+                                       conn->summed ? &conn->crc : NULL, conn->hashing ? &conn->sha : NULL);
+             if (status != STATUS_SUCCESS) {
+                 finish_with_status(reactor, conn, status);
+             } else if (conn->op.length == 0) {
+                 if (conn->total_received >= conn->filesize) {
+                     body_complete(reactor, conn);
+                 } else {
+                     conn->state = CONN_DELTA;
+                 }
+             }
+             return yield_connection(reactor, conn);
+             
+         case CONN_BODY:
+             /* Delta literal: collect it whole, then store it */
+             if (conn->delta) {
+                 wanted = quota_grant(ticket, conn->op.length - conn->in_received);
+                 if (wanted == 0) {
+                     return throttle_connection(reactor, conn);
+                 }
+                 bytes_read = recv(conn->fd, conn->chunk_buf + conn->in_received, wanted, 0);
+                 quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+                 if (bytes_read > 0) {
+                     conn->in_received += bytes_read;
+                     if (conn->in_received == conn->op.length) {
+                         status = store_delta(conn->file_fd, conn->basis_fd, conn->basis_size, &conn->op,
+                                              conn->chunk_buf, NULL, 0, &conn->total_received,
+                                              conn->summed ? &conn->crc : NULL,
+                                              conn->hashing ? &conn->sha : NULL);
+                         conn->in_received = 0;
+                         if (status != STATUS_SUCCESS) {
+                             finish_with_status(reactor, conn, status);
+                         } else if (conn->total_received >= conn->filesize) {
+                             body_complete(reactor, conn);
+                         } else {
+                             conn->state = CONN_DELTA;
+                         }
+                     }
+                 }
+                 return bytes_read;
+             }
+             
+             /* Resumable body: collect the whole chunk, then verify and store it */
+             if (conn->resume) {
+                 wanted = quota_grant(ticket, conn->chunk.length - conn->in_received);
+                 if (wanted == 0) {
+                     return throttle_connection(reactor, conn);
+                 }
+                 bytes_read = recv(conn->fd, conn->chunk_buf + conn->in_received, wanted, 0);
+                 quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+                 if (bytes_read > 0) {
+                     conn->in_received += bytes_read;
+                     if (conn->in_received == conn->chunk.length) {
+                         status = store_chunk(conn->file_fd, &conn->chunk, conn->chunk_buf,
+                                              &conn->total_received, conn->summed ? &conn->crc : NULL);
+                         conn->in_received = 0;
+                         if (status == STATUS_SUCCESS && conn->hashing) {
+                             sha256_update(&conn->sha, conn->chunk_buf, conn->chunk.length);
+                         }
+                         if (status != STATUS_SUCCESS) {
+                             finish_with_status(reactor, conn, status);
+                         } else if (conn->total_received >= conn->filesize) {
+                             complete_transfer(reactor, conn);
+                         } else {
+                             conn->state = CONN_CHUNK;
+                         }
+                     }
+                 }
+                 return bytes_read;
+             }
+             
+             /* Compressed body: collect the whole block, then expand it through the shared buffer */
+             if (conn->compress) {
+                 wanted = quota_grant(ticket, PROTO_BLOCK_PAYLOAD(&conn->block) - conn->in_received);
+                 if (wanted == 0) {
+                     return throttle_connection(reactor, conn);
+                 }
+                 bytes_read = recv(conn->fd, conn->chunk_buf + conn->in_received, wanted, 0);
+                 quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+                 if (bytes_read > 0) {
+                     conn->in_received += bytes_read;
+                     if (conn->in_received == PROTO_BLOCK_PAYLOAD(&conn->block)) {
+                         status = store_block(conn->file_fd, &conn->block, conn->chunk_buf, reactor->buffer,
+                                              &conn->total_received, conn->summed ? &conn->crc : NULL,
+                                              conn->hashing ? &conn->sha : NULL);
+                         conn->in_received = 0;
+                         if (status != STATUS_SUCCESS) {
+                             finish_with_status(reactor, conn, status);
+                         } else if (conn->total_received >= conn->filesize) {
+                             body_complete(reactor, conn);
+                         } else {
+                             conn->state = CONN_BLOCK;
+                         }
+                     }
+                 }
+                 return bytes_read;
+             }
+             
+             /* Never read past the announced body so the status exchange stays aligned */
+             wanted = (size_t)(conn->filesize - conn->total_received);
+             if (wanted > conn->chunk_size) {
+                 wanted = conn->chunk_size;
+             }
+             /* Zero-copy path: the socket is non-blocking so splice reports EAGAIN */
+             if (conn->use_splice) {
+                 wanted = quota_grant(ticket, (size_t)(conn->filesize - conn->total_received));
+                 if (wanted == 0) {
+                     return throttle_connection(reactor, conn);
+                 }
+                 bytes_read = splice_socket_to_file(conn->fd, conn->file_fd, wanted, SPLICE_F_NONBLOCK);
+                 quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+                 if (bytes_read < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                     /* Not supported for this socket/file pair: use the buffered path */
+                     conn->use_splice = 0;
+                     errno = EINTR;
+                     return -1;
+                 }
+                 if (bytes_read > 0) {
+                     conn->total_received += bytes_read;
+                     if (conn->total_received >= conn->filesize) {
+                         body_complete(reactor, conn);
+                     }
+                 }
+                 return bytes_read;
+             }
+             
+             wanted = quota_grant(ticket, wanted);
+             if (wanted == 0) {
+                 return throttle_connection(reactor, conn);
+             }
+             bytes_read = recv(conn->fd, reactor->buffer, wanted, 0);
+             quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+             if (bytes_read > 0) {
+                 bytes_written = write(conn->file_fd, reactor->buffer, bytes_read);
+                 if (bytes_written != bytes_read) {
+                     log_errno("write file data");
+                     finish_with_status(reactor, conn, STATUS_FILE_ERROR);
+                     return bytes_read;
+                 }
+                 
+                 /* Checksum while the bytes are still in cache */
+                 if (conn->summed) {
+                     conn->crc = crc32c_update(conn->crc, reactor->buffer, bytes_read);
+                 }
+                 if (conn->hashing) {
+                     sha256_update(&conn->sha, reactor->buffer, (size_t)bytes_read);
+                 }
+                 
+                 conn->total_received += bytes_read;
+                 if (conn->total_received >= conn->filesize) {
+                     body_complete(reactor, conn);
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_TRAILER:
+             bytes_read = recv(conn->fd, (char *)&conn->trailer + conn->in_received,
+                               sizeof(conn->trailer) - conn->in_received, 0);
+             if (bytes_read > 0) {
+                 conn->in_received += bytes_read;
+                 if (conn->in_received == sizeof(conn->trailer)) {
+                     conn->in_received = 0;
+                     check_trailer(reactor, conn);
+                 }
+             }
+             return bytes_read;
+             
+         case CONN_STATUS:
+         case CONN_CLOSED:
+         default:
+             /* Nothing more is expected from the client; discard stray input */
+             return recv(conn->fd, reactor->buffer, reactor->buffer_size, 0);
+     }
+ }
+ 
+ /* Drain readable input until EAGAIN, or until the read budget is spent */
+ static void service_input(reactor_t *reactor, connection_t *conn) {
+     ssize_t bytes_read;
+     int budget = REACTOR_READ_BUDGET;
+     
+     while (budget-- > 0) {
+         /* Input waits until the pending commit is published or the download is out;
+          * edge triggers are replayed then */
+         if (conn->state == CONN_CLOSED || conn->state == CONN_COMMIT || conn->state == CONN_SEND) {
+             return;
+         }
+         
+         bytes_read = read_step(reactor, conn);
+         if (bytes_read == 0) {
+             /* Peer closed the connection */
+             if (conn->state != CONN_CLOSED) {
+                 if (conn->state == CONN_BODY || conn->state == CONN_CHUNK || conn->state == CONN_BLOCK ||
+                     conn->state == CONN_DELTA) {
+                     log_warn("recv file data: connection closed by client %d", conn->client_id);
+                 }
+                 release_connection(reactor, conn);
+             }
+             return;
+         }
+         if (bytes_read < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                 log_errno("recv");
+                 release_connection(reactor, conn);
+             }
+             return;
+         }
+     }
+     
+     /* Budget exhausted with data possibly still pending: revisit after other events */
+     if (conn->state != CONN_CLOSED) {
+         schedule_ready(reactor, conn);
+     }
+ }
+ 
+ /* Tear down a connection; memory is reclaimed later from the ready list */
+ static void release_connection(reactor_t *reactor, connection_t *conn) {
+     int committing;
+     
+     if (conn->state == CONN_CLOSED) {
+         return;
+     }
+     
+     epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+     close(conn->fd);
+     end_transfer(conn);
+     release_attachment(conn);
+     bufpool_put(&buffer_pool, conn->chunk_buf, PROTO_CHUNK_SIZE);
+     conn->chunk_buf = NULL;
+     committing = (conn->state == CONN_COMMIT);
+     conn->state = CONN_CLOSED;
+     quota_release(conn->session.ticket);
+     conn->session.ticket = NULL;
+     reactor->active_connections--;
+     metrics_count(METRICS_CONNECTIONS_CLOSED);
+     
+     if (conn->session.persistent) {
+         log_info("Client %d session closed after %lu files", conn->client_id, conn->session.files);
+     }
+     
+     log_info("Client %d disconnected. Total active clients: %d", conn->client_id, reactor->active_connections);
+     
+     /* Callers may still hold the pointer, so defer the free to the ready pass
+      * (or to the group commit or throttled list that still links it) */
+     if (!committing && !conn->throttled) {
+         schedule_ready(reactor, conn);
+     }
+ }
+ 
+ /* Accept every pending connection on the listening socket */
+ static void accept_connections(reactor_t *reactor) {
+     struct sockaddr_in client_addr;
+     socklen_t client_addr_len;
+     struct epoll_event event;
+     connection_t *conn;
+     uint64_t accepted_ns;
+     int client_socket;
+     
+     while (1) {
+         client_addr_len = sizeof(client_addr);
+         client_socket = accept4(reactor->listen_fd, (struct sockaddr *)&client_addr,
+                                 &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+         if (client_socket < 0) {
+             if (errno == EINTR || errno == ECONNABORTED) {
+                 continue;
+             }
+             if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                 log_errno("accept");
+             }
+             return;
+         }
+         
+         /* The accept phase here is only the setup before the loop can serve it */
+         accepted_ns = metrics_now();
+         
+         /* Create connection state */
+         conn = calloc(1, sizeof(connection_t));
+         if (!conn) {
+             log_errno("calloc");
+             close(client_socket);
+             continue;
+         }
+         conn->fd = client_socket;
+         conn->file_fd = -1;
+         conn->basis_fd = -1;
+         conn->send_fd = -1;
+         conn->client_id = reactor->next_client_id;
+         reactor->next_client_id += reactor->client_id_step;
+         conn->state = CONN_HEADER;
+         
+         /* Watch for both directions once; edge triggering avoids re-arming */
+         event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+         event.data.ptr = conn;
+         if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+             log_errno("epoll_ctl add client");
+             close(client_socket);
+             free(conn);
+             continue;
+         }
+         
+         reactor->active_connections++;
+         metrics_count(METRICS_CONNECTIONS_ACCEPTED);
+         metrics_observe(METRICS_PHASE_ACCEPT, accepted_ns);
+         log_info("New connection from %s:%d. Client ID: %d",
+                  inet_ntoa(client_addr.sin_addr),
+                  ntohs(client_addr.sin_port),
+                  conn->client_id);
+     }
+ }
+ 
+ /* Prepare a reactor to serve connections from a listening socket */
+ int reactor_init(reactor_t *reactor, int listen_fd) {
+     struct epoll_event event;
+     
+     memset(reactor, 0, sizeof(*reactor));
+     reactor->listen_fd = listen_fd;
+     reactor->client_id_step = 1;
+     
+     /* One buffer of the largest chunk size serves every connection in turn */
+     reactor->buffer = bufpool_get(&buffer_pool, NETIO_MAX_CHUNK, &reactor->buffer_size);
+     if (!reactor->buffer) {
+         return -1;
+     }
+     
+     if (set_nonblocking(listen_fd) < 0) {
+         return -1;
+     }
+     
+     reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+     if (reactor->epoll_fd < 0) {
+         log_errno("epoll_create1");
+         bufpool_put(&buffer_pool, reactor->buffer, reactor->buffer_size);
+         return -1;
+     }
+     
+     /* The listener is identified by a NULL data pointer */
+     event.events = EPOLLIN | EPOLLET;
+     event.data.ptr = NULL;
+     if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+         log_errno("epoll_ctl add listener");
+         close(reactor->epoll_fd);
+         bufpool_put(&buffer_pool, reactor->buffer, reactor->buffer_size);
+         return -1;
+     }
+     
+     return 0;
+ }
+ 
+ /* Run the event loop until a fatal error occurs */
+ int reactor_run(reactor_t *reactor) {
+     struct epoll_event events[REACTOR_MAX_EVENTS];
+     connection_t *conn, *ready;
+     int i, count;
+     
+     while (1) {
+         /* Poll without blocking while budget-limited connections are waiting,
+          * and wake up in time for the first throttled one */
+         count = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS,
+                            reactor->ready_head ? 0 : throttle_timeout(reactor));
+         if (count < 0) {
+             if (errno == EINTR) {
+                 continue;
+             }
+             log_errno("epoll_wait");
+             return -1;
+         }
+         
+         for (i = 0; i < count; i++) {
+             conn = events[i].data.ptr;
+             if (!conn) {
+                 accept_connections(reactor);
+                 continue;
+             }
+             if (conn->state == CONN_CLOSED) {
+                 continue;
+             }
+             
+             if (events[i].events & EPOLLOUT) {
+                 flush_output(reactor, conn);
+             }
+             if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                 service_input(reactor, conn);
+             }
+         }
+         
+         /* Give each budget-limited or newly unthrottled connection one more pass
+          * and reclaim closed ones */
+         wake_throttled(reactor);
+         ready = reactor->ready_head;
+         reactor->ready_head = reactor->ready_tail = NULL;
+         while (ready) {
+             conn = ready;
+             ready = ready->next_ready;
+             conn->on_ready_list = 0;
+             
+             if (conn->state == CONN_CLOSED) {
+                 /* A throttled connection is freed once it leaves that list */
+                 if (!conn->throttled) {
+                     free(conn);
+                 }
+             } else {
+                 service_input(reactor, conn);
+             }
+         }
+         
+         /* Publish the uploads completed during this pass together */
+         flush_commits(reactor);
+     }
+     
+     return 0;
+ }
+ 
+ /* Release reactor resources (the listening socket is left open) */
+ void reactor_destroy(reactor_t *reactor) {
+     connection_t *conn;
+     
+     /* Free connections that were closed while still queued */
+     while ((conn = reactor->ready_head) != NULL) {
+         reactor->ready_head = conn->next_ready;
+         if (conn->state == CONN_CLOSED) {
+             free(conn);
+         }
+     }
+     
+     if (reactor->epoll_fd >= 0) {
+         close(reactor->epoll_fd);
+     }
+     
+     bufpool_put(&buffer_pool, reactor->buffer, reactor->buffer_size);
+     reactor->buffer = NULL;
+ }
@@ -0,0 +1,126 @@
+/* reactor.h - Header file for the epoll event-driven server core
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the reactor including:
+ * - Per-connection transfer state machine, for uploads and downloads
+ * - Delta signing and copies done a buffer at a time, between passes over other connections
+ * - Reactor instance owning an epoll set and a listening socket
+ * - Function prototypes for running the event loop
+ */
+
+ #ifndef REACTOR_H
+ #define REACTOR_H
+ 
+ #include "server.h"
+ #include "pathlock.h"
+ 
+ /* Maximum events fetched by a single epoll_wait call */
+ #define REACTOR_MAX_EVENTS 256
+ 
+ /* Maximum reads serviced for one connection before yielding to others */
+ #define REACTOR_READ_BUDGET 64
+ 
+ /* Stages of a single upload, in protocol order */
+ typedef enum {
+     CONN_HEADER,        /* Collecting the fixed-size request header */
+     CONN_FIELDS,        /* Collecting the username, directory and file name */
+     CONN_CHUNK,         /* Reading the prefix of the next resumable chunk */
+     CONN_BLOCK,         /* Reading the prefix of the next compressed block */
+     CONN_SIGN,          /* Signing the delta basis a buffer per pass; READY follows */
+     CONN_DELTA,         /* Reading the next delta instruction */
+     CONN_COPY,          /* Applying a delta copy a buffer per pass */
+     CONN_BODY,          /* Streaming file data (or one chunk's, block's or literal's payload) to disk */
+     CONN_TRAILER,       /* Collecting the checksum trailer after a plain body */
+     CONN_COMMIT,        /* Body complete, waiting for the batched sync to publish it */
+     CONN_SEND,          /* Sending a download or listing; input waits until it is out */
+     CONN_STATUS,        /* Flushing the final status code before closing */
+     CONN_CLOSED         /* Connection finished, pending release */
+ } conn_state_t;
+ 
+ /* Per-connection state tracked by the reactor */
+ typedef struct connection {
+     int fd;
+     int client_id;
+     conn_state_t state;
+     proto_header_t header;
+     proto_request_t request;
+     session_t session;
+     char fields[PROTO_MAX_FIELDS];
+     size_t field_bytes;
+     size_t in_received;
+     char target_path[MAX_PATH_LENGTH];
+     char staging_path[STAGING_PATH_LENGTH];
+     access_decision_t access;
+     pathlock_entry_t *path_lock; /* Held on target_path from the request until its status */
+     int file_fd;
+     off_t filesize;
+     off_t total_received;
+     int use_splice;
+     int checksum;               /* Plain body is followed by a checksum trailer */
+     uint32_t crc;               /* CRC32C of the body bytes received so far */
+     int summed;                 /* crc covers the body from its first byte, for the manifest */
+     proto_trailer_t trailer;
+     size_t chunk_size;          /* Largest single read for this upload, from its size */
+     int resume;                 /* Body arrives as checksummed chunks */
+     proto_chunk_t chunk;        /* Prefix of the chunk being received */
+     int compress;               /* Body arrives as compressed blocks */
+     proto_block_t block;        /* Prefix of the block being received */
+     int delta;                  /* Body arrives as copies from basis_fd and literals */
+     int basis_fd;               /* Existing file a delta upload is rebuilt from */
+     uint64_t basis_size;
+     proto_signature_t *signatures; /* Of basis_fd, until READY takes them as its attachment */
+     uint64_t sign_offset;       /* Bytes of the basis signed so far */
+     proto_delta_t op;           /* Delta instruction being received or applied; a copy shrinks as it is */
+     char *chunk_buf;            /* Chunk, block or literal payload, borrowed from the pool on first use */
+     int range;                  /* Body is one range of a parallel upload */
+     off_t range_offset;         /* Where that range starts in the staging file */
+     uint64_t request_started;   /* When the request was parsed, for its log record */
+     uint64_t body_started;      /* When READY was queued, for the receive phase metric */
+     int dedup;                  /* Body must match its announced digest, then joins the store */
+     int hashing;                /* sha covers the body from its first byte */
+     sha256_t sha;               /* SHA-256 of the body bytes stored so far */
+     unsigned char out_buf[4 * sizeof(proto_response_t)];
+     size_t out_len;
+     size_t out_sent;
+     char *attachment;           /* Delta signatures or a listing, sent after attachment_at bytes of out_buf */
+     int send_fd;                /* Or a download body, sent from this file with sendfile(), or -1 */
+     off_t send_offset;          /* Where the rest of that body starts in the file */
+     size_t attachment_len;
+     size_t attachment_sent;
+     size_t attachment_at;
+     int close_after_flush;
+     int on_ready_list;
+     int throttled;              /* Parked until throttle_until because its quota ran dry */
+     uint64_t throttle_until;
+     struct connection *next_ready;
+     struct connection *next_throttled;
+     struct connection *next_commit;
+ } connection_t;
+ 
+ /* A single event loop and the listening socket it accepts from */
+ typedef struct {
+     int epoll_fd;
+     int listen_fd;
+     int active_connections;
+     int next_client_id;
+     int client_id_step;         /* Shards interleave their client IDs */
+     connection_t *ready_head;
+     connection_t *ready_tail;
+     connection_t *throttled_head; /* Connections waiting for quota tokens */
+     connection_t *commit_head;  /* Uploads sharing the next group commit */
+     char *buffer;               /* Pooled body buffer shared by every connection */
+     size_t buffer_size;
+ } reactor_t;
+ 
+ /* Function prototypes */
+ 
+ /* Prepare a reactor to serve connections from a listening socket */
+ int reactor_init(reactor_t *reactor, int listen_fd);
+ 
+ /* Run the event loop until a fatal error occurs */
+ int reactor_run(reactor_t *reactor);
+ 
+ /* Release reactor resources (the listening socket is left open) */
+ void reactor_destroy(reactor_t *reactor);
+ 
+ #endif /* REACTOR_H */
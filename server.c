@@ -3,46 +3,431 @@
  *
  * This file implements the server functionality:
  * - Socket initialization and connection handling
- * - Multithreaded client processing
+ * - Multithreaded or epoll event-driven client processing
+ * - Event loops sharded across cores on SO_REUSEPORT listeners
  * - File transfer management with user permissions
+ * - Staged, resumable uploads with per-chunk CRC32C checks
+ * - Decompression of uploads sent as LZ-compressed blocks
+ * - Parallel uploads of one file as ranges over several connections
+ * - Atomic publication of uploads with a configurable fsync policy
  * - File ownership attribution
- * - Thread synchronization using mutex
+ * - Thread synchronization using per-destination path locks
+ * - Per-phase latency and throughput metrics on a control socket
+ * - Structured logging through an asynchronous, non-blocking logger
+ * - Per-user and per-directory concurrency caps and fairly shared rate limits
+ * - Deduplicated uploads cloned from a content-addressed store
+ * - Delta uploads rebuilt from block copies of the existing file and literal data
+ * - Settings from a configuration file and the command line, reloaded on SIGHUP
+ * - Downloads of whole files or byte ranges, and directory listings
+ * - A manifest of each directory, answering listings and "changed since" queries
  */
 
  #include "server.h"
+ #include "reactor.h"
+ #include "uring.h"
+ #include "shard.h"
+ #include "workpool.h"
+ #include "pathlock.h"
+ #include "rangetable.h"
+ #include "bufpool.h"
+ #include "netio.h"
+ #include "durability.h"
+ #include "lzblock.h"
+ #include "metrics.h"
+ #include "quota.h"
+ #include "dedup.h"
+ #include "delta.h"
+ #include "download.h"
+ #include "manifest.h"
+ #include <signal.h>
+ #include <semaphore.h>
 
  /* Global variables */
- pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+ pathlock_table_t path_locks;
+ rangetable_t range_uploads;
+ bufpool_t buffer_pool;
+ int zero_copy_receive = 0;
+ int tune_socket_buffers = 0;
  int active_clients = 0;
  
+ /* Listening sockets, whose options a configuration reload applies again */
+ static int listeners[SHARD_MAX];
+ static int listener_count;
+ static pthread_mutex_t listener_lock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ /* Posted by SIGHUP for the reload thread, since a reload cannot run in a handler */
+ static sem_t reload_requested;
+ 
+ /* Configuration the listeners and workers were set up with */
+ static const config_t *startup_config;
+ 
+ /* Drop cached credentials so passwd/group edits apply without a restart,
+  * reopen the log file after an external rotation, and re-read the configuration */
+ static void handle_sighup(int signo) {
+     (void)signo;
+     credcache_invalidate();
+     logger_reopen();
+     sem_post(&reload_requested);
+ }
+ 
+ /* Apply a reloaded configuration to what is already running */
+ static void apply_reloaded_config(const config_t *config) {
+     const char *option = NULL;
+     int i;
+     
+     /* Sockets already bound and threads already started keep what they were given */
+     if (memcmp(&startup_config->listen, &config->listen, sizeof(config->listen)) != 0 ||
+         startup_config->backlog != config->backlog || startup_config->workers != config->workers ||
+         startup_config->uring_slots != config->uring_slots ||
+         startup_config->uring_buffers != config->uring_buffers) {
+         log_warn("listen, backlog, workers, uring_slots and uring_buffers changes take effect after a restart");
+     }
+     
+     /* New connections inherit the listeners' options; open ones keep their own */
+     pthread_mutex_lock(&listener_lock);
+     for (i = 0; i < listener_count; i++) {
+         if (config_apply_socket(listeners[i], config, &option) < 0) {
+             log_errno(option);
+         }
+     }
+     pthread_mutex_unlock(&listener_lock);
+     
+     /* Directories added by the reload need a content store and a manifest before they are used */
+     if (dedup_enabled) {
+         dedup_prepare(config);
+     }
+     if (manifest_prepare(config) < 0) {
+         log_error("Directories added by the reload are not indexed");
+     }
+ }
+ 
+ /* Re-read the configuration each time SIGHUP asks; transfers in progress keep the
+  * directories they resolved, since snapshots are never freed while the server runs */
+ static void *reload_config(void *arg) {
+     const config_t *config;
+     char error[CONFIG_LINE_LENGTH];
+     
+     (void)arg;
+     while (1) {
+         if (sem_wait(&reload_requested) < 0) {
+             continue;
+         }
+         
+         if (config_reload(error, sizeof(error)) < 0) {
+             log_error("Keeping the current configuration: %s", error);
+             continue;
+         }
+         config = config_current();
+         apply_reloaded_config(config);
+         log_info("Configuration reloaded from %s (%d director%s)", config_path(), config->dir_count,
+                  config->dir_count == 1 ? "y" : "ies");
+     }
+     
+     return NULL;
+ }
+ 
+ /* SIGUSR1 makes the log more verbose, SIGUSR2 less */
+ static void handle_log_level(int signo) {
+     logger_adjust_level(signo == SIGUSR1 ? -1 : 1);
+ }
+ 
  /* Main function */
- int main(void) {
-     int server_socket, client_socket;
-     struct sockaddr_in client_addr;
-     socklen_t client_addr_len = sizeof(client_addr);
-     pthread_t thread_id;
+ int main(int argc, char *argv[]) {
+     int server_socket, opt, result, i;
+     server_mode_t mode = SERVER_MODE_EPOLL;
+     int worker_count;
+     int queue_capacity = 0;
+     int stats_interval = 0;
+     int cache_ttl = CREDCACHE_DEFAULT_TTL;
+     const char *metrics_path = NULL;
+     const char *log_path = NULL;
+     int level = LOG_LEVEL_INFO;
+     long rotate_mb = LOGGER_DEFAULT_ROTATE_MB;
+     int deduplicate = 0;
+     int shard_count = 1;
+     const char *config_file = NULL;
+     const char **quota_specs;
+     int quota_count = 0;
+     char setting[CONFIG_LINE_LENGTH], error[CONFIG_LINE_LENGTH];
+     const config_t *config;
+     pthread_t reload_thread;
+     struct sigaction sa;
+     
+     /* Quotas may name directories from the configuration, so they wait until it is read */
+     quota_specs = calloc((size_t)argc, sizeof(char *));
+     if (!quota_specs) {
+         perror("calloc");
+         return EXIT_FAILURE;
+     }
+     
+     /* Parse command line options */
+     while ((opt = getopt(argc, argv, "m:w:q:s:t:f:M:L:l:S:Q:n:b:F:o:zTDh")) != -1) {
+         switch (opt) {
+             case 'm':
+                 if (strcmp(optarg, "threaded") == 0) {
+                     mode = SERVER_MODE_THREADED;
+                 } else if (strcmp(optarg, "pool") == 0) {
+                     mode = SERVER_MODE_POOL;
+                 } else if (strcmp(optarg, "epoll") == 0) {
+                     mode = SERVER_MODE_EPOLL;
+                 } else if (strcmp(optarg, "uring") == 0) {
+                     mode = SERVER_MODE_URING;
+                 } else {
+                     fprintf(stderr, "Unknown mode: %s\n", optarg);
+                     display_usage();
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'w':
+             case 'b':
+                 /* Shorthands for the settings of the same name */
+                 snprintf(setting, sizeof(setting), "%s=%s", opt == 'w' ? "workers" : "backlog", optarg);
+                 if (config_override(setting) < 0) {
+                     perror("config_override");
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'F':
+                 config_file = optarg;
+                 break;
+             case 'o':
+                 if (config_override(optarg) < 0) {
+                     perror("config_override");
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'q':
+                 queue_capacity = atoi(optarg);
+                 break;
+             case 's':
+                 stats_interval = atoi(optarg);
+                 break;
+             case 't':
+                 cache_ttl = atoi(optarg);
+                 break;
+             case 'f':
+                 if (durability_parse(optarg, &durability_mode) < 0) {
+                     fprintf(stderr, "Unknown durability mode: %s\n", optarg);
+                     display_usage();
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'M':
+                 metrics_path = optarg;
+                 break;
+             case 'L':
+                 log_path = optarg;
+                 break;
+             case 'l':
+                 level = logger_parse_level(optarg);
+                 if (level < 0) {
+                     fprintf(stderr, "Unknown log level: %s\n", optarg);
+                     display_usage();
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'S':
+                 rotate_mb = atol(optarg);
+                 break;
+             case 'Q':
+                 quota_specs[quota_count++] = optarg;
+                 break;
+             case 'n':
+                 shard_count = atoi(optarg);
+                 if (shard_count < 0) {
+                     fprintf(stderr, "Invalid shard count: %s\n", optarg);
+                     display_usage();
+                     return EXIT_FAILURE;
+                 }
+                 break;
+             case 'z':
+                 zero_copy_receive = 1;
+                 break;
+             case 'T':
+                 tune_socket_buffers = 1;
+                 break;
+             case 'D':
+                 deduplicate = 1;
+                 break;
+             case 'h':
+             default:
+                 display_usage();
+                 return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+         }
+     }
+     
+     /* Defaults, then the file, then the command line */
+     if (config_load(config_file, error, sizeof(error)) < 0) {
+         fprintf(stderr, "Invalid configuration: %s\n", error);
+         display_usage();
+         return EXIT_FAILURE;
+     }
+     config = startup_config = config_current();
+     for (i = 0; i < quota_count; i++) {
+         if (quota_configure(quota_specs[i]) < 0) {
+             fprintf(stderr, "Invalid quota: %s\n", quota_specs[i]);
+             display_usage();
+             return EXIT_FAILURE;
+         }
+     }
+     free(quota_specs);
+     
+     /* Size the pool from the core count unless told otherwise */
+     worker_count = (config->workers > 0) ? config->workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+     if (worker_count < 1) {
+         worker_count = 1;
+     }
+     if (queue_capacity < 1) {
+         queue_capacity = worker_count * WORKPOOL_QUEUE_PER_WORKER;
+     }
+     
+     /* Only the event loop cores shard; the threaded cores already spread across cores */
+     shard_count = shard_resolve_count(shard_count);
+     if (mode != SERVER_MODE_EPOLL && mode != SERVER_MODE_URING) {
+         shard_count = 1;
+     }
+     
+     /* Log records are queued by every thread and written out by one */
+     if (logger_start(log_path, rotate_mb > 0 ? (uint64_t)rotate_mb * 1024 * 1024 : 0,
+                      (log_level_t)level) < 0) {
+         return EXIT_FAILURE;
+     }
+     
+     /* A device flush per upload would stall every connection of an event loop, so the
+      * loops share one flush between the uploads finished in a pass instead */
+     if (durability_mode == DURABILITY_FDATASYNC && (mode == SERVER_MODE_EPOLL || mode == SERVER_MODE_URING)) {
+         log_warn("fdatasync durability is for the threaded and pool modes; using group commit");
+         durability_mode = DURABILITY_GROUP;
+     }
+     
+     /* Per-destination file locks */
+     pathlock_init(&path_locks);
+     
+     /* Parallel uploads between their open and commit requests */
+     rangetable_init(&range_uploads);
+     
+     /* Transfer buffers shared by every connection */
+     bufpool_init(&buffer_pool);
+     
+     /* Credential cache, invalidated on SIGHUP */
+     credcache_init(cache_ttl);
+     
+     /* SIGHUP also re-reads the configuration file, off the signal handler */
+     sem_init(&reload_requested, 0, 0);
+     if (config_file && pthread_create(&reload_thread, NULL, reload_config, NULL) == 0) {
+         pthread_detach(reload_thread);
+     }
+     memset(&sa, 0, sizeof(sa));
+     sa.sa_handler = handle_sighup;
+     sa.sa_flags = SA_RESTART;
+     sigemptyset(&sa.sa_mask);
+     if (sigaction(SIGHUP, &sa, NULL) < 0) {
+         log_errno("sigaction");
+     }
+     sa.sa_handler = handle_log_level;
+     if (sigaction(SIGUSR1, &sa, NULL) < 0 || sigaction(SIGUSR2, &sa, NULL) < 0) {
+         log_errno("sigaction");
+     }
+     
+     /* sendfile() has no MSG_NOSIGNAL, and a client leaving mid-download must only cost its connection */
+     sa.sa_handler = SIG_IGN;
+     if (sigaction(SIGPIPE, &sa, NULL) < 0) {
+         log_errno("sigaction");
+     }
+     
+     /* Metrics are always recorded; the control socket only exposes them */
+     metrics_init();
      
      /* Initialize server socket */
-     server_socket = initialize_server();
+     server_socket = initialize_server(config->backlog, shard_count > 1);
      if (server_socket == -1) {
-         fprintf(stderr, "Failed to initialize server. Exiting.\n");
+         log_error("Failed to initialize server. Exiting.");
+         return EXIT_FAILURE;
+     }
+     if (metrics_path && metrics_serve(metrics_path) < 0) {
+         cleanup_server(server_socket);
+         return EXIT_FAILURE;
+     }
+     if (deduplicate && dedup_init() < 0) {
+         cleanup_server(server_socket);
+         return EXIT_FAILURE;
+     }
+     if (manifest_prepare(config) < 0) {
+         cleanup_server(server_socket);
          return EXIT_FAILURE;
      }
      
-     printf("Server initialized. Listening on port %d...\n", PORT);
+     log_info("Server initialized. Listening on %s:%d (%s mode, %s durability)...",
+              inet_ntoa(config->listen.sin_addr), ntohs(config->listen.sin_port),
+              mode == SERVER_MODE_URING ? "uring" :
+              (mode == SERVER_MODE_EPOLL ? "epoll" : (mode == SERVER_MODE_POOL ? "pool" : "threaded")),
+              durability_name(durability_mode));
+     log_info("Accept backlog %d per listener, %d listener%s", config->backlog, shard_count,
+              shard_count > 1 ? "s" : "");
+     log_info("Upload checksums use the %s CRC32C implementation", crc32c_implementation());
+     quota_log_limits();
+     
+     /* Hand the listening socket to the selected server core, or to one per shard */
+     if (shard_count > 1) {
+         result = run_sharded_server(server_socket, mode, shard_count, config->backlog, stats_interval);
+         cleanup_server(-1);
+         return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+     }
+     if (mode == SERVER_MODE_URING) {
+         uring_t *ring = malloc(sizeof(uring_t));
+         
+         if (!ring || uring_init(ring, server_socket, stats_interval) < 0) {
+             /* Kernels or sandboxes without io_uring still get the epoll core */
+             log_warn("io_uring unavailable, falling back to epoll");
+             free(ring);
+             mode = SERVER_MODE_EPOLL;
+         } else {
+             result = uring_run(ring);
+             uring_destroy(ring);
+             free(ring);
+         }
+     }
+     if (mode == SERVER_MODE_EPOLL) {
+         reactor_t reactor;
+         
+         if (reactor_init(&reactor, server_socket) < 0) {
+             cleanup_server(server_socket);
+             return EXIT_FAILURE;
+         }
+         result = reactor_run(&reactor);
+         reactor_destroy(&reactor);
+     } else if (mode == SERVER_MODE_POOL) {
+         result = run_pool_server(server_socket, worker_count, queue_capacity, stats_interval);
+     } else if (mode == SERVER_MODE_THREADED) {
+         result = run_threaded_server(server_socket);
+     }
+     
+     /* Clean up */
+     cleanup_server(server_socket);
+     
+     return (result == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+ }
+ 
+ /* Accept connections and spawn one thread per client */
+ int run_threaded_server(int server_socket) {
+     int client_socket;
+     struct sockaddr_in client_addr;
+     socklen_t client_addr_len = sizeof(client_addr);
+     pthread_t thread_id;
      
      /* Accept and handle client connections */
      while (1) {
          /* Accept new client connection */
+         client_addr_len = sizeof(client_addr);
          client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
          if (client_socket < 0) {
-             perror("accept");
+             log_errno("accept");
              continue;
          }
          
          /* Check if maximum clients limit reached */
-         if (active_clients >= MAX_CLIENTS) {
-             printf("Maximum clients reached. Rejecting connection.\n");
+         if (__atomic_load_n(&active_clients, __ATOMIC_RELAXED) >= config_current()->max_clients) {
+             log_warn("Maximum clients reached. Rejecting connection.");
              close(client_socket);
              continue;
          }
@@ -50,7 +435,7 @@
          /* Create client data structure */
          client_t *client = (client_t *)malloc(sizeof(client_t));
          if (!client) {
-             perror("malloc");
+             log_errno("malloc");
              close(client_socket);
              continue;
          }
@@ -58,19 +443,20 @@
          /* Initialize client data */
          client->client_socket = client_socket;
          client->client_addr = client_addr;
-         client->client_id = active_clients++;
+         client->client_id = __atomic_fetch_add(&active_clients, 1, __ATOMIC_RELAXED);
+         client->accepted_ns = metrics_now();
          
-         printf("New connection from %s:%d. Client ID: %d\n", 
-                inet_ntoa(client_addr.sin_addr), 
-                ntohs(client_addr.sin_port),
-                client->client_id);
+         log_info("New connection from %s:%d. Client ID: %d", 
+                  inet_ntoa(client_addr.sin_addr), 
+                  ntohs(client_addr.sin_port),
+                  client->client_id);
          
          /* Create thread to handle client */
          if (pthread_create(&thread_id, NULL, handle_client, (void *)client) != 0) {
-             perror("pthread_create");
+             log_errno("pthread_create");
              free(client);
              close(client_socket);
-             active_clients--;
+             __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
              continue;
          }
          
@@ -78,136 +464,289 @@
          pthread_detach(thread_id);
      }
      
-     /* Clean up (Note: This point is not reached in the current implementation) */
-     cleanup_server(server_socket);
-     
-     return EXIT_SUCCESS;
+     return 0;
  }
  
  /* Initialize server socket */
- int initialize_server(void) {
+ int initialize_server(int backlog, int reuse_port) {
+     const config_t *config = config_current();
+     const char *option = NULL;
      int server_socket, opt = 1;
-     struct sockaddr_in server_addr;
      
      /* Create socket */
      server_socket = socket(AF_INET, SOCK_STREAM, 0);
      if (server_socket < 0) {
-         perror("socket");
+         log_errno("socket");
          return -1;
      }
      
      /* Set socket options */
      if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-         perror("setsockopt");
+         log_errno("setsockopt");
          close(server_socket);
          return -1;
      }
      
-     /* Prepare the sockaddr_in structure */
-     memset(&server_addr, 0, sizeof(server_addr));
-     server_addr.sin_family = AF_INET;
-     server_addr.sin_addr.s_addr = INADDR_ANY;
-     server_addr.sin_port = htons(PORT);
+     /* Shards each bind their own listener to the port and the kernel spreads connections
+      * across them */
+     if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+         log_errno("setsockopt SO_REUSEPORT");
+         close(server_socket);
+         return -1;
+     }
+     
+     /* Accepted sockets inherit these. TCP_NODELAY is on unless configured off: a READY
+      * queued behind an unacknowledged status must not wait out the client's delayed ACK */
+     if (config_apply_socket(server_socket, config, &option) < 0) {
+         log_errno(option);
+         close(server_socket);
+         return -1;
+     }
      
-     /* Bind the socket */
-     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-         perror("bind");
+     /* Bind the socket to the configured address */
+     if (bind(server_socket, (const struct sockaddr *)&config->listen, sizeof(config->listen)) < 0) {
+         log_errno("bind");
          close(server_socket);
          return -1;
      }
      
      /* Listen for connections */
-     if (listen(server_socket, MAX_CLIENTS) < 0) {
-         perror("listen");
+     if (listen(server_socket, backlog) < 0) {
+         log_errno("listen");
          close(server_socket);
          return -1;
      }
      
+     /* Remembered so a reload can change the options new connections inherit */
+     pthread_mutex_lock(&listener_lock);
+     if (listener_count < SHARD_MAX) {
+         listeners[listener_count++] = server_socket;
+     }
+     pthread_mutex_unlock(&listener_lock);
+     
      return server_socket;
  }
  
+ /* Close a listening socket and stop applying reloaded options to it */
+ void close_listener(int server_socket) {
+     int i;
+     
+     pthread_mutex_lock(&listener_lock);
+     for (i = 0; i < listener_count; i++) {
+         if (listeners[i] == server_socket) {
+             listeners[i] = listeners[--listener_count];
+             break;
+         }
+     }
+     pthread_mutex_unlock(&listener_lock);
+     
+     close(server_socket);
+ }
+ 
  /* Handle client connection in a separate thread */
  void *handle_client(void *arg) {
-     client_t *client = (client_t *)arg;
+     serve_client((client_t *)arg);
+     pthread_exit(NULL);
+ }
+ 
+ /* Run the handshake and transfer(s) for one client, then release it */
+ void serve_client(client_t *client) {
      int client_socket = client->client_socket;
      int client_id = client->client_id;
-     char username[64] = {0};
-     char target_dir[64] = {0};
-     char filename[MAX_PATH_LENGTH] = {0};
-     int status_code;
+     proto_request_t request;
+     session_t session;
+     int status_code, remaining, result;
+     uint64_t committed, request_started;
      
-     /* Receive username from client */
-     if (recv(client_socket, username, sizeof(username) - 1, 0) <= 0) {
-         perror("recv username");
-         goto cleanup;
-     }
+     memset(&session, 0, sizeof(session));
+     
+     /* Time from accept() until a thread picked the connection up, queueing included */
+     metrics_count(METRICS_CONNECTIONS_ACCEPTED);
+     metrics_observe(METRICS_PHASE_ACCEPT, client->accepted_ns);
      
-     printf("Client %d identified as user: %s\n", client->client_id, username);
+     do {
+         /* Receive the request header and fields in one exchange */
+         result = proto_recv_request(client_socket, &request);
+         if (result == -1) {
+             /* A session ends when the client closes between requests */
+             if (!session.persistent) {
+                 log_errno("recv request");
+             }
+             break;
+         }
+         if (result == -2) {
+             log_warn("Client %d sent a malformed request", client_id);
+             proto_send_response(client_socket, STATUS_PROTOCOL_ERROR, 0, 0);
+             break;
+         }
+         
+         request_started = metrics_now();
+         
+         /* Session setup verifies access once for every file that follows */
+         if (request.opcode == PROTO_OP_SESSION) {
+             status_code = begin_session(&session, &request);
+             log_info("Client %d opened a session as %s for %s: status %d", client_id,
+                      request.username, request.target_dir, status_code);
+             proto_send_response(client_socket, (uint8_t)status_code, PROTO_FLAG_SESSION, 0);
+             if (status_code != STATUS_SUCCESS) {
+                 break;
+             }
+             continue;
+         }
+         if (request.opcode != PROTO_OP_PUT && request.opcode != PROTO_OP_RANGE &&
+             request.opcode != PROTO_OP_COMMIT && request.opcode != PROTO_OP_GET &&
+             request.opcode != PROTO_OP_LIST) {
+             log_warn("Client %d sent unknown operation %d", client_id, request.opcode);
+             proto_send_response(client_socket, STATUS_PROTOCOL_ERROR, 0, 0);
+             break;
+         }
+         
+         log_debug("Client %d: user %s, directory %s, file %s (%llu bytes)", client_id,
+                   request.username, request.target_dir, request.filename,
+                   (unsigned long long)request.size);
+         
+         /* Process file transfer request; a parallel open answers with its token */
+         committed = 0;
+         if (request.opcode == PROTO_OP_GET || request.opcode == PROTO_OP_LIST) {
+             status_code = process_download(client_socket, &request, &session, &committed);
+         } else if (request.opcode == PROTO_OP_RANGE) {
+             status_code = process_range_transfer(client_socket, &request, &session, &committed);
+         } else if (request.opcode == PROTO_OP_COMMIT) {
+             status_code = commit_parallel_upload(&request, &committed);
+         } else if (request.flags & PROTO_FLAG_PARALLEL) {
+             status_code = open_parallel_upload(&request, &session, &committed);
+         } else {
+             status_code = process_file_transfer(client_socket, &request, &session, &committed);
+         }
+         
+         /* Finished either way: the transfer no longer counts against its quotas */
+         quota_release(session.ticket);
+         session.ticket = NULL;
+         
+         /* Send status code back to client, with the bytes now safely staged (or sent) */
+         metrics_record_request(&request, committed, status_code);
+         log_transfer(client_id, &request, committed, request_started, status_code);
+         if (proto_send_response(client_socket, (uint8_t)status_code, 0, committed) < 0) {
+             log_errno("send status code");
+             break;
+         }
+         
+         if (status_code == STATUS_SUCCESS) {
+             session.files++;
+         }
+         
+         /* Keep going only while the stream is still aligned on a request boundary */
+     } while (session.persistent && !session.stream_broken);
      
-     /* Receive target directory from client */
-     if (recv(client_socket, target_dir, sizeof(target_dir) - 1, 0) <= 0) {
-         perror("recv target_dir");
-         goto cleanup;
+     if (session.persistent) {
+         log_info("Client %d session closed after %lu files", client_id, session.files);
      }
      
-     printf("Client %d requested transfer to directory: %s\n", client->client_id, target_dir);
+     /* Clean up after client handling */
+     close(client_socket);
+     remaining = __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+     metrics_count(METRICS_CONNECTIONS_CLOSED);
+     
+     log_info("Client %d disconnected. Total active clients: %d", client_id, remaining);
+     
+     free(client);
+ }
+ 
+ /* Verify access once and mark the connection as a persistent session */
+ int begin_session(session_t *session, const proto_request_t *request) {
+     const char *full_target_dir;
+     
+     full_target_dir = resolve_target_dir(request->target_dir);
+     if (!full_target_dir) {
+         log_warn("Invalid target directory: %s", request->target_dir);
+         return STATUS_PERMISSION_DENIED;
+     }
      
-     /* Receive filename from client */
-     if (recv(client_socket, filename, sizeof(filename) - 1, 0) <= 0) {
-         perror("recv filename");
-         goto cleanup;
+     /* Taken before the lookup, so an invalidation during it leaves the decision stale */
+     session->generation = credcache_generation();
+     if (!authorize_user(request->username, full_target_dir, &session->access)) {
+         log_warn("User %s does not have permission to access %s",
+                  request->username, request->target_dir);
+         return STATUS_PERMISSION_DENIED;
      }
      
-     printf("Client %d requested transfer of file: %s\n", client->client_id, filename);
+     strcpy(session->username, request->username);
+     session->target_dir = full_target_dir;
+     session->persistent = 1;
+     session->authenticated = 1;
      
-     /* Process file transfer request */
-     status_code = process_file_transfer(client_socket, username, target_dir, filename);
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Whether a session's decision covers this user and directory, made again if SIGHUP
+  * invalidated the credentials it came from */
+ int session_covers(session_t *session, const char *username, const char *full_target_dir) {
+     unsigned int generation = credcache_generation();
      
-     /* Send status code back to client */
-     if (send(client_socket, &status_code, sizeof(status_code), 0) < 0) {
-         perror("send status code");
+     if (!session->authenticated || session->target_dir != full_target_dir ||
+         strcmp(session->username, username) != 0) {
+         return 0;
      }
      
-     /* Clean up after client handling */
- cleanup:
-     close(client_socket);
-     active_clients--;
+     /* A user removed from the group must not keep writing until they disconnect */
+     if (session->generation != generation) {
+         session->generation = generation;
+         if (!authorize_user(session->username, session->target_dir, &session->access)) {
+             log_warn("User %s lost permission to access %s during a session", session->username,
+                      session->target_dir);
+             session->authenticated = 0;
+             return 0;
+         }
+     }
      
-     printf("Client %d disconnected. Total active clients: %d\n", client_id, active_clients);
+     return 1;
+ }
+ 
+ /* Map a requested directory onto a configured destination, or NULL if invalid */
+ const char *resolve_target_dir(const char *target_dir) {
+     /* The path stays valid after a reload, so a transfer can hold on to it */
+     const config_dir_t *dir = config_find_dir(config_current(), target_dir);
      
-     free(client);
-     pthread_exit(NULL);
+     return dir ? dir->path : NULL;
  }
  
- /* Process file transfer request from client */
- int process_file_transfer(int client_socket, const char *username, const char *target_dir, const char *filename) {
-     char full_target_dir[MAX_PATH_LENGTH] = {0};
-     char target_path[MAX_PATH_LENGTH] = {0};
-     int file_fd;
-     ssize_t bytes_read, bytes_written;
-     char buffer[BUFFER_SIZE] = {0};
-     long filesize = 0;
-     long total_received = 0;
+ /* Validate a transfer request and build the destination path */
+ int prepare_file_transfer(const proto_request_t *request, session_t *session, char *target_path,
+                           access_decision_t *decision) {
+     const char *username = request->username;
+     const char *target_dir = request->target_dir;
+     const char *filename = request->filename;
+     const char *full_target_dir;
      
      /* Determine the full target directory path */
-     if (strcmp(target_dir, MANUFACTURING_DIR) == 0) {
-         strcpy(full_target_dir, MANUFACTURING_DIR);
-     } else if (strcmp(target_dir, DISTRIBUTION_DIR) == 0) {
-         strcpy(full_target_dir, DISTRIBUTION_DIR);
-     } else {
-         fprintf(stderr, "Invalid target directory: %s\n", target_dir);
+     full_target_dir = resolve_target_dir(target_dir);
+     if (!full_target_dir) {
+         log_warn("Invalid target directory: %s", target_dir);
          return STATUS_PERMISSION_DENIED;
      }
      
-     /* Verify user access to the target directory */
-     if (!verify_user_access(username, target_dir)) {
-         fprintf(stderr, "User %s does not have permission to access %s\n", username, target_dir);
+     /* A transfer needs a file name, and not the one the directory's manifest is logged under */
+     if (filename[0] == '\0') {
+         log_warn("Missing file name");
+         return STATUS_FILE_ERROR;
+     }
+     if (manifest_reserved_name(filename)) {
+         log_warn("Reserved file name: %s", filename);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* Verify user access to the target directory, unless the session already did */
+     if (session && session_covers(session, username, full_target_dir)) {
+         /* Access decision reused from begin_session(), or remade since */
+         *decision = session->access;
+     } else if (!authorize_user(username, full_target_dir, decision)) {
+         log_warn("User %s does not have permission to access %s", username, target_dir);
          return STATUS_PERMISSION_DENIED;
      }
      
      /* Create the target file path - ensure there's room for the path separator and null terminator */
      if (strlen(full_target_dir) + strlen(filename) + 2 > MAX_PATH_LENGTH) {
-         fprintf(stderr, "Path too long: %s/%s\n", full_target_dir, filename);
+         log_warn("Path too long: %s/%s", full_target_dir, filename);
          return STATUS_FILE_ERROR;
      }
      
@@ -216,170 +755,1219 @@
      strcat(target_path, "/");
      strcat(target_path, filename);
      
-     /* Receive file size */
-     if (recv(client_socket, &filesize, sizeof(filesize), 0) <= 0) {
-         perror("recv filesize");
-         return STATUS_UNKNOWN_ERROR;
-     }
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Open the staging file for target_path, keeping its verified prefix when resuming */
+ int open_staging_file(const char *target_path, int resume, off_t filesize,
+                       char *staging_path, off_t *committed) {
+     const char *filename = strrchr(target_path, '/');
+     char dir_path[MAX_PATH_LENGTH];
+     struct stat st;
+     int file_fd;
      
-     printf("Expected file size: %ld bytes\n", filesize);
+     /* "<dir>/<name>" becomes "<dir>/.<name>.part" */
+     filename = filename ? filename + 1 : target_path;
+     if (strlen(target_path) + 1 + strlen(STAGING_SUFFIX) >= STAGING_PATH_LENGTH) {
+         log_warn("Path too long: %s", target_path);
+         return -1;
+     }
+     memcpy(staging_path, target_path, filename - target_path);
+     staging_path[filename - target_path] = '.';
+     strcpy(staging_path + (filename - target_path) + 1, filename);
+     strcat(staging_path, STAGING_SUFFIX);
      
-     /* Lock mutex for file operation */
-     pthread_mutex_lock(&file_mutex);
+     *committed = 0;
      
-     /* Open target file for writing */
-     file_fd = open(target_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-     if (file_fd < 0) {
-         perror("open target file");
-         pthread_mutex_unlock(&file_mutex);
-         return STATUS_FILE_ERROR;
+     /* A fresh upload gets an unnamed file, so a failed transfer leaves nothing behind */
+     if (!resume) {
+         if (filename == target_path) {
+             strcpy(dir_path, ".");
+         } else {
+             memcpy(dir_path, target_path, filename - target_path - 1);
+             dir_path[filename - target_path - 1] = '\0';
+         }
+         
+         /* Readable as well, so a spliced body can be checksummed from the page cache */
+         file_fd = open(dir_path, O_TMPFILE | O_RDWR, 0644);
+         if (file_fd >= 0) {
+             staging_path[0] = '\0';
+             return file_fd;
+         }
+         if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+             log_errno("open O_TMPFILE");
+             return -1;
+         }
+         /* This filesystem has no O_TMPFILE: stage under the visible name instead */
      }
      
-     /* Acknowledge ready to receive file */
-     int ready = 1;
-     if (send(client_socket, &ready, sizeof(ready), 0) < 0) {
-         perror("send ready");
-         close(file_fd);
-         pthread_mutex_unlock(&file_mutex);
-         return STATUS_UNKNOWN_ERROR;
+     /* A fresh upload discards any earlier partial copy */
+     file_fd = open(staging_path, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+     if (file_fd < 0) {
+         log_errno("open staging file");
+         return -1;
      }
      
-     /* Receive and write file data */
-     while (total_received < filesize) {
-         bytes_read = recv(client_socket, buffer, BUFFER_SIZE, 0);
-         if (bytes_read <= 0) {
-             perror("recv file data");
+     if (resume) {
+         if (fstat(file_fd, &st) < 0) {
+             log_errno("fstat staging file");
              close(file_fd);
-             pthread_mutex_unlock(&file_mutex);
-             return STATUS_FILE_ERROR;
+             return -1;
          }
          
-         bytes_written = write(file_fd, buffer, bytes_read);
-         if (bytes_written != bytes_read) {
-             perror("write file data");
-             close(file_fd);
-             pthread_mutex_unlock(&file_mutex);
-             return STATUS_FILE_ERROR;
+         /* Only verified chunks are ever written, so the size is the resume point */
+         *committed = st.st_size;
+         if (*committed > filesize) {
+             /* Left over from a different, larger file: start again */
+             if (ftruncate(file_fd, 0) < 0) {
+                 log_errno("ftruncate staging file");
+                 close(file_fd);
+                 return -1;
+             }
+             *committed = 0;
          }
-         
-         total_received += bytes_read;
      }
      
-     /* Close file */
-     close(file_fd);
+     return file_fd;
+ }
+ 
+ /* Give an unnamed O_TMPFILE a unique temporary name next to target_path */
+ static int link_anonymous_file(int file_fd, const char *target_path, char *temp_path) {
+     static unsigned long temp_counter = 0;
+     const char *filename = strrchr(target_path, '/');
+     char proc_path[64];
+     int length;
      
-     /* Set file ownership to the user who transferred it */
-     if (set_file_ownership(target_path, username) != 0) {
-         fprintf(stderr, "Failed to set file ownership for %s\n", target_path);
-         pthread_mutex_unlock(&file_mutex);
-         return STATUS_FILE_ERROR;
+     filename = filename ? filename + 1 : target_path;
+     length = snprintf(temp_path, STAGING_PATH_LENGTH, "%.*s.%s.%lu%s", (int)(filename - target_path),
+                       target_path, filename, __atomic_add_fetch(&temp_counter, 1, __ATOMIC_RELAXED),
+                       STAGING_TEMP_SUFFIX);
+     if (length < 0 || length >= STAGING_PATH_LENGTH) {
+         log_warn("Path too long: %s", target_path);
+         return -1;
      }
      
-     /* Unlock mutex */
-     pthread_mutex_unlock(&file_mutex);
-     
-     printf("File transfer completed: %s -> %s\n", filename, target_path);
+     /* AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH; /proc works for everyone else */
+     if (linkat(file_fd, "", AT_FDCWD, temp_path, AT_EMPTY_PATH) == 0) {
+         return 0;
+     }
+     snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", file_fd);
+     if (linkat(AT_FDCWD, proc_path, AT_FDCWD, temp_path, AT_SYMLINK_FOLLOW) < 0) {
+         log_errno("linkat");
+         return -1;
+     }
      
-     return STATUS_SUCCESS;
+     return 0;
  }
  
- /* Verify user permissions for accessing a directory */
- int verify_user_access(const char *username, const char *target_dir) {
-     struct passwd *pw;
-     struct group *gr;
-     gid_t *groups = NULL;
-     int ngroups = 0;
-     int i, has_access = 0;
+ /* Atomically replace the destination with a complete staging file */
+ int commit_staging_file(int file_fd, const char *staging_path, const char *target_path) {
+     char temp_path[STAGING_PATH_LENGTH];
      
-     /* Look up user information */
-     pw = getpwnam(username);
-     if (!pw) {
-         fprintf(stderr, "User not found: %s\n", username);
-         return 0;
+     /* linkat() cannot replace an existing name, so link under a temporary one and rename */
+     if (staging_path[0] == '\0') {
+         if (link_anonymous_file(file_fd, target_path, temp_path) < 0) {
+             return -1;
+         }
+         staging_path = temp_path;
      }
      
-     /* Get groups count */
-     getgrouplist(username, pw->pw_gid, NULL, &ngroups);
+     if (rename(staging_path, target_path) < 0) {
+         log_errno("rename staging file");
+         if (staging_path == temp_path) {
+             unlink(temp_path);
+         }
+         return -1;
+     }
      
-     /* Allocate memory for groups array */
-     groups = malloc(ngroups * sizeof(gid_t));
-     if (!groups) {
-         perror("malloc");
-         return 0;
+     return 0;
+ }
+ 
+ /* Check a received chunk and append it at *committed */
+ int store_chunk(int file_fd, const proto_chunk_t *chunk, const char *data, off_t *committed, uint32_t *crc) {
+     /* A corrupt chunk is never written, so the staged prefix stays trustworthy */
+     if (crc32c_update(0, data, chunk->length) != chunk->crc32c) {
+         log_warn("Checksum mismatch in chunk at offset %lld", (long long)*committed);
+         return STATUS_CHECKSUM_ERROR;
+     }
+     
+     if (pwrite(file_fd, data, chunk->length, *committed) != (ssize_t)chunk->length) {
+         log_errno("write file data");
+         return STATUS_FILE_ERROR;
      }
      
-     /* Get user's groups */
-     getgrouplist(username, pw->pw_gid, groups, &ngroups);
+     /* The chunk was just checked against its own checksum, so the body's needs no second pass */
+     if (crc) {
+         *crc = crc32c_combine(*crc, chunk->crc32c, chunk->length);
+     }
      
-     /* Check if user is in the appropriate group based on target directory */
-     const char *required_group = NULL;
+     *committed += chunk->length;
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Expand a received block and write it at *written */
+ int store_block(int file_fd, const proto_block_t *block, const char *payload, char *scratch,
+                 off_t *written, uint32_t *crc, sha256_t *sha) {
+     const char *data = payload;
      
-     if (strcmp(target_dir, MANUFACTURING_DIR) == 0) {
-         required_group = "manufacturing";
-     } else if (strcmp(target_dir, DISTRIBUTION_DIR) == 0) {
-         required_group = "distribution";
-     } else {
-         free(groups);
-         return 0;
+     /* The expanded size must match exactly, or the client and server disagree on the stream */
+     if (block->packed_length) {
+         if (lz_decompress(payload, block->packed_length, scratch, PROTO_BLOCK_SIZE) !=
+             (ssize_t)block->length) {
+             log_warn("Corrupt compressed block at offset %lld", (long long)*written);
+             return STATUS_PROTOCOL_ERROR;
+         }
+         data = scratch;
      }
      
-     /* Look up the required group */
-     gr = getgrnam(required_group);
-     if (!gr) {
-         fprintf(stderr, "Group not found: %s\n", required_group);
-         free(groups);
-         return 0;
+     if (pwrite(file_fd, data, block->length, *written) != (ssize_t)block->length) {
+         log_errno("write file data");
+         return STATUS_FILE_ERROR;
      }
      
-     /* Check if user is a member of the required group */
-     for (i = 0; i < ngroups; i++) {
-         if (groups[i] == gr->gr_gid) {
-             has_access = 1;
-             break;
-         }
+     /* The trailer and the store digest cover the file contents, so checksum what was decompressed */
+     if (crc) {
+         *crc = crc32c_update(*crc, data, block->length);
+     }
+     if (sha) {
+         sha256_update(sha, data, block->length);
      }
      
-     free(groups);
-     return has_access;
+     *written += block->length;
+     return STATUS_SUCCESS;
  }
  
- /* Set file ownership to the user who transferred it */
- int set_file_ownership(const char *filepath, const char *username) {
-     struct passwd *pw;
+ /* Open the existing file for a delta upload and allocate room for its signatures */
+ proto_signature_t *open_delta_basis(const char *target_path, int *basis_fd, uint64_t *basis_size) {
+     proto_signature_t *sigs;
+     struct stat st;
+     int fd;
      
-     /* Look up user information */
-     pw = getpwnam(username);
-     if (!pw) {
-         fprintf(stderr, "User not found: %s\n", username);
-         return -1;
+     /* A first upload has nothing to match against and is simply sent whole */
+     fd = open(target_path, O_RDONLY);
+     if (fd < 0) {
+         if (errno != ENOENT) {
+             log_errno("open delta basis");
+         }
+         return NULL;
+     }
+     if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+         proto_delta_block_count((uint64_t)st.st_size) > PROTO_DELTA_MAX_BLOCKS) {
+         close(fd);
+         return NULL;
      }
      
-     /* Change file ownership */
-     if (chown(filepath, pw->pw_uid, pw->pw_gid) < 0) {
-         perror("chown");
-         return -1;
+     sigs = malloc(proto_delta_block_count((uint64_t)st.st_size) * sizeof(proto_signature_t));
+     if (!sigs) {
+         log_errno("malloc");
+         close(fd);
+         return NULL;
      }
      
-     return 0;
+     *basis_fd = fd;
+     *basis_size = (uint64_t)st.st_size;
+     return sigs;
  }
  
- /* Get username from UID */
- char *get_username_from_uid(uid_t uid) {
-     struct passwd *pw;
+ /* Sign the existing file for a delta upload */
+ proto_signature_t *sign_delta_basis(const char *target_path, int *basis_fd, uint64_t *basis_size) {
+     proto_signature_t *sigs;
+     size_t capacity = 0;
+     char *scratch;
      
-     pw = getpwuid(uid);
-     if (!pw) {
+     sigs = open_delta_basis(target_path, basis_fd, basis_size);
+     if (!sigs) {
          return NULL;
      }
      
-     return pw->pw_name;
+     scratch = bufpool_get(&buffer_pool, NETIO_MAX_CHUNK, &capacity);
+     if (!scratch || delta_sign_file(*basis_fd, *basis_size, sigs, scratch, capacity) < 0) {
+         log_errno("sign delta basis");
+         bufpool_put(&buffer_pool, scratch, capacity);
+         free(sigs);
+         close(*basis_fd);
+         *basis_fd = -1;
+         return NULL;
+     }
+     bufpool_put(&buffer_pool, scratch, capacity);
+     
+     log_debug("Signed %s: %llu blocks of %u bytes", target_path,
+               (unsigned long long)proto_delta_block_count(*basis_size), proto_delta_block_size(*basis_size));
+     return sigs;
+ }
+ 
+ /* Apply one delta instruction at *written */
+ int store_delta(int file_fd, int basis_fd, uint64_t basis_size, const proto_delta_t *op,
+                 const char *literal, char *scratch, size_t scratch_size, off_t *written, uint32_t *crc,
+                 sha256_t *sha) {
+     off_t offset = (off_t)op->block * proto_delta_block_size(basis_size);
+     uint32_t remaining = op->length;
+     size_t length;
+     
+     /* Literal bytes came over the wire */
+     if (op->block == PROTO_DELTA_LITERAL) {
+         if (pwrite(file_fd, literal, op->length, *written) != (ssize_t)op->length) {
+             log_errno("write file data");
+             return STATUS_FILE_ERROR;
+         }
+         if (crc) {
+             *crc = crc32c_update(*crc, literal, op->length);
+         }
+         if (sha) {
+             sha256_update(sha, literal, op->length);
+         }
+         *written += op->length;
+         return STATUS_SUCCESS;
+     }
+     
+     /* Copies come from the existing file, which was just signed and so is in the page cache */
+     while (remaining > 0) {
+         length = (remaining > scratch_size) ? scratch_size : remaining;
+         if (pread(basis_fd, scratch, length, offset) != (ssize_t)length) {
+             log_errno("read delta basis");
+             return STATUS_FILE_ERROR;
+         }
+         if (pwrite(file_fd, scratch, length, *written) != (ssize_t)length) {
+             log_errno("write file data");
+             return STATUS_FILE_ERROR;
+         }
+         if (crc) {
+             *crc = crc32c_update(*crc, scratch, length);
+         }
+         if (sha) {
+             sha256_update(sha, scratch, length);
+         }
+         offset += (off_t)length;
+         *written += (off_t)length;
+         remaining -= (uint32_t)length;
+     }
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Apply at most scratch_size bytes of a delta copy and advance op past them */
+ int store_delta_step(int file_fd, int basis_fd, uint64_t basis_size, proto_delta_t *op, char *scratch,
+                      size_t scratch_size, off_t *written, uint32_t *crc, sha256_t *sha) {
+     uint32_t block_size = proto_delta_block_size(basis_size);
+     size_t span = scratch_size / block_size * block_size;
+     proto_delta_t step;
+     int status;
+     
+     /* Whole blocks, so the rest of the copy still starts at a block; never less than one */
+     if (span < block_size) {
+         span = block_size;
+     }
+     step.block = op->block;
+     step.length = (op->length > span) ? (uint32_t)span : op->length;
+     
+     status = store_delta(file_fd, basis_fd, basis_size, &step, NULL, scratch, scratch_size, written, crc, sha);
+     if (status == STATUS_SUCCESS) {
+         op->block += step.length / block_size;
+         op->length -= step.length;
+     }
+     
+     return status;
+ }
+ 
+ /* CRC32C of length bytes of a staging file from offset */
+ int checksum_staged_body(int file_fd, off_t offset, off_t length, uint32_t *crc) {
+     size_t capacity;
+     char *buffer;
+     int result;
+     
+     buffer = bufpool_get(&buffer_pool, netio_chunk_size(length), &capacity);
+     if (!buffer) {
+         return -1;
+     }
+     
+     /* The data was just written, so this reads the page cache rather than the disk */
+     *crc = 0;
+     result = netio_crc32c_file(file_fd, offset, length, buffer, capacity, crc);
+     if (result < 0) {
+         log_errno("checksum staged file");
+     }
+     
+     bufpool_put(&buffer_pool, buffer, capacity);
+     return result;
+ }
+ 
+ /* Decode a body trailer and compare it with the checksum of what was received */
+ int verify_body_trailer(proto_trailer_t *trailer, uint32_t crc, const char *filename) {
+     if (proto_parse_trailer(trailer) < 0) {
+         log_warn("Malformed checksum trailer after %s", filename);
+         return STATUS_PROTOCOL_ERROR;
+     }
+     
+     if (trailer->crc32c != crc) {
+         log_warn("Checksum mismatch for %s: client %08x, received %08x",
+                  filename, trailer->crc32c, crc);
+         return STATUS_CHECKSUM_ERROR;
+     }
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Receive checksummed chunks until the staging file reaches filesize, combining their
+  * checksums into *crc when it is not NULL */
+ static int receive_chunked_body(int client_socket, int file_fd, off_t filesize, off_t *committed,
+                                 uint32_t *crc, quota_ticket_t *ticket) {
+     proto_chunk_t chunk;
+     char *data;
+     size_t capacity;
+     int status = STATUS_SUCCESS;
+     
+     data = bufpool_get(&buffer_pool, PROTO_CHUNK_SIZE, &capacity);
+     if (!data) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     while (*committed < filesize) {
+         if (recv(client_socket, &chunk, sizeof(chunk), MSG_WAITALL) != sizeof(chunk)) {
+             log_errno("recv chunk header");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         if (proto_parse_chunk(&chunk, filesize - *committed) < 0) {
+             log_warn("Invalid chunk length %u", chunk.length);
+             status = STATUS_PROTOCOL_ERROR;
+             break;
+         }
+         quota_take(ticket, chunk.length);
+         if (recv(client_socket, data, chunk.length, MSG_WAITALL) != (ssize_t)chunk.length) {
+             log_errno("recv chunk data");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         
+         status = store_chunk(file_fd, &chunk, data, committed, crc);
+         if (status != STATUS_SUCCESS) {
+             break;
+         }
+     }
+     
+     bufpool_put(&buffer_pool, data, capacity);
+     return status;
+ }
+ 
+ /* Receive a compressed body block by block until filesize bytes have been written */
+ static int receive_compressed_body(int client_socket, int file_fd, off_t filesize, off_t *received,
+                                    uint32_t *crc, quota_ticket_t *ticket) {
+     proto_block_t block;
+     char *payload, *scratch;
+     size_t payload_capacity, scratch_capacity;
+     unsigned long long wire_bytes = 0;
+     int status = STATUS_SUCCESS;
+     
+     payload = bufpool_get(&buffer_pool, PROTO_BLOCK_SIZE, &payload_capacity);
+     scratch = bufpool_get(&buffer_pool, PROTO_BLOCK_SIZE, &scratch_capacity);
+     if (!payload || !scratch) {
+         bufpool_put(&buffer_pool, payload, payload_capacity);
+         bufpool_put(&buffer_pool, scratch, scratch_capacity);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     while (*received < filesize) {
+         if (recv(client_socket, &block, sizeof(block), MSG_WAITALL) != sizeof(block)) {
+             log_errno("recv block header");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         if (proto_parse_block(&block, filesize - *received) < 0) {
+             log_warn("Invalid block length %u (%u packed)", block.length, block.packed_length);
+             status = STATUS_PROTOCOL_ERROR;
+             break;
+         }
+         quota_take(ticket, PROTO_BLOCK_PAYLOAD(&block));
+         if (recv(client_socket, payload, PROTO_BLOCK_PAYLOAD(&block), MSG_WAITALL) !=
+             (ssize_t)PROTO_BLOCK_PAYLOAD(&block)) {
+             log_errno("recv block data");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         wire_bytes += sizeof(block) + PROTO_BLOCK_PAYLOAD(&block);
+         
+         status = store_block(file_fd, &block, payload, scratch, received, crc, NULL);
+         if (status != STATUS_SUCCESS) {
+             break;
+         }
+     }
+     
+     bufpool_put(&buffer_pool, payload, payload_capacity);
+     bufpool_put(&buffer_pool, scratch, scratch_capacity);
+     
+     if (status == STATUS_SUCCESS) {
+         log_info("Received %lld bytes as %llu compressed", (long long)filesize, wire_bytes);
+     }
+     
+     return status;
+ }
+ 
+ /* Receive a delta body instruction by instruction until filesize bytes have been written */
+ static int receive_delta_body(int client_socket, int file_fd, int basis_fd, uint64_t basis_size,
+                               off_t filesize, off_t *received, uint32_t *crc, quota_ticket_t *ticket) {
+     proto_delta_t op;
+     char *literal, *scratch;
+     size_t literal_capacity, scratch_capacity;
+     unsigned long long wire_bytes = 0;
+     int status = STATUS_SUCCESS;
+     
+     literal = bufpool_get(&buffer_pool, PROTO_CHUNK_SIZE, &literal_capacity);
+     scratch = bufpool_get(&buffer_pool, PROTO_CHUNK_SIZE, &scratch_capacity);
+     if (!literal || !scratch) {
+         bufpool_put(&buffer_pool, literal, literal_capacity);
+         bufpool_put(&buffer_pool, scratch, scratch_capacity);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     while (*received < filesize) {
+         if (recv(client_socket, &op, sizeof(op), MSG_WAITALL) != sizeof(op)) {
+             log_errno("recv delta instruction");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         if (proto_parse_delta(&op, (uint64_t)(filesize - *received), basis_size) < 0) {
+             log_warn("Invalid delta instruction: block %u, %u bytes", op.block, op.length);
+             status = STATUS_PROTOCOL_ERROR;
+             break;
+         }
+         wire_bytes += sizeof(op);
+         
+         /* Only literal bytes cross the network, so only they count against the quota */
+         if (op.block == PROTO_DELTA_LITERAL) {
+             quota_take(ticket, op.length);
+             if (recv(client_socket, literal, op.length, MSG_WAITALL) != (ssize_t)op.length) {
+                 log_errno("recv delta literal");
+                 status = STATUS_FILE_ERROR;
+                 break;
+             }
+             wire_bytes += op.length;
+         }
+         
+         status = store_delta(file_fd, basis_fd, basis_size, &op, literal, scratch, scratch_capacity,
+                              received, crc, NULL);
+         if (status != STATUS_SUCCESS) {
+             break;
+         }
+     }
+     
+     bufpool_put(&buffer_pool, literal, literal_capacity);
+     bufpool_put(&buffer_pool, scratch, scratch_capacity);
+     
+     if (status == STATUS_SUCCESS) {
+         log_info("Received %lld bytes as a %llu-byte delta", (long long)filesize, wire_bytes);
+     }
+     
+     return status;
+ }
+ 
+ /* Receive a plain body, spliced or through a pooled buffer sized for the file, reading
+  * no faster than the quota ticket allows. When crc is not NULL it receives the CRC32C
+  * of the whole body. */
+ static int receive_plain_body(int client_socket, int file_fd, off_t filesize, off_t *received,
+                               uint32_t *crc, quota_ticket_t *ticket) {
+     ssize_t bytes_read, bytes_written;
+     size_t wanted, capacity = 0;
+     char *buffer = NULL;
+     int use_splice = zero_copy_receive, spliced = 0;
+     int status = STATUS_SUCCESS;
+     off_t start = lseek(file_fd, 0, SEEK_CUR);
+     
+     while (*received < filesize) {
+         /* Zero-copy path: socket -> pipe -> file */
+         if (use_splice) {
+             wanted = quota_wait(ticket, (size_t)(filesize - *received));
+             bytes_read = splice_socket_to_file(client_socket, file_fd, wanted, 0);
+             quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+             if (bytes_read < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                 /* Not supported for this socket/file pair: use the buffered loop */
+                 use_splice = 0;
+                 continue;
+             }
+             if (bytes_read <= 0) {
+                 log_errno("splice file data");
+                 status = STATUS_FILE_ERROR;
+                 break;
+             }
+             
+             *received += bytes_read;
+             spliced = 1;
+             continue;
+         }
+         
+         /* Borrow a buffer only once the copying path is actually needed */
+         if (!buffer) {
+             buffer = bufpool_get(&buffer_pool, netio_chunk_size(filesize), &capacity);
+             if (!buffer) {
+                 status = STATUS_UNKNOWN_ERROR;
+                 break;
+             }
+         }
+         
+         /* Never read past the body: a pipelined request may follow it */
+         wanted = (filesize - *received > (off_t)capacity) ? capacity : (size_t)(filesize - *received);
+         wanted = quota_wait(ticket, wanted);
+         bytes_read = recv(client_socket, buffer, wanted, 0);
+         quota_return(ticket, bytes_read > 0 ? wanted - (size_t)bytes_read : wanted);
+         if (bytes_read <= 0) {
+             log_errno("recv file data");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         
+         bytes_written = write(file_fd, buffer, bytes_read);
+         if (bytes_written != bytes_read) {
+             log_errno("write file data");
+             status = STATUS_FILE_ERROR;
+             break;
+         }
+         
+         /* Checksum while the bytes are still in cache */
+         if (crc) {
+             *crc = crc32c_update(*crc, buffer, bytes_read);
+         }
+         
+         *received += bytes_read;
+     }
+     
+     bufpool_put(&buffer_pool, buffer, capacity);
+     
+     /* Spliced bytes never passed through user space: checksum what reached the file */
+     if (status == STATUS_SUCCESS && crc && spliced &&
+         checksum_staged_body(file_fd, start, filesize, crc) < 0) {
+         status = STATUS_FILE_ERROR;
+     }
+     
+     return status;
+ }
+ 
+ /* Receive the checksum trailer after a plain body and compare it with crc */
+ static int receive_trailer(int client_socket, uint32_t crc, const char *filename) {
+     proto_trailer_t trailer;
+     
+     if (recv(client_socket, &trailer, sizeof(trailer), MSG_WAITALL) != sizeof(trailer)) {
+         log_errno("recv checksum trailer");
+         return STATUS_FILE_ERROR;
+     }
+     
+     return verify_body_trailer(&trailer, crc, filename);
+ }
+ 
+ /* Set the owner of a complete staging file, then publish it at target_path and record it in
+  * the manifest with crc, the checksum kept as its body arrived, or NULL; closes file_fd */
+ static int publish_staged_file(int file_fd, const char *staging_path, const char *target_path,
+                                const access_decision_t *decision, const uint32_t *crc) {
+     uint64_t phase_start;
+     
+     /* Set ownership before publishing so the file never appears with the wrong owner */
+     if (apply_file_ownership(file_fd, decision) != 0) {
+         log_error("Failed to set file ownership for %s", target_path);
+         close(file_fd);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* Data reaches the disk before the name does, so a crash never exposes a torn file */
+     phase_start = metrics_now();
+     if (durability_sync_file(file_fd) != 0 ||
+         commit_staging_file(file_fd, staging_path, target_path) != 0) {
+         close(file_fd);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* The manifest's record is made durable with the name */
+     manifest_record(target_path, file_fd, crc);
+     
+     /* Close file */
+     close(file_fd);
+     
+     /* Make the new name durable before acknowledging it */
+     if (durability_sync_dir(target_path) != 0) {
+         return STATUS_FILE_ERROR;
+     }
+     metrics_observe(METRICS_PHASE_PUBLISH, phase_start);
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Process file transfer request from client */
+ int process_file_transfer(int client_socket, const proto_request_t *request, session_t *session,
+                           uint64_t *committed) {
+     char target_path[MAX_PATH_LENGTH] = {0};
+     char staging_path[STAGING_PATH_LENGTH] = {0};
+     int file_fd, status;
+     int resume = (request->flags & PROTO_FLAG_RESUME) != 0;
+     int checksum = !resume && (request->flags & PROTO_FLAG_CHECKSUM) != 0;
+     int compress = !resume && (request->flags & PROTO_FLAG_COMPRESS) != 0;
+     int delta = !resume && (request->flags & PROTO_FLAG_DELTA) != 0;
+     int summed = 0;
+     uint32_t crc = 0;
+     off_t filesize = (off_t)request->size;
+     off_t total_received = 0;
+     proto_signature_t *signatures = NULL;
+     uint64_t basis_size = 0;
+     int basis_fd = -1;
+     pathlock_entry_t *path_lock;
+     access_decision_t decision;
+     uint64_t phase_start;
+     
+     /* Validate the request and build the destination path */
+     status = prepare_file_transfer(request, session, target_path, &decision);
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     /* The size arrived in the header */
+     if (filesize < 0) {
+         log_warn("Invalid file size: %lld", (long long)filesize);
+         return STATUS_FILE_ERROR;
+     }
+     
+     log_debug("Expected file size: %lld bytes", (long long)filesize);
+     
+     /* Count the upload against its user's and directory's limits before it waits for anything;
+      * the caller releases the ticket */
+     status = quota_admit(request->username, resolve_target_dir(request->target_dir), &session->ticket);
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     /* Lock only this destination so unrelated uploads proceed in parallel */
+     phase_start = metrics_now();
+     path_lock = pathlock_acquire(&path_locks, target_path);
+     metrics_observe(METRICS_PHASE_LOCK_WAIT, phase_start);
+     if (!path_lock) {
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* Content the store already holds is cloned rather than received: no READY, no body */
+     if (dedup_requested(request)) {
+         file_fd = dedup_clone(request, target_path, staging_path, &crc, &summed);
+         if (file_fd >= 0) {
+             status = publish_staged_file(file_fd, staging_path, target_path, &decision, summed ? &crc : NULL);
+             pathlock_release(&path_locks, path_lock);
+             return status;
+         }
+     }
+     
+     /* Write into a staging file; the destination only changes once it is complete */
+     file_fd = open_staging_file(target_path, resume, filesize, staging_path, &total_received);
+     if (file_fd < 0) {
+         pathlock_release(&path_locks, path_lock);
+         return STATUS_FILE_ERROR;
+     }
+     
+     if (resume && total_received > 0) {
+         log_debug("Resuming %s at byte %lld", request->filename, (long long)total_received);
+     }
+     
+     /* A delta upload needs a file to be the delta of; without one the body is sent normally.
+      * Literal data is only what the existing file lacks, so it is not compressed as well. */
+     if (delta) {
+         signatures = sign_delta_basis(target_path, &basis_fd, &basis_size);
+         delta = (signatures != NULL);
+         compress = compress && !delta;
+     }
+     
+     /* Let the receive window cover several chunks of a large upload */
+     if (tune_socket_buffers) {
+         netio_tune_socket(client_socket, SO_RCVBUF, netio_chunk_size(filesize));
+     }
+     
+     /* From here on an early return leaves part of the body unread */
+     session->stream_broken = 1;
+     
+     /* Acknowledge ready to receive file, telling a resuming client where to start
+      * and a plain one whether to compress the body and follow it with a checksum trailer.
+      * A delta upload is told the size of the existing file and sent its block signatures. */
+     if (proto_send_response(client_socket, STATUS_READY,
+                             (request->flags & PROTO_FLAG_RESUME) | (checksum ? PROTO_FLAG_CHECKSUM : 0) |
+                             (compress ? PROTO_FLAG_COMPRESS : 0) | (delta ? PROTO_FLAG_DELTA : 0),
+                             delta ? basis_size : (uint64_t)total_received) < 0 ||
+         (delta && send_all(client_socket, signatures,
+                            proto_delta_block_count(basis_size) * sizeof(proto_signature_t)) < 0)) {
+         log_errno("send ready");
+         free(signatures);
+         if (basis_fd >= 0) {
+             close(basis_fd);
+         }
+         close(file_fd);
+         pathlock_release(&path_locks, path_lock);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     free(signatures);
+     
+     /* The manifest's checksum is kept as the body arrives. A resumed body's staged prefix
+      * was received earlier, and spliced bytes would have to be read back for it. */
+     if (resume) {
+         summed = (total_received == 0);
+     } else {
+         summed = delta || compress || checksum || !zero_copy_receive;
+     }
+     
+     /* Resumable bodies arrive as checksummed chunks, compressed ones as blocks, delta ones
+      * as instructions, others as one plain stream */
+     phase_start = metrics_now();
+     if (delta) {
+         status = receive_delta_body(client_socket, file_fd, basis_fd, basis_size, filesize, &total_received,
+                                     &crc, session->ticket);
+         close(basis_fd);
+     } else if (resume) {
+         status = receive_chunked_body(client_socket, file_fd, filesize, &total_received,
+                                       summed ? &crc : NULL, session->ticket);
+     } else if (compress) {
+         status = receive_compressed_body(client_socket, file_fd, filesize, &total_received,
+                                          &crc, session->ticket);
+     } else {
+         status = receive_plain_body(client_socket, file_fd, filesize, &total_received,
+                                     summed ? &crc : NULL, session->ticket);
+     }
+     if (status != STATUS_SUCCESS) {
+         close(file_fd);
+         pathlock_release(&path_locks, path_lock);
+         *committed = (uint64_t)total_received;
+         return status;
+     }
+     
+     /* Compare the client's checksum before anything is published */
+     if (checksum) {
+         status = receive_trailer(client_socket, crc, request->filename);
+         if (status != STATUS_SUCCESS) {
+             /* The trailer was consumed, so a mismatch leaves the session usable */
+             if (status == STATUS_CHECKSUM_ERROR) {
+                 session->stream_broken = 0;
+             }
+             if (staging_path[0]) {
+                 unlink(staging_path);
+             }
+             close(file_fd);
+             pathlock_release(&path_locks, path_lock);
+             return status;
+         }
+     }
+     
+     /* Whole body consumed: the next request starts at a clean boundary */
+     metrics_observe(METRICS_PHASE_RECEIVE, phase_start);
+     session->stream_broken = 0;
+     *committed = (uint64_t)total_received;
+     
+     /* A body announced with a digest must match it before it is published or stored */
+     if (dedup_requested(request)) {
+         status = dedup_store(file_fd, request, summed ? &crc : NULL);
+         if (status != STATUS_SUCCESS) {
+             *committed = 0;
+             if (staging_path[0]) {
+                 unlink(staging_path);
+             }
+             close(file_fd);
+             pathlock_release(&path_locks, path_lock);
+             return status;
+         }
+     }
+     
+     status = publish_staged_file(file_fd, staging_path, target_path, &decision, summed ? &crc : NULL);
+     
+     /* Unlock destination path */
+     pathlock_release(&path_locks, path_lock);
+     
+     if (status == STATUS_SUCCESS) {
+         log_debug("File transfer completed: %s -> %s", request->filename, target_path);
+     }
+     
+     return status;
+ }
+ 
+ /* Authorize a parallel upload once, stage and preallocate its file, and register it */
+ int open_parallel_upload(const proto_request_t *request, session_t *session, uint64_t *token) {
+     range_upload_t *upload;
+     off_t unused;
+     int status;
+     
+     upload = calloc(1, sizeof(range_upload_t));
+     if (!upload) {
+         log_errno("calloc");
+         return STATUS_UNKNOWN_ERROR;
+     }
+     upload->file_fd = -1;
+     
+     /* Permissions are checked here only; ranges and the commit present the token */
+     status = prepare_file_transfer(request, session, upload->target_path, &upload->access);
+     if (status != STATUS_SUCCESS) {
+         rangetable_free_upload(upload);
+         return status;
+     }
+     
+     upload->filesize = (off_t)request->size;
+     if (upload->filesize < 0) {
+         log_warn("Invalid file size: %lld", (long long)upload->filesize);
+         rangetable_free_upload(upload);
+         return STATUS_FILE_ERROR;
+     }
+     
+     upload->file_fd = open_staging_file(upload->target_path, 0, upload->filesize, upload->staging_path,
+                                         &unused);
+     if (upload->file_fd < 0) {
+         rangetable_free_upload(upload);
+         return STATUS_FILE_ERROR;
+     }
+     
+     /* Reserve the whole file up front: ranges land out of order, and a full disk
+      * is reported now rather than halfway through */
+     if (upload->filesize > 0 && fallocate(upload->file_fd, 0, 0, upload->filesize) < 0 &&
+         (errno != EOPNOTSUPP || ftruncate(upload->file_fd, upload->filesize) < 0)) {
+         log_errno("fallocate");
+         status = (errno == ENOSPC) ? STATUS_FILE_ERROR : STATUS_UNKNOWN_ERROR;
+     } else {
+         strcpy(upload->username, request->username);
+         strcpy(upload->filename, request->filename);
+         upload->range_count = proto_range_count((uint64_t)upload->filesize);
+         status = (rangetable_open(&range_uploads, upload) == 0) ? STATUS_SUCCESS : STATUS_UNKNOWN_ERROR;
+     }
+     if (status != STATUS_SUCCESS) {
+         if (upload->staging_path[0]) {
+             unlink(upload->staging_path);
+         }
+         rangetable_free_upload(upload);
+         return status;
+     }
+     
+     log_info("Opened parallel upload of %s: %u ranges of up to %llu bytes", upload->target_path,
+              upload->range_count, (unsigned long long)proto_range_size((uint64_t)upload->filesize));
+     *token = upload->token;
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Receive one range of a parallel upload into its place in the staging file */
+ int process_range_transfer(int client_socket, const proto_request_t *request, session_t *session,
+                            uint64_t *committed) {
+     int checksum = (request->flags & PROTO_FLAG_CHECKSUM) != 0;
+     int summed = checksum || !zero_copy_receive;
+     off_t offset, received = 0;
+     uint32_t crc = 0;
+     uint64_t phase_start;
+     int file_fd, status;
+     
+     /* Failures before READY leave the stream aligned on the next request */
+     status = rangetable_claim(&range_uploads, request, &file_fd, &offset);
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     /* Every range counts as a transfer of its own; the caller releases the ticket */
+     status = quota_admit(request->username, resolve_target_dir(request->target_dir), &session->ticket);
+     if (status != STATUS_SUCCESS) {
+         close(file_fd);
+         return status;
+     }
+     
+     if (tune_socket_buffers) {
+         netio_tune_socket(client_socket, SO_RCVBUF, netio_chunk_size((off_t)request->size));
+     }
+     
+     /* From here on an early return leaves part of the body unread */
+     session->stream_broken = 1;
+     
+     if (proto_send_response(client_socket, STATUS_READY, checksum ? PROTO_FLAG_CHECKSUM : 0, 0) < 0) {
+         log_errno("send ready");
+         close(file_fd);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* Each range has its own descriptor, so it streams exactly like a plain body; its
+      * checksum is kept for the whole file's unless that would mean reading spliced bytes back */
+     phase_start = metrics_now();
+     status = receive_plain_body(client_socket, file_fd, (off_t)request->size, &received,
+                                 summed ? &crc : NULL, session->ticket);
+     if (status == STATUS_SUCCESS && checksum) {
+         status = receive_trailer(client_socket, crc, request->filename);
+         if (status == STATUS_CHECKSUM_ERROR) {
+             /* The range is simply not marked stored; the client may send it again */
+             session->stream_broken = 0;
+         }
+     }
+     close(file_fd);
+     
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     metrics_observe(METRICS_PHASE_RECEIVE, phase_start);
+     session->stream_broken = 0;
+     rangetable_complete(&range_uploads, request, summed ? &crc : NULL);
+     *committed = (uint64_t)received;
+     
+     return STATUS_SUCCESS;
+ }
+ 
+ /* Set ownership on a parallel upload whose ranges have all arrived, then publish it */
+ int commit_parallel_upload(const proto_request_t *request, uint64_t *committed) {
+     pathlock_entry_t *path_lock;
+     range_upload_t *upload;
+     uint64_t phase_start;
+     uint32_t crc;
+     int status;
+     
+     status = rangetable_take(&range_uploads, request, &upload);
+     if (status != STATUS_SUCCESS) {
+         return status;
+     }
+     
+     /* Publishing replaces target_path, so wait for any single-stream upload writing it */
+     phase_start = metrics_now();
+     path_lock = pathlock_acquire(&path_locks, upload->target_path);
+     metrics_observe(METRICS_PHASE_LOCK_WAIT, phase_start);
+     if (!path_lock) {
+         rangetable_return(&range_uploads, upload);
+         return STATUS_UNKNOWN_ERROR;
+     }
+     
+     /* Ownership runs once per file, exactly as for a single-stream upload */
+     if (apply_file_ownership(upload->file_fd, &upload->access) != 0) {
+         log_error("Failed to set file ownership for %s", upload->target_path);
+         status = STATUS_FILE_ERROR;
+     } else {
+         phase_start = metrics_now();
+         if (durability_sync_file(upload->file_fd) != 0 ||
+             commit_staging_file(upload->file_fd, upload->staging_path, upload->target_path) != 0) {
+             status = STATUS_FILE_ERROR;
+         } else {
+             /* The whole file's checksum is combined from its ranges' rather than read back */
+             manifest_record(upload->target_path, upload->file_fd,
+                             rangetable_checksum(upload, &crc) == 0 ? &crc : NULL);
+             if (durability_sync_dir(upload->target_path) != 0) {
+                 status = STATUS_FILE_ERROR;
+             } else {
+                 metrics_observe(METRICS_PHASE_PUBLISH, phase_start);
+             }
+         }
+     }
+     
+     if (status == STATUS_SUCCESS) {
+         log_debug("File transfer completed: %s -> %s (%u ranges)", upload->filename, upload->target_path,
+                   upload->range_count);
+         *committed = (uint64_t)upload->filesize;
+     } else if (upload->staging_path[0]) {
+         /* Ranges cannot be resumed, so a named staging file is of no further use */
+         unlink(upload->staging_path);
+     }
+     
+     pathlock_release(&path_locks, path_lock);
+     rangetable_free_upload(upload);
+     return status;
+ }
+ 
+ /* Check group membership for a directory and record the owner to apply */
+ static int check_user_access(const char *username, const char *target_dir, access_decision_t *decision) {
+     cred_user_t user;
+     const config_dir_t *dir;
+     const char *required_group;
+     gid_t required_gid;
+     int i, found;
+     
+     memset(decision, 0, sizeof(*decision));
+     
+     /* Check if user is in the group the configuration gives the target directory */
+     dir = config_find_dir(config_current(), target_dir);
+     if (!dir) {
+         return 0;
+     }
+     required_group = dir->group;
+     
+     /* Look up user information and group membership (cached) */
+     if (credcache_get_user(username, &user) < 0) {
+         log_errno("user lookup");
+         return 0;
+     }
+     if (!user.found) {
+         log_warn("User not found: %s", username);
+         return 0;
+     }
+     
+     /* Look up the required group */
+     found = credcache_get_group(required_group, &required_gid);
+     if (found <= 0) {
+         log_warn("Group not found: %s", required_group);
+         credcache_free_user(&user);
+         return 0;
+     }
+     
+     /* Check if user is a member of the required group */
+     for (i = 0; i < user.ngroups; i++) {
+         if (user.groups[i] == required_gid) {
+             decision->allowed = 1;
+             break;
+         }
+     }
+     
+     decision->uid = user.uid;
+     decision->gid = user.gid;
+     credcache_free_user(&user);
+     
+     return decision->allowed;
+ }
+ 
+ /* Decide whether a user may write to a directory and record the owner to apply */
+ int authorize_user(const char *username, const char *target_dir, access_decision_t *decision) {
+     uint64_t start = metrics_now();
+     int allowed = check_user_access(username, target_dir, decision);
+     
+     metrics_observe(METRICS_PHASE_AUTH, start);
+     return allowed;
+ }
+ 
+ /* Verify user permissions for accessing a directory */
+ int verify_user_access(const char *username, const char *target_dir) {
+     access_decision_t decision;
+     
+     return authorize_user(username, target_dir, &decision);
+ }
+ 
+ /* Apply the ownership recorded in an access decision to an open file */
+ int apply_file_ownership(int file_fd, const access_decision_t *decision) {
+     uint64_t start = metrics_now();
+     
+     /* Change file ownership */
+     if (fchown(file_fd, decision->uid, decision->gid) < 0) {
+         log_errno("fchown");
+         return -1;
+     }
+     
+     metrics_observe(METRICS_PHASE_CHOWN, start);
+     return 0;
+ }
+ 
+ /* Set file ownership to the user who transferred it */
+ int set_file_ownership(const char *filepath, const char *username) {
+     cred_user_t user;
+     int result = 0;
+     
+     /* Look up user information */
+     if (credcache_get_user(username, &user) < 0 || !user.found) {
+         log_warn("User not found: %s", username);
+         credcache_free_user(&user);
+         return -1;
+     }
+     
+     /* Change file ownership */
+     if (chown(filepath, user.uid, user.gid) < 0) {
+         log_errno("chown");
+         result = -1;
+     }
+     credcache_free_user(&user);
+     
+     return result;
+ }
+ 
+ /* Get username from UID */
+ char *get_username_from_uid(uid_t uid) {
+     struct passwd *pw;
+     
+     pw = getpwuid(uid);
+     if (!pw) {
+         return NULL;
+     }
+     
+     return pw->pw_name;
+ }
+ 
+ /* Display usage instructions */
+ void display_usage(void) {
+     printf("Usage: server [-m threaded|pool|epoll|uring] [-w workers] [-q queue] [-s seconds] [-t seconds]\n");
+     printf("              [-f none|fdatasync|group] [-M socket] [-L file] [-l level] [-S megabytes]\n");
+     printf("              [-Q scope=rate[,transfers]]... [-n shards] [-b backlog] [-F file]\n");
+     printf("              [-o key=value]... [-z] [-T] [-D]\n");
+     printf("  -m mode: Connection handling core (default: epoll)\n");
+     printf("     threaded - one thread per client connection\n");
+     printf("     pool     - fixed worker pool fed by a bounded queue\n");
+     printf("     epoll    - single-threaded edge-triggered event loop\n");
+     printf("     uring    - single-threaded io_uring loop with registered buffers and fixed files\n");
+     printf("  -w workers: Pool worker threads, as workers=n (default: number of cores)\n");
+     printf("  -q queue: Pool queue capacity (default: %d per worker)\n", WORKPOOL_QUEUE_PER_WORKER);
+     printf("  -s seconds: Print pool or io_uring statistics at this interval\n");
+     printf("  -t seconds: Credential cache lifetime, 0 disables it (default: %d; SIGHUP flushes)\n",
+            CREDCACHE_DEFAULT_TTL);
+     printf("  -f mode: Flush uploads before acknowledging them (default: none)\n");
+     printf("     none      - leave write-back to the kernel\n");
+     printf("     fdatasync - fdatasync() every file and fsync() its directory (threaded and pool;\n");
+     printf("                 epoll and uring use group instead)\n");
+     printf("     group     - share syncfs() calls between concurrent uploads\n");
+     printf("  -M socket: Serve Prometheus-text metrics on this Unix socket (curl --unix-socket)\n");
+     printf("  -L file: Write the log to this file instead of standard output (SIGHUP reopens it)\n");
+     printf("  -l level: Least severe records logged: debug, info, warn or error (default: info;\n");
+     printf("            SIGUSR1 and SIGUSR2 make it one step more or less verbose)\n");
+     printf("  -S megabytes: Rotate the log file past this size, keeping %d old files; 0 never rotates\n",
+            LOGGER_KEEP_FILES);
+     printf("            (default: %d)\n", LOGGER_DEFAULT_ROTATE_MB);
+     printf("  -Q scope=rate[,transfers]: Limit the bandwidth (bytes per second, k/m/g suffixes)\n");
+     printf("     and concurrent uploads of a scope; 0 is unlimited. Repeat for each scope:\n");
+     printf("     user         - each user, unless named below\n");
+     printf("     user:name    - one user\n");
+     printf("     directory    - everyone uploading to that directory, e.g. Manufacturing\n");
+     printf("  -n shards: Run this many epoll or uring loops, each pinned to a core with its own\n");
+     printf("     SO_REUSEPORT listener and connections; 0 is one per core (default: 1)\n");
+     printf("  -b backlog: Pending connections queued per listener, as backlog=n (default: %d,\n",
+            CONFIG_DEFAULT_BACKLOG);
+     printf("     capped by net.core.somaxconn)\n");
+     printf("  -F file: Read settings from this file, one key = value per line ('#' comments);\n");
+     printf("     SIGHUP reads it again without dropping connections or transfers in progress\n");
+     printf("  -o key=value: Override a setting of the file; repeat for each. Keys:\n");
+     printf("     listen=[address][:port]  Address to bind (default: *:%d; restart to change)\n", PORT);
+     printf("     workers=n, backlog=n     As -w and -b (restart to change)\n");
+     printf("     max_clients=n            Connections the threaded core admits (default: %d)\n",
+            CONFIG_DEFAULT_MAX_CLIENTS);
+     printf("     uring_slots=n            Connections each io_uring loop serves at once; more wait in\n");
+     printf("                              the listen backlog (default: %d; restart to change)\n",
+            CONFIG_DEFAULT_URING_SLOTS);
+     printf("     uring_buffers=n          64 KiB body buffers each io_uring loop's uploads share\n");
+     printf("                              (default: %d; restart to change)\n", CONFIG_DEFAULT_URING_BUFFERS);
+     printf("     chunk_size=bytes         Largest transfer buffer, 4k to 512k (default: 512k)\n");
+     printf("     tcp_nodelay=on|off       Send statuses at once (default: on)\n");
+     printf("     tcp_cork=on|off          Send only full segments (default: off)\n");
+     printf("     sndbuf=, rcvbuf=bytes    Fixed socket buffers; 0 autotunes (default: 0)\n");
+     printf("     keepalive=off|idle[,interval[,count]]  TCP keepalive in seconds (default: off)\n");
+     printf("     cache_size=bytes         Hot files kept mapped for threaded and pool mode downloads;\n");
+     printf("                              0 disables (default: %dm)\n",
+            CONFIG_DEFAULT_CACHE_SIZE / (1024 * 1024));
+     printf("     cache_max_file=bytes     Largest file the download cache keeps (default: %dm)\n",
+            CONFIG_DEFAULT_CACHE_MAX_FILE / (1024 * 1024));
+     printf("     dir=name path group      Destination whose uploads land in path, open to the\n");
+     printf("                              group's members; the first replaces the defaults\n");
+     printf("                              (Manufacturing and Distribution)\n");
+     printf("  -z: Receive file data with splice() instead of a user-space buffer (in epoll mode,\n");
+     printf("      only bodies sent without a checksum, which would otherwise be read back)\n");
+     printf("  -T: Size socket receive buffers to each upload's chunk size (disables autotuning;\n");
+     printf("      not available in uring mode, whose sockets have no descriptor)\n");
+     printf("  -D: Keep a content-addressed store in each directory (.store) and clone uploads whose\n");
+     printf("      announced SHA-256 it already holds instead of receiving their bodies\n");
  }
  
  /* Clean up resources */
  void cleanup_server(int server_socket) {
-     /* Close server socket */
-     close(server_socket);
+     /* Close server socket, unless the shards already closed theirs */
+     if (server_socket >= 0) {
+         close_listener(server_socket);
+     }
+     
+     /* Destroy path locks */
+     pathlock_destroy(&path_locks);
+     rangetable_destroy(&range_uploads);
+     
+     /* Free idle transfer buffers */
+     bufpool_destroy(&buffer_pool);
+     
+     /* Release cached credentials */
+     credcache_destroy();
+     
+     /* Unmap cached downloads and free the manifests, then every configuration loaded */
+     filecache_destroy();
+     manifest_destroy();
+     config_destroy();
+     
+     /* Free quota accounting */
+     quota_destroy();
+     
+     /* Remove the metrics control socket */
+     metrics_shutdown();
      
-     /* Destroy mutex */
-     pthread_mutex_destroy(&file_mutex);
+     /* Write out queued log records last, after everything else has reported */
+     logger_stop();
  }
\ No newline at end of file
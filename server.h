@@ -18,59 +18,193 @@
  #include <sys/types.h>
  #include <netinet/in.h>
  #include <arpa/inet.h>
+ #include <netinet/tcp.h>
  #include <pthread.h>
  #include <errno.h>
  #include <sys/stat.h>
  #include <fcntl.h>
  #include <pwd.h>
  #include <grp.h>
+ #include <stdint.h>
+ #include <endian.h>
+ #include <getopt.h>
+ #include "protocol.h"
+ #include "credcache.h"
+ #include "crc32c.h"
+ #include "sha256.h"
+ #include "logger.h"
+ #include "config.h"
  
- /* Server configuration constants */
- #define PORT 8080
- #define BUFFER_SIZE 1024
- #define MAX_CLIENTS 10
+ /* Server configuration constants; runtime settings are in config.h */
  #define MAX_PATH_LENGTH 256
  
- /* Directory paths */
- #define MANUFACTURING_DIR "./Manufacturing"
- #define DISTRIBUTION_DIR "./Distribution"
+ /* Resumable uploads land in "<dir>/.<filename>.part" and are renamed once complete;
+  * others use an unnamed O_TMPFILE linked in as "<dir>/.<filename>.<n>.tmp" first */
+ #define STAGING_SUFFIX ".part"
+ #define STAGING_TEMP_SUFFIX ".tmp"
+ #define STAGING_PATH_LENGTH (MAX_PATH_LENGTH + 32)
  
- /* Status codes for client responses */
- #define STATUS_SUCCESS 0
- #define STATUS_PERMISSION_DENIED 1
- #define STATUS_FILE_ERROR 2
- #define STATUS_UNKNOWN_ERROR 3
+ /* Server concurrency modes selectable at runtime */
+ typedef enum {
+     SERVER_MODE_THREADED,   /* One detached thread per connection */
+     SERVER_MODE_POOL,       /* Fixed worker pool fed by a bounded queue */
+     SERVER_MODE_EPOLL,      /* Single-threaded edge-triggered epoll reactor */
+     SERVER_MODE_URING       /* Single-threaded io_uring completion loop */
+ } server_mode_t;
  
- /* Thread synchronization mutex */
- extern pthread_mutex_t file_mutex;
+ /* Number of connected clients (updated atomically) */
+ extern int active_clients;
+ 
+ /* Receive file data with splice() when non-zero */
+ extern int zero_copy_receive;
+ 
+ /* Size each upload's SO_RCVBUF to its chunk size when non-zero */
+ extern int tune_socket_buffers;
+ 
+ /* Outcome of one authorization check, reused for the chown after the upload */
+ typedef struct {
+     int allowed;                /* Non-zero if the user may write to the directory */
+     uid_t uid;                  /* Owner to assign to uploaded files */
+     gid_t gid;
+ } access_decision_t;
+ 
+ /* Per-connection session state */
+ typedef struct {
+     int persistent;             /* Keep the connection open between files */
+     int authenticated;          /* Access for username/target_dir already verified */
+     int stream_broken;          /* A body was left partly unread; the connection must close */
+     char username[PROTO_MAX_USERNAME + 1];
+     const char *target_dir;     /* Resolved directory the access check covered */
+     access_decision_t access;   /* Decision made by begin_session() */
+     unsigned int generation;    /* Credential cache generation that decision was made under */
+     unsigned long files;        /* Files transferred successfully in this session */
+     struct quota_ticket *ticket; /* Quota admission of the transfer in progress, or NULL */
+ } session_t;
  
  /* Client connection data structure */
  typedef struct {
      int client_socket;
      struct sockaddr_in client_addr;
      int client_id;
+     uint64_t accepted_ns;       /* Monotonic time of accept(), for the accept phase metric */
  } client_t;
  
  /* Function prototypes */
  
- /* Initialize server socket and start listening for connections */
- int initialize_server(void);
+ /* Initialize a server socket and start listening with room for backlog pending
+  * connections; reuse_port lets further sockets bind the same port as shards */
+ int initialize_server(int backlog, int reuse_port);
+ 
+ /* Close a listening socket and stop applying reloaded options to it */
+ void close_listener(int server_socket);
  
  /* Handle client connection in a separate thread */
  void *handle_client(void *arg) __attribute__((noreturn));
  
+ /* Run the handshake and transfer for one client, then release it */
+ void serve_client(client_t *client);
+ 
+ /* Accept connections and spawn one thread per client */
+ int run_threaded_server(int server_socket);
+ 
  /* Process file transfer request from client */
- int process_file_transfer(int client_socket, const char *username, const char *target_dir, const char *filename);
+ int process_file_transfer(int client_socket, const proto_request_t *request, session_t *session,
+                           uint64_t *committed);
+ 
+ /* Authorize a parallel upload once, stage and preallocate its file, and register it
+  * under a new token. Returns a status code. */
+ int open_parallel_upload(const proto_request_t *request, session_t *session, uint64_t *token);
+ 
+ /* Receive one range of a parallel upload into its place in the staging file */
+ int process_range_transfer(int client_socket, const proto_request_t *request, session_t *session,
+                            uint64_t *committed);
+ 
+ /* Set ownership on a parallel upload whose ranges have all arrived, then publish it */
+ int commit_parallel_upload(const proto_request_t *request, uint64_t *committed);
+ 
+ /* Verify access once and mark the connection as a persistent session */
+ int begin_session(session_t *session, const proto_request_t *request);
+ 
+ /* Whether a session's access decision covers username in full_target_dir. A decision older
+  * than the credential cache is made again first, and a session that lost access no longer
+  * covers anything. */
+ int session_covers(session_t *session, const char *username, const char *full_target_dir);
+ 
+ /* Map a requested directory onto a known destination, or NULL if invalid */
+ const char *resolve_target_dir(const char *target_dir);
+ 
+ /* Validate a transfer request and build the destination path */
+ int prepare_file_transfer(const proto_request_t *request, session_t *session, char *target_path,
+                           access_decision_t *decision);
+ 
+ /* Open the staging file for target_path, keeping its verified prefix when resuming.
+  * Returns the descriptor with *committed set to the resume offset, or -1.
+  * staging_path is left empty when the file is an unnamed O_TMPFILE. */
+ int open_staging_file(const char *target_path, int resume, off_t filesize,
+                       char *staging_path, off_t *committed);
+ 
+ /* Atomically replace the destination with a complete staging file */
+ int commit_staging_file(int file_fd, const char *staging_path, const char *target_path);
+ 
+ /* Check a received chunk and append it at *committed, combining its checksum into *crc
+  * when that is not NULL. Returns a status code. */
+ int store_chunk(int file_fd, const proto_chunk_t *chunk, const char *data, off_t *committed, uint32_t *crc);
+ 
+ /* Expand a received block (into scratch, at least PROTO_BLOCK_SIZE bytes, if compressed)
+  * and write it at *written, folding the expanded bytes into *crc and *sha when they are
+  * not NULL. Returns a status code. */
+ int store_block(int file_fd, const proto_block_t *block, const char *payload, char *scratch,
+                 off_t *written, uint32_t *crc, sha256_t *sha);
+ 
+ /* Open the existing file at target_path for a delta upload and allocate room for its
+  * signatures (proto_delta_block_count() of them, for the caller to free), leaving the file
+  * open on *basis_fd to be signed with delta_sign_step(). Returns NULL if there is no file
+  * worth matching against. */
+ proto_signature_t *open_delta_basis(const char *target_path, int *basis_fd, uint64_t *basis_size);
+ 
+ /* Sign the existing file at target_path for a delta upload. Returns its signatures
+  * (proto_delta_block_count() of them, for the caller to free) with the file left open
+  * on *basis_fd, or NULL if there is no file worth matching against. */
+ proto_signature_t *sign_delta_basis(const char *target_path, int *basis_fd, uint64_t *basis_size);
+ 
+ /* Apply one delta instruction at *written: literal bytes from literal, or a copy from the
+  * basis_size-byte file on basis_fd through scratch. Folds the bytes into *crc and *sha when
+  * they are not NULL. Returns a status code. */
+ int store_delta(int file_fd, int basis_fd, uint64_t basis_size, const proto_delta_t *op,
+                 const char *literal, char *scratch, size_t scratch_size, off_t *written, uint32_t *crc,
+                 sha256_t *sha);
+ 
+ /* Apply at most scratch_size bytes of a delta copy, in whole blocks, and advance op past
+  * them, so an event loop can interleave a long copy with other work; the copy is done once
+  * op->length reaches 0. Returns a status code. */
+ int store_delta_step(int file_fd, int basis_fd, uint64_t basis_size, proto_delta_t *op, char *scratch,
+                      size_t scratch_size, off_t *written, uint32_t *crc, sha256_t *sha);
+ 
+ /* CRC32C of length bytes of a staging file from offset, for bodies spliced past user space */
+ int checksum_staged_body(int file_fd, off_t offset, off_t length, uint32_t *crc);
+ 
+ /* Decode a body trailer and compare it with the checksum of what was received.
+  * Returns STATUS_SUCCESS, STATUS_CHECKSUM_ERROR or STATUS_PROTOCOL_ERROR. */
+ int verify_body_trailer(proto_trailer_t *trailer, uint32_t crc, const char *filename);
+ 
+ /* Decide whether a user may write to a directory and record the owner to apply */
+ int authorize_user(const char *username, const char *target_dir, access_decision_t *decision);
  
  /* Verify user permissions for accessing a directory */
  int verify_user_access(const char *username, const char *target_dir);
  
+ /* Apply the ownership recorded in an access decision to an open file */
+ int apply_file_ownership(int file_fd, const access_decision_t *decision);
+ 
  /* Set file ownership to the user who transferred it */
  int set_file_ownership(const char *filepath, const char *username);
  
  /* Get username from UID */
  char *get_username_from_uid(uid_t uid);
  
+ /* Display usage instructions */
+ void display_usage(void);
+ 
  /* Clean up resources */
  void cleanup_server(int server_socket);
  
@@ -0,0 +1,241 @@
+/* sha256.c - Implementation of the SHA-256 digest
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the digest that names content in the upload store:
+ * - SHA-256 as specified in FIPS 180-4
+ * - The x86 SHA extensions, four rounds per instruction pair, where the CPU has them
+ * - A portable implementation for every other machine
+ * - Implementation chosen once, on first use
+ */
+
+ #include "sha256.h"
+ #include <pthread.h>
+ #include <string.h>
+ 
+ #if defined(__x86_64__)
+ #include <immintrin.h>
+ #define SHA256_HAVE_SHANI 1
+ #endif
+ 
+ /* Compress whole 64-byte blocks into the state */
+ typedef void (*sha256_fn)(uint32_t state[8], const unsigned char *p, size_t blocks);
+ 
+ /* Round constants: the first 32 bits of the fractional parts of the cube roots of the first 64 primes */
+ static const uint32_t sha256_k[64] = {
+     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+     0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+     0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+     0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+     0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+     0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+     0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+     0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+ };
+ 
+ static sha256_fn sha256_impl;
+ static const char *sha256_impl_name;
+ static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+ 
+ #define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+ 
+ /* Portable path: the message schedule and 64 rounds, one block at a time */
+ static void sha256_software(uint32_t state[8], const unsigned char *p, size_t blocks) {
+     uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+     int i;
+     
+     while (blocks--) {
+         for (i = 0; i < 16; i++) {
+             w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 |
+                    (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+         }
+         for (i = 16; i < 64; i++) {
+             w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+                    w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+         }
+     
+         a = state[0];
+         b = state[1];
+         c = state[2];
+         d = state[3];
+         e = state[4];
+         f = state[5];
+         g = state[6];
+         h = state[7];
+         for (i = 0; i < 64; i++) {
+             t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+             t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+             h = g;
+             g = f;
+             f = e;
+             e = d + t1;
+             d = c;
+             c = b;
+             b = a;
+             a = t1 + t2;
+         }
+         state[0] += a;
+         state[1] += b;
+         state[2] += c;
+         state[3] += d;
+         state[4] += e;
+         state[5] += f;
+         state[6] += g;
+         state[7] += h;
+     
+         p += SHA256_BLOCK_SIZE;
+     }
+ }
+ 
+ #ifdef SHA256_HAVE_SHANI
+ /* Hardware path: compiled for the SHA extensions but only called once the CPU reports
+  * them. The state lives in two registers as ABEF and CDGH, the order sha256rnds2 wants. */
+ __attribute__((target("sha,sse4.1,ssse3")))
+ static void sha256_shani(uint32_t state[8], const unsigned char *p, size_t blocks) {
+     const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+     __m128i state0, state1, saved0, saved1, msg[4], schedule, tmp;
+     int group;
+     
+     /* ABCD EFGH -> ABEF CDGH */
+     tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+     state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+     state0 = _mm_alignr_epi8(tmp, state1, 8);
+     state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+     
+     while (blocks--) {
+         saved0 = state0;
+         saved1 = state1;
+     
+         /* Sixteen groups of four rounds; past the first four message words, each group's
+          * words W[t..t+3] come from the four groups before it:
+          * W[t-16] + s0(W[t-15]) (msg1), + W[t-7] (alignr), + s1(W[t-2]) (msg2) */
+         for (group = 0; group < 16; group++) {
+             if (group < 4) {
+                 msg[group] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * group)), byteswap);
+             } else {
+                 tmp = _mm_sha256msg1_epu32(msg[group & 3], msg[(group + 1) & 3]);
+                 tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[(group + 3) & 3], msg[(group + 2) & 3], 4));
+                 msg[group & 3] = _mm_sha256msg2_epu32(tmp, msg[(group + 3) & 3]);
+             }
+     
+             schedule = _mm_add_epi32(msg[group & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * group]));
+             state1 = _mm_sha256rnds2_epu32(state1, state0, schedule);
+             state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(schedule, 0x0E));
+         }
+     
+         state0 = _mm_add_epi32(state0, saved0);
+         state1 = _mm_add_epi32(state1, saved1);
+         p += SHA256_BLOCK_SIZE;
+     }
+     
+     /* ABEF CDGH -> ABCD EFGH */
+     tmp = _mm_shuffle_epi32(state0, 0x1B);
+     state1 = _mm_shuffle_epi32(state1, 0xB1);
+     _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+     _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+ }
+ #endif
+ 
+ /* Pick the fastest implementation */
+ static void sha256_select(void) {
+     sha256_impl = sha256_software;
+     sha256_impl_name = "software";
+ #ifdef SHA256_HAVE_SHANI
+     if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+         sha256_impl = sha256_shani;
+         sha256_impl_name = "sha-ni";
+     }
+ #endif
+ }
+ 
+ /* Start a new digest */
+ void sha256_init(sha256_t *ctx) {
+     static const uint32_t initial[8] = {
+         0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+     };
+     
+     pthread_once(&sha256_once, sha256_select);
+     
+     memcpy(ctx->state, initial, sizeof(initial));
+     ctx->length = 0;
+     ctx->used = 0;
+ }
+ 
+ /* Extend the digest with length bytes of data */
+ void sha256_update(sha256_t *ctx, const void *data, size_t length) {
+     const unsigned char *p = (const unsigned char *)data;
+     size_t take;
+     
+     ctx->length += length;
+     
+     /* Top up a partly filled block first */
+     if (ctx->used > 0) {
+         take = SHA256_BLOCK_SIZE - ctx->used;
+         if (take > length) {
+             take = length;
+         }
+         memcpy(ctx->block + ctx->used, p, take);
+         ctx->used += take;
+         p += take;
+         length -= take;
+         if (ctx->used < SHA256_BLOCK_SIZE) {
+             return;
+         }
+         sha256_impl(ctx->state, ctx->block, 1);
+         ctx->used = 0;
+     }
+     
+     /* Whole blocks straight from the caller's buffer */
+     if (length >= SHA256_BLOCK_SIZE) {
+         sha256_impl(ctx->state, p, length / SHA256_BLOCK_SIZE);
+         p += length / SHA256_BLOCK_SIZE * SHA256_BLOCK_SIZE;
+         length %= SHA256_BLOCK_SIZE;
+     }
+     
+     memcpy(ctx->block, p, length);
+     ctx->used = length;
+ }
+ 
+ /* Pad the message and write its digest */
+ void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+     uint64_t bits = ctx->length * 8;
+     int i;
+     
+     /* A one bit, zeros up to 56 bytes into a block, then the length in bits */
+     ctx->block[ctx->used++] = 0x80;
+     if (ctx->used > SHA256_BLOCK_SIZE - 8) {
+         memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - ctx->used);
+         sha256_impl(ctx->state, ctx->block, 1);
+         ctx->used = 0;
+     }
+     memset(ctx->block + ctx->used, 0, SHA256_BLOCK_SIZE - 8 - ctx->used);
+     for (i = 0; i < 8; i++) {
+         ctx->block[SHA256_BLOCK_SIZE - 1 - i] = (unsigned char)(bits >> (8 * i));
+     }
+     sha256_impl(ctx->state, ctx->block, 1);
+     
+     for (i = 0; i < 8; i++) {
+         digest[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+         digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+         digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+         digest[4 * i + 3] = (uint8_t)ctx->state[i];
+     }
+ }
+ 
+ /* Write a digest as lowercase hex */
+ void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex) {
+     static const char digits[] = "0123456789abcdef";
+     int i;
+     
+     for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+         hex[2 * i] = digits[digest[i] >> 4];
+         hex[2 * i + 1] = digits[digest[i] & 0x0f];
+     }
+     hex[2 * SHA256_DIGEST_SIZE] = '\0';
+ }
+ 
+ /* Name of the implementation in use ("sha-ni" or "software") */
+ const char *sha256_implementation(void) {
+     pthread_once(&sha256_once, sha256_select);
+     
+     return sha256_impl_name;
+ }
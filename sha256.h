@@ -0,0 +1,48 @@
+/* sha256.h - Header file for the SHA-256 digest
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations shared by the server and client for:
+ * - Incremental SHA-256 over buffers of any length
+ * - Hex encoding of a digest, for content store names and logs
+ * - Reporting which implementation (hardware or portable) is in use
+ */
+
+ #ifndef SHA256_H
+ #define SHA256_H
+ 
+ #include <stdint.h>
+ #include <stddef.h>
+ 
+ /* Digest and block sizes in bytes */
+ #define SHA256_DIGEST_SIZE 32
+ #define SHA256_BLOCK_SIZE 64
+ 
+ /* Hex encoding of a digest, terminator included */
+ #define SHA256_HEX_LENGTH (2 * SHA256_DIGEST_SIZE + 1)
+ 
+ /* Running digest of a message */
+ typedef struct {
+     uint32_t state[8];
+     uint64_t length;                /* Message bytes so far */
+     unsigned char block[SHA256_BLOCK_SIZE];
+     size_t used;                    /* Bytes waiting in block */
+ } sha256_t;
+ 
+ /* Function prototypes */
+ 
+ /* Start a new digest */
+ void sha256_init(sha256_t *ctx);
+ 
+ /* Extend the digest with length bytes of data */
+ void sha256_update(sha256_t *ctx, const void *data, size_t length);
+ 
+ /* Pad the message and write its digest */
+ void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+ 
+ /* Write a digest as lowercase hex into hex (SHA256_HEX_LENGTH bytes) */
+ void sha256_hex(const uint8_t digest[SHA256_DIGEST_SIZE], char *hex);
+ 
+ /* Name of the implementation in use ("sha-ni" or "software") */
+ const char *sha256_implementation(void);
+ 
+ #endif /* SHA256_H */
@@ -0,0 +1,202 @@
+/* shard.c - Implementation of the sharded multi-core server core
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements listener sharding:
+ * - A listening socket per shard in one SO_REUSEPORT group, so the kernel spreads
+ *   connections across shards and no accept queue is shared
+ * - Each shard's event loop pinned to its own CPU, serving its connections start to finish
+ * - Connections steered to the shard on the CPU that received them, where the CPUs allow it
+ * - A shard that stops leaving the group, so its connections go to the shards still serving
+ * - Client IDs interleaved between shards so they stay unique without coordination
+ */
+
+ #include "shard.h"
+ #include "reactor.h"
+ #include "uring.h"
+ #include <sched.h>
+ #include <linux/filter.h>
+ 
+ /* Take a stopped shard's listener out of the group, so no connection waits on it */
+ static void retire_shard(shard_t *shard) {
+     int unused = 0;
+     
+     /* Steering picks a listener by its position in the group, which closing one reorders:
+      * let the kernel hash connections across the shards that are left instead */
+     if (__atomic_exchange_n(shard->steered, 0, __ATOMIC_ACQ_REL)) {
+         if (setsockopt(shard->listen_fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, &unused, sizeof(unused)) < 0) {
+             log_errno("setsockopt SO_DETACH_REUSEPORT_BPF");
+         } else {
+             log_warn("Shard %d stopped: connections are no longer steered by CPU", shard->index);
+         }
+     }
+     
+     close_listener(shard->listen_fd);
+     shard->listen_fd = -1;
+ }
+ 
+ /* Run one shard's event loop on its own thread */
+ static void *shard_main(void *arg) {
+     shard_t *shard = (shard_t *)arg;
+     reactor_t *reactor;
+     uring_t *ring;
+     
+     log_info("Shard %d of %d serving on CPU %d", shard->index, shard->count, shard->cpu);
+     
+     /* Kernels or sandboxes without io_uring still get the epoll core */
+     if (shard->mode == SERVER_MODE_URING) {
+         ring = malloc(sizeof(uring_t));
+         if (ring && uring_init(ring, shard->listen_fd, shard->stats_interval) == 0) {
+             ring->next_client_id = shard->index;
+             ring->client_id_step = shard->count;
+             shard->result = uring_run(ring);
+             retire_shard(shard);
+             uring_destroy(ring);
+             free(ring);
+             return NULL;
+         }
+         log_warn("Shard %d: io_uring unavailable, falling back to epoll", shard->index);
+         free(ring);
+     }
+     
+     reactor = malloc(sizeof(reactor_t));
+     if (!reactor || reactor_init(reactor, shard->listen_fd) < 0) {
+         free(reactor);
+         shard->result = -1;
+         retire_shard(shard);
+         return NULL;
+     }
+     reactor->next_client_id = shard->index;
+     reactor->client_id_step = shard->count;
+     shard->result = reactor_run(reactor);
+     retire_shard(shard);
+     reactor_destroy(reactor);
+     free(reactor);
+     
+     return NULL;
+ }
+ 
+ /* Send each connection to the listener of the shard on the CPU that received it.
+  * The group indexes listeners in the order they were opened, so this only lines up
+  * when shard i runs on CPU i. */
+ static int steer_by_cpu(int listen_fd, int shard_count) {
+     struct sock_filter code[] = {
+         { BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU) },
+         { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)shard_count },
+         { BPF_RET | BPF_A, 0, 0, 0 }
+     };
+     struct sock_fprog program = { sizeof(code) / sizeof(code[0]), code };
+     
+     if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+         log_errno("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+         return -1;
+     }
+     return 0;
+ }
+ 
+ /* Number of shards asked for: 0 means one per CPU this process may run on */
+ int shard_resolve_count(int requested) {
+     cpu_set_t allowed;
+     int count;
+     
+     if (requested > 0) {
+         return (requested > SHARD_MAX) ? SHARD_MAX : requested;
+     }
+     
+     if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+         count = CPU_COUNT(&allowed);
+     } else {
+         count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+     }
+     if (count < 1) {
+         count = 1;
+     }
+     return (count > SHARD_MAX) ? SHARD_MAX : count;
+ }
+ 
+ /* Run shard_count event loops, each with its own listener and CPU */
+ int run_sharded_server(int listen_fd, server_mode_t mode, int shard_count, int backlog, int stats_interval) {
+     shard_t *shards;
+     cpu_set_t allowed, pinned;
+     pthread_attr_t attr;
+     int cpus[SHARD_MAX];
+     int cpu_count = 0, in_order = 1, opened = 0, started = 0, steered = 0, result = 0, cpu, i;
+     
+     shards = calloc((size_t)shard_count, sizeof(shard_t));
+     if (!shards) {
+         log_errno("calloc");
+         close_listener(listen_fd);
+         return -1;
+     }
+     
+     /* Shards take the CPUs this process may use in turn, wrapping if there are more shards */
+     if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+         for (cpu = 0; cpu < CPU_SETSIZE && cpu_count < SHARD_MAX; cpu++) {
+             if (CPU_ISSET(cpu, &allowed)) {
+                 cpus[cpu_count++] = cpu;
+             }
+         }
+     } else {
+         log_errno("sched_getaffinity");
+     }
+     
+     /* The first listener is already open; every other shard joins its SO_REUSEPORT group */
+     for (i = 0; i < shard_count; i++) {
+         shards[i].index = i;
+         shards[i].count = shard_count;
+         shards[i].cpu = (cpu_count > 0) ? cpus[i % cpu_count] : -1;
+         shards[i].mode = mode;
+         shards[i].stats_interval = stats_interval;
+         shards[i].steered = &steered;
+         shards[i].listen_fd = (i == 0) ? listen_fd : initialize_server(backlog, 1);
+         if (shards[i].listen_fd < 0) {
+             result = -1;
+             break;
+         }
+         opened++;
+         if (shards[i].cpu != i) {
+             in_order = 0;
+         }
+     }
+     
+     /* Without steering the kernel hashes each connection to a shard, which still spreads
+      * the load but may serve it on a different CPU from the one that received it */
+     if (result == 0 && in_order && shard_count > 1 && steer_by_cpu(listen_fd, shard_count) == 0) {
+         log_info("Connections are steered to the shard on the CPU that received them");
+         steered = 1;
+     }
+     
+     /* Start each loop on its CPU from the outset, so its memory is allocated there */
+     for (i = 0; result == 0 && i < shard_count; i++) {
+         pthread_attr_init(&attr);
+         if (shards[i].cpu >= 0) {
+             CPU_ZERO(&pinned);
+             CPU_SET(shards[i].cpu, &pinned);
+             pthread_attr_setaffinity_np(&attr, sizeof(pinned), &pinned);
+         }
+         if (pthread_create(&shards[i].thread, &attr, shard_main, &shards[i]) != 0) {
+             log_errno("pthread_create shard");
+             result = -1;
+         } else {
+             started++;
+         }
+         pthread_attr_destroy(&attr);
+     }
+     
+     /* Listeners of shards that never started would only collect connections */
+     for (i = started; i < opened; i++) {
+         retire_shard(&shards[i]);
+     }
+     
+     /* Shards run until a fatal error; one failing leaves the others serving */
+     for (i = 0; i < started; i++) {
+         pthread_join(shards[i].thread, NULL);
+         if (shards[i].result != 0) {
+             log_error("Shard %d stopped with an error", i);
+             result = -1;
+         }
+     }
+     
+     free(shards);
+     
+     return result;
+ }
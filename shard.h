@@ -0,0 +1,43 @@
+/* shard.h - Header file for the sharded multi-core server core
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for listener sharding including:
+ * - One SO_REUSEPORT listening socket and event loop per shard
+ * - Shards pinned to their own CPU, owning their connections end to end
+ * - Function prototypes for starting the shards
+ */
+
+ #ifndef SHARD_H
+ #define SHARD_H
+ 
+ #include "server.h"
+ 
+ /* Most shards a server runs */
+ #define SHARD_MAX 256
+ 
+ /* One event loop, its listening socket and the CPU it runs on */
+ typedef struct {
+     int index;
+     int count;                  /* Shards in the server */
+     int cpu;                    /* CPU the shard is pinned to, or -1 */
+     int listen_fd;              /* Closed as soon as the shard's loop stops */
+     int *steered;               /* Shared by every shard: CPU steering is attached to the group */
+     server_mode_t mode;         /* SERVER_MODE_EPOLL or SERVER_MODE_URING */
+     int stats_interval;
+     pthread_t thread;
+     int result;
+ } shard_t;
+ 
+ /* Function prototypes */
+ 
+ /* Number of shards asked for: 0 means one per CPU this process may run on */
+ int shard_resolve_count(int requested);
+ 
+ /* Run shard_count event loops of the given mode, the first on listen_fd (which must have
+  * SO_REUSEPORT set) and each other on a listener of its own with the same backlog.
+  * A shard that stops closes its listener, so the kernel sends its connections to the
+  * others. Returns when every shard has stopped, with every listener including listen_fd
+  * closed: 0, or -1 if one failed. */
+ int run_sharded_server(int listen_fd, server_mode_t mode, int shard_count, int backlog, int stats_interval);
+ 
+ #endif /* SHARD_H */
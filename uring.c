@@ -0,0 +1,1765 @@
+/* uring.c - Implementation of the io_uring server core
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the io_uring server mode:
+ * - Ring setup and submission with raw io_uring_setup/enter/register calls
+ * - Accepts installed straight into a fixed file table (no socket fds)
+ * - Body data read into a shared pool of registered buffers, picked by the kernel through
+ *   a provided-buffer ring when the data arrives, and written with WRITE_FIXED
+ * - Connection slots and pool size taken from the configuration at startup
+ * - Every pending submission flushed and every completion reaped per enter
+ * - Compressed and resumable bodies collected whole, then stored synchronously
+ * - Delta bases signed and copies applied a scratch buffer per no-op completion
+ * - Ranges of parallel uploads written at their own offsets
+ * - Quota admission, with rate-limited receives deferred by an absolute timeout
+ * - Uploads cloned from the content store, and received ones checked against their digest
+ * - Downloads read from the file into a pooled buffer and sent from it (there is no socket
+ *   descriptor for sendfile, and a mapping could fault or raise SIGBUS in the loop), and listings
+ */
+
+ #include "uring.h"
+ #include "durability.h"
+ #include "bufpool.h"
+ #include "rangetable.h"
+ #include "metrics.h"
+ #include "quota.h"
+ #include "dedup.h"
+ #include "delta.h"
+ #include "download.h"
+ #include "manifest.h"
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ 
+ /* user_data layout: connection slot above the operation kind */
+ #define URING_DATA(slot, op) (((uint64_t)(slot) << 8) | (uint64_t)(op))
+ #define URING_DATA_SLOT(data) ((int)((data) >> 8))
+ #define URING_DATA_OP(data) ((uring_op_t)((data) & 0xff))
+ 
+ /* Slot number used by requests that belong to no connection; above any configured slot */
+ #define URING_NO_SLOT 0xffffff
+ 
+ /* Start of a pool buffer */
+ #define URING_BUFFER(ring, id) ((ring)->buffers + (size_t)(id) * URING_BUFFER_SIZE)
+ 
+ /* Forward declarations for internal helpers */
+ static void close_connection(uring_t *ring, uring_conn_t *conn);
+ static void arm_accept(uring_t *ring);
+ static void arm_timer(uring_t *ring);
+ static void throttle_connection(uring_t *ring, uring_conn_t *conn);
+ static void wake_throttled(uring_t *ring);
+ static void post_read(uring_t *ring, uring_conn_t *conn);
+ static void send_ready(uring_t *ring, uring_conn_t *conn);
+ 
+ /* Thin wrappers over the io_uring system calls (no liburing) */
+ static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+     return (int)syscall(__NR_io_uring_setup, entries, params);
+ }
+ 
+ static int sys_io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete,
+                               unsigned int flags) {
+     return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+ }
+ 
+ static int sys_io_uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+     return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+ }
+ 
+ /* Hand pending submissions to the kernel, optionally waiting for completions */
+ static int submit_and_wait(uring_t *ring, unsigned int wait_nr) {
+     int result;
+ 
+     do {
+         result = sys_io_uring_enter(ring->ring_fd, ring->to_submit, wait_nr,
+                                     wait_nr ? IORING_ENTER_GETEVENTS : 0);
+     } while (result < 0 && errno == EINTR);
+ 
+     ring->enters++;
+     if (result < 0) {
+         if (errno == EBUSY || errno == EAGAIN) {
+             /* Completion queue is full: reap before submitting more */
+             return 0;
+         }
+         log_errno("io_uring_enter");
+         return -1;
+     }
+ 
+     ring->to_submit -= (unsigned int)result;
+     ring->submitted += (unsigned long)result;
+     return 0;
+ }
+ 
+ /* Claim the next submission queue entry, flushing the queue if it is full.
+  * Without SQPOLL the kernel reads the tail only inside io_uring_enter(), so
+  * publishing it before the entry is filled in is safe. */
+ static struct io_uring_sqe *get_sqe(uring_t *ring) {
+     unsigned int head, tail, index;
+     struct io_uring_sqe *sqe;
+ 
+     tail = *ring->sq_tail;
+     head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+     if (tail - head >= ring->sq_entries) {
+         if (submit_and_wait(ring, 0) < 0) {
+             return NULL;
+         }
+         head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+         if (tail - head >= ring->sq_entries) {
+             log_error("io_uring submission queue is full");
+             return NULL;
+         }
+     }
+ 
+     index = tail & *ring->sq_mask;
+     sqe = &ring->sqes[index];
+     memset(sqe, 0, sizeof(*sqe));
+     ring->sq_array[index] = index;
+     __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+     ring->to_submit++;
+ 
+     return sqe;
+ }
+ 
+ /* Prepare a request on a connection's fixed socket */
+ static struct io_uring_sqe *prep_socket_op(uring_t *ring, uring_conn_t *conn, uint8_t opcode,
+                                            uring_op_t op, void *addr, size_t length) {
+     struct io_uring_sqe *sqe = get_sqe(ring);
+ 
+     if (!sqe) {
+         return NULL;
+     }
+ 
+     sqe->opcode = opcode;
+     sqe->fd = URING_SOCKET_INDEX(conn->slot);
+     sqe->flags = IOSQE_FIXED_FILE;
+     sqe->addr = (uint64_t)(uintptr_t)addr;
+     sqe->len = (uint32_t)length;
+     sqe->user_data = URING_DATA(conn->slot, op);
+     conn->inflight++;
+ 
+     return sqe;
+ }
+ 
+ /* Receive protocol bytes (header, fields or chunk data) into connection memory */
+ static void post_recv(uring_t *ring, uring_conn_t *conn, void *buffer, size_t length) {
+     if (!prep_socket_op(ring, conn, IORING_OP_RECV, URING_OP_RECV, buffer, length)) {
+         close_connection(ring, conn);
+     }
+ }
+ 
+ /* Receive part of a chunk or block payload, as much as the quota grants */
+ static void post_payload_recv(uring_t *ring, uring_conn_t *conn, char *buffer, size_t length) {
+     conn->granted = quota_grant(conn->session.ticket, length);
+     if (conn->granted == 0) {
+         throttle_connection(ring, conn);
+         return;
+     }
+     post_recv(ring, conn, buffer, conn->granted);
+ }
+ 
+ /* Read body bytes into whichever pool buffer is free when they arrive */
+ static void post_read(uring_t *ring, uring_conn_t *conn) {
+     struct io_uring_sqe *sqe;
+     size_t wanted = (size_t)(conn->filesize - conn->total_received);
+ 
+     /* Never read past the body: a pipelined request may follow it */
+     if (wanted > URING_BUFFER_SIZE) {
+         wanted = URING_BUFFER_SIZE;
+     }
+     wanted = quota_grant(conn->session.ticket, wanted);
+     if (wanted == 0) {
+         throttle_connection(ring, conn);
+         return;
+     }
+     conn->granted = wanted;
+ 
+     /* An idle connection holds no buffer: the kernel picks one only once data is there */
+     sqe = prep_socket_op(ring, conn, IORING_OP_READ, URING_OP_READ, NULL, wanted);
+     if (!sqe) {
+         close_connection(ring, conn);
+         return;
+     }
+     sqe->off = (uint64_t)-1;
+     sqe->flags |= IOSQE_BUFFER_SELECT;
+     sqe->buf_group = URING_BUFFER_GROUP;
+ }
+ 
+ /* Hand a connection's pool buffer back to the kernel and offer it to a starved read */
+ static void release_buffer(uring_t *ring, uring_conn_t *conn) {
+     struct io_uring_buf *buf;
+     unsigned short tail;
+     uring_conn_t *waiter;
+     int i, slot;
+ 
+     if (conn->buffer_id < 0) {
+         return;
+     }
+ 
+     /* Only this thread adds buffers, so the tail needs no atomic read-modify-write */
+     tail = ring->buffer_ring->tail;
+     buf = &ring->buffer_ring->bufs[tail & ring->buffer_ring_mask];
+     buf->addr = (uint64_t)(uintptr_t)URING_BUFFER(ring, conn->buffer_id);
+     buf->len = URING_BUFFER_SIZE;
+     buf->bid = (unsigned short)conn->buffer_id;
+     __atomic_store_n(&ring->buffer_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+     conn->buffer_id = -1;
+ 
+     /* Round robin, so one busy upload cannot keep the buffer from the others */
+     for (i = 0; i < ring->max_connections && ring->buffer_waiters > 0; i++) {
+         slot = (ring->wake_cursor + i) % ring->max_connections;
+         waiter = &ring->conns[slot];
+         if (waiter->in_use && waiter->buffer_wait) {
+             waiter->buffer_wait = 0;
+             ring->buffer_waiters--;
+             ring->wake_cursor = (slot + 1) % ring->max_connections;
+             post_read(ring, waiter);
+             break;
+         }
+     }
+ }
+ 
+ /* Write the unwritten part of the connection's pool buffer to the fixed destination file */
+ static void post_write(uring_t *ring, uring_conn_t *conn) {
+     struct io_uring_sqe *sqe = get_sqe(ring);
+ 
+     if (!sqe) {
+         close_connection(ring, conn);
+         return;
+     }
+ 
+     sqe->opcode = IORING_OP_WRITE_FIXED;
+     sqe->fd = URING_FILE_INDEX(ring, conn->slot);
+     sqe->flags = IOSQE_FIXED_FILE;
+     sqe->addr = (uint64_t)(uintptr_t)(URING_BUFFER(ring, conn->buffer_id) + conn->write_done);
+     sqe->len = (uint32_t)(conn->write_len - conn->write_done);
+     sqe->off = (uint64_t)(conn->range_offset + conn->total_received + conn->write_done);
+     sqe->buf_index = (uint16_t)conn->buffer_id;
+     sqe->user_data = URING_DATA(conn->slot, URING_OP_WRITE);
+     conn->inflight++;
+ }
+ 
+ /* Send whatever responses are queued, one send in flight at a time */
+ static void post_send(uring_t *ring, uring_conn_t *conn) {
+     struct io_uring_sqe *sqe;
+     int attached = conn->attachment && conn->out_sent == conn->attachment_at;
+     size_t length;
+ 
+     if (conn->send_inflight || (!attached && conn->out_sent >= conn->out_len)) {
+         return;
+     }
+ 
+     /* Signatures of a delta upload, or a download body, go out right behind the READY
+      * that announced them; a download refills its buffer from the file once it is sent */
+     if (attached && conn->send_fd >= 0 && conn->send_done == conn->send_filled) {
+         length = conn->attachment_len - conn->attachment_sent;
+         sqe = get_sqe(ring);
+         if (!sqe) {
+             close_connection(ring, conn);
+             return;
+         }
+         sqe->opcode = IORING_OP_READ;
+         sqe->fd = conn->send_fd;
+         sqe->addr = (uint64_t)(uintptr_t)conn->attachment;
+         sqe->len = (uint32_t)(length < conn->send_capacity ? length : conn->send_capacity);
+         sqe->off = (uint64_t)conn->send_offset;
+         sqe->user_data = URING_DATA(conn->slot, URING_OP_FILE_READ);
+         conn->inflight++;
+         conn->send_inflight = 1;
+         return;
+     }
+     if (attached && conn->send_fd >= 0) {
+         sqe = prep_socket_op(ring, conn, IORING_OP_SEND, URING_OP_SEND, conn->attachment + conn->send_done,
+                              conn->send_filled - conn->send_done);
+     } else if (attached) {
+         length = conn->attachment_len - conn->attachment_sent;
+         sqe = prep_socket_op(ring, conn, IORING_OP_SEND, URING_OP_SEND, conn->attachment + conn->attachment_sent,
+                              length < URING_SEND_CHUNK ? length : URING_SEND_CHUNK);
+     } else {
+         sqe = prep_socket_op(ring, conn, IORING_OP_SEND, URING_OP_SEND, conn->out_buf + conn->out_sent,
+                              (conn->attachment ? conn->attachment_at : conn->out_len) - conn->out_sent);
+     }
+     if (!sqe) {
+         close_connection(ring, conn);
+         return;
+     }
+     sqe->msg_flags = MSG_NOSIGNAL;
+     conn->send_inflight = 1;
+     conn->send_attached = attached;
+ }
+ 
+ /* Free the attachment, or return a download's buffer and close its file */
+ static void release_attachment(uring_conn_t *conn) {
+     if (conn->send_fd >= 0) {
+         close(conn->send_fd);
+         conn->send_fd = -1;
+         bufpool_put(&buffer_pool, conn->attachment, conn->send_capacity);
+     } else {
+         free(conn->attachment);
+     }
+     conn->attachment = NULL;
+ }
+ 
+ /* Install or remove a destination file in the fixed file table */
+ static int update_file_slot(uring_t *ring, int slot, int file_fd) {
+     struct io_uring_files_update update;
+     int fds[1] = {file_fd};
+ 
+     memset(&update, 0, sizeof(update));
+     update.offset = URING_FILE_INDEX(ring, slot);
+     update.fds = (uint64_t)(uintptr_t)fds;
+ 
+     if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) < 0) {
+         log_errno("io_uring_register files update");
+         return -1;
+     }
+ 
+     return 0;
+ }
+ 
+ /* Close a connection's destination file, dropping it from the file table, and any delta
+  * basis, and let other uploads have its destination */
+ static void close_file(uring_t *ring, uring_conn_t *conn) {
+     if (conn->file_fd >= 0) {
+         update_file_slot(ring, conn->slot, -1);
+         close(conn->file_fd);
+         conn->file_fd = -1;
+     }
+     if (conn->basis_fd >= 0) {
+         close(conn->basis_fd);
+         conn->basis_fd = -1;
+     }
+     free(conn->signatures);
+     conn->signatures = NULL;
+     if (conn->path_lock) {
+         pathlock_release(&path_locks, conn->path_lock);
+         conn->path_lock = NULL;
+     }
+ }
+ 
+ /* Append a protocol response (ready or final status) and send it */
+ static void queue_reply(uring_t *ring, uring_conn_t *conn, uint8_t status, uint16_t flags, uint64_t value) {
+     /* A client that pipelines without reading its responses is dropped */
+     if (conn->out_len + sizeof(proto_response_t) > sizeof(conn->out_buf)) {
+         log_warn("Client %d is not reading responses", conn->client_id);
+         close_connection(ring, conn);
+         return;
+     }
+ 
+     proto_build_response((proto_response_t *)(conn->out_buf + conn->out_len), status, flags, value);
+     conn->out_len += sizeof(proto_response_t);
+     post_send(ring, conn);
+ }
+ 
+ /* Count a finished request in the metrics and queue its log record */
+ static void record_request(uring_conn_t *conn, int status_code) {
+     metrics_record_request(&conn->request, (uint64_t)conn->total_received, status_code);
+     log_transfer(conn->client_id, &conn->request, (uint64_t)conn->total_received, conn->request_started,
+                  status_code);
+     conn->request_started = 0;
+     quota_release(conn->session.ticket);
+     conn->session.ticket = NULL;
+ }
+ 
+ /* Send the final status code and close once it has been delivered */
+ static void finish_with_status(uring_t *ring, uring_conn_t *conn, int status_code) {
+     close_file(ring, conn);
+     record_request(conn, status_code);
+     conn->state = URING_CONN_STATUS;
+     conn->close_after_flush = 1;
+     queue_reply(ring, conn, status_code, 0, (uint64_t)conn->total_received);
+ }
+ 
+ /* Wait for the next request header */
+ static void expect_header(uring_t *ring, uring_conn_t *conn) {
+     conn->state = URING_CONN_HEADER;
+     conn->in_received = 0;
+     post_recv(ring, conn, &conn->header, sizeof(conn->header));
+ }
+ 
+ /* Queue a no-op whose completion runs the connection's next delta step */
+ static void post_step(uring_t *ring, uring_conn_t *conn) {
+     struct io_uring_sqe *sqe = get_sqe(ring);
+ 
+     if (!sqe) {
+         close_connection(ring, conn);
+         return;
+     }
+     sqe->opcode = IORING_OP_NOP;
+     sqe->user_data = URING_DATA(conn->slot, URING_OP_STEP);
+     conn->inflight++;
+ }
+ 
+ /* Wait for the next delta instruction */
+ static void expect_delta(uring_t *ring, uring_conn_t *conn) {
+     conn->state = URING_CONN_DELTA;
+     conn->in_received = 0;
+     post_recv(ring, conn, &conn->op, sizeof(conn->op));
+ }
+ 
+ /* Send a per-file status; sessions then wait for the next request, others close */
+ static void finish_request(uring_t *ring, uring_conn_t *conn, int status_code) {
+     if (!conn->session.persistent) {
+         finish_with_status(ring, conn, status_code);
+         return;
+     }
+ 
+     close_file(ring, conn);
+     if (status_code == STATUS_SUCCESS) {
+         conn->session.files++;
+     }
+     record_request(conn, status_code);
+ 
+     queue_reply(ring, conn, status_code, 0, (uint64_t)conn->total_received);
+     conn->total_received = 0;
+     if (conn->state != URING_CONN_CLOSING) {
+         expect_header(ring, conn);
+     }
+ }
+ 
+ /* Queue READY and the body of a download or listing; the status follows once it is out */
+ static void begin_send(uring_t *ring, uring_conn_t *conn) {
+     download_t download;
+     uint16_t flags = 0;
+     char *listing;
+     size_t length;
+     int status;
+ 
+     if (conn->request.opcode == PROTO_OP_LIST) {
+         status = build_listing(&conn->request, &conn->session, &listing, &length, &flags);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+         conn->attachment = listing;
+     } else {
+         status = open_download(&conn->request, &conn->session, &download);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+ 
+         /* Read from the descriptor by the ring a buffer at a time, so neither a page fault
+          * nor a truncation of the file can stall or kill the loop */
+         length = (size_t)download.length;
+         conn->send_fd = download.file_fd;
+         conn->send_offset = download.offset;
+         conn->send_filled = conn->send_done = 0;
+         if (length > 0) {
+             conn->attachment = bufpool_get(&buffer_pool, netio_chunk_size(download.length),
+                                            &conn->send_capacity);
+             if (!conn->attachment) {
+                 release_attachment(conn);
+                 finish_request(ring, conn, STATUS_UNKNOWN_ERROR);
+                 return;
+             }
+         }
+     }
+     if (length == 0) {
+         release_attachment(conn);
+     }
+ 
+     conn->attachment_len = length;
+     conn->attachment_sent = 0;
+     conn->attachment_at = conn->out_len + sizeof(proto_response_t);
+     conn->state = URING_CONN_SEND;
+ 
+     /* The send completion that finishes the body sends the status */
+     queue_reply(ring, conn, STATUS_READY, flags, length);
+ }
+ 
+ /* A download's body is out: send its status and wait for the next request */
+ static void finish_send(uring_t *ring, uring_conn_t *conn) {
+     conn->total_received = (off_t)conn->attachment_len;
+     finish_request(ring, conn, STATUS_SUCCESS);
+ }
+ 
+ /* Set ownership and flush a complete upload, then publish it */
+ static void complete_transfer(uring_t *ring, uring_conn_t *conn) {
+     uint8_t digest[SHA256_DIGEST_SIZE];
+     uint64_t publish_start;
+     int status = STATUS_SUCCESS;
+ 
+     /* Commits adopt a body that other connections received */
+     if (conn->body_started) {
+         metrics_observe(METRICS_PHASE_RECEIVE, conn->body_started);
+         conn->body_started = 0;
+     }
+ 
+     /* A range is only part of a file; its upload is published by the commit request */
+     if (conn->range) {
+         rangetable_complete(&range_uploads, &conn->request, conn->summed ? &conn->crc : NULL);
+         finish_request(ring, conn, STATUS_SUCCESS);
+         return;
+     }
+ 
+     /* A body announced with a digest must match it before it is published; the store copy
+      * is made and flushed off the loop. A resumed body was partly received by an earlier
+      * connection, so the writer checks that one before storing it. */
+     if (conn->dedup) {
+         if (conn->hashing) {
+             sha256_final(&conn->sha, digest);
+             status = dedup_verify(&conn->request, digest);
+         }
+         if (status != STATUS_SUCCESS) {
+             conn->total_received = 0;
+             if (conn->staging_path[0]) {
+                 unlink(conn->staging_path);
+             }
+             finish_request(ring, conn, status);
+             return;
+         }
+         dedup_store_later(conn->file_fd, &conn->request, conn->hashing, conn->summed ? &conn->crc : NULL);
+     }
+ 
+     /* Set ownership before publishing so the file never appears with the wrong owner */
+     if (apply_file_ownership(conn->file_fd, &conn->access) != 0) {
+         log_error("Failed to set file ownership for %s", conn->target_path);
+         finish_request(ring, conn, STATUS_FILE_ERROR);
+         return;
+     }
+ 
+     /* Group commit: publish together with the other uploads finished in this pass.
+      * The pending commit counts as a request so the slot cannot be reused meanwhile. */
+     if (durability_mode == DURABILITY_GROUP) {
+         conn->state = URING_CONN_COMMIT;
+         conn->next_commit = ring->commit_head;
+         ring->commit_head = conn;
+         conn->inflight++;
+         return;
+     }
+ 
+     /* Only durability none gets here (fdatasync mode is run as group commit in the loops),
+      * so nothing below waits for the device */
+     publish_start = metrics_now();
+     if (durability_sync_file(conn->file_fd) != 0 ||
+         commit_staging_file(conn->file_fd, conn->staging_path, conn->target_path) != 0) {
+         status = STATUS_FILE_ERROR;
+     } else {
+         /* The checksum kept as the body arrived; an upload without one is recorded as unknown */
+         manifest_record(conn->target_path, conn->file_fd, conn->summed ? &conn->crc : NULL);
+     }
+     close_file(ring, conn);
+ 
+     /* Make the new name durable before acknowledging it */
+     if (status == STATUS_SUCCESS && durability_sync_dir(conn->target_path) != 0) {
+         status = STATUS_FILE_ERROR;
+     }
+ 
+     if (status == STATUS_SUCCESS) {
+         metrics_observe(METRICS_PHASE_PUBLISH, publish_start);
+         log_debug("File transfer completed: %s -> %s", conn->request.filename, conn->target_path);
+     }
+     finish_request(ring, conn, status);
+ }
+ 
+ /* The last body byte was written: wait for the checksum trailer, or publish straight away */
+ static void body_complete(uring_t *ring, uring_conn_t *conn) {
+     if (conn->checksum) {
+         conn->state = URING_CONN_TRAILER;
+         conn->in_received = 0;
+         post_recv(ring, conn, &conn->trailer, sizeof(conn->trailer));
+         return;
+     }
+ 
+     complete_transfer(ring, conn);
+ }
+ 
+ /* Flush every upload waiting for group commit with two syncfs() calls per filesystem, then publish them */
+ static void flush_commits(uring_t *ring) {
+     uring_conn_t *conn, *next, *batch = ring->commit_head;
+     durability_batch_t synced;
+     int count = 0, published;
+     uint64_t flush_start;
+ 
+     if (!batch) {
+         return;
+     }
+     ring->commit_head = NULL;
+ 
+     /* One sync for the data of each filesystem the batch writes to */
+     flush_start = metrics_now();
+     durability_batch_init(&synced);
+ 
+     /* Rename everything, then one sync per filesystem for all of the new names */
+     for (conn = batch; conn; conn = conn->next_commit) {
+         if (conn->state == URING_CONN_COMMIT && conn->file_fd >= 0 &&
+             durability_batch_sync(&synced, conn->file_fd) == 0 &&
+             commit_staging_file(conn->file_fd, conn->staging_path, conn->target_path) == 0) {
+             manifest_record(conn->target_path, conn->file_fd, conn->summed ? &conn->crc : NULL);
+             conn->write_len = 1;
+             count++;
+         } else {
+             conn->write_len = 0;
+         }
+     }
+     durability_batch_init(&synced);
+ 
+     /* Report each result and resume reading pipelined requests */
+     for (conn = batch; conn; conn = next) {
+         next = conn->next_commit;
+         conn->next_commit = NULL;
+         conn->inflight--;
+         published = (conn->write_len == 1 && durability_batch_sync(&synced, conn->file_fd) == 0);
+         conn->write_len = 0;
+ 
+         if (conn->state == URING_CONN_CLOSING) {
+             /* Dropped while waiting: only the slot needs releasing */
+             close_connection(ring, conn);
+             continue;
+         }
+ 
+         close_file(ring, conn);
+         if (published) {
+             metrics_observe(METRICS_PHASE_PUBLISH, flush_start);
+             log_debug("File transfer completed: %s -> %s", conn->request.filename, conn->target_path);
+         }
+         finish_request(ring, conn, published ? STATUS_SUCCESS : STATUS_FILE_ERROR);
+     }
+ 
+     log_info("Group commit published %d uploads", count);
+ }
+ 
+ /* Act on a complete request: open a session or start receiving a file */
+ static void begin_body(uring_t *ring, uring_conn_t *conn) {
+     range_upload_t *upload;
+     uint64_t token;
+     int status;
+ 
+     /* Session setup verifies access once for every file that follows */
+     if (conn->request.opcode == PROTO_OP_SESSION) {
+         status = begin_session(&conn->session, &conn->request);
+         log_info("Client %d opened a session as %s for %s: status %d", conn->client_id,
+                  conn->request.username, conn->request.target_dir, status);
+         if (status != STATUS_SUCCESS) {
+             finish_with_status(ring, conn, status);
+             return;
+         }
+         queue_reply(ring, conn, STATUS_SUCCESS, PROTO_FLAG_SESSION, 0);
+         if (conn->state != URING_CONN_CLOSING) {
+             expect_header(ring, conn);
+         }
+         return;
+     }
+ 
+     log_debug("Client %d: user %s, directory %s, file %s (%llu bytes)", conn->client_id,
+               conn->request.username, conn->request.target_dir, conn->request.filename,
+               (unsigned long long)conn->request.size);
+ 
+     /* Downloads and listings answer with READY and their body instead of receiving one */
+     if (conn->request.opcode == PROTO_OP_GET || conn->request.opcode == PROTO_OP_LIST) {
+         conn->request_started = metrics_now();
+         conn->total_received = 0;
+         begin_send(ring, conn);
+         return;
+     }
+ 
+     if (conn->request.opcode != PROTO_OP_PUT && conn->request.opcode != PROTO_OP_RANGE &&
+         conn->request.opcode != PROTO_OP_COMMIT) {
+         finish_with_status(ring, conn, STATUS_PROTOCOL_ERROR);
+         return;
+     }
+     conn->range = 0;
+     conn->range_offset = 0;
+     conn->body_started = 0;
+     conn->dedup = 0;
+     conn->hashing = 0;
+     conn->delta = 0;
+     conn->checksum = 0;
+     conn->summed = 0;
+     conn->request_started = metrics_now();
+ 
+     /* Opening a parallel upload answers with its token instead of READY */
+     if (conn->request.opcode == PROTO_OP_PUT && (conn->request.flags & PROTO_FLAG_PARALLEL)) {
+         status = open_parallel_upload(&conn->request, &conn->session, &token);
+         conn->total_received = (status == STATUS_SUCCESS) ? (off_t)token : 0;
+         finish_request(ring, conn, status);
+         return;
+     }
+ 
+     /* All ranges arrived: adopt the staging file and publish it like any other upload */
+     if (conn->request.opcode == PROTO_OP_COMMIT) {
+         status = rangetable_take(&range_uploads, &conn->request, &upload);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+ 
+         /* Publishing replaces target_path, so it waits for any upload writing it; the loop
+          * cannot wait, so the upload goes back in the table for the client's retry */
+         conn->path_lock = pathlock_try_acquire(&path_locks, upload->target_path);
+         if (!conn->path_lock) {
+             status = (errno == EBUSY) ? STATUS_BUSY : STATUS_UNKNOWN_ERROR;
+             log_info("Client %d: %s is being written by another upload", conn->client_id, upload->target_path);
+             rangetable_return(&range_uploads, upload);
+             finish_request(ring, conn, status);
+             return;
+         }
+         conn->file_fd = upload->file_fd;
+         upload->file_fd = -1;
+         strcpy(conn->target_path, upload->target_path);
+         strcpy(conn->staging_path, upload->staging_path);
+         conn->access = upload->access;
+         conn->filesize = upload->filesize;
+         conn->total_received = upload->filesize;
+         conn->summed = (rangetable_checksum(upload, &conn->crc) == 0);
+         rangetable_free_upload(upload);
+         if (update_file_slot(ring, conn->slot, conn->file_fd) < 0) {
+             finish_request(ring, conn, STATUS_UNKNOWN_ERROR);
+             return;
+         }
+         complete_transfer(ring, conn);
+         return;
+     }
+ 
+     /* Failures before READY leave the stream aligned, so a session can continue */
+     if (conn->request.opcode == PROTO_OP_RANGE) {
+         status = rangetable_claim(&range_uploads, &conn->request, &conn->file_fd, &conn->range_offset);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+         status = quota_admit(conn->request.username, resolve_target_dir(conn->request.target_dir),
+                              &conn->session.ticket);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+         conn->range = 1;
+         conn->filesize = (off_t)conn->request.size;
+         conn->staging_path[0] = '\0';
+         conn->resume = 0;
+         conn->compress = 0;
+     } else {
+         status = prepare_file_transfer(&conn->request, &conn->session, conn->target_path, &conn->access);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+ 
+         conn->filesize = (off_t)conn->request.size;
+         if (conn->filesize < 0) {
+             log_warn("Invalid file size: %lld", (long long)conn->filesize);
+             finish_request(ring, conn, STATUS_FILE_ERROR);
+             return;
+         }
+ 
+         log_debug("Expected file size: %lld bytes", (long long)conn->filesize);
+ 
+         /* Charged to the user's and directory's quotas until its status is recorded */
+         status = quota_admit(conn->request.username, resolve_target_dir(conn->request.target_dir),
+                              &conn->session.ticket);
+         if (status != STATUS_SUCCESS) {
+             finish_request(ring, conn, status);
+             return;
+         }
+ 
+         /* One writer per destination, or two resumers would interleave chunks in the same
+          * staging file; the loop cannot wait for the other, so the client tries again later */
+         conn->path_lock = pathlock_try_acquire(&path_locks, conn->target_path);
+         if (!conn->path_lock) {
+             log_info("Client %d: %s is being written by another upload", conn->client_id, conn->target_path);
+             finish_request(ring, conn, errno == EBUSY ? STATUS_BUSY : STATUS_UNKNOWN_ERROR);
+             return;
+         }
+ 
+         /* Content the store already holds is cloned rather than received: no READY, no body */
+         if (dedup_requested(&conn->request)) {
+             conn->file_fd = dedup_clone(&conn->request, conn->target_path, conn->staging_path, &conn->crc,
+                                         &conn->summed);
+             if (conn->file_fd >= 0) {
+                 conn->total_received = 0;
+                 if (update_file_slot(ring, conn->slot, conn->file_fd) < 0) {
+                     finish_request(ring, conn, STATUS_UNKNOWN_ERROR);
+                     return;
+                 }
+                 complete_transfer(ring, conn);
+                 return;
+             }
+             conn->dedup = 1;
+         }
+ 
+         /* Write into a staging file; the destination only changes once it is complete */
+         conn->resume = (conn->request.flags & PROTO_FLAG_RESUME) != 0;
+         conn->compress = !conn->resume && (conn->request.flags & PROTO_FLAG_COMPRESS) != 0;
+         conn->file_fd = open_staging_file(conn->target_path, conn->resume, conn->filesize,
+                                           conn->staging_path, &conn->total_received);
+         if (conn->file_fd < 0) {
+             finish_request(ring, conn, STATUS_FILE_ERROR);
+             return;
+         }
+ 
+         /* The store digest is kept as the body arrives, unless part of it is already staged */
+         conn->hashing = conn->dedup && conn->total_received == 0;
+         if (conn->hashing) {
+             sha256_init(&conn->sha);
+         }
+ 
+         /* A delta upload is rebuilt from the existing file, if there is one, whose
+          * signatures are computed a step at a time before READY */
+         if (!conn->resume && (conn->request.flags & PROTO_FLAG_DELTA)) {
+             conn->signatures = open_delta_basis(conn->target_path, &conn->basis_fd, &conn->basis_size);
+         }
+     }
+     if (update_file_slot(ring, conn->slot, conn->file_fd) < 0) {
+         close(conn->file_fd);
+         conn->file_fd = -1;
+         finish_request(ring, conn, STATUS_UNKNOWN_ERROR);
+         return;
+     }
+     if (conn->signatures) {
+         conn->sign_offset = 0;
+         conn->state = URING_CONN_SIGN;
+         post_step(ring, conn);
+         return;
+     }
+ 
+     send_ready(ring, conn);
+ }
+ 
+ /* Queue READY, with the delta signatures if there are any, and start receiving the body */
+ static void send_ready(uring_t *ring, uring_conn_t *conn) {
+     proto_signature_t *signatures = conn->signatures;
+     size_t capacity;
+ 
+     conn->signatures = NULL;
+     if ((conn->resume || conn->compress || conn->delta) && !conn->chunk_buf) {
+         conn->chunk_buf = bufpool_get(&buffer_pool, PROTO_CHUNK_SIZE, &capacity);
+         if (!conn->chunk_buf) {
+             free(signatures);
+             finish_request(ring, conn, STATUS_UNKNOWN_ERROR);
+             return;
+         }
+     }
+ 
+     if (conn->resume && conn->total_received > 0) {
+         log_debug("Resuming %s at byte %lld", conn->request.filename, (long long)conn->total_received);
+     }
+ 
+     /* Acknowledge ready to receive file, telling a resuming client where to start,
+      * a plain one whether to compress the body and follow it with a checksum trailer,
+      * and a delta one the size of the existing file, whose signatures follow */
+     conn->checksum = !conn->resume && (conn->request.flags & PROTO_FLAG_CHECKSUM) != 0;
+     
+     /* The manifest's checksum is kept as the body arrives, unless part of it is already staged */
+     conn->summed = (conn->total_received == 0);
+     conn->crc = 0;
+     conn->body_started = metrics_now();
+     if (signatures) {
+         conn->attachment = (char *)signatures;
+         conn->attachment_len = proto_delta_block_count(conn->basis_size) * sizeof(proto_signature_t);
+         conn->attachment_sent = 0;
+         conn->attachment_at = conn->out_len + sizeof(proto_response_t);
+     }
+     queue_reply(ring, conn, STATUS_READY,
+                 (conn->resume ? PROTO_FLAG_RESUME : 0) | (conn->checksum ? PROTO_FLAG_CHECKSUM : 0) |
+                 (conn->compress ? PROTO_FLAG_COMPRESS : 0) | (conn->delta ? PROTO_FLAG_DELTA : 0),
+                 conn->delta ? conn->basis_size : (uint64_t)conn->total_received);
+     if (conn->state == URING_CONN_CLOSING) {
+         return;
+     }
+ 
+     if (conn->total_received >= conn->filesize) {
+         body_complete(ring, conn);
+     } else if (conn->resume) {
+         conn->state = URING_CONN_CHUNK;
+         conn->in_received = 0;
+         post_recv(ring, conn, &conn->chunk, sizeof(conn->chunk));
+     } else if (conn->compress) {
+         conn->state = URING_CONN_BLOCK;
+         conn->in_received = 0;
+         post_recv(ring, conn, &conn->block, sizeof(conn->block));
+     } else if (conn->delta) {
+         expect_delta(ring, conn);
+     } else {
+         conn->state = URING_CONN_BODY;
+         post_read(ring, conn);
+     }
+ }
+ 
+ /* A receive into connection memory finished: advance the protocol state */
+ static void handle_recv(uring_t *ring, uring_conn_t *conn, int result) {
+     ssize_t field_bytes;
+     int status;
+ 
+     /* Hand back whatever part of a payload grant the receive did not fill; protocol
+      * receives were never granted anything */
+     if (conn->granted) {
+         quota_return(conn->session.ticket, result > 0 ? conn->granted - (size_t)result : conn->granted);
+         conn->granted = 0;
+     }
+ 
+     if (result <= 0) {
+         if (result < 0) {
+             log_error("recv: %s", strerror(-result));
+         } else if (conn->state != URING_CONN_HEADER) {
+             log_warn("recv file data: connection closed by client %d", conn->client_id);
+         }
+         close_connection(ring, conn);
+         return;
+     }
+     conn->in_received += (size_t)result;
+ 
+     switch (conn->state) {
+         case URING_CONN_HEADER:
+             if (conn->in_received < sizeof(conn->header)) {
+                 post_recv(ring, conn, (char *)&conn->header + conn->in_received,
+                           sizeof(conn->header) - conn->in_received);
+                 return;
+             }
+             field_bytes = proto_parse_header(&conn->header, &conn->request);
+             if (field_bytes < 0) {
+                 log_warn("Client %d sent a malformed request", conn->client_id);
+                 finish_with_status(ring, conn, STATUS_PROTOCOL_ERROR);
+                 return;
+             }
+             /* A username and directory are always present, so fields follow */
+             conn->field_bytes = (size_t)field_bytes;
+             conn->in_received = 0;
+             conn->state = URING_CONN_FIELDS;
+             post_recv(ring, conn, conn->fields, conn->field_bytes);
+             return;
+ 
+         case URING_CONN_FIELDS:
+             if (conn->in_received < conn->field_bytes) {
+                 post_recv(ring, conn, conn->fields + conn->in_received,
+                           conn->field_bytes - conn->in_received);
+                 return;
+             }
+             if (proto_parse_fields(conn->fields, &conn->request) < 0) {
+                 log_warn("Client %d sent a malformed request", conn->client_id);
+                 finish_with_status(ring, conn, STATUS_PROTOCOL_ERROR);
+                 return;
+             }
+             begin_body(ring, conn);
+             return;
+ 
+         case URING_CONN_CHUNK:
+             if (conn->in_received < sizeof(conn->chunk)) {
+                 post_recv(ring, conn, (char *)&conn->chunk + conn->in_received,
+                           sizeof(conn->chunk) - conn->in_received);
+                 return;
+             }
+             if (proto_parse_chunk(&conn->chunk, conn->filesize - conn->total_received) < 0) {
+                 log_warn("Client %d sent an invalid chunk length %u",
+                          conn->client_id, conn->chunk.length);
+                 finish_with_status(ring, conn, STATUS_PROTOCOL_ERROR);
+                 return;
+             }
+             conn->in_received = 0;
+             conn->state = URING_CONN_CHUNK_DATA;
+             post_payload_recv(ring, conn, conn->chunk_buf, conn->chunk.length);
+             return;
+ 
+         case URING_CONN_CHUNK_DATA:
+             if (conn->in_received < conn->chunk.length) {
+                 post_payload_recv(ring, conn, conn->chunk_buf + conn->in_received,
+                                   conn->chunk.length - conn->in_received);
+                 return;
+             }
+             ring->bytes_received += conn->chunk.length;
+ 
+             /* Chunks are verified before they are written, so store them synchronously */
+             status = store_chunk(conn->file_fd, &conn->chunk, conn->chunk_buf, &conn->total_received,
+                                  conn->summed ? &conn->crc : NULL);
+             if (status == STATUS_SUCCESS && conn->hashing) {
+                 sha256_update(&conn->sha, conn->chunk_buf, conn->chunk.length);
+             }
+             if (status != STATUS_SUCCESS) {
+                 finish_with_status(ring, conn, status);
+             } else if (conn->total_received >= conn->filesize) {
+                 complete_transfer(ring, conn);
+             } else {
+                 conn->state = URING_CONN_CHUNK;
+                 conn->in_received = 0;
+                 post_recv(ring, conn, &conn->chunk, sizeof(conn->chunk));
+             }
+             return;
+ 
+         case URING_CONN_BLOCK:
+             if (conn->in_received < sizeof(conn->block)) {
+                 post_recv(ring, conn, (char *)&conn->block + conn->in_received,
+                           sizeof(conn->block) - conn->in_received);
+                 return;
+             }
+             if (proto_parse_block(&conn->block, conn->filesize - conn->total_received) < 0) {
+                 log_warn("Client %d sent an invalid block length %u (%u packed)",
+                          conn->client_id, conn->block.length, conn->block.packed_length);
+                 finish_with_status(ring, conn, STATUS_PROTOCOL_ERROR);
+                 return;
+             }
+             conn->in_received = 0;
+             conn->state = URING_CONN_BLOCK_DATA;
+             post_payload_recv(ring, conn, conn->chunk_buf, PROTO_BLOCK_PAYLOAD(&conn->block));
+             return;
+ 
+         case URING_CONN_BLOCK_DATA:
+             if (conn->in_received < PROTO_BLOCK_PAYLOAD(&conn->block)) {
+                 post_payload_recv(ring, conn, conn->chunk_buf + conn->in_received,
+                                   PROTO_BLOCK_PAYLOAD(&conn->block) - conn->in_received);
+                 return;
+             }
+             ring->bytes_received += PROTO_BLOCK_PAYLOAD(&conn->block);
+ 
+             /* Expansion happens in user space anyway, so store the block synchronously too */
+             status = store_block(conn->file_fd, &conn->block, conn->chunk_buf, ring->scratch,
+                                  &conn->total_received, conn->summed ? &conn->crc : NULL,
+                                  conn->hashing ? &conn->sha : NULL);
+             if (status != STATUS_SUCCESS) {
+                 finish_with_status(ring, conn, status);
+             } else if (conn->total_received >= conn->filesize) {
+                 body_complete(ring, conn);
+             } else {
+                 conn->state = URING_CONN_BLOCK;
+                 conn->in_received = 0;
+                 post_recv(ring, conn, &conn->block, sizeof(conn->block));
+             }
+             return;
+ 
+         case URING_CONN_DELTA:
+             if (conn->in_received < sizeof(conn->op)) {
+                 post_recv(ring, conn, (char *)&conn->op + conn->in_received, sizeof(conn->op) - conn->in_received);
+                 return;
+             }
+             if (proto_parse_delta(&conn->op, (uint64_t)(conn->filesize - conn->total_received),
+                                   conn->basis_size) < 0) {
+                 log_warn("Client %d sent an invalid delta instruction: block %u, %u bytes",
+                          conn->client_id, conn->op.block, conn->op.length);
+                 finish_with_status(ring, conn, STATUS_PROTOCOL_ERROR);
+                 return;
+             }
+             conn->in_received = 0;
+             if (conn->op.block == PROTO_DELTA_LITERAL) {
+                 conn->state = URING_CONN_DELTA_DATA;
+                 post_payload_recv(ring, conn, conn->chunk_buf, conn->op.length);
+                 return;
+             }
+ 
+             /* Copies come from the server's own file, a scratch buffer per step */
+             conn->state = URING_CONN_COPY;
+             post_step(ring, conn);
+             return;
+ 
+         case URING_CONN_DELTA_DATA:
+             if (conn->in_received < conn->op.length) {
+                 post_payload_recv(ring, conn, conn->chunk_buf + conn->in_received,
+                                   conn->op.length - conn->in_received);
+                 return;
+             }
+             ring->bytes_received += conn->op.length;
+ 
+             status = store_delta(conn->file_fd, conn->basis_fd, conn->basis_size, &conn->op, conn->chunk_buf,
+                                  NULL, 0, &conn->total_received, conn->summed ? &conn->crc : NULL,
+                                  conn->hashing ? &conn->sha : NULL);
+             if (status != STATUS_SUCCESS) {
+                 finish_with_status(ring, conn, status);
+             } else if (conn->total_received >= conn->filesize) {
+                 body_complete(ring, conn);
+             } else {
+                 expect_delta(ring, conn);
+             }
+             return;
+ 
+         case URING_CONN_TRAILER:
+             if (conn->in_received < sizeof(conn->trailer)) {
+                 post_recv(ring, conn, (char *)&conn->trailer + conn->in_received,
+                           sizeof(conn->trailer) - conn->in_received);
+                 return;
+             }
+             status = verify_body_trailer(&conn->trailer, conn->crc, conn->request.filename);
+             if (status == STATUS_SUCCESS) {
+                 complete_transfer(ring, conn);
+                 return;
+             }
+ 
+             /* Nothing is kept; a mismatch leaves the stream aligned for the next request */
+             conn->total_received = 0;
+             if (status == STATUS_CHECKSUM_ERROR) {
+                 if (conn->staging_path[0]) {
+                     unlink(conn->staging_path);
+                 }
+                 finish_request(ring, conn, status);
+             } else {
+                 finish_with_status(ring, conn, status);
+             }
+             return;
+ 
+         default:
+             return;
+     }
+ }
+ 
+ /* Run one step of signing the delta basis or applying a copy, and re-arm for the next
+  * so that the other connections' completions are reaped in between */
+ static void handle_step(uring_t *ring, uring_conn_t *conn) {
+     int status;
+ 
+     if (conn->state == URING_CONN_SIGN) {
+         if (delta_sign_step(conn->basis_fd, conn->basis_size, &conn->sign_offset, conn->signatures,
+                             ring->scratch, ring->scratch_size) < 0) {
+             /* Without signatures the body is simply sent whole */
+             log_errno("sign delta basis");
+             free(conn->signatures);
+             conn->signatures = NULL;
+             close(conn->basis_fd);
+             conn->basis_fd = -1;
+             send_ready(ring, conn);
+         } else if (conn->sign_offset >= conn->basis_size) {
+             /* Literals are not compressed */
+             log_debug("Signed %s: %llu blocks of %u bytes", conn->target_path,
+                       (unsigned long long)proto_delta_block_count(conn->basis_size),
+                       proto_delta_block_size(conn->basis_size));
+             conn->delta = 1;
+             conn->compress = 0;
+             send_ready(ring, conn);
+         } else {
+             post_step(ring, conn);
+         }
+         return;
+     }
+ 
+     if (conn->state == URING_CONN_COPY) {
+         status = store_delta_step(conn->file_fd, conn->basis_fd, conn->basis_size, &conn->op, ring->scratch,
+                                   ring->scratch_size, &conn->total_received, conn->summed ? &conn->crc : NULL,
+                                   conn->hashing ? &conn->sha : NULL);
+         if (status != STATUS_SUCCESS) {
+             finish_with_status(ring, conn, status);
+         } else if (conn->op.length > 0) {
+             post_step(ring, conn);
+         } else if (conn->total_received >= conn->filesize) {
+             body_complete(ring, conn);
+         } else {
+             expect_delta(ring, conn);
+         }
+     }
+ }
+ 
+ /* Dispatch one completion to the connection it belongs to */
+ static int handle_completion(uring_t *ring, const struct io_uring_cqe *cqe) {
+     int slot = URING_DATA_SLOT(cqe->user_data);
+     uring_op_t op = URING_DATA_OP(cqe->user_data);
+     uring_conn_t *conn;
+     uint64_t accepted_ns;
+ 
+     if (op == URING_OP_ACCEPT) {
+         slot = ring->accept_slot;
+         ring->accept_slot = -1;
+         if (cqe->res < 0) {
+             log_error("accept: %s", strerror(-cqe->res));
+             arm_accept(ring);
+             return 0;
+         }
+ 
+         /* Create connection state; the socket is already installed at its fixed index.
+          * The completion is the accept here, so the phase is only the setup below. */
+         accepted_ns = metrics_now();
+         conn = &ring->conns[slot];
+         memset(conn, 0, sizeof(*conn));
+         conn->in_use = 1;
+         conn->slot = slot;
+         conn->file_fd = -1;
+         conn->basis_fd = -1;
+         conn->send_fd = -1;
+         conn->buffer_id = -1;
+         conn->client_id = ring->next_client_id;
+         ring->next_client_id += ring->client_id_step;
+         ring->active_connections++;
+         metrics_count(METRICS_CONNECTIONS_ACCEPTED);
+         metrics_observe(METRICS_PHASE_ACCEPT, accepted_ns);
+         log_info("New connection from %s:%d. Client ID: %d",
+                  inet_ntoa(ring->accept_addr.sin_addr),
+                  ntohs(ring->accept_addr.sin_port),
+                  conn->client_id);
+ 
+         expect_header(ring, conn);
+         arm_accept(ring);
+         return 0;
+     }
+ 
+     if (op == URING_OP_TIMER) {
+         log_info("uring: %d of %d connections, %lu enters, %lu submitted, %lu completed, "
+                  "%llu KiB received, %lu reads waited for one of %d buffers",
+                  ring->active_connections, ring->max_connections, ring->enters, ring->submitted,
+                  ring->completed, ring->bytes_received / 1024, ring->buffer_waits, ring->buffer_count);
+         if (ring->bytes_received >= 1024 * 1024) {
+             log_info("uring: %.2f enters and %.1f requests per MiB received",
+                      ring->enters / (ring->bytes_received / 1048576.0),
+                      ring->submitted / (ring->bytes_received / 1048576.0));
+         }
+         arm_timer(ring);
+         return 0;
+     }
+ 
+     if (op == URING_OP_THROTTLE) {
+         wake_throttled(ring);
+         return 0;
+     }
+ 
+     if (slot < 0 || slot >= ring->max_connections || !ring->conns[slot].in_use) {
+         return 0;
+     }
+     conn = &ring->conns[slot];
+     conn->inflight--;
+ 
+     /* A read that picked a pool buffer owns it until its bytes are written */
+     if (op == URING_OP_READ && (cqe->flags & IORING_CQE_F_BUFFER)) {
+         conn->buffer_id = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+     }
+ 
+     /* Late completions for a closing connection only need to be counted */
+     if (conn->state == URING_CONN_CLOSING) {
+         if (op == URING_OP_SEND || op == URING_OP_FILE_READ) {
+             conn->send_inflight = 0;
+         }
+         close_connection(ring, conn);
+         return 0;
+     }
+ 
+     switch (op) {
+         case URING_OP_RECV:
+             handle_recv(ring, conn, cqe->res);
+             break;
+ 
+         case URING_OP_READ:
+             quota_return(conn->session.ticket,
+                          cqe->res > 0 ? conn->granted - (size_t)cqe->res : conn->granted);
+             conn->granted = 0;
+             if (cqe->res == -ENOBUFS) {
+                 /* Every pool buffer is being written out; the next one returned resumes this read */
+                 conn->buffer_wait = 1;
+                 ring->buffer_waiters++;
+                 ring->buffer_waits++;
+                 log_debug("Client %d: waiting for a body buffer", conn->client_id);
+                 break;
+             }
+             if (cqe->res <= 0) {
+                 log_error("recv file data: %s",
+                           cqe->res < 0 ? strerror(-cqe->res) : "connection closed by client");
+                 close_connection(ring, conn);
+                 break;
+             }
+             ring->bytes_received += (unsigned long long)cqe->res;
+ 
+             /* Checksum the pool buffer before it is written out */
+             if (conn->summed) {
+                 conn->crc = crc32c_update(conn->crc, URING_BUFFER(ring, conn->buffer_id), (size_t)cqe->res);
+             }
+             if (conn->hashing) {
+                 sha256_update(&conn->sha, URING_BUFFER(ring, conn->buffer_id), (size_t)cqe->res);
+             }
+             conn->write_len = (size_t)cqe->res;
+             conn->write_done = 0;
+             post_write(ring, conn);
+             break;
+ 
+         case URING_OP_WRITE:
+             if (cqe->res <= 0) {
+                 log_error("write file data: %s", cqe->res < 0 ? strerror(-cqe->res) : "short write");
+                 release_buffer(ring, conn);
+                 finish_with_status(ring, conn, STATUS_FILE_ERROR);
+                 break;
+             }
+             conn->write_done += (size_t)cqe->res;
+             if (conn->write_done < conn->write_len) {
+                 post_write(ring, conn);
+                 break;
+             }
+             release_buffer(ring, conn);
+             conn->total_received += (off_t)conn->write_len;
+             conn->write_len = conn->write_done = 0;
+             if (conn->total_received >= conn->filesize) {
+                 body_complete(ring, conn);
+             } else {
+                 post_read(ring, conn);
+             }
+             break;
+ 
+         case URING_OP_SEND:
+             conn->send_inflight = 0;
+             if (cqe->res < 0) {
+                 log_error("send: %s", strerror(-cqe->res));
+                 close_connection(ring, conn);
+                 break;
+             }
+             if (!conn->send_attached) {
+                 conn->out_sent += (size_t)cqe->res;
+             } else {
+                 conn->attachment_sent += (size_t)cqe->res;
+                 conn->send_done += (size_t)cqe->res;
+                 if (conn->attachment_sent == conn->attachment_len) {
+                     release_attachment(conn);
+                 }
+             }
+             if (conn->out_sent < conn->out_len || conn->attachment) {
+                 post_send(ring, conn);
+                 break;
+             }
+             conn->out_len = conn->out_sent = 0;
+             if (conn->state == URING_CONN_SEND) {
+                 finish_send(ring, conn);
+                 break;
+             }
+             if (conn->close_after_flush) {
+                 close_connection(ring, conn);
+             }
+             break;
+ 
+         case URING_OP_STEP:
+             handle_step(ring, conn);
+             break;
+ 
+         case URING_OP_FILE_READ:
+             conn->send_inflight = 0;
+             if (cqe->res <= 0) {
+                 /* The client counts body bytes, so a short body leaves the stream unusable */
+                 log_error("Client %d: read %s: %s", conn->client_id, conn->request.filename,
+                           cqe->res < 0 ? strerror(-cqe->res) : "file shrank while it was being sent");
+                 close_connection(ring, conn);
+                 break;
+             }
+             conn->send_offset += cqe->res;
+             conn->send_filled = (size_t)cqe->res;
+             conn->send_done = 0;
+             post_send(ring, conn);
+             break;
+ 
+         default:
+             break;
+     }
+ 
+     return 0;
+ }
+ 
+ /* Submit the timeout that triggers the next statistics report */
+ static void arm_timer(uring_t *ring) {
+     struct io_uring_sqe *sqe = get_sqe(ring);
+ 
+     if (!sqe) {
+         return;
+     }
+ 
+     sqe->opcode = IORING_OP_TIMEOUT;
+     sqe->fd = -1;
+     sqe->addr = (uint64_t)(uintptr_t)&ring->stats_timeout;
+     sqe->len = 1;
+     sqe->user_data = URING_DATA(URING_NO_SLOT, URING_OP_TIMER);
+ }
+ 
+ /* Submit a timeout that fires at deadline (monotonic ns), unless an earlier one is armed */
+ static void arm_throttle(uring_t *ring, uint64_t deadline) {
+     struct io_uring_sqe *sqe;
+ 
+     if (ring->throttle_deadline && ring->throttle_deadline <= deadline) {
+         return;
+     }
+     sqe = get_sqe(ring);
+     if (!sqe) {
+         return;
+     }
+ 
+     /* Absolute, so timeouts armed in one pass can share the timespec until it is submitted */
+     ring->throttle_deadline = deadline;
+     ring->throttle_timeout.tv_sec = (long long)(deadline / 1000000000ULL);
+     ring->throttle_timeout.tv_nsec = (long long)(deadline % 1000000000ULL);
+     sqe->opcode = IORING_OP_TIMEOUT;
+     sqe->fd = -1;
+     sqe->addr = (uint64_t)(uintptr_t)&ring->throttle_timeout;
+     sqe->len = 1;
+     sqe->timeout_flags = IORING_TIMEOUT_ABS;
+     sqe->user_data = URING_DATA(URING_NO_SLOT, URING_OP_THROTTLE);
+ }
+ 
+ /* Leave a connection without a receive posted until its quota is worth asking again */
+ static void throttle_connection(uring_t *ring, uring_conn_t *conn) {
+     conn->throttled = 1;
+     conn->throttle_until = metrics_now() + quota_delay_ns(conn->session.ticket);
+     arm_throttle(ring, conn->throttle_until);
+ }
+ 
+ /* Resume the receives of throttled connections that are due, then re-arm for the rest */
+ static void wake_throttled(uring_t *ring) {
+     uint64_t now = metrics_now(), next = 0;
+     uring_conn_t *conn;
+     int i;
+ 
+     ring->throttle_deadline = 0;
+     for (i = 0; i < ring->max_connections; i++) {
+         conn = &ring->conns[i];
+         if (!conn->in_use || !conn->throttled || conn->state == URING_CONN_CLOSING) {
+             continue;
+         }
+         if (conn->throttle_until > now) {
+             if (!next || conn->throttle_until < next) {
+                 next = conn->throttle_until;
+             }
+             continue;
+         }
+ 
+         conn->throttled = 0;
+         if (conn->state == URING_CONN_BODY) {
+             post_read(ring, conn);
+         } else if (conn->state == URING_CONN_CHUNK_DATA) {
+             post_payload_recv(ring, conn, conn->chunk_buf + conn->in_received,
+                               conn->chunk.length - conn->in_received);
+         } else if (conn->state == URING_CONN_BLOCK_DATA) {
+             post_payload_recv(ring, conn, conn->chunk_buf + conn->in_received,
+                               PROTO_BLOCK_PAYLOAD(&conn->block) - conn->in_received);
+         }
+     }
+ 
+     if (next) {
+         arm_throttle(ring, next);
+     }
+ }
+ 
+ /* Begin tearing down a connection; the slot is freed once nothing is outstanding */
+ static void close_connection(uring_t *ring, uring_conn_t *conn) {
+     struct io_uring_sqe *sqe;
+ 
+     if (conn->state != URING_CONN_CLOSING) {
+         conn->state = URING_CONN_CLOSING;
+         close_file(ring, conn);
+         quota_release(conn->session.ticket);
+         conn->session.ticket = NULL;
+         if (conn->buffer_wait) {
+             conn->buffer_wait = 0;
+             ring->buffer_waiters--;
+         }
+ 
+         /* Shut the socket down so a pending receive completes, then close the fixed slot */
+         sqe = prep_socket_op(ring, conn, IORING_OP_SHUTDOWN, URING_OP_CLOSE, NULL, SHUT_RDWR);
+         if (sqe) {
+             sqe->flags |= IOSQE_IO_HARDLINK;
+         }
+         sqe = get_sqe(ring);
+         if (sqe) {
+             sqe->opcode = IORING_OP_CLOSE;
+             sqe->file_index = URING_SOCKET_INDEX(conn->slot) + 1;
+             sqe->user_data = URING_DATA(conn->slot, URING_OP_CLOSE);
+             conn->inflight++;
+         }
+         return;
+     }
+ 
+     if (conn->inflight > 0) {
+         return;
+     }
+ 
+     /* Nothing outstanding: release the slot */
+     release_buffer(ring, conn);
+     bufpool_put(&buffer_pool, conn->chunk_buf, PROTO_CHUNK_SIZE);
+     conn->chunk_buf = NULL;
+     release_attachment(conn);
+     conn->in_use = 0;
+     ring->active_connections--;
+     metrics_count(METRICS_CONNECTIONS_CLOSED);
+ 
+     if (conn->session.persistent) {
+         log_info("Client %d session closed after %lu files", conn->client_id, conn->session.files);
+     }
+     log_info("Client %d disconnected. Total active clients: %d", conn->client_id, ring->active_connections);
+ 
+     if (ring->accept_slot < 0) {
+         arm_accept(ring);
+     }
+ }
+ 
+ /* Submit an accept that installs the next connection into a free fixed slot */
+ static void arm_accept(uring_t *ring) {
+     struct io_uring_sqe *sqe;
+     int slot;
+ 
+     if (ring->accept_slot >= 0) {
+         return;
+     }
+ 
+     /* With every slot busy, new connections wait in the listen backlog */
+     for (slot = 0; slot < ring->max_connections; slot++) {
+         if (!ring->conns[slot].in_use) {
+             break;
+         }
+     }
+     if (slot == ring->max_connections) {
+         if (!ring->accept_starved) {
+             log_warn("uring: all %d connection slots are busy; new connections wait in the listen "
+                      "backlog (see uring_slots)", ring->max_connections);
+             ring->accept_starved = 1;
+         }
+         return;
+     }
+     if (ring->accept_starved) {
+         log_info("uring: a connection slot is free, accepting again");
+         ring->accept_starved = 0;
+     }
+ 
+     sqe = get_sqe(ring);
+     if (!sqe) {
+         return;
+     }
+ 
+     ring->accept_addr_len = sizeof(ring->accept_addr);
+     sqe->opcode = IORING_OP_ACCEPT;
+     sqe->fd = ring->listen_fd;
+     sqe->addr = (uint64_t)(uintptr_t)&ring->accept_addr;
+     sqe->addr2 = (uint64_t)(uintptr_t)&ring->accept_addr_len;
+     sqe->file_index = URING_SOCKET_INDEX(slot) + 1;
+     sqe->user_data = URING_DATA(URING_NO_SLOT, URING_OP_ACCEPT);
+     ring->accept_slot = slot;
+ }
+ 
+ /* Set up the rings, buffer pool, slots and file table */
+ int uring_init(uring_t *ring, int listen_fd, int stats_interval) {
+     const config_t *config = config_current();
+     struct io_uring_params params;
+     struct io_uring_buf_reg reg;
+     struct iovec *iovecs;
+     int *files;
+     size_t sq_size, cq_size;
+     char *sq_ptr, *cq_ptr;
+     unsigned int entries;
+     int i, result;
+ 
+     memset(ring, 0, sizeof(*ring));
+     ring->ring_fd = -1;
+     ring->listen_fd = listen_fd;
+     ring->accept_slot = -1;
+     ring->stats_interval = stats_interval;
+     ring->client_id_step = 1;
+     ring->max_connections = config->uring_slots;
+     ring->buffer_count = config->uring_buffers;
+ 
+     ring->conns = calloc((size_t)ring->max_connections, sizeof(uring_conn_t));
+     if (!ring->conns) {
+         log_error("Failed to allocate %d io_uring connection slots", ring->max_connections);
+         return -1;
+     }
+ 
+     /* Create the ring; only this thread submits, so let the kernel skip cross-thread work */
+     memset(&params, 0, sizeof(params));
+     params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+     ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+     if (ring->ring_fd < 0 && errno == EINVAL) {
+         memset(&params, 0, sizeof(params));
+         ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+     }
+     if (ring->ring_fd < 0) {
+         log_errno("io_uring_setup");
+         return -1;
+     }
+ 
+     /* Map the submission and completion rings */
+     sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+     cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+     }
+ 
+     ring->ring_map_size = sq_size;
+     ring->ring_map = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring->ring_fd, IORING_OFF_SQ_RING);
+     if (ring->ring_map == MAP_FAILED) {
+         log_errno("mmap sq ring");
+         ring->ring_map = NULL;
+         uring_destroy(ring);
+         return -1;
+     }
+     sq_ptr = ring->ring_map;
+ 
+     if (params.features & IORING_FEAT_SINGLE_MMAP) {
+         cq_ptr = sq_ptr;
+     } else {
+         ring->cq_map_size = cq_size;
+         ring->cq_map = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->ring_fd, IORING_OFF_CQ_RING);
+         if (ring->cq_map == MAP_FAILED) {
+             log_errno("mmap cq ring");
+             ring->cq_map = NULL;
+             uring_destroy(ring);
+             return -1;
+         }
+         cq_ptr = ring->cq_map;
+     }
+ 
+     ring->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+     ring->sqes = mmap(NULL, ring->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->ring_fd, IORING_OFF_SQES);
+     if (ring->sqes == MAP_FAILED) {
+         log_errno("mmap sqes");
+         ring->sqes = NULL;
+         uring_destroy(ring);
+         return -1;
+     }
+ 
+     ring->sq_entries = params.sq_entries;
+     ring->sq_head = (unsigned int *)(sq_ptr + params.sq_off.head);
+     ring->sq_tail = (unsigned int *)(sq_ptr + params.sq_off.tail);
+     ring->sq_mask = (unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+     ring->sq_array = (unsigned int *)(sq_ptr + params.sq_off.array);
+     ring->cq_head = (unsigned int *)(cq_ptr + params.cq_off.head);
+     ring->cq_tail = (unsigned int *)(cq_ptr + params.cq_off.tail);
+     ring->cq_mask = (unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+     ring->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+ 
+     /* Register the page-aligned body buffer pool for WRITE_FIXED */
+     if (posix_memalign((void **)&ring->buffers, 4096, (size_t)ring->buffer_count * URING_BUFFER_SIZE) != 0) {
+         log_error("Failed to allocate io_uring buffers");
+         ring->buffers = NULL;
+         uring_destroy(ring);
+         return -1;
+     }
+     iovecs = malloc((size_t)ring->buffer_count * sizeof(struct iovec));
+     if (!iovecs) {
+         log_errno("malloc");
+         uring_destroy(ring);
+         return -1;
+     }
+     for (i = 0; i < ring->buffer_count; i++) {
+         iovecs[i].iov_base = URING_BUFFER(ring, i);
+         iovecs[i].iov_len = URING_BUFFER_SIZE;
+     }
+     result = sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iovecs,
+                                    (unsigned int)ring->buffer_count);
+     free(iovecs);
+     if (result < 0) {
+         log_errno("io_uring_register buffers");
+         uring_destroy(ring);
+         return -1;
+     }
+ 
+     /* Offer every pool buffer to body reads through a provided-buffer ring, whose size
+      * must be a power of two */
+     entries = 1;
+     while (entries < (unsigned int)ring->buffer_count) {
+         entries <<= 1;
+     }
+     ring->buffer_ring_size = entries * sizeof(struct io_uring_buf);
+     ring->buffer_ring = mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     if (ring->buffer_ring == MAP_FAILED) {
+         log_errno("mmap buffer ring");
+         ring->buffer_ring = NULL;
+         uring_destroy(ring);
+         return -1;
+     }
+     memset(&reg, 0, sizeof(reg));
+     reg.ring_addr = (uint64_t)(uintptr_t)ring->buffer_ring;
+     reg.ring_entries = entries;
+     reg.bgid = URING_BUFFER_GROUP;
+     if (sys_io_uring_register(ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+         log_errno("io_uring_register provided buffer ring");
+         uring_destroy(ring);
+         return -1;
+     }
+     ring->buffer_ring_mask = entries - 1;
+     for (i = 0; i < ring->buffer_count; i++) {
+         ring->buffer_ring->bufs[i].addr = (uint64_t)(uintptr_t)URING_BUFFER(ring, i);
+         ring->buffer_ring->bufs[i].len = URING_BUFFER_SIZE;
+         ring->buffer_ring->bufs[i].bid = (unsigned short)i;
+     }
+     __atomic_store_n(&ring->buffer_ring->tail, (unsigned short)ring->buffer_count, __ATOMIC_RELEASE);
+ 
+     /* Compressed blocks are expanded one at a time, so a single buffer serves every slot */
+     ring->scratch = bufpool_get(&buffer_pool, PROTO_BLOCK_SIZE, &ring->scratch_size);
+     if (!ring->scratch) {
+         uring_destroy(ring);
+         return -1;
+     }
+ 
+     /* Register an empty fixed file table for sockets and destination files */
+     files = malloc(2 * (size_t)ring->max_connections * sizeof(int));
+     if (!files) {
+         log_errno("malloc");
+         uring_destroy(ring);
+         return -1;
+     }
+     for (i = 0; i < 2 * ring->max_connections; i++) {
+         files[i] = -1;
+     }
+     result = sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, files,
+                                    2 * (unsigned int)ring->max_connections);
+     free(files);
+     if (result < 0) {
+         log_errno("io_uring_register files");
+         uring_destroy(ring);
+         return -1;
+     }
+ 
+     log_info("uring: %d connection slots sharing %d body buffers of %d KiB", ring->max_connections,
+              ring->buffer_count, URING_BUFFER_SIZE / 1024);
+ 
+     return 0;
+ }
+ 
+ /* Run the completion loop until a fatal error occurs */
+ int uring_run(uring_t *ring) {
+     unsigned int head, tail;
+ 
+     arm_accept(ring);
+ 
+     /* Periodic statistics ride on a timeout request */
+     if (ring->stats_interval > 0) {
+         ring->stats_timeout.tv_sec = ring->stats_interval;
+         arm_timer(ring);
+     }
+ 
+     while (1) {
+         /* One system call submits everything queued and waits for at least one completion */
+         if (submit_and_wait(ring, 1) < 0) {
+             return -1;
+         }
+ 
+         /* Reap every completion that is ready */
+         head = *ring->cq_head;
+         tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+         while (head != tail) {
+             handle_completion(ring, &ring->cqes[head & *ring->cq_mask]);
+             ring->completed++;
+             head++;
+             __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+             tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+         }
+ 
+         /* Publish the uploads completed during this pass together */
+         flush_commits(ring);
+     }
+ 
+     return 0;
+ }
+ 
+ /* Release the ring and its buffers (the listening socket is left open) */
+ void uring_destroy(uring_t *ring) {
+     int i;
+ 
+     for (i = 0; ring->conns && i < ring->max_connections; i++) {
+         if (ring->conns[i].in_use) {
+             if (ring->conns[i].file_fd >= 0) {
+                 close(ring->conns[i].file_fd);
+             }
+             if (ring->conns[i].path_lock) {
+                 pathlock_release(&path_locks, ring->conns[i].path_lock);
+             }
+             release_attachment(&ring->conns[i]);
+             bufpool_put(&buffer_pool, ring->conns[i].chunk_buf, PROTO_CHUNK_SIZE);
+         }
+     }
+ 
+     if (ring->sqes) {
+         munmap(ring->sqes, ring->sqes_map_size);
+     }
+     if (ring->cq_map) {
+         munmap(ring->cq_map, ring->cq_map_size);
+     }
+     if (ring->ring_map) {
+         munmap(ring->ring_map, ring->ring_map_size);
+     }
+     if (ring->ring_fd >= 0) {
+         close(ring->ring_fd);
+     }
+     if (ring->buffer_ring) {
+         munmap(ring->buffer_ring, ring->buffer_ring_size);
+         ring->buffer_ring = NULL;
+     }
+     free(ring->buffers);
+     ring->buffers = NULL;
+     free(ring->conns);
+     ring->conns = NULL;
+     bufpool_put(&buffer_pool, ring->scratch, ring->scratch_size);
+     ring->scratch = NULL;
+ }
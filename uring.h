@@ -0,0 +1,201 @@
+/* uring.h - Header file for the io_uring server core
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the io_uring engine including:
+ * - Submission and completion ring mappings set up with raw system calls
+ * - Per-connection transfer state tied to fixed files, with body buffers picked by the
+ *   kernel from a shared pool only when data arrives
+ * - Delta signing and copies split into steps that no-op completions re-arm
+ * - Function prototypes for running the completion loop
+ */
+
+ #ifndef URING_H
+ #define URING_H
+ 
+ #include "server.h"
+ #include "pathlock.h"
+ #include <linux/io_uring.h>
+ #include <linux/time_types.h>
+ 
+ /* Submission queue depth */
+ #define URING_ENTRIES 256
+ 
+ /* Size of each registered body buffer in the shared pool */
+ #define URING_BUFFER_SIZE (64 * 1024)
+ 
+ /* Provided-buffer group the body reads pick from */
+ #define URING_BUFFER_GROUP 0
+ 
+ /* Largest send of a download body or other attachment; a request's length is 32 bits */
+ #define URING_SEND_CHUNK (8 * 1024 * 1024)
+ 
+ /* Fixed file table layout: sockets first, then destination files, by slot */
+ #define URING_SOCKET_INDEX(slot) (slot)
+ #define URING_FILE_INDEX(ring, slot) ((ring)->max_connections + (slot))
+ 
+ /* Operation kinds carried in the low byte of each request's user_data */
+ typedef enum {
+     URING_OP_ACCEPT,
+     URING_OP_RECV,          /* Header, fields or chunk bytes into connection memory */
+     URING_OP_READ,          /* Body bytes into a pool buffer the kernel picks */
+     URING_OP_WRITE,         /* That pool buffer to the fixed destination file */
+     URING_OP_SEND,
+     URING_OP_FILE_READ,     /* Download body from its file into the attachment buffer */
+     URING_OP_CLOSE,
+     URING_OP_TIMER,         /* Periodic statistics */
+     URING_OP_THROTTLE,      /* Wake-up for connections waiting on quota tokens */
+     URING_OP_STEP           /* No-op whose completion runs a connection's next delta step */
+ } uring_op_t;
+ 
+ /* Stages of a single upload, in protocol order */
+ typedef enum {
+     URING_CONN_HEADER,      /* Collecting the fixed-size request header */
+     URING_CONN_FIELDS,      /* Collecting the username, directory and file name */
+     URING_CONN_CHUNK,       /* Reading the prefix of the next resumable chunk */
+     URING_CONN_CHUNK_DATA,  /* Reading one chunk's payload */
+     URING_CONN_BLOCK,       /* Reading the prefix of the next compressed block */
+     URING_CONN_BLOCK_DATA,  /* Reading one block's payload */
+     URING_CONN_SIGN,        /* Signing the delta basis a scratch buffer per step; READY follows */
+     URING_CONN_DELTA,       /* Reading the next delta instruction */
+     URING_CONN_COPY,        /* Applying a delta copy a scratch buffer per step */
+     URING_CONN_DELTA_DATA,  /* Reading one delta literal */
+     URING_CONN_BODY,        /* Streaming plain body data to disk */
+     URING_CONN_TRAILER,     /* Collecting the checksum trailer after a plain body */
+     URING_CONN_COMMIT,      /* Body complete, waiting for the batched sync to publish it */
+     URING_CONN_SEND,        /* Sending a download or listing; no receive is posted until it is out */
+     URING_CONN_STATUS,      /* Flushing the final status code before closing */
+     URING_CONN_CLOSING      /* Close submitted, waiting for outstanding requests */
+ } uring_state_t;
+ 
+ /* Per-connection state tracked by the engine */
+ typedef struct uring_conn {
+     int in_use;
+     int slot;                   /* Index of this connection and its fixed files */
+     int client_id;
+     int inflight;               /* Submitted requests not yet completed */
+     uring_state_t state;
+     proto_header_t header;
+     proto_request_t request;
+     session_t session;
+     char fields[PROTO_MAX_FIELDS];
+     size_t field_bytes;
+     size_t in_received;
+     char target_path[MAX_PATH_LENGTH];
+     char staging_path[STAGING_PATH_LENGTH];
+     access_decision_t access;
+     pathlock_entry_t *path_lock; /* Held on target_path from the request until its status */
+     int file_fd;                /* Also installed at URING_FILE_INDEX(ring, slot) */
+     off_t filesize;
+     off_t total_received;
+     int buffer_id;              /* Pool buffer holding body bytes until they are written, or -1 */
+     int buffer_wait;            /* The pool ran dry; the next returned buffer resumes the read */
+     size_t write_len;           /* Bytes in that buffer awaiting write */
+     size_t write_done;
+     size_t granted;             /* Quota granted to the receive in flight, returned if unread */
+     int throttled;              /* No receive posted until throttle_until: the quota ran dry */
+     uint64_t throttle_until;
+     int resume;
+     int checksum;               /* Plain body is followed by a checksum trailer */
+     uint32_t crc;               /* CRC32C of the body bytes read so far */
+     int summed;                 /* crc covers the body from its first byte, for the manifest */
+     proto_trailer_t trailer;
+     proto_chunk_t chunk;
+     int compress;               /* Body arrives as compressed blocks */
+     proto_block_t block;
+     int delta;                  /* Body arrives as copies from basis_fd and literals */
+     int basis_fd;               /* Existing file a delta upload is rebuilt from */
+     uint64_t basis_size;
+     proto_signature_t *signatures; /* Of basis_fd, until READY takes them as its attachment */
+     uint64_t sign_offset;       /* Bytes of the basis signed so far */
+     proto_delta_t op;           /* Delta instruction being received or applied; a copy shrinks as it is */
+     char *chunk_buf;            /* Chunk, block or literal payload, borrowed from the shared buffer pool */
+     int range;                  /* Body is one range of a parallel upload */
+     off_t range_offset;         /* Where that range starts in the staging file */
+     uint64_t request_started;   /* When the request was parsed, for its log record */
+     uint64_t body_started;      /* When READY was queued, for the receive phase metric */
+     int dedup;                  /* Body must match its announced digest, then joins the store */
+     int hashing;                /* sha covers the body from its first byte */
+     sha256_t sha;               /* SHA-256 of the body bytes stored so far */
+     unsigned char out_buf[4 * sizeof(proto_response_t)];
+     size_t out_len;
+     size_t out_sent;
+     char *attachment;           /* Delta signatures, a listing, or the pooled buffer a download body
+                                  * passes through, sent after attachment_at bytes of out_buf */
+     int send_fd;                /* File a download body is read from into that buffer, or -1 */
+     off_t send_offset;          /* Where the next read of that file starts */
+     size_t send_capacity;       /* Size of the pooled buffer */
+     size_t send_filled;         /* Body bytes the last read put in the buffer */
+     size_t send_done;           /* Of those, bytes sent */
+     size_t attachment_len;
+     size_t attachment_sent;
+     size_t attachment_at;
+     int send_inflight;          /* A send, or a read of the download file, is in flight */
+     int send_attached;          /* The send in flight is from the attachment */
+     int close_after_flush;
+     struct uring_conn *next_commit;
+ } uring_conn_t;
+ 
+ /* One ring, the listening socket it accepts from and every connection slot */
+ typedef struct {
+     int ring_fd;
+     int listen_fd;
+     unsigned int sq_entries;
+     unsigned int *sq_head;
+     unsigned int *sq_tail;
+     unsigned int *sq_mask;
+     unsigned int *sq_array;
+     struct io_uring_sqe *sqes;
+     unsigned int *cq_head;
+     unsigned int *cq_tail;
+     unsigned int *cq_mask;
+     struct io_uring_cqe *cqes;
+     void *ring_map;
+     size_t ring_map_size;
+     void *cq_map;               /* Separate CQ mapping on kernels without IORING_FEAT_SINGLE_MMAP */
+     size_t cq_map_size;
+     size_t sqes_map_size;
+     unsigned int to_submit;
+     int max_connections;        /* Connection slots, from the uring_slots setting */
+     int buffer_count;           /* Pool buffers, from the uring_buffers setting */
+     char *buffers;              /* The pool, registered for WRITE_FIXED */
+     struct io_uring_buf_ring *buffer_ring; /* Pool buffers the kernel may pick for a read */
+     size_t buffer_ring_size;
+     unsigned int buffer_ring_mask;
+     int buffer_waiters;         /* Connections whose read found the pool empty */
+     int wake_cursor;            /* Slot the next returned buffer is offered to first */
+     int accept_starved;         /* Every slot was busy when the accept was due */
+     char *scratch;              /* Pooled buffer that compressed blocks are expanded into and
+                                  * delta copies pass through */
+     size_t scratch_size;
+     int accept_slot;            /* Slot the armed accept installs into, or -1 */
+     struct sockaddr_in accept_addr;
+     socklen_t accept_addr_len;
+     int active_connections;
+     int next_client_id;
+     int client_id_step;         /* Shards interleave their client IDs */
+     int stats_interval;
+     struct __kernel_timespec stats_timeout;
+     uint64_t throttle_deadline; /* When the armed throttle timeout fires, or 0 */
+     struct __kernel_timespec throttle_timeout;
+     uring_conn_t *commit_head;  /* Uploads sharing the next group commit */
+     unsigned long enters;       /* io_uring_enter() calls */
+     unsigned long submitted;    /* Requests submitted */
+     unsigned long completed;    /* Completions reaped */
+     unsigned long buffer_waits; /* Reads that found the pool empty */
+     unsigned long long bytes_received;
+     uring_conn_t *conns;        /* max_connections slots */
+ } uring_t;
+ 
+ /* Function prototypes */
+ 
+ /* Set up the rings, buffer pool, slots and file table, sized by the current configuration.
+  * Returns 0, or -1 if io_uring is unavailable. */
+ int uring_init(uring_t *ring, int listen_fd, int stats_interval);
+ 
+ /* Run the completion loop until a fatal error occurs */
+ int uring_run(uring_t *ring);
+ 
+ /* Release the ring and its buffers (the listening socket is left open) */
+ void uring_destroy(uring_t *ring);
+ 
+ #endif /* URING_H */
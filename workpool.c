@@ -0,0 +1,263 @@
+/* workpool.c - Implementation of the fixed worker thread pool
+ * Systems Software Continuous Assessment 2
+ *
+ * This file implements the pool server mode:
+ * - Workers spawned once at startup instead of per connection
+ * - A bounded ring buffer protected by a mutex and two condition variables
+ * - Backpressure by pausing accept while the queue is full
+ * - Queue depth and worker utilisation reporting
+ */
+
+ #include "workpool.h"
+ #include "metrics.h"
+ #include <time.h>
+ 
+ /* Seconds elapsed between two monotonic timestamps */
+ static double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+     return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+ }
+ 
+ /* Worker thread: serve queued clients until the pool shuts down */
+ static void *worker_main(void *arg) {
+     workpool_t *pool = (workpool_t *)arg;
+     struct timespec begin, end;
+     client_t *client;
+     
+     while (1) {
+         /* Wait for a queued client */
+         pthread_mutex_lock(&pool->lock);
+         while (pool->count == 0 && !pool->shutting_down) {
+             pthread_cond_wait(&pool->not_empty, &pool->lock);
+         }
+         if (pool->count == 0 && pool->shutting_down) {
+             pthread_mutex_unlock(&pool->lock);
+             break;
+         }
+         
+         client = pool->slots[pool->head];
+         pool->head = (pool->head + 1) % pool->capacity;
+         pool->count--;
+         pool->busy_workers++;
+         pthread_cond_signal(&pool->not_full);
+         pthread_mutex_unlock(&pool->lock);
+         
+         /* Serve the client outside the lock */
+         clock_gettime(CLOCK_MONOTONIC, &begin);
+         serve_client(client);
+         clock_gettime(CLOCK_MONOTONIC, &end);
+         
+         /* Account for the time spent busy */
+         pthread_mutex_lock(&pool->lock);
+         pool->busy_workers--;
+         pool->completed++;
+         pool->busy_seconds += elapsed_seconds(&begin, &end);
+         pthread_mutex_unlock(&pool->lock);
+     }
+     
+     return NULL;
+ }
+ 
+ /* Start worker_count threads sharing a queue of queue_capacity slots */
+ int workpool_init(workpool_t *pool, int worker_count, int queue_capacity) {
+     int i;
+     
+     memset(pool, 0, sizeof(*pool));
+     pool->capacity = queue_capacity;
+     pool->worker_count = worker_count;
+     
+     pool->slots = calloc(queue_capacity, sizeof(client_t *));
+     pool->workers = calloc(worker_count, sizeof(pthread_t));
+     if (!pool->slots || !pool->workers) {
+         log_errno("calloc");
+         free(pool->slots);
+         free(pool->workers);
+         return -1;
+     }
+     
+     pthread_mutex_init(&pool->lock, NULL);
+     pthread_cond_init(&pool->not_empty, NULL);
+     pthread_cond_init(&pool->not_full, NULL);
+     clock_gettime(CLOCK_MONOTONIC, &pool->started);
+     
+     /* Spawn the workers up front */
+     for (i = 0; i < worker_count; i++) {
+         if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+             log_errno("pthread_create");
+             pool->worker_count = i;
+             workpool_destroy(pool);
+             return -1;
+         }
+     }
+     
+     return 0;
+ }
+ 
+ /* Block until the queue can take another client (accept backpressure) */
+ void workpool_wait_for_space(workpool_t *pool) {
+     pthread_mutex_lock(&pool->lock);
+     if (pool->count == pool->capacity) {
+         pool->accept_pauses++;
+         while (pool->count == pool->capacity) {
+             pthread_cond_wait(&pool->not_full, &pool->lock);
+         }
+     }
+     pthread_mutex_unlock(&pool->lock);
+ }
+ 
+ /* Queue an accepted client for the next free worker */
+ int workpool_submit(workpool_t *pool, client_t *client) {
+     pthread_mutex_lock(&pool->lock);
+     while (pool->count == pool->capacity && !pool->shutting_down) {
+         pthread_cond_wait(&pool->not_full, &pool->lock);
+     }
+     if (pool->shutting_down) {
+         pthread_mutex_unlock(&pool->lock);
+         return -1;
+     }
+     
+     pool->slots[pool->tail] = client;
+     pool->tail = (pool->tail + 1) % pool->capacity;
+     pool->count++;
+     if (pool->count > pool->peak) {
+         pool->peak = pool->count;
+     }
+     pthread_cond_signal(&pool->not_empty);
+     pthread_mutex_unlock(&pool->lock);
+     
+     return 0;
+ }
+ 
+ /* Take a consistent snapshot of pool statistics */
+ void workpool_get_stats(workpool_t *pool, workpool_stats_t *stats) {
+     struct timespec now;
+     double available;
+     
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     
+     pthread_mutex_lock(&pool->lock);
+     stats->queue_depth = pool->count;
+     stats->queue_capacity = pool->capacity;
+     stats->queue_peak = pool->peak;
+     stats->busy_workers = pool->busy_workers;
+     stats->worker_count = pool->worker_count;
+     stats->completed = pool->completed;
+     stats->accept_pauses = pool->accept_pauses;
+     available = elapsed_seconds(&pool->started, &now) * pool->worker_count;
+     stats->utilisation = (available > 0) ? pool->busy_seconds / available : 0.0;
+     pthread_mutex_unlock(&pool->lock);
+ }
+ 
+ /* Print pool statistics on one line */
+ void workpool_print_stats(workpool_t *pool) {
+     workpool_stats_t stats;
+     
+     workpool_get_stats(pool, &stats);
+     log_info("Pool: queue %d/%d (peak %d), busy workers %d/%d, utilisation %.1f%%, "
+              "completed %lu, accept pauses %lu",
+              stats.queue_depth, stats.queue_capacity, stats.queue_peak,
+              stats.busy_workers, stats.worker_count, stats.utilisation * 100.0,
+              stats.completed, stats.accept_pauses);
+ }
+ 
+ /* Stop the workers after the queue drains and free pool resources */
+ void workpool_destroy(workpool_t *pool) {
+     int i;
+     
+     pthread_mutex_lock(&pool->lock);
+     pool->shutting_down = 1;
+     pthread_cond_broadcast(&pool->not_empty);
+     pthread_cond_broadcast(&pool->not_full);
+     pthread_mutex_unlock(&pool->lock);
+     
+     for (i = 0; i < pool->worker_count; i++) {
+         pthread_join(pool->workers[i], NULL);
+     }
+     
+     pthread_mutex_destroy(&pool->lock);
+     pthread_cond_destroy(&pool->not_empty);
+     pthread_cond_destroy(&pool->not_full);
+     free(pool->slots);
+     free(pool->workers);
+ }
+ 
+ /* Periodically report pool statistics */
+ static void *stats_reporter(void *arg) {
+     workpool_t *pool = (workpool_t *)arg;
+     int interval = pool->stats_interval;
+     
+     while (1) {
+         sleep(interval);
+         workpool_print_stats(pool);
+     }
+     
+     return NULL;
+ }
+ 
+ /* Accept connections and hand them to a worker pool */
+ int run_pool_server(int server_socket, int worker_count, int queue_capacity, int stats_interval) {
+     struct sockaddr_in client_addr;
+     socklen_t client_addr_len;
+     pthread_t reporter;
+     workpool_t pool;
+     client_t *client;
+     int client_socket, next_client_id = 0;
+     
+     if (workpool_init(&pool, worker_count, queue_capacity) < 0) {
+         return -1;
+     }
+     
+     log_info("Worker pool started: %d workers, queue capacity %d", worker_count, queue_capacity);
+     
+     /* Optional periodic statistics */
+     if (stats_interval > 0) {
+         pool.stats_interval = stats_interval;
+         if (pthread_create(&reporter, NULL, stats_reporter, &pool) == 0) {
+             pthread_detach(reporter);
+         } else {
+             log_errno("pthread_create stats reporter");
+         }
+     }
+     
+     while (1) {
+         /* Leave connections in the kernel backlog while every slot is taken */
+         workpool_wait_for_space(&pool);
+         
+         /* Accept new client connection */
+         client_addr_len = sizeof(client_addr);
+         client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+         if (client_socket < 0) {
+             log_errno("accept");
+             continue;
+         }
+         
+         /* Create client data structure */
+         client = (client_t *)malloc(sizeof(client_t));
+         if (!client) {
+             log_errno("malloc");
+             close(client_socket);
+             continue;
+         }
+         
+         client->client_socket = client_socket;
+         client->client_addr = client_addr;
+         client->client_id = next_client_id++;
+         client->accepted_ns = metrics_now();
+         __atomic_add_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+         
+         log_info("New connection from %s:%d. Client ID: %d",
+                  inet_ntoa(client_addr.sin_addr),
+                  ntohs(client_addr.sin_port),
+                  client->client_id);
+         
+         /* Only this thread produces, so the space checked above is still free */
+         if (workpool_submit(&pool, client) < 0) {
+             close(client_socket);
+             free(client);
+             __atomic_sub_fetch(&active_clients, 1, __ATOMIC_RELAXED);
+             break;
+         }
+     }
+     
+     workpool_destroy(&pool);
+     return -1;
+ }
@@ -0,0 +1,75 @@
+/* workpool.h - Header file for the fixed worker thread pool
+ * Systems Software Continuous Assessment 2
+ *
+ * This file contains declarations for the worker pool including:
+ * - A bounded multi-producer/multi-consumer queue of accepted clients
+ * - Pool statistics used to size the worker count
+ * - Function prototypes for pool lifecycle and submission
+ */
+
+ #ifndef WORKPOOL_H
+ #define WORKPOOL_H
+ 
+ #include "server.h"
+ 
+ /* Pending connections allowed per worker when no queue size is given */
+ #define WORKPOOL_QUEUE_PER_WORKER 4
+ 
+ /* Snapshot of pool activity */
+ typedef struct {
+     int queue_depth;            /* Clients waiting for a worker */
+     int queue_capacity;         /* Maximum clients that may wait */
+     int queue_peak;             /* Highest depth observed */
+     int busy_workers;           /* Workers currently serving a client */
+     int worker_count;           /* Total workers in the pool */
+     unsigned long completed;    /* Clients fully served */
+     unsigned long accept_pauses;/* Times accept waited for queue space */
+     double utilisation;         /* Busy worker time / available worker time */
+ } workpool_stats_t;
+ 
+ /* Pre-spawned workers fed by a bounded ring of accepted clients */
+ typedef struct {
+     client_t **slots;
+     int capacity;
+     int head;
+     int tail;
+     int count;
+     int peak;
+     int shutting_down;
+     pthread_mutex_t lock;
+     pthread_cond_t not_empty;
+     pthread_cond_t not_full;
+     pthread_t *workers;
+     int worker_count;
+     int busy_workers;
+     unsigned long completed;
+     unsigned long accept_pauses;
+     double busy_seconds;
+     struct timespec started;
+     int stats_interval;
+ } workpool_t;
+ 
+ /* Function prototypes */
+ 
+ /* Start worker_count threads sharing a queue of queue_capacity slots */
+ int workpool_init(workpool_t *pool, int worker_count, int queue_capacity);
+ 
+ /* Block until the queue can take another client (accept backpressure) */
+ void workpool_wait_for_space(workpool_t *pool);
+ 
+ /* Queue an accepted client for the next free worker */
+ int workpool_submit(workpool_t *pool, client_t *client);
+ 
+ /* Take a consistent snapshot of pool statistics */
+ void workpool_get_stats(workpool_t *pool, workpool_stats_t *stats);
+ 
+ /* Print pool statistics on one line */
+ void workpool_print_stats(workpool_t *pool);
+ 
+ /* Stop the workers after the queue drains and free pool resources */
+ void workpool_destroy(workpool_t *pool);
+ 
+ /* Accept connections and hand them to a worker pool */
+ int run_pool_server(int server_socket, int worker_count, int queue_capacity, int stats_interval);
+ 
+ #endif /* WORKPOOL_H */